@@ -0,0 +1,30 @@
+#include "pch.h"
+
+#include <unistd.h>
+
+#include "core/block_sender.h"
+
+namespace tube {
+
+BlockSender::BlockSender(const DataBlockPtr& block, size_t offset,
+                         size_t length)
+    : block_(block), offset_(offset), length_(length)
+{
+}
+
+ssize_t
+BlockSender::write_to_fd(int fd)
+{
+    blocked_ = false;
+    if (length_ == 0)
+        return 0;
+    ssize_t nwrite = ::write(fd, block_->data() + offset_, length_);
+    blocked_ = nwrite < (ssize_t) length_;
+    if (nwrite > 0) {
+        offset_ += nwrite;
+        length_ -= nwrite;
+    }
+    return nwrite;
+}
+
+}
@@ -0,0 +1,41 @@
+// -*- mode: c++ -*-
+#ifndef _BLOCK_SENDER_H_
+#define _BLOCK_SENDER_H_
+
+#include <boost/shared_ptr.hpp>
+
+#include "core/buffer.h"
+
+namespace tube {
+
+// Immutable piece of memory which can be queued on several output streams at
+// the same time without being copied.
+class DataBlock
+{
+public:
+    virtual ~DataBlock() {}
+
+    virtual const byte* data() const = 0;
+    virtual size_t      size() const = 0;
+};
+
+typedef boost::shared_ptr<const DataBlock> DataBlockPtr;
+
+class BlockSender : public Writeable
+{
+    DataBlockPtr block_;
+    size_t       offset_;
+    size_t       length_;
+public:
+    BlockSender(const DataBlockPtr& block, size_t offset, size_t length);
+
+    virtual ssize_t write_to_fd(int fd);
+    virtual u64     size() const { return length_; }
+    // the block is shared, it is not accounted to the stream
+    virtual size_t  memory_usage() const { return 0; }
+    virtual bool    append(const byte* data, size_t size) { return false; }
+};
+
+}
+
+#endif /* _BLOCK_SENDER_H_ */
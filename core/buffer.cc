@@ -162,7 +162,7 @@ Buffer::copy_front(byte* ptr, size_t sz)
             ncopy = MIN(sz, kPageSize);
             memcpy(ptr, *it, ncopy);
         }
-        ptr += sz;
+        ptr += ncopy;
         sz -= ncopy;
         ++it;
     } while (sz > 0);
@@ -214,6 +214,7 @@ Buffer::write_to_fd(int fd)
     if (need_copy_for_write())
         copy_for_write();
 
+    blocked_ = false;
     if (size_ == 0)
         return 0;
     int nwrite = 0;
@@ -229,7 +230,12 @@ Buffer::write_to_fd(int fd)
     }
     vec[0].iov_len -= left_offset_;
     vec[nvec - 1].iov_len -= right_offset_;
+    size_t noffer = 0;
+    for (int i = 0; i < nvec; i++) {
+        noffer += vec[i].iov_len;
+    }
     nwrite = writev(fd, vec, nvec);
+    blocked_ = nwrite < (int) noffer;
     if (nwrite > 0) {
         pop(nwrite);
     }
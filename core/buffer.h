@@ -17,12 +17,18 @@ namespace tube {
 class Writeable
 {
 public:
+    Writeable() : blocked_(false) {}
     virtual ~Writeable() {}
 
     virtual ssize_t write_to_fd(int fd) = 0;
     virtual u64     size() const = 0;
     virtual size_t  memory_usage() const = 0;
     virtual bool    append(const byte* ptr, size_t size) = 0;
+
+    // the last write_to_fd took less than it offered, the socket is full
+    bool is_blocked() const { return blocked_; }
+protected:
+    bool blocked_;
 };
 
 class Buffer : public Writeable
@@ -6,15 +6,17 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <cstdio>
+#include <cerrno>
+#include <sys/socket.h>
+
+#include <sys/mman.h>
 
 #ifdef USE_LINUX_SENDFILE
 #include <sys/sendfile.h>
 #else
-#ifdef USER_FREEBSD_SENDFILE
+#ifdef USE_FREEBSD_SENDFILE
 #include <sys/socket.h>
 #include <sys/uio.h>
-#else
-#include <sys/mman.h>
 #endif
 #endif
 
@@ -24,8 +26,15 @@
 
 namespace tube {
 
+FileHandle::~FileHandle()
+{
+    ::close(fd_);
+}
+
 FileSender::FileSender(int file_desc, off64_t offset, off64_t length)
-    : file_fd_(file_desc), offset_(offset), length_(length)
+    : handle_(new FileHandle(file_desc)), file_fd_(file_desc),
+      offset_(offset), length_(length), chunk_size_(0), window_(NULL),
+      window_offset_(0), window_size_(0)
 {
     if (length_ == -1) {
         // get the length of whole file
@@ -38,28 +47,165 @@ FileSender::FileSender(int file_desc, off64_t offset, off64_t length)
     // }
 }
 
+FileSender::FileSender(const FileHandlePtr& handle, off64_t offset,
+                       off64_t length)
+    : handle_(handle), file_fd_(handle->fd()), offset_(offset),
+      length_(length), chunk_size_(0), window_(NULL), window_offset_(0),
+      window_size_(0)
+{
+    if (length_ == -1) {
+        struct stat64 st;
+        fstat64(file_fd_, &st);
+        length_ = st.st_size - offset;
+    }
+}
+
 FileSender::~FileSender()
 {
-    ::close(file_fd_);
+    unmap_window();
 }
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+const size_t FileSender::kDefaultMinChunkSize = 64 << 10;
+const size_t FileSender::kDefaultMaxChunkSize = 1 << 20;
+
+const size_t FileSender::kMmapWindowSize = 4 << 20;
+
+static size_t min_chunk_size = FileSender::kDefaultMinChunkSize;
+static size_t max_chunk_size = FileSender::kDefaultMaxChunkSize;
+
+#if defined(USE_LINUX_SENDFILE) || defined(USE_FREEBSD_SENDFILE)
+static FileSender::SendStrategy strategy = FileSender::kSendfile;
+#else
+static FileSender::SendStrategy strategy = FileSender::kMmapWrite;
+#endif
+
+void
+FileSender::set_send_strategy(SendStrategy send_strategy)
+{
+#if defined(USE_LINUX_SENDFILE) || defined(USE_FREEBSD_SENDFILE)
+    strategy = send_strategy;
+#endif
+}
+
+FileSender::SendStrategy
+FileSender::send_strategy()
+{
+    return strategy;
+}
+
+void
+FileSender::set_chunk_size_range(size_t min_size, size_t max_size)
+{
+    min_chunk_size = min_size;
+    max_chunk_size = MAX(min_size, max_size);
+}
+
+// start with what the socket buffer can take at once
+size_t
+FileSender::initial_chunk_size(int fd) const
+{
+    int sndbuf = 0;
+    socklen_t len = sizeof(sndbuf);
+    if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) < 0
+        || sndbuf <= 0) {
+        return min_chunk_size;
+    }
+    return MIN(MAX((size_t) sndbuf, min_chunk_size), max_chunk_size);
+}
+
+// grow while the socket takes everything, shrink to what it took otherwise
+void
+FileSender::adapt_chunk_size(size_t nrequest, ssize_t nsend)
+{
+    if (nsend < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            chunk_size_ = MAX(chunk_size_ / 2, min_chunk_size);
+    } else if ((size_t) nsend < nrequest) {
+        chunk_size_ = MAX((size_t) nsend, min_chunk_size);
+    } else if (nrequest == chunk_size_) {
+        chunk_size_ = MIN(chunk_size_ * 2, max_chunk_size);
+    }
+}
+
+void
+FileSender::unmap_window()
+{
+    if (window_) {
+        munmap(window_, window_size_);
+        window_ = NULL;
+    }
+}
 
 ssize_t
-FileSender::write_to_fd(int fd)
+FileSender::mmap_write_chunk(int fd, size_t nbytes)
+{
+    if (window_ == NULL || offset_ < window_offset_
+        || offset_ >= window_offset_ + (off64_t) window_size_) {
+        // slide the window, mmap offsets have to be page aligned
+        unmap_window();
+        off64_t page_size = sysconf(_SC_PAGESIZE);
+        window_offset_ = offset_ - offset_ % page_size;
+        window_size_ = MIN((off64_t) kMmapWindowSize,
+                           offset_ + length_ - window_offset_);
+        void* addr = mmap(NULL, window_size_, PROT_READ, MAP_SHARED,
+                          file_fd_, window_offset_);
+        if (addr == MAP_FAILED) {
+            LOG(WARNING, "Cannot map file %d at %lld", file_fd_,
+                (long long) window_offset_);
+            return -1;
+        }
+        madvise(addr, window_size_, MADV_SEQUENTIAL);
+        window_ = (byte*) addr;
+    }
+    size_t avail = window_offset_ + window_size_ - offset_;
+    ssize_t nsend = ::write(fd, window_ + (offset_ - window_offset_),
+                            MIN(nbytes, avail));
+    if (nsend > 0) {
+        offset_ += nsend;
+    }
+    return nsend;
+}
+
+ssize_t
+FileSender::sendfile_chunk(int fd, size_t nbytes)
 {
-    size_t n_should_send = MIN(length_, Buffer::kPageSize);
-    ssize_t nsend = -1;
 #ifdef USE_LINUX_SENDFILE
     // use sendfile64 under linux to send
-    nsend =  sendfile64(fd, file_fd_, &offset_, n_should_send);
+    return sendfile64(fd, file_fd_, &offset_, nbytes);
 #else
 #ifdef USE_FREEBSD_SENDFILE
-    // use sendfile under freebsd to send
+    // use sendfile under freebsd to send, offset is not updated for us
+    off_t nsend = 0;
+    if (sendfile(file_fd_, fd, offset_, nbytes, NULL, &nsend, 0) < 0
+        && nsend == 0) {
+        return -1;
+    }
+    offset_ += nsend;
+    return nsend;
 #else
-    // use mmap and write to send
+    return mmap_write_chunk(fd, nbytes);
 #endif
 #endif
+}
+
+ssize_t
+FileSender::write_to_fd(int fd)
+{
+    if (chunk_size_ == 0) {
+        chunk_size_ = initial_chunk_size(fd);
+    }
+    size_t n_should_send = MIN((size_t) length_, chunk_size_);
+    ssize_t nsend = -1;
+    if (strategy == kMmapWrite) {
+        nsend = mmap_write_chunk(fd, n_should_send);
+    } else {
+        nsend = sendfile_chunk(fd, n_should_send);
+    }
+    adapt_chunk_size(n_should_send, nsend);
+    blocked_ = nsend < (ssize_t) n_should_send;
     if (nsend < 0)
         return nsend;
     length_ -= nsend;
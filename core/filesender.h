@@ -6,23 +6,67 @@
 #include <unistd.h>
 #include <sys/types.h>
 
+#include <boost/shared_ptr.hpp>
+
 #include "core/buffer.h"
 
 namespace tube {
 
+// A file descriptor shared by several senders (and caches), closed when the
+// last reference goes away.
+class FileHandle : utils::Noncopyable
+{
+    int fd_;
+public:
+    explicit FileHandle(int fd) : fd_(fd) {}
+    ~FileHandle();
+
+    int fd() const { return fd_; }
+};
+
+typedef boost::shared_ptr<FileHandle> FileHandlePtr;
+
 class FileSender : public Writeable
 {
-    int         file_fd_;
-    off64_t     offset_;
-    off64_t     length_;
+    FileHandlePtr handle_;
+    int           file_fd_;
+    off64_t       offset_;
+    off64_t       length_;
+    size_t        chunk_size_; // adapted to the socket, 0 until first write
+    byte*         window_;     // mapped part of the file, for kMmapWrite
+    off64_t       window_offset_;
+    size_t        window_size_;
 public:
+    enum SendStrategy {
+        kSendfile,  // falls back to kMmapWrite if sendfile is not built in
+        kMmapWrite  // write from a sliding read-only mapping of the file
+    };
+
+    static const size_t kDefaultMinChunkSize;
+    static const size_t kDefaultMaxChunkSize;
+    static const size_t kMmapWindowSize;
+
+    // bounds of the adaptive chunk size, shared by all senders
+    static void set_chunk_size_range(size_t min_size, size_t max_size);
+    static void set_send_strategy(SendStrategy strategy);
+    static SendStrategy send_strategy();
+
+    // takes the ownership of file_desc
     FileSender(int file_desc, off64_t offset, off64_t length);
+    FileSender(const FileHandlePtr& handle, off64_t offset, off64_t length);
     virtual ~FileSender();
 
     virtual ssize_t write_to_fd(int fd);
     virtual u64     size() const { return length_; }
     virtual size_t  memory_usage() const { return 0; }
     virtual bool    append(const byte* data, size_t size) { return false; }
+private:
+    size_t initial_chunk_size(int fd) const;
+    void   adapt_chunk_size(size_t nrequest, ssize_t nsend);
+
+    ssize_t sendfile_chunk(int fd, size_t nbytes);
+    ssize_t mmap_write_chunk(int fd, size_t nbytes);
+    void    unmap_window();
 };
 
 }
@@ -2,6 +2,8 @@
 
 #include <ctime>
 #include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <netinet/tcp.h>
 
 #include "core/pipeline.h"
@@ -12,7 +14,8 @@
 namespace tube {
 
 Connection::Connection(int sock)
-    : in_stream(sock), out_stream(sock), close_after_finish(false)
+    : in_stream(sock), out_stream(sock), close_after_finish(false),
+      input_paused(false)
 {
     fd = sock;
     timeout = 0; // default no timeout
@@ -32,6 +35,18 @@ Connection::active_close()
     stage->cleanup_connection(this);
 }
 
+bool
+Connection::is_idle()
+{
+    if (!out_stream.is_done() || in_stream.buffer().size() > 0)
+        return false;
+    // a request still in the socket buffer is not read yet, but it's there
+    int pending = 0;
+    if (ioctl(fd, FIONREAD, &pending) == 0 && pending > 0)
+        return false;
+    return true;
+}
+
 void
 Connection::set_cork()
 {
@@ -118,7 +133,8 @@ Scheduler::~Scheduler()
 }
 
 QueueScheduler::QueueScheduler(bool suppress_connection_lock)
-    : Scheduler(), suppress_connection_lock_(suppress_connection_lock)
+    : Scheduler(), suppress_connection_lock_(suppress_connection_lock),
+      stopped_(false)
 {
 }
 
@@ -182,9 +198,11 @@ Connection*
 QueueScheduler::pick_task_nolock_connection()
 {
     utils::Lock lk(mutex_);
-    while (list_.empty()) {
+    while (list_.empty() && !stopped_) {
         cond_.wait(lk);
     }
+    if (stopped_)
+        return NULL;
     Connection* conn = list_.front();
     list_.pop_front();
     nodes_.erase(conn->fd);
@@ -195,11 +213,13 @@ Connection*
 QueueScheduler::pick_task_lock_connection()
 {
     QueueSchedulerPickScope lk(mutex_);
-    while (list_.empty()) {
+    while (list_.empty() && !stopped_) {
         cond_.wait(lk);
     }
 
 reschedule:
+    if (stopped_)
+        return NULL;
     Connection* conn = NULL;
     for (NodeList::iterator it = list_.begin(); it != list_.end(); ++it) {
         conn = *it;
@@ -223,6 +243,14 @@ QueueScheduler::pick_task()
     }
 }
 
+void
+QueueScheduler::stop()
+{
+    utils::Lock lk(mutex_);
+    stopped_ = true;
+    cond_.notify_all();
+}
+
 void
 QueueScheduler::remove_task(Connection* conn)
 {
@@ -254,6 +282,7 @@ ConnectionFactory::destroy_connection(Connection* conn)
 }
 
 Pipeline::Pipeline()
+    : draining_(false)
 {
     factory_ = new ConnectionFactory();
 }
@@ -284,7 +313,17 @@ Pipeline::find_stage(const std::string& name)
 Connection*
 Pipeline::create_connection(int fd)
 {
-    return factory_->create_connection(fd);
+    Connection* conn = factory_->create_connection(fd);
+    utils::Lock lk(connections_mutex_);
+    connections_.insert(conn);
+    return conn;
+}
+
+size_t
+Pipeline::connection_count()
+{
+    utils::Lock lk(connections_mutex_);
+    return connections_.size();
 }
 
 void
@@ -304,6 +343,10 @@ Pipeline::dispose_connection(Connection* conn)
     }
     ::close(conn->fd);
     conn->unlock();
+    {
+        utils::Lock lk(connections_mutex_);
+        connections_.erase(conn);
+    }
     factory_->destroy_connection(conn);
     LOG(DEBUG, "disposed");
 }
@@ -328,11 +371,25 @@ void
 Pipeline::enable_poll(Connection* conn)
 {
     utils::set_socket_blocking(conn->fd, false);
-    if (!conn->inactive) {
+    if (!conn->inactive && !conn->input_paused) {
         poll_in_stage_->sched_add(conn);
     }
 }
 
+void
+Pipeline::pause_input(Connection* conn)
+{
+    conn->input_paused = true;
+    poll_in_stage_->sched_remove(conn);
+}
+
+void
+Pipeline::resume_input(Connection* conn)
+{
+    conn->input_paused = false;
+    find_stage("parser")->sched_add(conn);
+}
+
 void
 Pipeline::reschedule_all()
 {
@@ -342,5 +399,44 @@ Pipeline::reschedule_all()
     }
 }
 
+void
+Pipeline::shutdown_all_connections()
+{
+    // the shared lock keeps the fds from being closed meanwhile
+    utils::SLock lk(mutex_);
+    utils::Lock conns_lk(connections_mutex_);
+    for (ConnectionSet::iterator it = connections_.begin();
+         it != connections_.end(); ++it) {
+        ::shutdown((*it)->fd, SHUT_RDWR);
+    }
+}
+
+void
+Pipeline::stop_all_stages()
+{
+    StageMap::iterator poll_in = map_.find("poll_in");
+    if (poll_in != map_.end())
+        poll_in->second->stop();
+    for (StageMap::iterator it = map_.begin(); it != map_.end(); ++it) {
+        if (it != poll_in)
+            it->second->stop();
+    }
+}
+
+void
+Pipeline::dispose_all_connections()
+{
+    ConnectionSet connections;
+    {
+        utils::Lock lk(connections_mutex_);
+        connections = connections_;
+    }
+    utils::XLock lk(mutex_);
+    for (ConnectionSet::iterator it = connections.begin();
+         it != connections.end(); ++it) {
+        dispose_connection(*it);
+    }
+}
+
 }
 
@@ -10,6 +10,7 @@
 #include <set>
 
 #include <map>
+#include <vector>
 
 #include "utils/fdmap.h"
 #include "utils/misc.h"
@@ -44,6 +45,8 @@ struct Connection
     long         owner;
 
     bool close_after_finish;
+    // left out of polling until resumed, the idle scan cannot see it then
+    volatile bool input_paused;
 
     bool trylock();
     void lock();
@@ -57,6 +60,13 @@ struct Connection
 
     void active_close();
 
+    // nothing in flight, closing it loses nothing.  with the connection
+    // locked.
+    virtual bool is_idle();
+    // everything queued on out_stream was written.  with the connection
+    // locked.
+    virtual void on_output_done() {}
+
     Connection(int sock);
     virtual ~Connection() {}
 };
@@ -68,9 +78,12 @@ public:
     virtual ~Scheduler();
 
     virtual void add_task(Connection* conn)     = 0;
+    // NULL once stopped
     virtual Connection* pick_task()             = 0;
     virtual void remove_task(Connection* conn)  = 0;
     virtual void reschedule()                   = 0;
+    // wakes up every thread waiting in pick_task
+    virtual void stop()                         = 0;
 };
 
 class QueueScheduler : public Scheduler
@@ -86,6 +99,7 @@ protected:
     utils::Condition  cond_;
 
     bool      suppress_connection_lock_;
+    bool      stopped_;
 public:
     QueueScheduler(bool suppress_connection_lock = false);
     ~QueueScheduler();
@@ -94,6 +108,7 @@ public:
     virtual Connection* pick_task();
     virtual void        remove_task(Connection* conn);
     virtual void        reschedule();
+    virtual void        stop();
 private:
     Connection* pick_task_nolock_connection();
     Connection* pick_task_lock_connection();
@@ -119,6 +134,11 @@ class Pipeline : utils::Noncopyable
     PollInStage*             poll_in_stage_;
     ConnectionFactory* factory_;
 
+    typedef std::set<Connection*> ConnectionSet;
+    ConnectionSet connections_;
+    utils::Mutex  connections_mutex_;
+    volatile bool draining_;
+
     Pipeline();
     ~Pipeline();
 
@@ -139,11 +159,31 @@ public:
 
     Connection* create_connection(int fd);
     void dispose_connection(Connection* conn);
+    size_t connection_count();
+
+    // no new requests on the connections kept alive, they are closed once
+    // idle
+    void set_draining() { draining_ = true; }
+    bool is_draining() const { return draining_; }
 
     void disable_poll(Connection* conn);
     void enable_poll(Connection* conn);
 
+    // stops reading from the client without blocking the socket, resuming
+    // passes the connection to the parser stage for what was held back
+    void pause_input(Connection* conn);
+    void resume_input(Connection* conn);
+
     void reschedule_all();
+
+    // the connections still busy at the deadline, their reads and writes
+    // fail from now on
+    void shutdown_all_connections();
+    // joins the threads of every stage, the poll in stage first so nothing
+    // new comes in
+    void stop_all_stages();
+    // frees the connections left, once no stage runs
+    void dispose_all_connections();
 };
 
 }
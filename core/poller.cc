@@ -6,9 +6,17 @@
 namespace tube {
 
 Poller::Poller() 
+    : stopped_(false)
 {
 }
 
+void
+Poller::stop()
+{
+    stopped_ = true;
+    wake();
+}
+
 bool
 Poller::has_fd(int fd) const
 {
@@ -44,7 +44,10 @@ public:
     bool has_fd(int fd) const;
     Connection* find_connection(int fd);
 
+    // loops until stop(), timeout is in seconds
     virtual void handle_event(int timeout)  = 0;
+    // from any thread, handle_event returns once the current round is done
+    void stop();
     virtual bool poll_add_fd(int fd, Connection* conn, PollerEvent evt) = 0;
     virtual bool poll_remove_fd(int fd) = 0;
 
@@ -52,11 +55,15 @@ public:
     bool remove_fd(int fd);
 protected:
     FDMap          fds_;
+    volatile bool  stopped_;
     // handler when events happened
     EventCallback  handler_;
     // handler before or after events processed
     PollerCallback pre_handler_, post_handler_;
 protected:
+    // cuts the wait short, or handle_event notices the stop on its timeout
+    virtual void wake() {}
+
     bool add_fd_set(int fd, Connection* conn);
     bool remove_fd_set(int fd);
 };
@@ -19,6 +19,7 @@ namespace tube {
 class EpollPoller : public Poller
 {
     int epoll_fd_;
+    int wake_fds_[2]; // watched with no connection, only to wake up
 public:
     EpollPoller() ;
     virtual ~EpollPoller();
@@ -26,6 +27,8 @@ public:
     virtual void handle_event(int timeout) ;
     virtual bool poll_add_fd(int fd, Connection* conn, PollerEvent evt);
     virtual bool poll_remove_fd(int fd);
+protected:
+    virtual void wake();
 };
 
 EpollPoller::EpollPoller() 
@@ -35,11 +38,29 @@ EpollPoller::EpollPoller()
     if (epoll_fd_ < 0) {
         throw utils::SyscallException();
     }
+    if (::pipe(wake_fds_) < 0) {
+        ::close(epoll_fd_);
+        throw utils::SyscallException();
+    }
+    struct epoll_event epoll_evt;
+    epoll_evt.events = EPOLLIN;
+    epoll_evt.data.ptr = NULL;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fds_[0], &epoll_evt);
 }
 
 EpollPoller::~EpollPoller()
 {
     ::close(epoll_fd_);
+    ::close(wake_fds_[0]);
+    ::close(wake_fds_[1]);
+}
+
+void
+EpollPoller::wake()
+{
+    char tag = 'w';
+    if (::write(wake_fds_[1], &tag, 1) < 0)
+        LOG(WARNING, "cannot wake the poller: %s", strerror(errno));
 }
 
 static int
@@ -101,7 +122,7 @@ EpollPoller::handle_event(int timeout)
     struct epoll_event* epoll_evt = (struct epoll_event*)
         malloc(sizeof(struct epoll_event) * MAX_EVENT_PER_POLL);
     Connection* conn = NULL;
-    while (true) {
+    while (!stopped_) {
         int nfds = epoll_wait(epoll_fd_, epoll_evt, MAX_EVENT_PER_POLL,
                               timeout * 1000);
         if (nfds < 0) {
@@ -117,6 +138,8 @@ EpollPoller::handle_event(int timeout)
         if (!handler_.empty()) {
             for (int i = 0; i < nfds; i++) {
                 conn = (Connection*) epoll_evt[i].data.ptr;
+                if (conn == NULL)
+                    continue; // woken up to stop
                 handler_(conn, build_poller_event(epoll_evt[i].events));
             }
         }
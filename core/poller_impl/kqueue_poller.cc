@@ -106,7 +106,7 @@ KqueuePoller::handle_event(int timeout) throw ()
     struct timespec tspec;
     tspec.tv_sec = timeout;
     tspec.tv_nsec = 0;
-    while (true) {
+    while (!stopped_) {
         int nfds = ::kevent(kqueue_, NULL, 0, kevents, MAX_EVENT_PER_KEVENT,
                             &tspec);
         if (nfds < 0) {
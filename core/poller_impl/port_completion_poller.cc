@@ -116,7 +116,7 @@ PortPoller::handle_event(int timeout)
     tspec.tv_sec = timeout;
     tspec.tv_nsec = 0;
     Connection* conn = NULL;
-    while (true) {
+    while (!stopped_) {
         uint_t nfds = 0;
         /* weird handling.
          * 1. getn seems return immediately when no fd is associated
@@ -4,6 +4,7 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <cstdlib>
 #include <signal.h>
 
@@ -37,10 +38,19 @@ lookup_addr(const char* host, const char* service)
     return info;
 }
 
-Server::Server(const char* host, const char* service) 
-    : read_stage_pool_size_(kDefaultReadStagePoolSize),
+Server::Server(const char* host, const char* service, int listen_fd)
+    : fd_(listen_fd), addr_size_(0), stopping_(false),
+      read_stage_pool_size_(kDefaultReadStagePoolSize),
       write_stage_pool_size_(kDefaultWriteStagePoolSize)
 {
+    if (pipe(wake_fds_) < 0)
+        throw SyscallException();
+    read_stage_ = new PollInStage();
+    write_stage_ = new WriteBackStage();
+    recycle_stage_ = new RecycleStage();
+    if (fd_ >= 0)
+        return;
+
     struct addrinfo* info = lookup_addr(host, service);
     bool done = false;
     for (struct addrinfo* p = info; p != NULL; p = p->ai_next) {
@@ -65,10 +75,6 @@ Server::Server(const char* host, const char* service)
         err += strerror(errno);
         throw std::invalid_argument(err);
     }
-
-    read_stage_ = new PollInStage();
-    write_stage_ = new WriteBackStage();
-    recycle_stage_ = new RecycleStage();
 }
 
 Server::~Server()
@@ -77,8 +83,12 @@ Server::~Server()
     delete write_stage_;
     delete recycle_stage_;
 
-    shutdown(fd_, SHUT_RDWR);
-    close(fd_);
+    if (fd_ >= 0) {
+        ::shutdown(fd_, SHUT_RDWR);
+        close(fd_);
+    }
+    close(wake_fds_[0]);
+    close(wake_fds_[1]);
 }
 
 void
@@ -120,12 +130,33 @@ Server::main_loop()
     ::signal(SIGPIPE, SIG_IGN);
     Pipeline& pipeline = Pipeline::instance();
     Stage* stage = pipeline.find_stage("poll_in");
-    while (true) {
+    // never blocks in accept then, when a process sharing the socket took
+    // the connection first
+    utils::set_socket_blocking(fd_, false);
+    struct pollfd pfds[2];
+    pfds[0].fd = fd_;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = wake_fds_[0];
+    pfds[1].events = POLLIN;
+    while (!stopping_) {
+        if (::poll(pfds, 2, -1) < 0) {
+            if (errno != EINTR)
+                LOG(WARNING, "Error when polling listener: %s",
+                    strerror(errno));
+            continue;
+        }
+        if (stopping_)
+            break;
+        if (!(pfds[0].revents & POLLIN))
+            continue;
         InternetAddress address;
         socklen_t socklen = address.max_address_length();
         int client_fd = ::accept(fd_, address.get_address(), &socklen);
         if (client_fd < 0) {
-            LOG(WARNING, "Error when accepting socket: %s", strerror(errno));
+            // another process sharing the socket may have taken it
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                LOG(WARNING, "Error when accepting socket: %s",
+                    strerror(errno));
             continue;
         }
         // set non-blocking mode
@@ -137,6 +168,49 @@ Server::main_loop()
             conn->address_string().c_str());
         stage->sched_add(conn);
     }
+    // not shut down, a new process may accept on it
+    close(fd_);
+    fd_ = -1;
+}
+
+void
+Server::stop_accepting()
+{
+    stopping_ = true;
+    char tag = 's';
+    if (write(wake_fds_[1], &tag, 1) < 0)
+        LOG(WARNING, "cannot wake the accepting thread: %s", strerror(errno));
+}
+
+bool
+Server::drain(int timeout)
+{
+    Pipeline& pipeline = Pipeline::instance();
+    pipeline.set_draining();
+    time_t deadline = time(NULL) + timeout;
+    while (true) {
+        read_stage_->close_idle_connections();
+        recycle_stage_->flush();
+        size_t count = pipeline.connection_count();
+        if (count == 0)
+            return true;
+        if (time(NULL) >= deadline) {
+            LOG(WARNING, "%lu connections still busy", count);
+            return false;
+        }
+        usleep(100000);
+    }
+}
+
+void
+Server::shutdown()
+{
+    Pipeline& pipeline = Pipeline::instance();
+    pipeline.shutdown_all_connections();
+    pipeline.stop_all_stages();
+    stop_handlers();
+    pipeline.dispose_all_connections();
+    LOG(INFO, "all stages stopped");
 }
 
 }
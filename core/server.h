@@ -14,6 +14,8 @@ class Server
 {
     int fd_;
     size_t addr_size_;
+    int wake_fds_[2]; // wakes main_loop up to stop accepting
+    volatile bool stopping_;
 
     size_t read_stage_pool_size_;
     size_t write_stage_pool_size_;
@@ -25,7 +27,9 @@ public:
     static const size_t kDefaultReadStagePoolSize;
     static const size_t kDefaultWriteStagePoolSize;
 public:
-    Server(const char* host, const char* service) ;
+    // listen_fd is a socket listening already, handed over by the process
+    // this one replaces
+    Server(const char* host, const char* service, int listen_fd = -1);
     virtual ~Server();
 
     int fd() const { return fd_; }
@@ -38,7 +42,23 @@ public:
     void start_all_threads();
 
     void listen(int queue_size);
+    // returns once stop_accepting() is called
     void main_loop();
+
+    // from any thread.  the listening socket is only closed here, a new
+    // process accepting on it keeps it open.
+    void stop_accepting();
+    // closes the connections kept alive as they become idle, false if some
+    // are still busy after timeout seconds
+    bool drain(int timeout);
+    // after drain(), cuts what is left, joins every stage thread and frees
+    // the connections
+    void shutdown();
+protected:
+    // in shutdown(), once the stages are stopped and before the
+    // connections are freed.  threads of the server's own besides the
+    // stages are joined here.
+    virtual void stop_handlers() {}
 };
 
 }
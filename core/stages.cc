@@ -22,6 +22,14 @@ Stage::Stage(std::string name)
     pipeline_.add_stage(name, this);
 }
 
+Stage::~Stage()
+{
+    // a stage never stopped leaves its threads detached
+    for (size_t i = 0; i < threads_.size(); i++) {
+        delete threads_[i];
+    }
+}
+
 bool
 Stage::sched_add(Connection* conn)
 {
@@ -53,6 +61,8 @@ Stage::main_loop()
     if (!sched_) return;
     while (true) {
         Connection* conn = sched_->pick_task();
+        if (conn == NULL)
+            break; // stopped
         if (process_task(conn) >= 0) {
             conn->unlock();
             pipeline_.reschedule_all();
@@ -63,7 +73,26 @@ Stage::main_loop()
 void
 Stage::start_thread()
 {
-    Thread th(boost::bind(&Stage::main_loop, this));
+    threads_.push_back(new Thread(boost::bind(&Stage::main_loop, this)));
+}
+
+void
+Stage::interrupt()
+{
+    if (sched_) {
+        sched_->stop();
+    }
+}
+
+void
+Stage::stop()
+{
+    interrupt();
+    for (size_t i = 0; i < threads_.size(); i++) {
+        threads_[i]->join();
+        delete threads_[i];
+    }
+    threads_.clear();
 }
 
 IdleScanner::IdleScanner(int scan_timeout, PollInStage& stage)
@@ -130,12 +159,18 @@ PollInStage::add_poll(Poller* poller)
 {
     utils::Lock lk(mutex_);
     pollers_.push_back(poller);
+    ready_.notify_all();
 }
 
 bool
 PollInStage::sched_add(Connection* conn)
 {
     utils::Lock lk(mutex_);
+    // the poller threads add themselves, an upgraded process may accept
+    // before the first one did
+    while (pollers_.empty()) {
+        ready_.wait(lk);
+    }
     current_poller_ = (current_poller_ + 1) % pollers_.size();
     return pollers_[current_poller_]->add_fd(
         conn->fd, conn, POLLER_EVENT_READ | POLLER_EVENT_ERROR
@@ -176,6 +211,41 @@ PollInStage::cleanup_connection(Connection* conn)
     }
 }
 
+size_t
+PollInStage::close_idle_connections()
+{
+    std::vector<Connection*> idle_connections;
+    time_t now = time(NULL);
+    {
+        utils::Lock lk(mutex_);
+        for (size_t i = 0; i < pollers_.size(); i++) {
+            for (Poller::FDMap::iterator it = pollers_[i]->begin();
+                 it != pollers_[i]->end(); ++it) {
+                Connection* conn = *it;
+                // locked means a stage works on it
+                if (conn->inactive || !conn->trylock())
+                    continue;
+                // one just accepted or answered gets a second, its request
+                // may still be on the way
+                if (now - conn->last_active >= 1 && conn->is_idle()) {
+                    // shut down while it's locked, nothing is read in
+                    // between.  inactive keeps anyone else from recycling
+                    // it.
+                    conn->inactive = true;
+                    ::shutdown(conn->fd, SHUT_RDWR);
+                    idle_connections.push_back(conn);
+                }
+                conn->unlock();
+            }
+        }
+    }
+    for (size_t i = 0; i < idle_connections.size(); i++) {
+        sched_remove(idle_connections[i]);
+        recycle_stage_->sched_add(idle_connections[i]);
+    }
+    return idle_connections.size();
+}
+
 void
 PollInStage::read_connection(Connection* conn)
 {
@@ -229,41 +299,129 @@ PollInStage::main_loop()
     poller->set_post_handler(posthdl);
     poller->set_event_handler(evthdl);
     add_poll(poller);
+    // freed with the stage
     poller->handle_event(timeout_);
-    delete poller;
+}
+
+void
+PollInStage::interrupt()
+{
+    utils::Lock lk(mutex_);
+    for (size_t i = 0; i < pollers_.size(); i++) {
+        pollers_[i]->stop();
+    }
 }
 
 WriteBackStage::WriteBackStage()
-    : Stage("write_back")
+    : Stage("write_back"), poller_(NULL), watcher_(NULL), stopped_(false)
 {
     sched_ = new QueueScheduler(true);
 }
 
 WriteBackStage::~WriteBackStage()
 {
+    interrupt();
+    if (poller_)
+        PollerFactory::instance().destroy_poller(poller_);
     delete sched_;
 }
 
+void
+WriteBackStage::initialize()
+{
+    if (watcher_)
+        return;
+    poller_ = PollerFactory::instance().create_poller(
+        PollerFactory::instance().default_poller_name());
+    if (poller_ == NULL) {
+        LOG(WARNING, "no poller for the sockets of slow clients");
+        return;
+    }
+    poller_->set_event_handler(
+        boost::bind(&WriteBackStage::handle_writable, this, _1, _2));
+    watcher_ = new utils::Thread(boost::bind(&WriteBackStage::poll, this));
+}
+
+void
+WriteBackStage::poll()
+{
+    poller_->handle_event(1);
+}
+
+bool
+WriteBackStage::wait_writable(Connection* conn)
+{
+    utils::Lock lk(mutex_);
+    if (stopped_ || watcher_ == NULL)
+        return false;
+    if (!poller_->add_fd(conn->fd, conn, POLLER_EVENT_WRITE
+                         | POLLER_EVENT_ERROR | POLLER_EVENT_HUP))
+        return false;
+    waiting_.insert(conn);
+    return true;
+}
+
+void
+WriteBackStage::handle_writable(Connection* conn, PollerEvent evt)
+{
+    utils::Lock lk(mutex_);
+    // an event fetched before the stage gave it up
+    if (waiting_.erase(conn) == 0)
+        return;
+    poller_->remove_fd(conn->fd);
+    // a socket in error fails the next write, which finishes it
+    sched_add(conn);
+}
+
+void
+WriteBackStage::interrupt()
+{
+    {
+        utils::Lock lk(mutex_);
+        stopped_ = true;
+        for (std::set<Connection*>::iterator it = waiting_.begin();
+             it != waiting_.end(); ++it) {
+            poller_->remove_fd((*it)->fd);
+            (*it)->unlock();
+        }
+        waiting_.clear();
+    }
+    if (watcher_) {
+        poller_->stop();
+        watcher_->join();
+        delete watcher_;
+        watcher_ = NULL;
+    }
+    Stage::interrupt();
+}
+
 int
 WriteBackStage::process_task(Connection* conn)
 {
     conn->last_active = time(NULL);
-    utils::set_socket_blocking(conn->fd, true);
     OutputStream& out = conn->out_stream;
-    int rs = out.write_into_output();
-    utils::set_socket_blocking(conn->fd, false);
-
-    if (!out.is_done() && rs > 0) {
-        conn->last_active = time(NULL);
-        sched_add(conn);
-        return -1;
-    } else {
-        conn->clear_cork();
-        if (conn->close_after_finish) {
-            conn->active_close();
+    ssize_t rs = out.write_into_output();
+
+    if (!out.is_done()) {
+        if (rs > 0)
+            conn->last_active = time(NULL);
+        if (out.is_blocked()) {
+            // back here once the client made room
+            if (wait_writable(conn))
+                return -1;
+        } else if (rs > 0) {
+            // the budget is spent, the others get their turn first
+            sched_add(conn);
+            return -1;
         }
-        return 0; // done, and not to schedule it anymore
     }
+    conn->clear_cork();
+    if (out.is_done())
+        conn->on_output_done();
+    if (conn->close_after_finish) {
+        conn->active_close();
+    }
+    return 0; // done, and not to schedule it anymore
 }
 
 ParserStage::ParserStage()
@@ -288,6 +446,15 @@ RecycleStage::sched_add(Connection* conn)
     return true;
 }
 
+void
+RecycleStage::flush()
+{
+    utils::Lock lk(mutex_);
+    flush_ = true;
+    queue_.push(NULL);
+    cond_.notify_one();
+}
+
 void
 RecycleStage::main_loop()
 {
@@ -295,16 +462,23 @@ RecycleStage::main_loop()
     std::vector<Connection*> dead_conns;
     while (true) {
         mutex_.lock();
+        bool stopped = false;
         while (true) {
-            while (queue_.empty()) {
+            while (queue_.empty() && !stopped_) {
                 cond_.wait(mutex_);
             }
+            if (queue_.empty()) {
+                // whatever was queued is disposed before leaving
+                stopped = true;
+                break;
+            }
             Connection* conn = queue_.front();
             queue_.pop();
             if (conn) {
                 dead_conns.push_back(conn);
             } else {
-                if (dead_conns.size() > recycle_batch_size_) {
+                if (dead_conns.size() > recycle_batch_size_ || flush_) {
+                    flush_ = false;
                     break;
                 }
             }
@@ -316,7 +490,17 @@ RecycleStage::main_loop()
             pipeline.dispose_connection(dead_conns[i]);
         }
         dead_conns.clear();
+        if (stopped)
+            return;
     }
 }
 
+void
+RecycleStage::interrupt()
+{
+    utils::Lock lk(mutex_);
+    stopped_ = true;
+    cond_.notify_all();
+}
+
 }
@@ -19,9 +19,11 @@ protected:
     Pipeline&  pipeline_;
 protected:
     Stage(std::string name);
-    virtual ~Stage() {}
+    virtual ~Stage();
 
     virtual int process_task(Connection* conn) { return 0; };
+    // makes main_loop return in every thread of the stage
+    virtual void interrupt();
 public:
     virtual void initialize() {}
 
@@ -32,6 +34,10 @@ public:
     virtual void main_loop();
 
     void start_thread();
+    // returns once every thread of the stage is done
+    void stop();
+private:
+    std::vector<utils::Thread*> threads_;
 };
 
 class IdleScanner;
@@ -39,6 +45,8 @@ class IdleScanner;
 class PollInStage : public Stage
 {
     utils::Mutex      mutex_;
+    // signalled as the poller threads come up
+    utils::Condition  ready_;
 
     std::vector<Poller*> pollers_;
     size_t               current_poller_;
@@ -64,7 +72,11 @@ public:
     virtual void main_loop();
 
     void cleanup_connection(Connection* conn);
+    // how many were closed
+    size_t close_idle_connections();
 friend class IdleScanner;
+protected:
+    virtual void interrupt();
 private:
     void read_connection(Connection* conn);
     void add_poll(Poller* poller);
@@ -82,13 +94,30 @@ public:
     void scan_idle_connection(Poller& poller);
 };
 
+// Writes the output streams out.  A connection whose socket is full waits
+// in a poller of its own until the client makes room, still locked, so no
+// thread of the stage blocks on a slow client.
 class WriteBackStage : public Stage
 {
+    utils::Mutex           mutex_;
+    std::set<Connection*>  waiting_;
+    Poller*                poller_;
+    utils::Thread*         watcher_;
+    bool                   stopped_;
+protected:
+    // the waiting connections are given up
+    virtual void interrupt();
 public:
     WriteBackStage();
     virtual ~WriteBackStage();
 
+    virtual void initialize();
     virtual int process_task(Connection* conn);
+private:
+    // false if the stage is stopped, or cannot watch the socket
+    bool wait_writable(Connection* conn);
+    void handle_writable(Connection* conn, PollerEvent evt);
+    void poll();
 };
 
 class ParserStage : public Stage
@@ -104,9 +133,14 @@ class RecycleStage : public Stage
     utils::Condition        cond_;
     std::queue<Connection*> queue_;
     size_t                  recycle_batch_size_;
+    bool                    flush_;
+    bool                    stopped_;
+protected:
+    virtual void interrupt();
 public:
     RecycleStage()
-        : Stage("recycle"), recycle_batch_size_(1) {}
+        : Stage("recycle"), recycle_batch_size_(1), flush_(false),
+          stopped_(false) {}
 
     virtual ~RecycleStage() {}
 
@@ -115,6 +149,8 @@ public:
 
     virtual void main_loop();
     void set_recycle_batch_size(size_t size) { recycle_batch_size_ = size; }
+    // disposes what is queued without waiting for a whole batch
+    void flush();
 };
 
 }
@@ -1,5 +1,7 @@
 #include "pch.h"
 
+#include <cerrno>
+
 #include "core/stream.h"
 #include "core/filesender.h"
 #include "utils/exception.h"
@@ -19,8 +21,10 @@ InputStream::close()
     buffer_.clear();
 }
 
+const size_t OutputStream::kWriteBudget = 1 << 20;
+
 OutputStream::OutputStream(int fd)
-    : fd_(fd), memory_usage_(0)
+    : fd_(fd), memory_usage_(0), blocked_(false)
 {
 }
 
@@ -36,18 +40,32 @@ OutputStream::~OutputStream()
 ssize_t
 OutputStream::write_into_output()
 {
-    if (writeables_.empty()) {
-        return 0;
-    }
-    Writeable* writeable = writeables_.front();
-    size_t mem_use = writeable->memory_usage();
-    ssize_t res = writeable->write_to_fd(fd_);
-    memory_usage_ -= mem_use - writeable->memory_usage();
-    if (writeable->size() == 0) {
-        writeables_.pop_front();
-        delete writeable;
+    ssize_t nwrite = 0;
+    blocked_ = false;
+    // keep writing so headers and body leave in the same turn, but stop at
+    // the budget to give other connections their share, or once the socket
+    // takes no more
+    while (!writeables_.empty() && (size_t) nwrite < kWriteBudget) {
+        Writeable* writeable = writeables_.front();
+        size_t mem_use = writeable->memory_usage();
+        ssize_t res = writeable->write_to_fd(fd_);
+        int err = errno;
+        blocked_ = writeable->is_blocked()
+            && (res >= 0 || err == EAGAIN || err == EWOULDBLOCK);
+        memory_usage_ -= mem_use - writeable->memory_usage();
+        if (writeable->size() == 0) {
+            writeables_.pop_front();
+            delete writeable;
+        }
+        if (res <= 0) {
+            errno = err;
+            return nwrite > 0 ? nwrite : res;
+        }
+        nwrite += res;
+        if (blocked_)
+            break;
     }
-    return res;
+    return nwrite;
 }
 
 void
@@ -74,6 +92,15 @@ OutputStream::append_file(int file_desc, off64_t offset, off64_t length)
     return filesender->size();
 }
 
+off64_t
+OutputStream::append_file(const FileHandlePtr& handle, off64_t offset,
+                          off64_t length)
+{
+    Writeable* filesender = new FileSender(handle, offset, length);
+    writeables_.push_back(filesender);
+    return filesender->size();
+}
+
 
 size_t
 OutputStream::append_buffer(const Buffer& buf)
@@ -83,4 +110,13 @@ OutputStream::append_buffer(const Buffer& buf)
     return buffer->size();
 }
 
+size_t
+OutputStream::append_block(const DataBlockPtr& block, size_t offset,
+                           size_t length)
+{
+    Writeable* sender = new BlockSender(block, offset, length);
+    writeables_.push_back(sender);
+    return sender->size();
+}
+
 }
@@ -4,6 +4,8 @@
 #define _STREAM_H_
 
 #include "core/buffer.h"
+#include "core/block_sender.h"
+#include "core/filesender.h"
 
 namespace tube {
 
@@ -26,21 +28,31 @@ private:
 class OutputStream
 {
 public:
+    // most bytes written in one write_into_output call
+    static const size_t kWriteBudget;
+
     OutputStream(int fd);
     virtual ~OutputStream();
 
     ssize_t write_into_output();
     void    append_data(const byte* data, size_t size);
     off64_t append_file(int file_desc, off64_t offset, off64_t length);
+    off64_t append_file(const FileHandlePtr& handle, off64_t offset,
+                        off64_t length);
     size_t  append_buffer(const Buffer& buf);
+    size_t  append_block(const DataBlockPtr& block, size_t offset,
+                         size_t length);
 
     bool    is_done() const { return writeables_.empty(); }
+    // the last write_into_output stopped at a full socket, not the budget
+    bool    is_blocked() const { return blocked_; }
     size_t  memory_usage() const { return memory_usage_; }
 
 private:
     std::list<Writeable*> writeables_;
     int                   fd_;
     size_t                memory_usage_;
+    bool                  blocked_;
 };
 
 }
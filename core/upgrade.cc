@@ -0,0 +1,172 @@
+#include "pch.h"
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <cstdio>
+#include <cstdlib>
+
+#include "core/upgrade.h"
+#include "utils/logger.h"
+
+namespace tube {
+
+const char* BinaryUpgrade::kChannelEnv = "TUBE_UPGRADE_FD";
+int BinaryUpgrade::channel_ = -1;
+
+static bool
+send_fd(int channel, int fd)
+{
+    char tag = 'L';
+    struct iovec iov;
+    iov.iov_base = &tag;
+    iov.iov_len = 1;
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    ssize_t nsent;
+    do {
+        nsent = sendmsg(channel, &msg, MSG_NOSIGNAL);
+    } while (nsent < 0 && errno == EINTR);
+    return nsent == 1;
+}
+
+static int
+recv_fd(int channel)
+{
+    char tag;
+    struct iovec iov;
+    iov.iov_base = &tag;
+    iov.iov_len = 1;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t nread;
+    do {
+        nread = recvmsg(channel, &msg, 0);
+    } while (nread < 0 && errno == EINTR);
+    if (nread != 1)
+        return -1;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET
+        || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+        return -1;
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+// false if the new process exits, or says nothing for timeout seconds
+static bool
+wait_ready(int channel, int timeout)
+{
+    struct pollfd pfd;
+    pfd.fd = channel;
+    pfd.events = POLLIN;
+    int rs;
+    do {
+        rs = poll(&pfd, 1, timeout * 1000);
+    } while (rs < 0 && errno == EINTR);
+    if (rs <= 0)
+        return false;
+    char tag;
+    return read(channel, &tag, 1) == 1;
+}
+
+bool
+BinaryUpgrade::start(char* const argv[], int listen_fd, int timeout)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        LOG(ERROR, "cannot create the upgrade channel: %s", strerror(errno));
+        return false;
+    }
+    int max_fd = 65536;
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0
+        && limit.rlim_cur != RLIM_INFINITY)
+        max_fd = (int) limit.rlim_cur;
+
+    char env[16];
+    snprintf(env, sizeof(env), "%d", fds[1]);
+    setenv(kChannelEnv, env, 1);
+    pid_t pid = fork();
+    if (pid == 0) {
+        // a client socket left open in the new process would never see
+        // the old one closing it, only the channel goes along
+        for (int fd = 3; fd < max_fd; fd++) {
+            if (fd != fds[1])
+                close(fd);
+        }
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    unsetenv(kChannelEnv);
+    close(fds[1]);
+    if (pid < 0) {
+        LOG(ERROR, "cannot fork the new process: %s", strerror(errno));
+        close(fds[0]);
+        return false;
+    }
+
+    bool ready = send_fd(fds[0], listen_fd) && wait_ready(fds[0], timeout);
+    close(fds[0]);
+    if (!ready) {
+        LOG(ERROR, "new process %d did not start, still serving", pid);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return false;
+    }
+    LOG(WARNING, "new process %d accepts now", pid);
+    return true;
+}
+
+int
+BinaryUpgrade::take_listen_fd()
+{
+    const char* env = getenv(kChannelEnv);
+    if (env == NULL)
+        return -1;
+    channel_ = atoi(env);
+    // not for whatever this process starts
+    unsetenv(kChannelEnv);
+    int fd = recv_fd(channel_);
+    if (fd < 0) {
+        LOG(ERROR, "no listening socket from the old process");
+        close(channel_);
+        channel_ = -1;
+    }
+    return fd;
+}
+
+void
+BinaryUpgrade::notify_ready()
+{
+    if (channel_ < 0)
+        return;
+    char tag = 'R';
+    if (write(channel_, &tag, 1) != 1)
+        LOG(ERROR, "cannot notify the old process: %s", strerror(errno));
+    close(channel_);
+    channel_ = -1;
+}
+
+}
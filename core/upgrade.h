@@ -0,0 +1,32 @@
+// -*- mode: c++ -*-
+
+#ifndef _UPGRADE_H_
+#define _UPGRADE_H_
+
+namespace tube {
+
+// Replaces the running binary without refusing a connection.  The old
+// process starts the binary again and passes its listening socket over a
+// unix socket; the new one accepts on it instead of binding, and tells the
+// old one, which then stops accepting and drains.
+class BinaryUpgrade
+{
+    static int channel_;
+public:
+    // the new process finds the channel's fd here
+    static const char* kChannelEnv;
+
+    // old process.  true once the new process accepts, it is killed if it
+    // isn't ready within timeout seconds.
+    static bool start(char* const argv[], int listen_fd, int timeout);
+
+    // new process.  the listening socket handed over, -1 if the process
+    // wasn't started by an upgrade.
+    static int take_listen_fd();
+    // new process, accepting now
+    static void notify_ready();
+};
+
+}
+
+#endif /* _UPGRADE_H_ */
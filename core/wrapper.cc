@@ -36,12 +36,15 @@ Request::read_data(byte* ptr, size_t sz)
             sz -= nbuffer_read;
         }
         buf.copy_front(ptr, nbuffer_read);
+        buf.pop(nbuffer_read);
         ptr += nbuffer_read;
     }
     if (sz > 0) {
         utils::set_socket_blocking(conn_->fd, true);
         nread = ::read(conn_->fd, (void*) ptr, sz);
         utils::set_socket_blocking(conn_->fd, false);
+        if (nread < 0 && nbuffer_read > 0)
+            nread = 0;
     }
     return nbuffer_read + nread;
 }
@@ -102,6 +105,19 @@ Response::write_file(int file_desc, off64_t offset, off64_t length)
     conn_->out_stream.append_file(file_desc, offset, length);
 }
 
+void
+Response::write_file(const FileHandlePtr& handle, off64_t offset,
+                     off64_t length)
+{
+    conn_->out_stream.append_file(handle, offset, length);
+}
+
+void
+Response::write_block(const DataBlockPtr& block, size_t offset, size_t length)
+{
+    conn_->out_stream.append_block(block, offset, length);
+}
+
 ssize_t
 Response::flush_data()
 {
@@ -20,6 +20,8 @@ protected:
 public:
     Wrapper(Connection* conn);
     virtual ~Wrapper() {}
+
+    Connection* connection() const { return conn_; }
 protected:
     void disable_poll() { pipeline_.disable_poll(conn_); }
     void enable_poll() { pipeline_.enable_poll(conn_); }
@@ -53,6 +55,10 @@ public:
     virtual ssize_t write_string(std::string str);
     virtual ssize_t write_string(const char* str);
     virtual void    write_file(int file_desc, off64_t offset, off64_t length);
+    virtual void    write_file(const FileHandlePtr& handle, off64_t offset,
+                               off64_t length);
+    virtual void    write_block(const DataBlockPtr& block, size_t offset,
+                                size_t length);
     virtual ssize_t flush_data();
 
     bool    active() const { return !inactive_; }
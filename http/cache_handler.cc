@@ -0,0 +1,246 @@
+#include "pch.h"
+
+#include <cstdlib>
+#include <boost/bind.hpp>
+
+#include "http/cache_handler.h"
+#include "http/http_parser.h"
+#include "utils/logger.h"
+#include "module.h"
+
+namespace tube {
+
+// keeps what a miss responds and hands it to the cache when done
+class CacheRecorder : public HttpResponseRecorder
+{
+    CacheHttpHandler*   handler_;
+    // an async response may outlive the request, and a reload the handler
+    BaseHttpHandlerPtr  handler_ref_;
+    std::string         key_;
+    HttpHeaderEnumerate request_headers_;
+    HttpResponseStatus  status_;
+    HttpHeaderEnumerate headers_;
+    int64               content_length_;
+    std::string         body_;
+    int                 ttl_;
+public:
+    CacheRecorder(CacheHttpHandler* handler,
+                  const BaseHttpHandlerPtr& handler_ref,
+                  const std::string& key,
+                  const HttpHeaderEnumerate& request_headers)
+        : handler_(handler), handler_ref_(handler_ref), key_(key),
+          request_headers_(request_headers),
+          status_(HttpResponseStatus::kHttpResponseOK), content_length_(-1),
+          ttl_(-1) {}
+
+    virtual void on_head(const HttpResponseStatus& status,
+                         const HttpHeaderEnumerate& headers,
+                         int64 content_length) {
+        status_ = status;
+        headers_ = headers;
+        content_length_ = content_length;
+        ttl_ = ResponseCache::cacheable_ttl(status, headers,
+                                            handler_->default_ttl());
+        if (content_length < 0
+            || (u64) content_length > handler_->max_entry_size())
+            ttl_ = -1;
+        if (ttl_ > 0)
+            body_.reserve(content_length);
+    }
+
+    virtual void on_body(const byte* ptr, size_t size) {
+        if (ttl_ > 0)
+            body_.append((const char*) ptr, size);
+    }
+
+    virtual void on_finish(bool complete) {
+        CachedResponsePtr response;
+        if (complete && ttl_ > 0 && (int64) body_.size() == content_length_)
+            response.reset(new CachedResponse(status_, headers_, body_));
+        handler_->finish_miss(key_, request_headers_, response, ttl_);
+    }
+};
+
+CacheHttpHandler::CacheHttpHandler()
+    : max_entry_size_(0), default_ttl_(0), waker_stopped_(false),
+      waker_(NULL)
+{
+    add_option("max_cache_bytes", "67108864");
+    add_option("max_entry_size", "1048576");
+    add_option("default_ttl", "0");
+}
+
+CacheHttpHandler::~CacheHttpHandler()
+{
+    shutdown();
+}
+
+void
+CacheHttpHandler::load_param()
+{
+    cache_.set_max_bytes(strtoull(option("max_cache_bytes").c_str(), NULL,
+                                  10));
+    max_entry_size_ = strtoull(option("max_entry_size").c_str(), NULL, 10);
+    default_ttl_ = atoi(option("default_ttl").c_str());
+    if (cache_.max_bytes() > 0 && waker_ == NULL) {
+        waker_ = new utils::Thread(
+            boost::bind(&CacheHttpHandler::wake_waiters, this));
+    }
+}
+
+bool
+CacheHttpHandler::is_cacheable_request(const HttpRequest& request) const
+{
+    if (request.method() != HTTP_GET || cache_.max_bytes() == 0)
+        return false;
+    const HttpHeaderEnumerate& headers = request.headers();
+    for (size_t i = 0; i < headers.size(); i++) {
+        const HttpHeaderItem& item = headers[i];
+        // the answer is somebody's own, or the client wants a fresh one
+        if (utils::ignore_compare(item.key, "authorization"))
+            return false;
+        if ((utils::ignore_compare(item.key, "cache-control")
+             || utils::ignore_compare(item.key, "pragma"))
+            && (item.value.find("no-cache") != std::string::npos
+                || item.value.find("no-store") != std::string::npos))
+            return false;
+    }
+    return true;
+}
+
+void
+CacheHttpHandler::respond_cached(const CachedResponsePtr& cached,
+                                 HttpRequest& request, HttpResponse& response)
+{
+    if (request.version_major() > 1
+        || (request.version_major() == 1 && request.version_minor() >= 1)) {
+        response.respond_raw(cached, 0, cached->size());
+        return;
+    }
+    // HTTP/1.0 may need its own Connection header, only the body is shared
+    const HttpHeaderEnumerate& headers = cached->headers();
+    for (size_t i = 0; i < headers.size(); i++) {
+        response.add_header(headers[i].key, headers[i].value);
+    }
+    response.set_content_length(cached->body_length());
+    response.respond(cached->status());
+    response.write_block(cached, cached->head_length(),
+                         cached->body_length());
+}
+
+void
+CacheHttpHandler::handle_request(HttpRequest& request, HttpResponse& response)
+{
+    if (!is_cacheable_request(request))
+        return;
+    std::string key = ResponseCache::build_key(request);
+    CachedResponsePtr cached = cache_.lookup(key, request.headers());
+    if (cached) {
+        respond_cached(cached, request, response);
+        return;
+    }
+    if (request.is_resumed()) {
+        // waited for a miss which turned out not to be kept, or one of
+        // the later handlers resumed it
+        return;
+    }
+    {
+        utils::Lock lk(pending_mutex_);
+        PendingMap::iterator it = pending_.find(key);
+        if (it != pending_.end()) {
+            if (it->second.size() >= kMaxWaiters)
+                return;
+            HttpAsyncResponsePtr waiter = response.suspend();
+            if (waiter) {
+                it->second.push_back(waiter);
+                collapsed_count_.increment();
+            }
+            return;
+        }
+        pending_[key];
+    }
+    response.set_recorder(HttpResponseRecorderPtr(
+                              new CacheRecorder(this,
+                                                shared_from_request(request),
+                                                key, request.headers())));
+}
+
+void
+CacheHttpHandler::finish_miss(const std::string& key,
+                              const HttpHeaderEnumerate& request_headers,
+                              const CachedResponsePtr& response, int ttl)
+{
+    if (response)
+        cache_.insert(key, request_headers, response, ttl);
+    WaiterList waiters;
+    {
+        utils::Lock lk(pending_mutex_);
+        PendingMap::iterator it = pending_.find(key);
+        if (it == pending_.end())
+            return;
+        waiters.swap(it->second);
+        pending_.erase(it);
+    }
+    if (waiters.empty())
+        return;
+    utils::Lock lk(wake_mutex_);
+    wake_queue_.splice(wake_queue_.end(), waiters);
+    wake_cond_.notify_one();
+}
+
+void
+CacheHttpHandler::wake_waiters()
+{
+    while (true) {
+        WaiterList waiters;
+        {
+            utils::Lock lk(wake_mutex_);
+            while (wake_queue_.empty() && !waker_stopped_) {
+                wake_cond_.wait(lk);
+            }
+            if (waker_stopped_)
+                return;
+            waiters.swap(wake_queue_);
+        }
+        for (WaiterList::iterator it = waiters.begin(); it != waiters.end();
+             ++it) {
+            (*it)->retry();
+        }
+    }
+}
+
+void
+CacheHttpHandler::shutdown()
+{
+    if (waker_ == NULL)
+        return;
+    {
+        utils::Lock lk(wake_mutex_);
+        waker_stopped_ = true;
+        wake_cond_.notify_one();
+    }
+    waker_->join();
+    delete waker_;
+    waker_ = NULL;
+}
+
+static void
+cache_handler_module_init()
+{
+    static CacheHttpHandlerFactory cache_handler_factory;
+    BaseHttpHandlerFactory::register_factory(&cache_handler_factory);
+}
+
+static struct CacheHandlerModule : public Module
+{
+    CacheHandlerModule() {
+        this->on_initialize = cache_handler_module_init;
+        this->name = "cache_handler";
+        this->vendor = "tube server";
+        this->description = "shared response cache handler";
+    }
+} cache_handler_module;
+
+EXPORT_MODULE_STATIC(cache_handler_module);
+
+}
@@ -0,0 +1,88 @@
+// -*- mode: c++ -*-
+
+#ifndef _CACHE_HANDLER_H_
+#define _CACHE_HANDLER_H_
+
+#include <string>
+#include <list>
+#include <boost/unordered_map.hpp>
+
+#include "utils/misc.h"
+#include "http/http_wrapper.h"
+#include "http/interface.h"
+#include "http/response_cache.h"
+
+namespace tube {
+
+// Goes first in a handler chain and keeps what the handlers after it
+// respond, for as long as Cache-Control allows.  Only GET responses of a
+// known length are kept, given by respond() with the body in memory or
+// streamed by an async response, e.g. from the proxy, fastcgi or a module;
+// files and chunked bodies pass through.  While one request for a
+// key is at the backend, the others for it are suspended and handed back
+// to the chain once it is done, to be served from the cache.
+class CacheHttpHandler : public BaseHttpHandler
+{
+    ResponseCache cache_;
+    size_t        max_entry_size_;
+    int           default_ttl_;
+
+    typedef std::list<HttpAsyncResponsePtr> WaiterList;
+    typedef boost::unordered_map<std::string, WaiterList> PendingMap;
+
+    // keys at the backend, with the requests waiting for them
+    utils::Mutex pending_mutex_;
+    PendingMap   pending_;
+
+    // retried off the handler threads, those hold a connection lock which
+    // waking another connection must not wait under
+    utils::Mutex     wake_mutex_;
+    utils::Condition wake_cond_;
+    WaiterList       wake_queue_;
+    bool             waker_stopped_;
+    utils::Thread*   waker_;
+
+    utils::AtomicCounter collapsed_count_;
+public:
+    // followers of a single miss beyond that go to the backend themselves
+    static const size_t kMaxWaiters = 1024;
+
+    CacheHttpHandler();
+    virtual ~CacheHttpHandler();
+    virtual void load_param();
+    virtual void handle_request(HttpRequest& request, HttpResponse& response);
+    virtual void shutdown();
+
+    ResponseCache& cache() { return cache_; }
+    size_t max_entry_size() const { return max_entry_size_; }
+    int    default_ttl() const { return default_ttl_; }
+    u64    collapsed_count() const { return collapsed_count_.value(); }
+
+    // the leader of a miss is done, response is NULL if it can't be kept
+    void finish_miss(const std::string& key,
+                     const HttpHeaderEnumerate& request_headers,
+                     const CachedResponsePtr& response, int ttl);
+private:
+    bool is_cacheable_request(const HttpRequest& request) const;
+    void respond_cached(const CachedResponsePtr& cached, HttpRequest& request,
+                        HttpResponse& response);
+    void wake_waiters();
+};
+
+class CacheHttpHandlerFactory : public BaseHttpHandlerFactory
+{
+public:
+    virtual BaseHttpHandler* create() const {
+        return new CacheHttpHandler();
+    }
+    virtual std::string module_name() const {
+        return std::string("cache");
+    }
+    virtual std::string vender_name() const {
+        return std::string("tube");
+    }
+};
+
+}
+
+#endif /* _CACHE_HANDLER_H_ */
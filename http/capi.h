@@ -18,9 +18,25 @@ typedef short int     int16;
 typedef int           int23;
 typedef long long int int64;
 
+/* bumped whenever functions are added.  nothing is ever removed or changed,
+   modules built against an older version keep loading. */
+#define TUBE_HTTP_API_VERSION 3
+
 typedef void tube_http_request_t;
 typedef void tube_http_response_t;
 
+typedef struct _tube_str_view_t tube_str_view_t;
+typedef struct _tube_file_t tube_file_t;
+typedef struct _tube_http_async_response_t tube_http_async_response_t;
+
+/* a string that is not NUL terminated, owned by the server */
+struct _tube_str_view_t {
+    const char* ptr;
+    size_t      len;
+};
+
+typedef void (*tube_free_func_t) (void* ptr, void* arg);
+
 typedef struct _tube_http_handler_t tube_http_handler_t;
 typedef struct _tube_http_handler_desc_t tube_http_handler_desc_t;
 
@@ -39,6 +55,10 @@ struct _tube_http_handler_desc_t {
     const char* vender_name;
 };
 
+/* TUBE_HTTP_API_VERSION of the running server, check it before using
+   anything newer than version 1 */
+int          tube_http_api_version(void);
+
 const char*  tube_http_handler_get_name(tube_http_handler_t* handler);
 
 /* needs to be freed after use */
@@ -78,6 +98,18 @@ char**       tube_http_request_find_header_values(tube_http_request_t* request,
 ssize_t      tube_http_request_read_data(tube_http_request_t* request,
                                          void* ptr, size_t size);
 
+/* version 2: headers without copies, the views are valid as long as the
+   request.  both return 0 when there is no such header. */
+size_t       tube_http_request_get_header_count(tube_http_request_t* request);
+int          tube_http_request_get_header(tube_http_request_t* request,
+                                          size_t index, tube_str_view_t* key,
+                                          tube_str_view_t* value);
+/* the values of key one by one, *pos is 0 for the first call */
+int          tube_http_request_next_header_value(tube_http_request_t* request,
+                                                 const char* key,
+                                                 size_t* pos,
+                                                 tube_str_view_t* value);
+
 /* response api */
 void         tube_http_response_add_header(tube_http_response_t* response,
                                            const char* key, const char* value);
@@ -105,6 +137,47 @@ void         tube_http_response_close(tube_http_response_t* response);
 void         tube_http_response_respond(tube_http_response_t* response,
                                         int status_code,
                                         const char* reason);
+/* streaming api, the body is sent as it is written */
+void         tube_http_response_begin_chunked(tube_http_response_t* response,
+                                              int status_code,
+                                              const char* reason);
+void         tube_http_response_end_chunked(tube_http_response_t* response);
+
+/* version 2: zero copy body.  the data is queued as it is and goes out after
+   the headers, so call these after tube_http_response_respond with the
+   content length set, or between begin_chunked and end_chunked.  they
+   return -1 before that, and the caller keeps the ownership then. */
+
+/* free_func(ptr, arg) is called from any thread once ptr is not needed, it
+   may be NULL for data that lives forever */
+int          tube_http_response_write_buffer(tube_http_response_t* response,
+                                             const void* ptr, size_t size,
+                                             tube_free_func_t free_func,
+                                             void* arg);
+
+/* takes the ownership of file_desc, for sending ranges of it to any number
+   of clients.  it is closed once released and sent to all of them. */
+tube_file_t* tube_file_create(int file_desc);
+void         tube_file_release(tube_file_t* file);
+int          tube_http_response_write_file_range(
+    tube_http_response_t* response, tube_file_t* file, off64_t offset,
+    off64_t length);
+
+/* version 3: responding later, from any thread, without holding a handler
+   thread meanwhile.  returns NULL if the response is already sent. */
+tube_http_async_response_t* tube_http_response_suspend(
+    tube_http_response_t* response);
+void         tube_http_async_response_add_header(
+    tube_http_async_response_t* response, const char* key, const char* value);
+ssize_t      tube_http_async_response_write_data(
+    tube_http_async_response_t* response, const void* ptr, size_t size);
+/* the client is gone, there is no point in responding */
+int          tube_http_async_response_is_aborted(
+    tube_http_async_response_t* response);
+/* sends the response and frees it, also when aborted */
+void         tube_http_async_response_respond(
+    tube_http_async_response_t* response, int status_code,
+    const char* reason);
 END_DECLS
 
 #endif /* _CAPI_H_ */
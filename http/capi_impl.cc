@@ -12,8 +12,41 @@ typedef tube::BaseHttpHandler* tube_http_handler_handle_t;
 #define HTTP_RESPONSE(ptr) ((tube::HttpResponse*) (ptr))
 #define HANDLER_IMPL(ptr) ((tube::CHttpHandlerAdapter*) (ptr))
 
+struct _tube_file_t
+{
+    tube::FileHandlePtr handle;
+};
+
+struct _tube_http_async_response_t
+{
+    tube::HttpAsyncResponsePtr response;
+};
+
 namespace tube {
 
+// a module's buffer, handed back to it once sent
+class CBufferBlock : public DataBlock
+{
+    const byte*      ptr_;
+    size_t           size_;
+    tube_free_func_t free_func_;
+    void*            arg_;
+public:
+    CBufferBlock(const void* ptr, size_t size, tube_free_func_t free_func,
+                 void* arg)
+        : ptr_((const byte*) ptr), size_(size), free_func_(free_func),
+          arg_(arg) {}
+
+    virtual ~CBufferBlock() {
+        if (free_func_) {
+            free_func_((void*) ptr_, arg_);
+        }
+    }
+
+    virtual const byte* data() const { return ptr_; }
+    virtual size_t      size() const { return size_; }
+};
+
 class CHttpHandlerAdapter : public BaseHttpHandler
 {
     tube_http_handler_t* handler_;
@@ -60,6 +93,12 @@ public:
 #define MAX_OPTION_LEN 128
 #define MAX_HEADER_VALUE_LEN 128
 
+EXPORT_API int
+tube_http_api_version(void)
+{
+    return TUBE_HTTP_API_VERSION;
+}
+
 EXPORT_API const char*
 tube_http_handler_get_name(tube_http_handler_t* handler)
 {
@@ -81,12 +120,19 @@ tube_http_handler_add_option(tube_http_handler_t* handler, const char* name,
 }
 
 EXPORT_API void
-tube_http_handler_descriptor_register(tube_http_handler_desc_t* desc)
+tube_http_handler_desc_register(tube_http_handler_desc_t* desc)
 {
     tube::BaseHttpHandlerFactory::register_factory(
         new tube::CHttpHandlerFactoryAdapter(desc));
 }
 
+// the name it was exported as before, modules may still link to it
+EXPORT_API void
+tube_http_handler_descriptor_register(tube_http_handler_desc_t* desc)
+{
+    tube_http_handler_desc_register(desc);
+}
+
 // request api
 #define REQ_DATA(request) ((request)->request_data_ref())
 
@@ -157,6 +203,48 @@ tube_http_request_read_data(tube_http_request_t* request, void* ptr,
     return HTTP_REQUEST(request)->read_data((tube::byte*) ptr, size);
 }
 
+EXPORT_API size_t
+tube_http_request_get_header_count(tube_http_request_t* request)
+{
+    return HTTP_REQUEST(request)->headers().size();
+}
+
+static void
+set_view(tube_str_view_t* view, const std::string& str)
+{
+    view->ptr = str.data();
+    view->len = str.length();
+}
+
+EXPORT_API int
+tube_http_request_get_header(tube_http_request_t* request, size_t index,
+                             tube_str_view_t* key, tube_str_view_t* value)
+{
+    const tube::HttpHeaderEnumerate& headers = HTTP_REQUEST(request)->headers();
+    if (index >= headers.size())
+        return 0;
+    set_view(key, headers[index].key);
+    set_view(value, headers[index].value);
+    return 1;
+}
+
+EXPORT_API int
+tube_http_request_next_header_value(tube_http_request_t* request,
+                                    const char* key, size_t* pos,
+                                    tube_str_view_t* value)
+{
+    const tube::HttpHeaderEnumerate& headers = HTTP_REQUEST(request)->headers();
+    for (size_t i = *pos; i < headers.size(); i++) {
+        if (headers[i].key == key) {
+            set_view(value, headers[i].value);
+            *pos = i + 1;
+            return 1;
+        }
+    }
+    *pos = headers.size();
+    return 0;
+}
+
 // response api
 EXPORT_API void
 tube_http_response_add_header(tube_http_response_t* response, const char* key,
@@ -237,3 +325,102 @@ tube_http_response_respond(tube_http_response_t* response, int status_code,
     HTTP_RESPONSE(response)->respond(tube::HttpResponseStatus(status_code,
                                                               reason));
 }
+
+EXPORT_API void
+tube_http_response_begin_chunked(tube_http_response_t* response,
+                                 int status_code, const char* reason)
+{
+    HTTP_RESPONSE(response)->begin_chunked(
+        tube::HttpResponseStatus(status_code, reason));
+}
+
+EXPORT_API void
+tube_http_response_end_chunked(tube_http_response_t* response)
+{
+    HTTP_RESPONSE(response)->end_chunked();
+}
+
+static bool
+headers_sent(tube_http_response_t* response)
+{
+    return HTTP_RESPONSE(response)->is_responded()
+        || HTTP_RESPONSE(response)->is_streaming();
+}
+
+EXPORT_API int
+tube_http_response_write_buffer(tube_http_response_t* response,
+                                const void* ptr, size_t size,
+                                tube_free_func_t free_func, void* arg)
+{
+    if (!headers_sent(response))
+        return -1;
+    tube::DataBlockPtr block(new tube::CBufferBlock(ptr, size, free_func, arg));
+    HTTP_RESPONSE(response)->write_block(block, 0, size);
+    return 0;
+}
+
+EXPORT_API tube_file_t*
+tube_file_create(int file_desc)
+{
+    tube_file_t* file = new tube_file_t;
+    file->handle.reset(new tube::FileHandle(file_desc));
+    return file;
+}
+
+EXPORT_API void
+tube_file_release(tube_file_t* file)
+{
+    delete file;
+}
+
+EXPORT_API int
+tube_http_response_write_file_range(tube_http_response_t* response,
+                                    tube_file_t* file, off64_t offset,
+                                    off64_t length)
+{
+    if (!headers_sent(response))
+        return -1;
+    HTTP_RESPONSE(response)->write_file(file->handle, offset, length);
+    return 0;
+}
+
+EXPORT_API tube_http_async_response_t*
+tube_http_response_suspend(tube_http_response_t* response)
+{
+    tube::HttpAsyncResponsePtr async_response =
+        HTTP_RESPONSE(response)->suspend();
+    if (!async_response)
+        return NULL;
+    tube_http_async_response_t* handle = new tube_http_async_response_t;
+    handle->response = async_response;
+    return handle;
+}
+
+EXPORT_API void
+tube_http_async_response_add_header(tube_http_async_response_t* response,
+                                    const char* key, const char* value)
+{
+    response->response->add_header(key, value);
+}
+
+EXPORT_API ssize_t
+tube_http_async_response_write_data(tube_http_async_response_t* response,
+                                    const void* ptr, size_t size)
+{
+    return response->response->write_data((const tube::byte*) ptr, size);
+}
+
+EXPORT_API int
+tube_http_async_response_is_aborted(tube_http_async_response_t* response)
+{
+    return response->response->is_aborted();
+}
+
+EXPORT_API void
+tube_http_async_response_respond(tube_http_async_response_t* response,
+                                 int status_code, const char* reason)
+{
+    response->response->respond(tube::HttpResponseStatus(status_code,
+                                                         reason));
+    delete response;
+}
@@ -0,0 +1,184 @@
+#include "pch.h"
+
+#include "config.h"
+
+#include <cstdlib>
+
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef USE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#include "http/compression.h"
+#include "utils/logger.h"
+
+namespace tube {
+
+const char*
+content_coding_name(ContentCoding coding)
+{
+    switch (coding) {
+    case kCodingGzip:
+        return "gzip";
+    case kCodingBrotli:
+        return "br";
+    default:
+        return "identity";
+    }
+}
+
+const char*
+content_coding_suffix(ContentCoding coding)
+{
+    switch (coding) {
+    case kCodingGzip:
+        return ".gz";
+    case kCodingBrotli:
+        return ".br";
+    default:
+        return "";
+    }
+}
+
+static std::string
+trim_token(const std::string& str)
+{
+    size_t start = str.find_first_not_of(" \t");
+    if (start == std::string::npos)
+        return "";
+    size_t end = str.find_last_not_of(" \t");
+    return str.substr(start, end - start + 1);
+}
+
+// q-value of an "coding;q=0.5" element, 1 if there is none
+static double
+parse_qvalue(const std::string& params)
+{
+    size_t pos = params.find("q=");
+    if (pos == std::string::npos)
+        return 1.0;
+    return strtod(params.c_str() + pos + 2, NULL);
+}
+
+ContentCoding
+choose_content_coding(const std::string& accept_encoding, int codings)
+{
+    // -1 for not mentioned at all
+    double gzip_q = -1, br_q = -1, any_q = -1;
+    size_t start = 0;
+    while (start < accept_encoding.length()) {
+        size_t end = accept_encoding.find(',', start);
+        if (end == std::string::npos)
+            end = accept_encoding.length();
+        std::string elem = accept_encoding.substr(start, end - start);
+        start = end + 1;
+
+        size_t semi = elem.find(';');
+        std::string name = trim_token(elem.substr(0, semi));
+        double q = semi == std::string::npos ? 1.0
+            : parse_qvalue(elem.substr(semi + 1));
+        if (utils::ignore_compare(name, "gzip")
+            || utils::ignore_compare(name, "x-gzip")) {
+            gzip_q = q;
+        } else if (utils::ignore_compare(name, "br")) {
+            br_q = q;
+        } else if (name == "*") {
+            any_q = q;
+        }
+    }
+    if (gzip_q < 0)
+        gzip_q = any_q;
+    if (br_q < 0)
+        br_q = any_q;
+    if (!(codings & CODING_MASK(kCodingGzip)))
+        gzip_q = 0;
+    if (!(codings & CODING_MASK(kCodingBrotli)))
+        br_q = 0;
+
+    if (br_q > 0 && br_q >= gzip_q)
+        return kCodingBrotli;
+    if (gzip_q > 0)
+        return kCodingGzip;
+    return kCodingIdentity;
+}
+
+int
+supported_compressors()
+{
+    int codings = 0;
+#ifdef USE_ZLIB
+    codings |= CODING_MASK(kCodingGzip);
+#endif
+#ifdef USE_BROTLI
+    codings |= CODING_MASK(kCodingBrotli);
+#endif
+    return codings;
+}
+
+#ifdef USE_ZLIB
+static bool
+gzip_data(int level, const byte* data, size_t size, std::string& output)
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // 16 more window bits for a gzip header instead of a zlib one
+    if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    output.resize(deflateBound(&stream, size) + 32);
+    stream.next_in = (Bytef*) data;
+    stream.avail_in = size;
+    stream.next_out = (Bytef*) &output[0];
+    stream.avail_out = output.size();
+    int res = deflate(&stream, Z_FINISH);
+    output.resize(stream.total_out);
+    deflateEnd(&stream);
+    return res == Z_STREAM_END;
+}
+#endif
+
+#ifdef USE_BROTLI
+static bool
+brotli_data(int level, const byte* data, size_t size, std::string& output)
+{
+    size_t out_size = BrotliEncoderMaxCompressedSize(size);
+    if (out_size == 0)
+        return false;
+    output.resize(out_size);
+    // gzip levels go up to 9, brotli ones up to 11
+    int quality = level > BROTLI_MAX_QUALITY ? BROTLI_MAX_QUALITY : level;
+    if (!BrotliEncoderCompress(quality, BROTLI_DEFAULT_WINDOW,
+                               BROTLI_MODE_TEXT, size, data, &out_size,
+                               (uint8_t*) &output[0])) {
+        return false;
+    }
+    output.resize(out_size);
+    return true;
+}
+#endif
+
+bool
+compress_data(ContentCoding coding, int level, const byte* data, size_t size,
+              std::string& output)
+{
+    switch (coding) {
+#ifdef USE_ZLIB
+    case kCodingGzip:
+        return gzip_data(level, data, size, output);
+#endif
+#ifdef USE_BROTLI
+    case kCodingBrotli:
+        return brotli_data(level, data, size, output);
+#endif
+    default:
+        LOG(WARNING, "%s compression is not supported",
+            content_coding_name(coding));
+        return false;
+    }
+}
+
+}
@@ -0,0 +1,39 @@
+// -*- mode: c++ -*-
+
+#ifndef _COMPRESSION_H_
+#define _COMPRESSION_H_
+
+#include <string>
+
+#include "utils/misc.h"
+
+namespace tube {
+
+enum ContentCoding {
+    kCodingIdentity = 0,
+    kCodingGzip,
+    kCodingBrotli
+};
+
+#define CODING_MASK(coding) (1 << (coding))
+
+// every coding we may find a pre-compressed file for
+const int kAllCodings = CODING_MASK(kCodingGzip) | CODING_MASK(kCodingBrotli);
+
+const char* content_coding_name(ContentCoding coding);
+// suffix of the pre-compressed sibling, like ".gz"
+const char* content_coding_suffix(ContentCoding coding);
+
+// picks the coding with the highest q-value in Accept-Encoding out of the
+// ones set in codings, brotli wins a tie
+ContentCoding choose_content_coding(const std::string& accept_encoding,
+                                    int codings);
+
+// codings this build can compress with
+int  supported_compressors();
+bool compress_data(ContentCoding coding, int level, const byte* data,
+                   size_t size, std::string& output);
+
+}
+
+#endif /* _COMPRESSION_H_ */
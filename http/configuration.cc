@@ -1,5 +1,7 @@
 #include "pch.h"
 
+#include <fstream>
+#include <boost/bind.hpp>
 #include <boost/xpressive/xpressive.hpp>
 
 #include "http/configuration.h"
@@ -8,57 +10,141 @@
 
 namespace tube {
 
-void
+bool
 HandlerConfig::load_handlers(const Node& subdoc)
 {
     // subdoc is an array
     for (size_t i = 0; i < subdoc.size(); i++) {
-        load_handler(subdoc[i]);
+        if (!load_handler(subdoc[i]))
+            return false;
     }
+    return true;
 }
 
-void
+bool
 HandlerConfig::load_handler(const Node& subdoc)
 {
     std::string name, module;
     subdoc["name"] >> name;
     subdoc["module"] >> module;
-    BaseHttpHandler* handler = create_handler_instance(name, module);
+    std::map<std::string, std::string> options;
     for (YAML::Iterator it = subdoc.begin(); it != subdoc.end(); ++it) {
         std::string key, value;
         it.first() >> key;
         it.second() >> value;
         if (key == "name" || key == "module")
             continue;
-        handler->add_option(key, value);
+        options[key] = value;
+    }
+    HandlerEntry entry;
+    entry.definition = module + "\n";
+    for (std::map<std::string, std::string>::iterator it = options.begin();
+         it != options.end(); ++it) {
+        entry.definition += it->first + "=" + it->second + "\n";
+    }
+
+    if (loading_.find(name) != loading_.end()) {
+        LOG(WARNING, "handler %s is defined twice, using the first one",
+            name.c_str());
+        return true;
+    }
+    HandlerMap::iterator it = handlers_.find(name);
+    if (it != handlers_.end() && it->second.definition == entry.definition) {
+        loading_[name] = it->second;
+        return true;
     }
-    handler->load_param();
+    FactoryMap::iterator fac_it = factories_.find(module);
+    if (fac_it == factories_.end()) {
+        LOG(ERROR, "handler %s: unknown module %s", name.c_str(),
+            module.c_str());
+        return false;
+    }
+    entry.handler.reset(fac_it->second->create(),
+                        boost::bind(&HandlerConfig::release, this, _1));
+    {
+        utils::Lock lk(released_mutex_);
+        alive_.insert(entry.handler.get());
+    }
+    entry.handler->set_name(name);
+    for (std::map<std::string, std::string>::iterator it = options.begin();
+         it != options.end(); ++it) {
+        entry.handler->add_option(it->first, it->second);
+    }
+    entry.handler->load_param();
+    loading_[name] = entry;
+    return true;
 }
 
-HandlerConfig::HandlerConfig()
-{}
+void
+HandlerConfig::commit()
+{
+    for (HandlerMap::iterator it = handlers_.begin(); it != handlers_.end();
+         ++it) {
+        HandlerMap::iterator loaded = loading_.find(it->first);
+        if (loaded == loading_.end()
+            || loaded->second.handler != it->second.handler) {
+            // freed once the requests of the old config are done
+            LOG(INFO, "handler %s is replaced", it->first.c_str());
+        }
+    }
+    handlers_.swap(loading_);
+    loading_.clear();
+}
 
-HandlerConfig::~HandlerConfig()
+void
+HandlerConfig::rollback()
 {
-    // FIXME: need to free all handlers?
+    // the ones created for it are freed by the next load, the rules built
+    // so far hold some of them too
+    loading_.clear();
 }
 
-BaseHttpHandler*
-HandlerConfig::create_handler_instance(const std::string& name,
-                                       const std::string& module)
+void
+HandlerConfig::release(BaseHttpHandler* handler)
 {
-    HandlerMap::iterator it = handlers_.find(name);
-    if (it != handlers_.end()) {
-        return it->second;
+    utils::Lock lk(released_mutex_);
+    released_.push_back(handler);
+}
+
+void
+HandlerConfig::free_released()
+{
+    std::vector<BaseHttpHandler*> released;
+    {
+        utils::Lock lk(released_mutex_);
+        released.swap(released_);
+        for (size_t i = 0; i < released.size(); i++) {
+            alive_.erase(released[i]);
+        }
     }
-    FactoryMap::iterator fac_it = factories_.find(module);
-    if (fac_it != factories_.end()) {
-        BaseHttpHandler* handler = fac_it->second->create();
-        handlers_.insert(std::make_pair(name, handler));
-        handler->set_name(name);
-        return handler;
+    for (size_t i = 0; i < released.size(); i++) {
+        LOG(INFO, "handler %s is freed", released[i]->name().c_str());
+        delete released[i];
     }
-    return NULL;
+}
+
+void
+HandlerConfig::shutdown()
+{
+    std::set<BaseHttpHandler*> alive;
+    {
+        utils::Lock lk(released_mutex_);
+        alive = alive_;
+    }
+    for (std::set<BaseHttpHandler*>::iterator it = alive.begin();
+         it != alive.end(); ++it) {
+        (*it)->shutdown();
+    }
+}
+
+HandlerConfig::HandlerConfig()
+{}
+
+HandlerConfig::~HandlerConfig()
+{
+    handlers_.clear();
+    loading_.clear();
+    free_released();
 }
 
 void
@@ -67,14 +153,14 @@ HandlerConfig::register_handler_factory(const BaseHttpHandlerFactory* factory)
     factories_[factory->module_name()] = factory;
 }
 
-BaseHttpHandler*
+BaseHttpHandlerPtr
 HandlerConfig::get_handler_instance(const std::string& name) const
 {
-    HandlerMap::const_iterator it = handlers_.find(name);
-    if (it != handlers_.end()) {
-        return it->second;
+    HandlerMap::const_iterator it = loading_.find(name);
+    if (it != loading_.end()) {
+        return it->second.handler;
     }
-    return NULL;
+    return BaseHttpHandlerPtr();
 }
 
 class UrlRuleItemMatcher
@@ -122,17 +208,17 @@ public:
 };
 
 UrlRuleItem::UrlRuleItem(const std::string& type, const Node& subdoc)
+    : path_only(true)
 {
     if (type == "prefix") {
         std::string prefix;
         subdoc["prefix"] >> prefix;
-        matcher = new PrefixUrlRuleItemMatcher(prefix);
+        matcher.reset(new PrefixUrlRuleItemMatcher(prefix));
     } else if (type == "regex") {
         std::string regex;
         subdoc["regex"] >> regex;
-        matcher = new RegexUrlRuleItemMatcher(regex);
-    } else {
-        matcher = NULL;
+        matcher.reset(new RegexUrlRuleItemMatcher(regex));
+        path_only = false; // regex matches against the whole uri
     }
 }
 
@@ -140,6 +226,7 @@ UrlRuleItem::~UrlRuleItem()
 {}
 
 UrlRuleConfig::UrlRuleConfig()
+    : path_only_(true)
 {}
 
 UrlRuleConfig::~UrlRuleConfig()
@@ -165,14 +252,15 @@ UrlRuleConfig::load_url_rule(const Node& subdoc)
     for (size_t i = 0; i < chaindoc.size(); i++) {
         std::string name;
         chaindoc[i] >> name;
-        BaseHttpHandler* handler = handler_cfg.get_handler_instance(name);
-        if (handler != NULL) {
+        BaseHttpHandlerPtr handler = handler_cfg.get_handler_instance(name);
+        if (handler) {
             rule.handlers.push_back(handler);
         } else {
             LOG(WARNING, "Cannot find handler instance %s", name.c_str());
         }
     }
     rules_.push_back(rule);
+    path_only_ = path_only_ && rule.path_only;
 }
 
 const UrlRuleItem*
@@ -180,27 +268,28 @@ UrlRuleConfig::match_uri(HttpRequestData& req_ref) const
 {
     for (size_t i = 0; i < rules_.size(); i++) {
         LOG(DEBUG, "matching uri %lu/%lu", i, rules_.size());
-        if (rules_[i].matcher == NULL || rules_[i].matcher->match(req_ref)) {
+        if (!rules_[i].matcher || rules_[i].matcher->match(req_ref)) {
             return &rules_[i];
         }
     }
     return NULL;
 }
 
-VHostConfig::VHostConfig()
-{}
-
-VHostConfig::~VHostConfig()
+VHostRules::VHostRules()
+    : path_only_(true)
 {}
 
 void
-VHostConfig::load_vhost_rules(const Node& subdoc)
+VHostRules::load_vhost_rules(const Node& subdoc)
 {
     std::string host;
     UrlRuleConfig url_config;
     subdoc["domain"] >> host;
     url_config.load_url_rules(subdoc["url-rules"]);
     host_map_.insert(std::make_pair(host, url_config));
+    path_only_ = path_only_ && url_config.path_only();
+    // cached routes point into the old rule set
+    route_cache_.clear();
 }
 
 static std::string
@@ -214,18 +303,69 @@ parse_host(const std::string& host)
 }
 
 const UrlRuleItem*
-VHostConfig::match_uri(const std::string& host, HttpRequestData& req_ref) const
+VHostRules::match_uri_nocache(const std::string& host,
+                               HttpRequestData& req_ref) const
 {
     HostMap::const_iterator it = host_map_.find(parse_host(host));
     if (it == host_map_.end()) {
         it = host_map_.find("default");
+        if (it == host_map_.end())
+            return NULL;
     }
     return it->second.match_uri(req_ref);
 }
 
+const UrlRuleItem*
+VHostRules::match_uri(const std::string& host, HttpRequestData& req_ref) const
+{
+    const UrlRuleItem* rule = NULL;
+    size_t strip_len = 0;
+    std::string key = RouteCache::build_key(
+        host, path_only_ ? req_ref.path : req_ref.uri);
+
+    if (route_cache_.lookup(key, &rule, &strip_len)) {
+        // replay what the prefix matcher did to the request
+        req_ref.path.erase(0, strip_len);
+        req_ref.uri.erase(0, strip_len);
+        return rule;
+    }
+    size_t path_len = req_ref.path.length();
+    rule = match_uri_nocache(host, req_ref);
+    route_cache_.insert(key, rule, path_len - req_ref.path.length());
+    return rule;
+}
+
+VHostConfig::VHostConfig()
+{}
+
+VHostConfig::~VHostConfig()
+{}
+
+VHostRulesPtr
+VHostConfig::rules()
+{
+    utils::Lock lk(mutex_);
+    return rules_;
+}
+
+void
+VHostConfig::publish(const VHostRulesPtr& rules)
+{
+    VHostRulesPtr old;
+    {
+        utils::Lock lk(mutex_);
+        old = rules_;
+        rules_ = rules;
+    }
+    // old is freed here if no request holds it, not under the lock
+}
+
 ServerConfig::ServerConfig()
     : read_stage_pool_size_(0), write_stage_pool_size_(0),
-      recycle_threshold_(0), handler_stage_pool_size_(0)
+      recycle_threshold_(0), handler_stage_pool_size_(0),
+      compress_stage_pool_size_(1), disk_io_stage_pool_size_(0),
+      websocket_stage_pool_size_(1),
+      route_cache_size_(RouteCache::kDefaultMaxEntry), drain_timeout_(30)
 {}
 
 ServerConfig::~ServerConfig()
@@ -233,47 +373,116 @@ ServerConfig::~ServerConfig()
 
 void
 ServerConfig::load_config_file(const char* filename)
+{
+    utils::Lock lk(load_mutex_);
+    std::string error;
+    if (!load(filename, false, error)) {
+        throw std::invalid_argument(std::string(filename) + ": " + error);
+    }
+}
+
+bool
+ServerConfig::reload_config_file(const char* filename)
+{
+    utils::Lock lk(load_mutex_);
+    std::string error;
+    if (!load(filename, true, error)) {
+        LOG(ERROR, "cannot reload %s, keeping the running config: %s",
+            filename, error.c_str());
+        return false;
+    }
+    LOG(INFO, "reloaded %s", filename);
+    return true;
+}
+
+bool
+ServerConfig::load(const char* filename, bool reload, std::string& error)
 {
     std::ifstream fin(filename);
-    YAML::Parser parser(fin);
+    if (!fin) {
+        error = "cannot open the file";
+        return false;
+    }
     HandlerConfig& handler_cfg = HandlerConfig::instance();
-    VHostConfig& host_cfg = VHostConfig::instance();
-
-    Node doc;
-    while (parser.GetNextDocument(doc)) {
-        for (YAML::Iterator it = doc.begin(); it != doc.end(); ++it) {
-            std::string key, value;
-            it.first() >> key;
-            if (key == "address") {
-                it.second() >> address_;
-            } else if (key == "port") {
-                it.second() >> port_;
-            } else if (key == "handlers") {
-                handler_cfg.load_handlers(it.second());
-            } else if (key == "host") {
-                host_cfg.load_vhost_rules(it.second());
-            } else if (key == "read_stage_pool_size") {
-                it.second() >> value;
-                read_stage_pool_size_ = atoi(value.c_str());
-            } else if (key == "write_stage_pool_size") {
-                it.second() >> value;
-                write_stage_pool_size_ = atoi(value.c_str());
-            } else if (key == "recycle_threshold") {
-                it.second() >> value;
-                recycle_threshold_ = atoi(value.c_str());
-            } else if (key == "handler_stage_pool_size") {
-                it.second() >> value;
-                handler_stage_pool_size_ = atoi(value.c_str());
-            } else if (key == "listen_queue_size") {
-                it.second() >> value;
-                listen_queue_size_ = atoi(value.c_str());
-            } else if (key == "idle_timeout") {
-                it.second() >> value;
-                HttpConnectionFactory::kDefaultTimeout = atoi(value.c_str());
+    boost::shared_ptr<VHostRules> rules(new VHostRules());
+    int route_cache_size = route_cache_size_;
+
+    try {
+        YAML::Parser parser(fin);
+        Node doc;
+        while (parser.GetNextDocument(doc)) {
+            for (YAML::Iterator it = doc.begin(); it != doc.end(); ++it) {
+                std::string key, value;
+                it.first() >> key;
+                if (key == "handlers") {
+                    if (!handler_cfg.load_handlers(it.second())) {
+                        handler_cfg.rollback();
+                        error = "unknown handler module";
+                        return false;
+                    }
+                } else if (key == "host") {
+                    rules->load_vhost_rules(it.second());
+                } else if (key == "route_cache_size") {
+                    it.second() >> value;
+                    route_cache_size = atoi(value.c_str());
+                } else if (reload) {
+                    // the rest is set up once, at start
+                    continue;
+                } else if (key == "address") {
+                    it.second() >> address_;
+                } else if (key == "port") {
+                    it.second() >> port_;
+                } else if (key == "read_stage_pool_size") {
+                    it.second() >> value;
+                    read_stage_pool_size_ = atoi(value.c_str());
+                } else if (key == "write_stage_pool_size") {
+                    it.second() >> value;
+                    write_stage_pool_size_ = atoi(value.c_str());
+                } else if (key == "recycle_threshold") {
+                    it.second() >> value;
+                    recycle_threshold_ = atoi(value.c_str());
+                } else if (key == "handler_stage_pool_size") {
+                    it.second() >> value;
+                    handler_stage_pool_size_ = atoi(value.c_str());
+                } else if (key == "compress_stage_pool_size") {
+                    it.second() >> value;
+                    compress_stage_pool_size_ = atoi(value.c_str());
+                } else if (key == "disk_io_stage_pool_size") {
+                    it.second() >> value;
+                    disk_io_stage_pool_size_ = atoi(value.c_str());
+                } else if (key == "websocket_stage_pool_size") {
+                    it.second() >> value;
+                    websocket_stage_pool_size_ = atoi(value.c_str());
+                } else if (key == "listen_queue_size") {
+                    it.second() >> value;
+                    listen_queue_size_ = atoi(value.c_str());
+                } else if (key == "drain_timeout") {
+                    it.second() >> value;
+                    drain_timeout_ = atoi(value.c_str());
+                } else if (key == "idle_timeout") {
+                    it.second() >> value;
+                    HttpConnectionFactory::kDefaultTimeout =
+                        atoi(value.c_str());
+                } else {
+                    LOG(INFO, "ignore unsupported key %s", key.c_str());
+                }
             }
-            LOG(INFO, "ignore unsupported key %s", key.c_str());
         }
+    } catch (const std::exception& ex) {
+        // a yaml syntax error, or a bad regex in a url rule
+        handler_cfg.rollback();
+        error = ex.what();
+        return false;
     }
+
+    route_cache_size_ = route_cache_size;
+    rules->route_cache().set_max_entry(route_cache_size_);
+    handler_cfg.commit();
+    VHostConfig::instance().publish(rules);
+    // the replaced handlers no request runs any more, and the ones left
+    // over from earlier loads
+    handler_cfg.free_released();
+    return true;
 }
 
 }
@@ -4,9 +4,11 @@
 #define _CONFIGURATION_H_
 
 #include <yaml-cpp/yaml.h>
+#include <boost/shared_ptr.hpp>
 
 #include "http/interface.h"
 #include "http/connection.h"
+#include "http/route_cache.h"
 
 namespace tube {
 
@@ -24,26 +26,52 @@ public:
 
     void register_handler_factory(const BaseHttpHandlerFactory* factory);
 
-    BaseHttpHandler* create_handler_instance(const std::string& name,
-                                             const std::string& module);
-    BaseHttpHandler* get_handler_instance(const std::string& name) const;
-
-    void load_handlers(const Node& subdoc);
-    void load_handler(const Node& subdoc);
+    // of the config being loaded
+    BaseHttpHandlerPtr get_handler_instance(const std::string& name) const;
+
+    // a handler defined just as in the running config is the same
+    // instance, so its caches and connection pools survive a reload.
+    // false on an unknown module.
+    bool load_handlers(const Node& subdoc);
+    bool load_handler(const Node& subdoc);
+    // the loaded handlers become the running ones
+    void commit();
+    // the loaded config is thrown away
+    void rollback();
+    // deletes the handlers no config or request holds any more
+    void free_released();
+    // shuts every handler not freed yet down, old configs' too
+    void shutdown();
 private:
+    struct HandlerEntry
+    {
+        BaseHttpHandlerPtr handler;
+        std::string        definition; // module and options
+    };
     typedef std::map<std::string, const BaseHttpHandlerFactory*> FactoryMap;
-    typedef std::map<std::string, BaseHttpHandler*> HandlerMap;
+    typedef std::map<std::string, HandlerEntry> HandlerMap;
     FactoryMap factories_;
     HandlerMap handlers_;
+    HandlerMap loading_;
+    // the last reference to a replaced handler may go with a request,
+    // under a connection lock its threads could be waiting for.  so it is
+    // only put here, and deleted by free_released() when the config is
+    // loaded again.
+    utils::Mutex                  released_mutex_;
+    std::vector<BaseHttpHandler*> released_;
+    std::set<BaseHttpHandler*>    alive_; // created and not freed yet
+
+    void release(BaseHttpHandler* handler);
 };
 
 class UrlRuleItemMatcher;
 
 struct UrlRuleItem
 {
-    typedef std::list<BaseHttpHandler*> HandlerChain;
+    typedef std::list<BaseHttpHandlerPtr> HandlerChain;
     HandlerChain handlers;
-    UrlRuleItemMatcher* matcher;
+    boost::shared_ptr<UrlRuleItemMatcher> matcher;
+    bool path_only;
 
     UrlRuleItem(const std::string& type, const Node& subdoc);
     virtual ~UrlRuleItem();
@@ -59,14 +87,41 @@ public:
 
     const UrlRuleItem* match_uri(HttpRequestData& req_ref) const;
 
+    // whether matching depends on the path only, not on the query string
+    bool path_only() const { return path_only_; }
 private:
     std::vector<UrlRuleItem> rules_;
+    bool                     path_only_;
 };
 
-class VHostConfig
+// The hosts and url rules of one load of the config file.  Never changed
+// once published; a request holds on to the rules it was routed with, so a
+// reload frees them only when the last such request is done.
+class VHostRules : utils::Noncopyable
 {
     typedef std::map<std::string, UrlRuleConfig> HostMap;
     HostMap host_map_;
+    bool    path_only_;
+
+    mutable RouteCache route_cache_;
+public:
+    VHostRules();
+
+    void load_vhost_rules(const Node& subdoc);
+    const UrlRuleItem* match_uri(const std::string& host,
+                                 HttpRequestData& req_ref) const;
+
+    RouteCache& route_cache() { return route_cache_; }
+private:
+    const UrlRuleItem* match_uri_nocache(const std::string& host,
+                                         HttpRequestData& req_ref) const;
+};
+
+class VHostConfig
+{
+    utils::Mutex  mutex_;
+    VHostRulesPtr rules_;
+
     VHostConfig();
     ~VHostConfig();
 public:
@@ -75,9 +130,9 @@ public:
         return ins;
     }
 
-    void load_vhost_rules(const Node& subdoc);
-    const UrlRuleItem* match_uri(const std::string& host,
-                                 HttpRequestData& req_ref) const;
+    // the running rules, NULL before the config is loaded
+    VHostRulesPtr rules();
+    void publish(const VHostRulesPtr& rules);
 };
 
 class ServerConfig
@@ -90,7 +145,12 @@ public:
         return ins;
     }
 
+    // throws std::invalid_argument if the file can't be used
     void load_config_file(const char* filename);
+    // loads the handlers and hosts again, for the requests to come.  the
+    // other keys take a restart.  false and the running config kept on
+    // error.
+    bool reload_config_file(const char* filename);
 
     std::string address() const { return address_; }
     std::string port() const { return port_; }
@@ -98,9 +158,17 @@ public:
     int write_stage_pool_size() const {   return write_stage_pool_size_; }
     int recycle_threshold() const { return recycle_threshold_; }
     int handler_stage_pool_size() const { return handler_stage_pool_size_; }
+    int compress_stage_pool_size() const { return compress_stage_pool_size_; }
+    int disk_io_stage_pool_size() const { return disk_io_stage_pool_size_; }
+    int websocket_stage_pool_size() const {
+        return websocket_stage_pool_size_;
+    }
     int listen_queue_size() const { return listen_queue_size_; }
+    int route_cache_size() const { return route_cache_size_; }
+    int drain_timeout() const { return drain_timeout_; }
 
 private:
+    utils::Mutex load_mutex_;
     std::string address_;
     std::string port_; // port can be a server, keep it as a string
 
@@ -108,7 +176,14 @@ private:
     int write_stage_pool_size_;
     int recycle_threshold_;
     int handler_stage_pool_size_;
+    int compress_stage_pool_size_;
+    int disk_io_stage_pool_size_;
+    int websocket_stage_pool_size_;
     int listen_queue_size_;
+    int route_cache_size_;
+    int drain_timeout_;
+
+    bool load(const char* filename, bool reload, std::string& error);
 };
 
 }
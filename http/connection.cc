@@ -2,6 +2,8 @@
 
 #include "http/connection.h"
 #include "http/configuration.h"
+#include "http/http_wrapper.h"
+#include "http/websocket.h"
 #include "utils/logger.h"
 
 namespace tube {
@@ -37,9 +39,16 @@ on_header_line_complete(http_parser* parser)
     return 0;
 }
 
+static int
+on_headers_complete(http_parser* parser)
+{
+    HTTP_CONNECTION(parser->data)->finish_headers();
+    return 0;
+}
+
 HttpRequestData::HttpRequestData()
     : method(0), content_length(0), transfer_encoding(0), version_major(0),
-      version_minor(0), keep_alive(false)
+      version_minor(0), keep_alive(false), url_rule(NULL)
 {
 }
 
@@ -81,12 +90,14 @@ HttpRequestData::method_string() const
 }
 
 HttpConnection::HttpConnection(int fd)
-    : Connection(fd)
+    : Connection(fd), body_state_(kBodyNone), body_remaining_(0),
+      body_chunked_(false), parked_(false), resume_ready_(false)
 {
     http_parser_init(&parser_, HTTP_REQUEST);
     parser_.data = this;
     parser_.on_message_complete = on_message_complete;
     parser_.on_header_line_complete = on_header_line_complete;
+    parser_.on_headers_complete = on_headers_complete;
     parser_.on_header_field = on_field;
     parser_.on_header_value = on_value;
     parser_.on_path = on_path;
@@ -98,16 +109,68 @@ HttpConnection::HttpConnection(int fd)
     set_io_timeout(500); // max block time
 }
 
+HttpConnection::~HttpConnection()
+{
+    if (body_consumer_) {
+        // closed before the body was complete
+        body_consumer_->attach(NULL);
+        body_consumer_->on_error();
+    }
+    if (parked_response_) {
+        // closed while a handler still works on the response
+        parked_response_->detach();
+    }
+    if (websocket_)
+        websocket_->detach();
+}
+
+bool
+HttpConnection::is_idle()
+{
+    // an upgraded connection is never done, it is cut at the drain deadline
+    return Connection::is_idle() && requests_.empty() && !parked_
+        && body_state_ == kBodyNone && !websocket_;
+}
+
+void
+HttpConnection::on_output_done()
+{
+    // a streamed body may wait for the client to catch up
+    if (parked_response_)
+        parked_response_->drained();
+    if (websocket_)
+        websocket_->output_written();
+}
+
 const size_t HttpConnection::kMaxBodySize = 16 << 10;
 
 bool
 HttpConnection::do_parse()
 {
-    if (!requests_.empty() && requests_.back().content_length > 0) {
-        // here, we don't consume the buffer, we'll leave the buffer to the
-        // application to consume it, since it's a stream
-        return true;
+    while (!has_error()) {
+        if (!feed_body())
+            break;
+        if (body_state_ == kBodyPending && requests_.empty() && !parked_) {
+            // taken without a decision, whoever took it read the body
+            body_state_ = kBodyNone;
+            body_remaining_ = 0;
+        }
+        if (body_state_ != kBodyNone) {
+            // here, we don't parse beyond the body, only the chunks of a
+            // chunked one until enough of them are waiting
+            if (body_remaining_ > 0 || !body_chunked_
+                || body_buffer_.size() >= kMaxBodySize)
+                break;
+        }
+        if (parse_input() == 0)
+            break;
     }
+    return !has_error();
+}
+
+size_t
+HttpConnection::parse_input()
+{
     Buffer& buf = in_stream.buffer();
     size_t nconsumed = 0;
     for (Buffer::PageIterator it = buf.page_begin(); it != buf.page_end();
@@ -115,18 +178,21 @@ HttpConnection::do_parse()
         size_t len = 0;
         const char* ptr = (const char*) buf.get_page_segment(*it, &len);
         //LOG(DEBUG, "parsing %.*s", len, ptr);
-        nconsumed += http_parser_execute(&parser_, ptr, len);
-        if (!requests_.empty() && requests_.back().content_length > 0) {
-            break;
-        }
+        size_t nparsed = http_parser_execute(&parser_, ptr, len);
+        nconsumed += nparsed;
         if (http_parser_has_error(&parser_)) {
             LOG(WARNING, "error when parsing http packet at %*s", (int) len,
                 ptr);
             break;
         }
+        if (nparsed < len) // stopped at the end of a message with a body
+            break;
+        if (body_state_ != kBodyNone
+            && (!body_chunked_ || body_buffer_.size() >= kMaxBodySize))
+            break;
     }
     buf.pop(nconsumed);
-    return !http_parser_has_error(&parser_);
+    return nconsumed;
 }
 
 bool
@@ -189,7 +255,17 @@ HttpConnection::append_fragment(const char* ptr, size_t sz)
 void
 HttpConnection::append_chunk(const char* ptr, size_t sz)
 {
-    tmp_request_.chunk_buffer.append((const byte*) ptr, sz);
+    if (body_state_ == kBodyDiscarding)
+        return;
+    if (body_state_ == kBodyStreaming && body_buffer_.size() == 0) {
+        // nothing held back, so the consumer may take it from here directly
+        size_t ntaken = body_consumer_->on_data((const byte*) ptr, sz);
+        ptr += ntaken;
+        sz -= ntaken;
+    }
+    if (sz > 0) {
+        body_buffer_.append((const byte*) ptr, sz);
+    }
 }
 
 void
@@ -201,10 +277,39 @@ HttpConnection::finish_header_line()
     last_header_value_ = "";
 }
 
+void
+HttpConnection::finish_headers()
+{
+    if (parser_.transfer_encoding == HTTP_CHUNKED) {
+        // no need to wait for the whole body, it streams to the handler
+        dispatch_request();
+        body_state_ = kBodyPending;
+        body_chunked_ = true;
+    }
+}
+
 void
 HttpConnection::finish_parse()
 {
-    VHostConfig& vhost_cfg = VHostConfig::instance();
+    if (body_chunked_) {
+        // the request went out with its headers, this only ends the body.
+        // the trailers are dropped.
+        body_chunked_ = false;
+        tmp_request_ = HttpRequestData();
+        last_header_key_.clear();
+        last_header_value_.clear();
+        return;
+    }
+    dispatch_request();
+    if (parser_.content_length > 0) {
+        body_state_ = kBodyPending;
+        body_remaining_ = parser_.content_length;
+    }
+}
+
+void
+HttpConnection::dispatch_request()
+{
     tmp_request_.method = parser_.method;
     tmp_request_.content_length = parser_.content_length;
     tmp_request_.transfer_encoding = parser_.transfer_encoding;
@@ -222,8 +327,12 @@ HttpConnection::finish_parse()
     }
     LOG(INFO, "[%s] %s from %s",  tmp_request_.method_string(),
         tmp_request_.uri.c_str(), address_string().c_str());
-    // matching the rule
-    tmp_request_.url_rule = vhost_cfg.match_uri(host, tmp_request_);
+    // matching the rule, the request keeps the rules it got across reloads
+    tmp_request_.vhost_rules = VHostConfig::instance().rules();
+    if (tmp_request_.vhost_rules) {
+        tmp_request_.url_rule = tmp_request_.vhost_rules->match_uri(
+            host, tmp_request_);
+    }
 
     requests_.push_back(tmp_request_);
     tmp_request_ = HttpRequestData();
@@ -231,4 +340,149 @@ HttpConnection::finish_parse()
     last_header_value_.clear();
 }
 
+bool
+HttpConnection::is_body_complete() const
+{
+    return body_state_ == kBodyStreaming && body_remaining_ == 0
+        && !body_chunked_ && body_buffer_.size() == 0;
+}
+
+bool
+HttpConnection::is_body_held_back() const
+{
+    return body_state_ == kBodyStreaming
+        && (body_buffer_.size() > 0
+            || (body_remaining_ > 0 && in_stream.buffer().size() > 0));
+}
+
+void
+HttpConnection::set_body_consumer(const HttpBodyConsumerPtr& consumer,
+                                  const HttpRequestData& request)
+{
+    // a request without a body completes right away
+    body_state_ = kBodyStreaming;
+    body_consumer_ = consumer;
+    body_consumer_->attach(this);
+    body_request_ = request;
+}
+
+void
+HttpConnection::discard_body()
+{
+    if (body_state_ != kBodyPending)
+        return;
+    body_buffer_.clear();
+    if (body_remaining_ > 0 || body_chunked_) {
+        body_state_ = kBodyDiscarding;
+    } else {
+        body_state_ = kBodyNone;
+    }
+}
+
+size_t
+HttpConnection::offer_body(Buffer& buf, size_t limit)
+{
+    size_t ntaken = 0;
+    for (Buffer::PageIterator it = buf.page_begin();
+         it != buf.page_end() && ntaken < limit; ++it) {
+        size_t len = 0;
+        const byte* ptr = buf.get_page_segment(*it, &len);
+        if (len > limit - ntaken) {
+            len = limit - ntaken;
+        }
+        size_t n = body_consumer_->on_data(ptr, len);
+        ntaken += n;
+        if (n < len)
+            break;
+    }
+    buf.pop(ntaken);
+    return ntaken;
+}
+
+bool
+HttpConnection::feed_body()
+{
+    Buffer& buf = in_stream.buffer();
+    if (body_state_ == kBodyDiscarding) {
+        size_t nskip = buf.size() < body_remaining_ ?
+            buf.size() : body_remaining_;
+        buf.pop(nskip);
+        body_remaining_ -= nskip;
+        if (body_remaining_ == 0 && !body_chunked_) {
+            body_state_ = kBodyNone;
+        }
+        return true;
+    }
+    if (body_state_ != kBodyStreaming)
+        return true;
+
+    size_t noffer = body_buffer_.size();
+    if (noffer > 0 && offer_body(body_buffer_, noffer) < noffer)
+        return false;
+    noffer = buf.size() < body_remaining_ ? buf.size() : body_remaining_;
+    if (noffer > 0) {
+        size_t ntaken = offer_body(buf, noffer);
+        body_remaining_ -= ntaken;
+        if (ntaken < noffer)
+            return false;
+    }
+    return true;
+}
+
+size_t
+HttpConnection::read_chunked_body(byte* ptr, size_t sz)
+{
+    if (sz > body_buffer_.size()) {
+        sz = body_buffer_.size();
+    }
+    if (sz > 0) {
+        body_buffer_.copy_front(ptr, sz);
+        body_buffer_.pop(sz);
+    }
+    return sz;
+}
+
+void
+HttpConnection::consume_body(size_t sz)
+{
+    body_remaining_ -= sz < body_remaining_ ? sz : body_remaining_;
+}
+
+HttpBodyConsumerPtr
+HttpConnection::finish_body(HttpRequestData& request)
+{
+    HttpBodyConsumerPtr consumer = body_consumer_;
+    request = body_request_;
+    consumer->attach(NULL);
+    body_consumer_.reset();
+    body_request_ = HttpRequestData();
+    body_state_ = kBodyNone;
+    return consumer;
+}
+
+void
+HttpConnection::park_request(const HttpRequestData& request,
+                             const HttpAsyncResponsePtr& response)
+{
+    // resume_ready_ is left alone, the work may be done already
+    parked_request_ = request;
+    parked_response_ = response;
+    parked_ = true;
+}
+
+bool
+HttpConnection::take_resumed_request(HttpRequestData& request,
+                                     HttpAsyncResponsePtr& response)
+{
+    if (!parked_ || !resume_ready_)
+        return false;
+    request = parked_request_;
+    response = parked_response_;
+    parked_request_ = HttpRequestData();
+    parked_response_.reset();
+    parked_ = false;
+    resume_ready_ = false;
+    return true;
+}
+
 }
@@ -3,6 +3,8 @@
 #ifndef _CONNECTION_H_
 #define _CONNECTION_H_
 
+#include <boost/shared_ptr.hpp>
+
 #include "http/http_parser.h"
 #include "core/pipeline.h"
 #include "utils/misc.h"
@@ -20,6 +22,8 @@ struct HttpHeaderItem
 typedef std::vector<HttpHeaderItem> HttpHeaderEnumerate;
 
 struct UrlRuleItem;
+class VHostRules;
+typedef boost::shared_ptr<const VHostRules> VHostRulesPtr;
 
 struct HttpRequestData
 {
@@ -28,7 +32,6 @@ struct HttpRequestData
     std::string         uri;
     std::string         query_string;
     std::string         fragment;
-    Buffer              chunk_buffer;
 
     short method; // defined in http_parser.h
     u64   content_length;
@@ -38,14 +41,29 @@ struct HttpRequestData
     bool  keep_alive;
 
     const UrlRuleItem* url_rule;
+    VHostRulesPtr      vhost_rules; // url_rule points into it
 
     HttpRequestData();
 
     const char* method_string() const;
 };
 
+class HttpBodyConsumer;
+typedef boost::shared_ptr<HttpBodyConsumer> HttpBodyConsumerPtr;
+class HttpAsyncResponse;
+typedef boost::shared_ptr<HttpAsyncResponse> HttpAsyncResponsePtr;
+class WebSocket;
+typedef boost::shared_ptr<WebSocket> WebSocketPtr;
+
 class HttpConnection : public Connection
 {
+    enum BodyState {
+        kBodyNone,
+        kBodyPending,    // dispatched, the handler has not decided yet
+        kBodyStreaming,  // fed to body_consumer_
+        kBodyDiscarding  // nobody wants it, skipped as it arrives
+    };
+
     struct http_parser         parser_;
     std::list<HttpRequestData> requests_;
 
@@ -53,12 +71,33 @@ class HttpConnection : public Connection
     std::string     last_header_key_;
     std::string     last_header_value_;
 
+    // body of the request currently being handled
+    BodyState           body_state_;
+    u64                 body_remaining_; // content-length bytes still unread
+    bool                body_chunked_;   // last chunk not parsed yet
+    Buffer              body_buffer_;    // decoded chunks not taken yet
+    HttpBodyConsumerPtr body_consumer_;
+    HttpRequestData     body_request_;
+
+    // request waiting for the disk io stage or an async response, handled
+    // again once resumable
+    bool                 parked_;
+    volatile bool        resume_ready_;
+    HttpRequestData      parked_request_;
+    HttpAsyncResponsePtr parked_response_;
+
+    // set once the connection is upgraded, the rest of it is frames
+    WebSocketPtr websocket_;
+
 public:
 
     static const size_t kMaxBodySize;
 
     HttpConnection(int fd);
-    virtual ~HttpConnection() {}
+    virtual ~HttpConnection();
+
+    virtual bool is_idle();
+    virtual void on_output_done();
 
     void append_field(const char* ptr, size_t sz);
     void append_value(const char* ptr, size_t sz);
@@ -70,12 +109,52 @@ public:
 
     bool do_parse();
     void finish_header_line();
+    void finish_headers();
     void finish_parse();
 
     bool has_error() const;
     bool is_ready() const;
 
+    // request body streaming.  a handler either hands the body to a consumer
+    // or leaves it, then whatever it did not read is discarded.
+    bool has_pending_body() const { return body_state_ == kBodyPending; }
+    bool is_body_streaming() const { return body_state_ == kBodyStreaming; }
+    bool is_body_complete() const;
+    // the consumer has not taken everything offered
+    bool is_body_held_back() const;
+    u64  body_remaining() const { return body_remaining_; }
+
+    void   set_body_consumer(const HttpBodyConsumerPtr& consumer,
+                             const HttpRequestData& request);
+    void   discard_body();
+    // false while the consumer is behind and the input should be paused
+    bool   feed_body();
+    size_t read_chunked_body(byte* ptr, size_t sz);
+    void   consume_body(size_t sz);
+    // hands the consumer back once the whole body went to it
+    HttpBodyConsumerPtr finish_body(HttpRequestData& request);
+
+    // a deferred or suspended request is parked until the work it waits
+    // for is done.  requests behind it are not handled meanwhile.
+    void park_request(const HttpRequestData& request,
+                      const HttpAsyncResponsePtr& response =
+                      HttpAsyncResponsePtr());
+    bool is_parked() const { return parked_; }
+    void set_resumable() { resume_ready_ = true; }
+    // false unless a parked request is resumable.  response is the async
+    // one it was suspended with, if any.
+    bool take_resumed_request(HttpRequestData& request,
+                              HttpAsyncResponsePtr& response);
+
     std::list<HttpRequestData>& get_request_data_list() { return requests_; }
+
+    void upgrade(const WebSocketPtr& websocket) { websocket_ = websocket; }
+    bool is_upgraded() const { return websocket_.get() != NULL; }
+    const WebSocketPtr& websocket() const { return websocket_; }
+private:
+    size_t parse_input();
+    void   dispatch_request();
+    size_t offer_body(Buffer& buf, size_t limit);
 };
 
 }
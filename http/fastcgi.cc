@@ -0,0 +1,793 @@
+#include "pch.h"
+
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/un.h>
+#include <boost/bind.hpp>
+
+#include "http/fastcgi.h"
+#include "utils/logger.h"
+
+namespace tube {
+
+static const int kFcgiRequestComplete = 0;
+
+static void
+append_header(std::string& out, int type, u16 request_id, size_t length,
+              size_t padding)
+{
+    out.push_back((char) kFcgiVersion);
+    out.push_back((char) type);
+    out.push_back((char) (request_id >> 8));
+    out.push_back((char) (request_id & 0xff));
+    out.push_back((char) (length >> 8));
+    out.push_back((char) (length & 0xff));
+    out.push_back((char) padding);
+    out.push_back(0);
+}
+
+void
+fcgi_append_record(std::string& out, int type, u16 request_id,
+                   const char* ptr, size_t size)
+{
+    do {
+        size_t length = size < kFcgiMaxContentLength
+            ? size : kFcgiMaxContentLength;
+        // keeps the next header aligned, as the spec recommends
+        size_t padding = (8 - length % 8) % 8;
+        append_header(out, type, request_id, length, padding);
+        if (length > 0)
+            out.append(ptr, length);
+        out.append(padding, '\0');
+        ptr += length;
+        size -= length;
+    } while (size > 0);
+}
+
+void
+fcgi_append_begin_request(std::string& out, u16 request_id)
+{
+    char body[8];
+    memset(body, 0, sizeof(body));
+    body[1] = (char) kFcgiResponder;
+    body[2] = (char) kFcgiKeepConn;
+    fcgi_append_record(out, kFcgiBeginRequest, request_id, body,
+                       sizeof(body));
+}
+
+static void
+append_length(std::string& out, size_t length)
+{
+    if (length < 128) {
+        out.push_back((char) length);
+        return;
+    }
+    out.push_back((char) (((length >> 24) & 0x7f) | 0x80));
+    out.push_back((char) ((length >> 16) & 0xff));
+    out.push_back((char) ((length >> 8) & 0xff));
+    out.push_back((char) (length & 0xff));
+}
+
+void
+fcgi_append_param(std::string& out, const std::string& name,
+                  const std::string& value)
+{
+    append_length(out, name.length());
+    append_length(out, value.length());
+    out.append(name);
+    out.append(value);
+}
+
+static bool
+parse_length(const std::string& content, size_t& pos, size_t& length)
+{
+    if (pos >= content.size())
+        return false;
+    const byte* ptr = (const byte*) content.data() + pos;
+    if (!(ptr[0] & 0x80)) {
+        length = ptr[0];
+        pos++;
+        return true;
+    }
+    if (pos + 4 > content.size())
+        return false;
+    length = ((size_t) (ptr[0] & 0x7f) << 24) | ((size_t) ptr[1] << 16)
+        | ((size_t) ptr[2] << 8) | ptr[3];
+    pos += 4;
+    return true;
+}
+
+bool
+fcgi_parse_params(const std::string& content, FcgiParams& params)
+{
+    size_t pos = 0;
+    while (pos < content.size()) {
+        size_t name_length, value_length;
+        if (!parse_length(content, pos, name_length)
+            || !parse_length(content, pos, value_length)
+            || content.size() - pos < name_length + value_length)
+            return false;
+        params.push_back(std::make_pair(content.substr(pos, name_length),
+                                        content.substr(pos + name_length,
+                                                       value_length)));
+        pos += name_length + value_length;
+    }
+    return true;
+}
+
+size_t
+fcgi_cgi_head_length(const std::string& data)
+{
+    size_t pos = 0;
+    while (true) {
+        size_t end = data.find('\n', pos);
+        if (end == std::string::npos)
+            return std::string::npos;
+        if (end == pos || (end == pos + 1 && data[pos] == '\r'))
+            return end + 1;
+        pos = end + 1;
+    }
+}
+
+bool
+fcgi_parse_cgi_head(const std::string& head, int& status_code,
+                    std::string& reason, HttpHeaderEnumerate& headers)
+{
+    bool has_status = false, has_location = false;
+    status_code = 200;
+    reason = "OK";
+    size_t pos = 0;
+    while (pos < head.size()) {
+        size_t end = head.find('\n', pos);
+        if (end == std::string::npos)
+            end = head.size();
+        std::string line = head.substr(pos, end - pos);
+        pos = end + 1;
+        if (!line.empty() && line[line.length() - 1] == '\r')
+            line.erase(line.length() - 1);
+        if (line.empty())
+            continue;
+        size_t colon = line.find(':');
+        if (colon == std::string::npos || colon == 0)
+            return false;
+        std::string key = line.substr(0, colon);
+        size_t begin = line.find_first_not_of(" \t", colon + 1);
+        std::string value = begin == std::string::npos
+            ? std::string() : line.substr(begin);
+        if (utils::ignore_compare(key, "status")) {
+            // "Status: 404 Not Found", the reason may be left out
+            status_code = atoi(value.c_str());
+            if (status_code < 100 || status_code > 999)
+                return false;
+            size_t space = value.find(' ');
+            reason = space == std::string::npos
+                ? std::string() : value.substr(space + 1);
+            has_status = true;
+            continue;
+        }
+        if (utils::ignore_compare(key, "location"))
+            has_location = true;
+        headers.push_back(HttpHeaderItem(key, value));
+    }
+    if (has_location && !has_status) {
+        status_code = 302;
+        reason = "Found";
+    }
+    return true;
+}
+
+void
+FcgiRecordParser::feed(const char* ptr, size_t size)
+{
+    if (pos_ > 0 && pos_ * 2 >= buf_.size()) {
+        buf_.erase(0, pos_);
+        pos_ = 0;
+    }
+    buf_.append(ptr, size);
+}
+
+bool
+FcgiRecordParser::next(FcgiRecord& record)
+{
+    if (malformed_ || buf_.size() - pos_ < kFcgiHeaderLength)
+        return false;
+    const byte* header = (const byte*) buf_.data() + pos_;
+    if (header[0] != kFcgiVersion) {
+        malformed_ = true;
+        return false;
+    }
+    size_t length = ((size_t) header[4] << 8) | header[5];
+    size_t padding = header[6];
+    if (buf_.size() - pos_ < kFcgiHeaderLength + length + padding)
+        return false;
+    record.type = header[1];
+    record.request_id = ((u16) header[2] << 8) | header[3];
+    record.content.assign(buf_, pos_ + kFcgiHeaderLength, length);
+    pos_ += kFcgiHeaderLength + length + padding;
+    return true;
+}
+
+FcgiConnection::~FcgiConnection()
+{
+    ::close(fd);
+}
+
+static bool
+send_all(int fd, const char* ptr, size_t size)
+{
+    while (size > 0) {
+        ssize_t nsent = ::send(fd, ptr, size, MSG_NOSIGNAL);
+        if (nsent < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        ptr += nsent;
+        size -= nsent;
+    }
+    return true;
+}
+
+FcgiClient::FcgiClient()
+    : backend_addr_len_(0), max_connections_(8), multiplex_(1),
+      io_timeout_(30000), connecting_(0), poller_(NULL), thread_(NULL),
+      wake_conn_(NULL), last_scan_(0)
+{
+    memset(&backend_addr_, 0, sizeof(backend_addr_));
+    wake_fds_[0] = wake_fds_[1] = -1;
+}
+
+FcgiClient::~FcgiClient()
+{
+    stop();
+    conns_.clear();
+    if (poller_)
+        PollerFactory::instance().destroy_poller(poller_);
+    delete wake_conn_;
+    if (wake_fds_[0] >= 0) {
+        ::close(wake_fds_[0]);
+        ::close(wake_fds_[1]);
+    }
+}
+
+bool
+FcgiClient::set_backend(const std::string& backend)
+{
+    backend_ = backend;
+    memset(&backend_addr_, 0, sizeof(backend_addr_));
+    if (backend.compare(0, 5, "unix:") == 0) {
+        std::string path = backend.substr(5);
+        struct sockaddr_un* addr = (struct sockaddr_un*) &backend_addr_;
+        if (path.empty() || path.length() >= sizeof(addr->sun_path)) {
+            LOG(ERROR, "bad fastcgi socket path %s", path.c_str());
+            return false;
+        }
+        addr->sun_family = AF_UNIX;
+        strcpy(addr->sun_path, path.c_str());
+        backend_addr_len_ = sizeof(struct sockaddr_un);
+        return true;
+    }
+
+    size_t colon = backend.rfind(':');
+    if (colon == std::string::npos || colon == 0) {
+        LOG(ERROR, "fastcgi backend %s should be unix:path or host:port",
+            backend.c_str());
+        return false;
+    }
+    std::string host = backend.substr(0, colon);
+    std::string port = backend.substr(colon + 1);
+    struct addrinfo hints;
+    struct addrinfo* res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+    if (err != 0 || res == NULL) {
+        LOG(ERROR, "cannot resolve fastcgi backend %s: %s", backend.c_str(),
+            gai_strerror(err));
+        return false;
+    }
+    memcpy(&backend_addr_, res->ai_addr, res->ai_addrlen);
+    backend_addr_len_ = res->ai_addrlen;
+    freeaddrinfo(res);
+    return true;
+}
+
+bool
+FcgiClient::start()
+{
+    if (thread_)
+        return true;
+    if (backend_addr_len_ == 0)
+        return false;
+    poller_ = PollerFactory::instance().create_poller(
+        PollerFactory::instance().default_poller_name());
+    if (poller_ == NULL) {
+        LOG(ERROR, "no poller for fastcgi connections");
+        return false;
+    }
+    if (::pipe(wake_fds_) < 0) {
+        LOG(ERROR, "cannot create the fastcgi wake up pipe");
+        return false;
+    }
+    utils::set_socket_blocking(wake_fds_[0], false);
+    utils::set_socket_blocking(wake_fds_[1], false);
+    wake_conn_ = new Connection(wake_fds_[0]);
+    poller_->set_event_handler(
+        boost::bind(&FcgiClient::handle_event, this, _1, _2));
+    poller_->set_post_handler(
+        boost::bind(&FcgiClient::scan_timeouts, this, _1));
+    poller_->add_fd(wake_fds_[0], wake_conn_, POLLER_EVENT_READ);
+    thread_ = new utils::Thread(boost::bind(&FcgiClient::poll, this));
+    return true;
+}
+
+void
+FcgiClient::stop()
+{
+    if (thread_ == NULL)
+        return;
+    poller_->stop();
+    thread_->join();
+    delete thread_;
+    thread_ = NULL;
+}
+
+void
+FcgiClient::poll()
+{
+    // wakes up every second at least, for the timeouts
+    poller_->handle_event(1);
+}
+
+FcgiConnectionPtr
+FcgiClient::connect()
+{
+    int fd = ::socket(backend_addr_.ss_family, SOCK_STREAM, 0);
+    if (fd < 0)
+        return FcgiConnectionPtr();
+    FcgiConnectionPtr conn(new FcgiConnection(fd));
+    // bounds the connect too
+    if (io_timeout_ > 0)
+        conn->set_io_timeout(io_timeout_);
+    if (::connect(fd, (struct sockaddr*) &backend_addr_, backend_addr_len_)
+        < 0) {
+        LOG(WARNING, "cannot connect to fastcgi backend %s: %s",
+            backend_.c_str(), strerror(errno));
+        return FcgiConnectionPtr();
+    }
+    return conn;
+}
+
+void
+FcgiClient::add_request(const FcgiConnectionPtr& conn,
+                        const HttpAsyncResponsePtr& response,
+                        FcgiRequestHandle& handle)
+{
+    // ids are only reused once the backend ended the request
+    do {
+        if (++conn->next_id == 0)
+            conn->next_id = 1;
+    } while (conn->requests.find(conn->next_id) != conn->requests.end());
+    FcgiConnection::Pending& pending = conn->requests[conn->next_id];
+    pending.response = response;
+    pending.last_active = time(NULL);
+    response->set_drain_handler(
+        boost::bind(&FcgiClient::resume_reading, this,
+                    FcgiConnectionWeakPtr(conn), conn->next_id));
+    handle.conn = conn;
+    handle.request_id = conn->next_id;
+    request_count_.increment();
+}
+
+bool
+FcgiClient::open_request(const HttpAsyncResponsePtr& response,
+                         FcgiRequestHandle& handle)
+{
+    {
+        utils::Lock lk(mutex_);
+        for (ConnectionMap::iterator it = conns_.begin(); it != conns_.end();
+             ++it) {
+            if (it->second->requests.size() < multiplex_) {
+                add_request(it->second, response, handle);
+                return true;
+            }
+        }
+        if (conns_.size() + connecting_ >= max_connections_) {
+            lk.unlock();
+            LOG(WARNING, "fastcgi backend %s is busy", backend_.c_str());
+            fail_later(response,
+                       HttpResponseStatus::kHttpResponseServiceUnavailable);
+            return false;
+        }
+        connecting_++;
+    }
+
+    FcgiConnectionPtr conn = connect();
+    utils::Lock lk(mutex_);
+    connecting_--;
+    if (conn && !poller_->add_fd(conn->fd, conn.get(), POLLER_EVENT_READ
+                                 | POLLER_EVENT_ERROR | POLLER_EVENT_HUP)) {
+        conn.reset();
+    }
+    if (!conn) {
+        lk.unlock();
+        fail_later(response, HttpResponseStatus::kHttpResponseBadGateway);
+        return false;
+    }
+    conns_[conn.get()] = conn;
+    add_request(conn, response, handle);
+    return true;
+}
+
+bool
+FcgiClient::send(const FcgiRequestHandle& handle, const std::string& records)
+{
+    FcgiConnection* conn = handle.conn.get();
+    {
+        utils::Lock lk(conn->write_mutex);
+        if (!send_all(conn->fd, records.data(), records.size())) {
+            LOG(WARNING, "cannot send to fastcgi backend %s: %s",
+                backend_.c_str(), strerror(errno));
+            // the poller thread sees it closed and fails its requests
+            ::shutdown(conn->fd, SHUT_RDWR);
+            return false;
+        }
+    }
+    // a long request body doesn't count against the backend
+    utils::Lock lk(mutex_);
+    FcgiConnection::PendingMap::iterator it =
+        conn->requests.find(handle.request_id);
+    if (it != conn->requests.end())
+        it->second.last_active = time(NULL);
+    return true;
+}
+
+void
+FcgiClient::send_abort(const FcgiConnectionPtr& conn, u16 request_id)
+{
+    std::string record;
+    fcgi_append_record(record, kFcgiAbortRequest, request_id, NULL, 0);
+    utils::Lock lk(conn->write_mutex);
+    if (!send_all(conn->fd, record.data(), record.size()))
+        ::shutdown(conn->fd, SHUT_RDWR);
+}
+
+void
+FcgiClient::fail_later(const HttpAsyncResponsePtr& response,
+                       const HttpResponseStatus& status)
+{
+    {
+        utils::Lock lk(mutex_);
+        failures_.push_back(std::make_pair(response, status));
+    }
+    // a full pipe has a wake up pending already
+    char c = 0;
+    if (::write(wake_fds_[1], &c, 1) < 0 && errno != EAGAIN)
+        LOG(WARNING, "cannot wake the fastcgi poller up");
+}
+
+size_t
+FcgiClient::connection_count()
+{
+    utils::Lock lk(mutex_);
+    return conns_.size();
+}
+
+void
+FcgiClient::handle_failures()
+{
+    FailureList failures;
+    {
+        utils::Lock lk(mutex_);
+        failures.swap(failures_);
+    }
+    for (FailureList::iterator it = failures.begin(); it != failures.end();
+         ++it) {
+        it->first->respond(it->second);
+    }
+}
+
+void
+FcgiClient::handle_event(Connection* conn, PollerEvent evt)
+{
+    if (conn == wake_conn_) {
+        char buf[64];
+        while (::read(wake_fds_[0], buf, sizeof(buf)) > 0) {}
+        handle_failures();
+        return;
+    }
+    FcgiConnectionPtr fcgi_conn;
+    {
+        utils::Lock lk(mutex_);
+        ConnectionMap::iterator it = conns_.find(conn);
+        if (it == conns_.end())
+            return;
+        fcgi_conn = it->second;
+    }
+
+    bool closed = false;
+    char buf[16384];
+    while (true) {
+        ssize_t nread = ::recv(fcgi_conn->fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (nread > 0) {
+            fcgi_conn->parser.feed(buf, nread);
+            if ((size_t) nread < sizeof(buf))
+                break;
+            continue;
+        }
+        if (nread < 0 && errno == EINTR)
+            continue;
+        if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        closed = true;
+        break;
+    }
+    FcgiRecord record;
+    while (fcgi_conn->parser.next(record)) {
+        handle_record(fcgi_conn, record);
+    }
+    if (fcgi_conn->parser.is_malformed()) {
+        LOG(WARNING, "fastcgi backend %s sent a malformed record",
+            backend_.c_str());
+        closed = true;
+    }
+    if (closed)
+        close_connection(fcgi_conn);
+}
+
+void
+FcgiClient::handle_record(const FcgiConnectionPtr& conn,
+                          const FcgiRecord& record)
+{
+    switch (record.type) {
+    case kFcgiStdout:
+        handle_stdout(conn, record);
+        break;
+    case kFcgiStderr:
+        if (!record.content.empty()) {
+            LOG(WARNING, "fastcgi %s: %.*s", backend_.c_str(),
+                (int) record.content.size(), record.content.data());
+        }
+        break;
+    case kFcgiEndRequest:
+    {
+        FcgiConnection::Pending pending;
+        {
+            utils::Lock lk(mutex_);
+            FcgiConnection::PendingMap::iterator it =
+                conn->requests.find(record.request_id);
+            if (it == conn->requests.end())
+                break;
+            uncongest(conn, it->second);
+            pending = it->second;
+            conn->requests.erase(it);
+            pending.response->set_drain_handler(
+                HttpAsyncResponse::DrainHandler());
+        }
+        int protocol_status = record.content.size() > 4
+            ? (byte) record.content[4] : kFcgiRequestComplete;
+        if (pending.head_done) {
+            // ends the body streamed so far
+            pending.response->respond(HttpResponseStatus::kHttpResponseOK);
+        } else if (protocol_status != kFcgiRequestComplete) {
+            // overloaded, or can't take that many requests at a time
+            pending.response->respond(
+                HttpResponseStatus::kHttpResponseServiceUnavailable);
+        } else {
+            pending.response->fail();
+        }
+        break;
+    }
+    default:
+        LOG(DEBUG, "fastcgi record of type %d ignored", record.type);
+        break;
+    }
+}
+
+// headers describing the connection to the backend only
+static bool
+is_connection_header(const std::string& key)
+{
+    return utils::ignore_compare(key, "connection")
+        || utils::ignore_compare(key, "keep-alive")
+        || utils::ignore_compare(key, "transfer-encoding");
+}
+
+void
+FcgiClient::handle_stdout(const FcgiConnectionPtr& conn,
+                          const FcgiRecord& record)
+{
+    if (record.content.empty())
+        return;
+    HttpAsyncResponsePtr response;
+    std::string body;
+    bool started = false, malformed = false;
+    int status_code = 200;
+    std::string reason;
+    HttpHeaderEnumerate headers;
+    {
+        utils::Lock lk(mutex_);
+        FcgiConnection::PendingMap::iterator it =
+            conn->requests.find(record.request_id);
+        if (it == conn->requests.end() || it->second.aborting)
+            return;
+        FcgiConnection::Pending& pending = it->second;
+        pending.last_active = time(NULL);
+        response = pending.response;
+        if (pending.head_done) {
+            body = record.content;
+        } else {
+            pending.head.append(record.content);
+            size_t length = fcgi_cgi_head_length(pending.head);
+            if (length == std::string::npos) {
+                if (pending.head.size() <= kMaxHeadSize)
+                    return;
+                malformed = true;
+            } else if (!fcgi_parse_cgi_head(pending.head.substr(0, length),
+                                            status_code, reason, headers)) {
+                malformed = true;
+            } else {
+                body = pending.head.substr(length);
+                pending.head_done = true;
+                started = true;
+            }
+            std::string().swap(pending.head);
+        }
+        // the backend is told to stop, its END_REQUEST frees the id
+        if (malformed || response->is_aborted())
+            pending.aborting = true;
+    }
+    if (malformed) {
+        LOG(WARNING, "fastcgi backend %s sent a malformed CGI head",
+            backend_.c_str());
+        send_abort(conn, record.request_id);
+        response->fail();
+        return;
+    }
+    if (response->is_aborted()) {
+        send_abort(conn, record.request_id);
+        return;
+    }
+    if (started) {
+        for (size_t i = 0; i < headers.size(); i++) {
+            if (!is_connection_header(headers[i].key))
+                response->add_header(headers[i].key, headers[i].value);
+        }
+        response->begin_streaming(HttpResponseStatus(status_code, reason));
+    }
+    if (!body.empty()) {
+        response->write_data((const byte*) body.data(), body.size());
+        pause_reading(conn, record.request_id);
+    }
+}
+
+// other requests on the connection wait as well, their records can't be
+// read past the congested one's
+void
+FcgiClient::pause_reading(const FcgiConnectionPtr& conn, u16 request_id)
+{
+    utils::Lock lk(mutex_);
+    FcgiConnection::PendingMap::iterator it = conn->requests.find(request_id);
+    if (it == conn->requests.end() || it->second.congested
+        || !it->second.response->is_congested())
+        return;
+    it->second.congested = true;
+    if (conn->ncongested++ == 0 && !conn->closed)
+        poller_->remove_fd(conn->fd);
+}
+
+// called by the response once its client caught up
+void
+FcgiClient::resume_reading(const FcgiConnectionWeakPtr& weak_conn,
+                           u16 request_id)
+{
+    FcgiConnectionPtr conn = weak_conn.lock();
+    if (!conn)
+        return;
+    utils::Lock lk(mutex_);
+    FcgiConnection::PendingMap::iterator it = conn->requests.find(request_id);
+    if (it != conn->requests.end())
+        uncongest(conn, it->second);
+}
+
+void
+FcgiClient::uncongest(const FcgiConnectionPtr& conn,
+                      FcgiConnection::Pending& pending)
+{
+    if (!pending.congested)
+        return;
+    pending.congested = false;
+    if (--conn->ncongested > 0 || conn->closed)
+        return;
+    // the timeouts start over, nothing was read meanwhile
+    time_t now = time(NULL);
+    for (FcgiConnection::PendingMap::iterator it = conn->requests.begin();
+         it != conn->requests.end(); ++it) {
+        it->second.last_active = now;
+    }
+    poller_->add_fd(conn->fd, conn.get(), POLLER_EVENT_READ
+                    | POLLER_EVENT_ERROR | POLLER_EVENT_HUP);
+}
+
+void
+FcgiClient::close_connection(const FcgiConnectionPtr& conn)
+{
+    FcgiConnection::PendingMap requests;
+    {
+        utils::Lock lk(mutex_);
+        if (conn->closed)
+            return;
+        conn->closed = true;
+        conns_.erase(conn.get());
+        poller_->remove_fd(conn->fd);
+        requests.swap(conn->requests);
+    }
+    if (!requests.empty()) {
+        LOG(WARNING, "fastcgi backend %s closed a connection with %lu "
+            "requests", backend_.c_str(), requests.size());
+    }
+    for (FcgiConnection::PendingMap::iterator it = requests.begin();
+         it != requests.end(); ++it) {
+        it->second.response->fail();
+    }
+}
+
+void
+FcgiClient::scan_timeouts(Poller& poller)
+{
+    time_t now = time(NULL);
+    if (io_timeout_ <= 0 || now == last_scan_)
+        return;
+    last_scan_ = now;
+
+    typedef std::list<std::pair<FcgiConnectionPtr, u16> > ExpiredList;
+    ExpiredList expired;
+    std::list<FcgiConnection::Pending> timed_out;
+    {
+        utils::Lock lk(mutex_);
+        for (ConnectionMap::iterator conn = conns_.begin();
+             conn != conns_.end(); ++conn) {
+            // nothing is read meanwhile, it waits for a client
+            if (conn->second->ncongested > 0)
+                continue;
+            FcgiConnection::PendingMap& requests = conn->second->requests;
+            FcgiConnection::PendingMap::iterator it = requests.begin();
+            while (it != requests.end()) {
+                FcgiConnection::Pending& pending = it->second;
+                if ((now - pending.last_active) * 1000 < io_timeout_) {
+                    ++it;
+                    continue;
+                }
+                if (pending.aborting) {
+                    // the backend ignored the abort, its id is given up
+                    requests.erase(it++);
+                    continue;
+                }
+                pending.aborting = true;
+                pending.last_active = now;
+                expired.push_back(std::make_pair(conn->second, it->first));
+                timed_out.push_back(pending);
+                ++it;
+            }
+        }
+    }
+    for (ExpiredList::iterator it = expired.begin(); it != expired.end();
+         ++it) {
+        send_abort(it->first, it->second);
+    }
+    for (std::list<FcgiConnection::Pending>::iterator it = timed_out.begin();
+         it != timed_out.end(); ++it) {
+        if (it->head_done) {
+            it->response->fail();
+        } else {
+            it->response->respond(
+                HttpResponseStatus::kHttpResponseGatewayTimeout);
+        }
+    }
+}
+
+}
@@ -0,0 +1,216 @@
+// -*- mode: c++ -*-
+
+#ifndef _FASTCGI_H_
+#define _FASTCGI_H_
+
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <sys/socket.h>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+
+#include "utils/misc.h"
+#include "core/pipeline.h"
+#include "core/poller.h"
+#include "http/http_wrapper.h"
+
+namespace tube {
+
+// record types of the FastCGI protocol, version 1
+enum FcgiRecordType {
+    kFcgiBeginRequest = 1,
+    kFcgiAbortRequest = 2,
+    kFcgiEndRequest = 3,
+    kFcgiParams = 4,
+    kFcgiStdin = 5,
+    kFcgiStdout = 6,
+    kFcgiStderr = 7
+};
+
+static const int    kFcgiVersion = 1;
+static const int    kFcgiResponder = 1;
+static const int    kFcgiKeepConn = 1;
+static const size_t kFcgiHeaderLength = 8;
+static const size_t kFcgiMaxContentLength = 65535;
+
+struct FcgiRecord
+{
+    int         type;
+    u16         request_id;
+    std::string content;
+
+    FcgiRecord() : type(0), request_id(0) {}
+};
+
+typedef std::vector<std::pair<std::string, std::string> > FcgiParams;
+
+// longer contents are split over several records, an empty one ends the
+// stream of that type
+void fcgi_append_record(std::string& out, int type, u16 request_id,
+                        const char* ptr, size_t size);
+void fcgi_append_begin_request(std::string& out, u16 request_id);
+void fcgi_append_param(std::string& out, const std::string& name,
+                       const std::string& value);
+// false if content isn't made of whole name value pairs
+bool fcgi_parse_params(const std::string& content, FcgiParams& params);
+
+// where the CGI header block at the start of a stdout stream ends, with the
+// blank line.  npos if it hasn't all arrived.
+size_t fcgi_cgi_head_length(const std::string& data);
+// status from the Status header, 302 for a bare Location, 200 otherwise.
+// false on a malformed line.
+bool fcgi_parse_cgi_head(const std::string& head, int& status_code,
+                         std::string& reason, HttpHeaderEnumerate& headers);
+
+// Splits what comes in from a connection into records, whichever request
+// they belong to.
+class FcgiRecordParser : utils::Noncopyable
+{
+public:
+    FcgiRecordParser() : pos_(0), malformed_(false) {}
+
+    void feed(const char* ptr, size_t size);
+    // false until a whole record has arrived, or once is_malformed()
+    bool next(FcgiRecord& record);
+    bool is_malformed() const { return malformed_; }
+private:
+    std::string buf_;
+    size_t      pos_;
+    bool        malformed_;
+};
+
+// a connection to the backend carrying several requests at a time
+struct FcgiConnection : public Connection
+{
+    struct Pending
+    {
+        HttpAsyncResponsePtr response;
+        std::string          head; // the CGI headers, until all arrived
+        bool                 head_done;
+        bool                 aborting;
+        bool                 congested; // the client is behind
+        time_t               last_active;
+
+        Pending()
+            : head_done(false), aborting(false), congested(false),
+              last_active(0) {}
+    };
+    typedef std::map<u16, Pending> PendingMap;
+
+    utils::Mutex     write_mutex; // records of a request go out whole
+    FcgiRecordParser parser; // the poller thread's only
+    PendingMap       requests;
+    u16              next_id;
+    bool             closed;
+    size_t           ncongested; // not read from while any
+
+    explicit FcgiConnection(int sock)
+        : Connection(sock), next_id(0), closed(false), ncongested(0) {}
+    virtual ~FcgiConnection();
+};
+
+typedef boost::shared_ptr<FcgiConnection> FcgiConnectionPtr;
+typedef boost::weak_ptr<FcgiConnection> FcgiConnectionWeakPtr;
+
+struct FcgiRequestHandle
+{
+    FcgiConnectionPtr conn;
+    u16               request_id;
+
+    FcgiRequestHandle() : request_id(0) {}
+};
+
+// FastCGI over a few kept alive connections to one backend, up to
+// multiplex requests on each.  What the backend answers is read by a
+// poller thread of its own and streamed to the async responses, so no
+// handler thread waits for it.  A connection isn't read from while the
+// client of one of its requests is too far behind.  The async responses
+// are only ever answered from that thread, never from the one sending the
+// request.  Freeing a started client joins its thread; what is still
+// pending on it is dropped.
+class FcgiClient : utils::Noncopyable
+{
+public:
+    // a CGI header block beyond that is taken as malformed
+    static const size_t kMaxHeadSize = 65536;
+
+    FcgiClient();
+    ~FcgiClient();
+
+    // "unix:/path/to/socket" or "host:port"
+    bool set_backend(const std::string& backend);
+    void set_max_connections(size_t max_connections) {
+        max_connections_ = max_connections;
+    }
+    // php-fpm takes a single request per connection
+    void set_multiplex(size_t multiplex) { multiplex_ = multiplex; }
+    // for sending, and for waiting between two records of an answer
+    void set_io_timeout(int msec) { io_timeout_ = msec; }
+
+    bool start();
+    bool is_started() const { return thread_ != NULL; }
+    // joins the poller thread, nothing is read from the backend after
+    void stop();
+
+    // a request id on a connection with room for response.  false if
+    // there is none, response is answered with 503 or 502 shortly then.
+    bool open_request(const HttpAsyncResponsePtr& response,
+                      FcgiRequestHandle& handle);
+    // the records of the request, in order.  false if the connection
+    // broke, every request on it fails shortly then.
+    bool send(const FcgiRequestHandle& handle, const std::string& records);
+
+    size_t connection_count();
+    u64    request_count() const { return request_count_.value(); }
+private:
+    typedef std::map<Connection*, FcgiConnectionPtr> ConnectionMap;
+    typedef std::list<std::pair<HttpAsyncResponsePtr, HttpResponseStatus> >
+    FailureList;
+
+    utils::Mutex  mutex_;
+    ConnectionMap conns_;
+    FailureList   failures_; // to be answered by the poller thread
+
+    sockaddr_storage backend_addr_;
+    socklen_t        backend_addr_len_;
+    std::string      backend_;
+    size_t           max_connections_;
+    size_t           multiplex_;
+    int              io_timeout_;
+    size_t           connecting_;
+
+    Poller*        poller_;
+    utils::Thread* thread_;
+    int            wake_fds_[2];
+    Connection*    wake_conn_;
+    time_t         last_scan_;
+
+    utils::AtomicCounter request_count_;
+
+    FcgiConnectionPtr connect();
+    void add_request(const FcgiConnectionPtr& conn,
+                     const HttpAsyncResponsePtr& response,
+                     FcgiRequestHandle& handle);
+    void fail_later(const HttpAsyncResponsePtr& response,
+                    const HttpResponseStatus& status);
+    void poll();
+    void handle_event(Connection* conn, PollerEvent evt);
+    void handle_failures();
+    void handle_record(const FcgiConnectionPtr& conn,
+                       const FcgiRecord& record);
+    void handle_stdout(const FcgiConnectionPtr& conn,
+                       const FcgiRecord& record);
+    void close_connection(const FcgiConnectionPtr& conn);
+    void pause_reading(const FcgiConnectionPtr& conn, u16 request_id);
+    void resume_reading(const FcgiConnectionWeakPtr& conn, u16 request_id);
+    void uncongest(const FcgiConnectionPtr& conn,
+                   FcgiConnection::Pending& pending);
+    void scan_timeouts(Poller& poller);
+    void send_abort(const FcgiConnectionPtr& conn, u16 request_id);
+};
+
+}
+
+#endif /* _FASTCGI_H_ */
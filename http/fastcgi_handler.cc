@@ -0,0 +1,204 @@
+#include "pch.h"
+
+#include <cstdlib>
+#include <cctype>
+#include <sstream>
+
+#include "http/fastcgi_handler.h"
+#include "utils/logger.h"
+#include "module.h"
+
+namespace tube {
+
+static void
+respond_error(const HttpResponseStatus& error, HttpRequest& request,
+              HttpResponse& response)
+{
+    LOG(WARNING, "%d with %s", error.status_code, request.uri().c_str());
+    std::string body = error.reason + "\n";
+    response.add_header("Content-Type", "text/plain");
+    response.write_data((const byte*) body.c_str(), body.length());
+    response.respond(error);
+}
+
+// a ".." segment would leave doc_root
+static bool
+has_dot_segment(const std::string& path)
+{
+    size_t pos = 0;
+    while ((pos = path.find("..", pos)) != std::string::npos) {
+        if ((pos == 0 || path[pos - 1] == '/')
+            && (pos + 2 == path.length() || path[pos + 2] == '/'))
+            return true;
+        pos += 2;
+    }
+    return false;
+}
+
+static std::string
+to_string(u64 value)
+{
+    std::stringstream ss;
+    ss << value;
+    return ss.str();
+}
+
+FastCgiHttpHandler::FastCgiHttpHandler()
+{
+    add_option("backend", "unix:/var/run/php-fpm.sock");
+    add_option("doc_root", "/var/www");
+    add_option("max_connections", "8");
+    add_option("multiplex", "1");
+    add_option("read_timeout", "30000");
+}
+
+void
+FastCgiHttpHandler::load_param()
+{
+    doc_root_ = option("doc_root");
+    int max_connections = atoi(option("max_connections").c_str());
+    int multiplex = atoi(option("multiplex").c_str());
+    client_.set_max_connections(max_connections > 0 ? max_connections : 1);
+    client_.set_multiplex(multiplex > 0 ? (multiplex < 65535 ? multiplex
+                                           : 65535) : 1);
+    client_.set_io_timeout(atoi(option("read_timeout").c_str()));
+    if (!client_.set_backend(option("backend")) || !client_.start()) {
+        LOG(ERROR, "fastcgi handler %s has no usable backend",
+            this->name().c_str());
+    }
+}
+
+void
+FastCgiHttpHandler::shutdown()
+{
+    client_.stop();
+}
+
+std::string
+FastCgiHttpHandler::build_params(HttpRequest& request,
+                                 const std::string& script) const
+{
+    std::string params;
+    fcgi_append_param(params, "GATEWAY_INTERFACE", "CGI/1.1");
+    fcgi_append_param(params, "SERVER_SOFTWARE", "tube");
+    fcgi_append_param(params, "SERVER_PROTOCOL",
+                      "HTTP/" + to_string(request.version_major()) + "."
+                      + to_string(request.version_minor()));
+    fcgi_append_param(params, "REQUEST_METHOD", request.method_string());
+    fcgi_append_param(params, "REQUEST_URI", request.uri());
+    fcgi_append_param(params, "QUERY_STRING", request.query_string());
+    fcgi_append_param(params, "DOCUMENT_ROOT", doc_root_);
+    fcgi_append_param(params, "SCRIPT_NAME", script);
+    fcgi_append_param(params, "SCRIPT_FILENAME", doc_root_ + script);
+    fcgi_append_param(params, "REMOTE_ADDR",
+                      request.connection()->address_string());
+    fcgi_append_param(params, "CONTENT_LENGTH",
+                      request.content_length() > 0
+                      ? to_string(request.content_length()) : "");
+
+    const HttpHeaderEnumerate& headers = request.headers();
+    for (size_t i = 0; i < headers.size(); i++) {
+        const HttpHeaderItem& item = headers[i];
+        if (utils::ignore_compare(item.key, "content-type")) {
+            fcgi_append_param(params, "CONTENT_TYPE", item.value);
+            continue;
+        }
+        // given above already; Proxy would become HTTP_PROXY, which CGI
+        // libraries take for their own proxy setting
+        if (utils::ignore_compare(item.key, "content-length")
+            || utils::ignore_compare(item.key, "proxy"))
+            continue;
+        if (utils::ignore_compare(item.key, "host")) {
+            fcgi_append_param(params, "SERVER_NAME",
+                              item.value.substr(0, item.value.find(':')));
+        }
+        std::string name = "HTTP_";
+        for (size_t j = 0; j < item.key.length(); j++) {
+            char c = item.key[j];
+            name.push_back(c == '-' ? '_' : toupper(c));
+        }
+        fcgi_append_param(params, name, item.value);
+    }
+    return params;
+}
+
+void
+FastCgiHttpHandler::handle_request(HttpRequest& request,
+                                   HttpResponse& response)
+{
+    if (!client_.is_started()) {
+        respond_error(HttpResponseStatus::kHttpResponseBadGateway, request,
+                      response);
+        return;
+    }
+    if (request.transfer_encoding() == HTTP_CHUNKED) {
+        // CONTENT_LENGTH has to be known up front
+        respond_error(HttpResponseStatus::kHttpResponseLengthRequired,
+                      request, response);
+        return;
+    }
+    std::string script = HttpRequest::url_decode(request.path());
+    if (has_dot_segment(script)) {
+        respond_error(HttpResponseStatus::kHttpResponseBadRequest, request,
+                      response);
+        return;
+    }
+    HttpAsyncResponsePtr async_response = response.suspend();
+    if (!async_response)
+        return;
+    // from here on the client's poller thread answers, whatever happens
+    FcgiRequestHandle handle;
+    if (!client_.open_request(async_response, handle))
+        return;
+
+    u16 id = handle.request_id;
+    std::string records;
+    std::string params = build_params(request, script);
+    fcgi_append_begin_request(records, id);
+    fcgi_append_record(records, kFcgiParams, id, params.data(),
+                       params.size());
+    fcgi_append_record(records, kFcgiParams, id, NULL, 0);
+
+    byte buf[kBufferSize];
+    u64 remaining = request.content_length();
+    while (remaining > 0) {
+        ssize_t nread = request.read_data(
+            buf, remaining < kBufferSize ? remaining : kBufferSize);
+        if (nread <= 0) {
+            // the client is gone, so is the rest of the body
+            request.connection()->close_after_finish = true;
+            fcgi_append_record(records, kFcgiAbortRequest, id, NULL, 0);
+            client_.send(handle, records);
+            return;
+        }
+        fcgi_append_record(records, kFcgiStdin, id, (const char*) buf,
+                           nread);
+        if (!client_.send(handle, records))
+            return;
+        records.clear();
+        remaining -= nread;
+    }
+    fcgi_append_record(records, kFcgiStdin, id, NULL, 0);
+    client_.send(handle, records);
+}
+
+static void
+fastcgi_handler_module_init()
+{
+    static FastCgiHttpHandlerFactory fastcgi_handler_factory;
+    BaseHttpHandlerFactory::register_factory(&fastcgi_handler_factory);
+}
+
+static struct FastCgiHandlerModule : public Module
+{
+    FastCgiHandlerModule() {
+        this->on_initialize = fastcgi_handler_module_init;
+        this->name = "fastcgi_handler";
+        this->vendor = "tube server";
+        this->description = "FastCGI client handler";
+    }
+} fastcgi_handler_module;
+
+EXPORT_MODULE_STATIC(fastcgi_handler_module);
+
+}
@@ -0,0 +1,52 @@
+// -*- mode: c++ -*-
+
+#ifndef _FASTCGI_HANDLER_H_
+#define _FASTCGI_HANDLER_H_
+
+#include <string>
+
+#include "http/http_wrapper.h"
+#include "http/interface.h"
+#include "http/fastcgi.h"
+
+namespace tube {
+
+// Passes requests to a FastCGI responder, e.g. php-fpm, as the script
+// under doc_root the path names.  The handler thread only sends the
+// request, reading a content-length body from the client as it goes; the
+// answer is streamed to the client from the client's poller thread.
+class FastCgiHttpHandler : public BaseHttpHandler
+{
+    FcgiClient  client_;
+    std::string doc_root_;
+public:
+    static const size_t kBufferSize = 16384;
+
+    FastCgiHttpHandler();
+    virtual void load_param();
+    virtual void handle_request(HttpRequest& request, HttpResponse& response);
+    virtual void shutdown();
+
+    FcgiClient& client() { return client_; }
+private:
+    std::string build_params(HttpRequest& request,
+                             const std::string& script) const;
+};
+
+class FastCgiHttpHandlerFactory : public BaseHttpHandlerFactory
+{
+public:
+    virtual BaseHttpHandler* create() const {
+        return new FastCgiHttpHandler();
+    }
+    virtual std::string module_name() const {
+        return std::string("fastcgi");
+    }
+    virtual std::string vender_name() const {
+        return std::string("tube");
+    }
+};
+
+}
+
+#endif /* _FASTCGI_HANDLER_H_ */
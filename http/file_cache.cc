@@ -0,0 +1,522 @@
+#include "pch.h"
+
+#include "config.h"
+
+#include <errno.h>
+#include <boost/functional/hash.hpp>
+
+#ifdef USE_INOTIFY
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+
+#include "http/file_cache.h"
+#include "http/http_date.h"
+#include "utils/logger.h"
+
+namespace tube {
+
+static void
+append_hex(std::string& str, u64 value)
+{
+    char buf[16];
+    int n = 0;
+    do {
+        buf[n++] = "0123456789abcdef"[value & 0x0F];
+        value >>= 4;
+    } while (value > 0);
+    while (n > 0) {
+        str += buf[--n];
+    }
+}
+
+// strong validator, any change of the content shows up in one of these
+static std::string
+build_etag(const struct stat64& buf)
+{
+    std::string etag;
+    etag.reserve(40);
+    etag += '"';
+    append_hex(etag, buf.st_ino);
+    etag += '-';
+    append_hex(etag, buf.st_size);
+    etag += '-';
+    append_hex(etag, buf.st_mtime);
+    etag += '"';
+    return etag;
+}
+
+OpenFileInfo::OpenFileInfo(const std::string& file_path,
+                           const struct stat64& buf)
+    : path(file_path), stat(buf)
+{
+    // computed once per entry, not per response
+    etag = build_etag(stat);
+    last_modified = format_http_date(stat.st_mtime);
+}
+
+static bool
+same_file(const struct stat64& p, const struct stat64& q)
+{
+    return p.st_ino == q.st_ino && p.st_dev == q.st_dev
+        && p.st_size == q.st_size && p.st_mtime == q.st_mtime
+        && p.st_ctime == q.st_ctime;
+}
+
+#ifdef USE_INOTIFY
+
+static bool
+directory_of(const std::string& path, std::string* dir)
+{
+    size_t pos = path.rfind('/');
+    if (pos == std::string::npos)
+        return false;
+    *dir = path.substr(0, pos);
+    return true;
+}
+
+// Watches the directories of cached files and drops the entries of whatever
+// changes in there.  A directory is watched as long as one of its files is
+// cached.
+class InotifyWatcher : utils::Noncopyable
+{
+    struct WatchedDir
+    {
+        int    wd; // -1 if the watch could not be added
+        size_t nentry;
+    };
+
+    typedef boost::unordered_map<int, std::string> WatchMap;
+    typedef boost::unordered_map<std::string, WatchedDir> DirMap;
+
+    OpenFileCache*        cache_;
+    int                   fd_;
+    volatile bool         running_;
+    utils::Mutex          mutex_;
+    WatchMap              watch_dirs_;
+    DirMap                watched_;
+    utils::Thread*        thread_;
+public:
+    explicit InotifyWatcher(OpenFileCache* cache);
+    ~InotifyWatcher();
+
+    bool start();
+    // a file of path's directory is cached, or no longer is
+    void watch(const std::string& path);
+    void release(const std::string& path);
+    size_t watch_count();
+private:
+    void main_loop();
+    void handle_event(const struct inotify_event* event);
+};
+
+InotifyWatcher::InotifyWatcher(OpenFileCache* cache)
+    : cache_(cache), fd_(-1), running_(false), thread_(NULL)
+{
+}
+
+InotifyWatcher::~InotifyWatcher()
+{
+    running_ = false;
+    if (thread_) {
+        thread_->join();
+        delete thread_;
+    }
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+}
+
+bool
+InotifyWatcher::start()
+{
+    fd_ = inotify_init();
+    if (fd_ < 0) {
+        LOG(WARNING, "inotify unavailable, relying on revalidation only");
+        return false;
+    }
+    running_ = true;
+    thread_ = new utils::Thread(boost::bind(&InotifyWatcher::main_loop, this));
+    return true;
+}
+
+void
+InotifyWatcher::watch(const std::string& path)
+{
+    std::string dir;
+    if (!directory_of(path, &dir))
+        return;
+    utils::Lock lk(mutex_);
+    DirMap::iterator it = watched_.find(dir);
+    if (it != watched_.end()) {
+        it->second.nentry++;
+        return;
+    }
+    int wd = inotify_add_watch(fd_, dir.empty() ? "/" : dir.c_str(),
+                               IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE
+                               | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF
+                               | IN_MOVE_SELF | IN_ONLYDIR);
+    if (wd < 0) {
+        // most likely out of watches, entries still expire on their own.
+        // tried again once the directory has no entry left.
+        LOG(WARNING, "cannot watch %s", dir.c_str());
+    } else {
+        watch_dirs_[wd] = dir;
+    }
+    WatchedDir& watched = watched_[dir];
+    watched.wd = wd;
+    watched.nentry = 1;
+}
+
+void
+InotifyWatcher::release(const std::string& path)
+{
+    std::string dir;
+    if (!directory_of(path, &dir))
+        return;
+    utils::Lock lk(mutex_);
+    DirMap::iterator it = watched_.find(dir);
+    // gone already if the directory itself went away
+    if (it == watched_.end() || --it->second.nentry > 0)
+        return;
+    int wd = it->second.wd;
+    if (wd >= 0) {
+        inotify_rm_watch(fd_, wd);
+        watch_dirs_.erase(wd);
+    }
+    watched_.erase(it);
+}
+
+size_t
+InotifyWatcher::watch_count()
+{
+    utils::Lock lk(mutex_);
+    return watch_dirs_.size();
+}
+
+void
+InotifyWatcher::handle_event(const struct inotify_event* event)
+{
+    if (event->mask & IN_Q_OVERFLOW) {
+        cache_->clear();
+        return;
+    }
+    utils::Lock lk(mutex_);
+    WatchMap::iterator it = watch_dirs_.find(event->wd);
+    // removed by release() if its events were still queued
+    if (it == watch_dirs_.end())
+        return;
+    std::string dir = it->second;
+    if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+        // the directory itself went away, so did the watch
+        watched_.erase(dir);
+        watch_dirs_.erase(it);
+        lk.unlock();
+        cache_->invalidate_directory(dir);
+        return;
+    }
+    lk.unlock();
+    if (event->len > 0) {
+        cache_->invalidate(dir + "/" + event->name);
+    }
+}
+
+void
+InotifyWatcher::main_loop()
+{
+    char buf[4096]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd;
+    pfd.fd = fd_;
+    pfd.events = POLLIN;
+    while (running_) {
+        // wake up every now and then to see whether we should quit
+        if (poll(&pfd, 1, 1000) <= 0)
+            continue;
+        ssize_t len = ::read(fd_, buf, sizeof(buf));
+        if (len <= 0) {
+            if (len < 0 && errno != EINTR && errno != EAGAIN) {
+                LOG(ERROR, "error reading inotify events");
+                break;
+            }
+            continue;
+        }
+        char* ptr = buf;
+        while (ptr < buf + len) {
+            const struct inotify_event* event =
+                (const struct inotify_event*) ptr;
+            handle_event(event);
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+#else
+
+class InotifyWatcher
+{
+public:
+    void watch(const std::string& path) {}
+    void release(const std::string& path) {}
+    size_t watch_count() { return 0; }
+};
+
+#endif
+
+const size_t OpenFileCache::kShardCount = 16;
+
+OpenFileCache::OpenFileCache()
+    : max_entry_(0), max_shard_entry_(0), valid_time_(5), watcher_(NULL),
+      mime_types_(NULL)
+{
+    shards_ = new Shard[kShardCount];
+}
+
+OpenFileCache::~OpenFileCache()
+{
+    delete watcher_; // joins the watcher thread before the shards go away
+    delete [] shards_;
+}
+
+void
+OpenFileCache::set_max_entry(size_t nentry)
+{
+    clear();
+    max_entry_ = nentry;
+    max_shard_entry_ = (nentry + kShardCount - 1) / kShardCount;
+#ifdef USE_INOTIFY
+    if (max_entry_ > 0 && watcher_ == NULL) {
+        watcher_ = new InotifyWatcher(this);
+        if (!watcher_->start()) {
+            delete watcher_;
+            watcher_ = NULL;
+        }
+    }
+#endif
+}
+
+OpenFileCache::Shard&
+OpenFileCache::shard_of(const std::string& path)
+{
+    boost::hash<std::string> hasher;
+    return shards_[hasher(path) % kShardCount];
+}
+
+void
+OpenFileCache::remove_entry(Shard& shard, EntryMap::iterator map_it)
+{
+    // senders still holding the descriptor keep it open
+    if (watcher_) {
+        watcher_->release(map_it->first);
+    }
+    shard.entries.erase(map_it->second);
+    shard.entry_map.erase(map_it);
+}
+
+OpenFileInfo*
+OpenFileCache::new_info(const std::string& path, const struct stat64& buf)
+{
+    OpenFileInfo* info = new OpenFileInfo(path, buf);
+    if (mime_types_ && S_ISREG(buf.st_mode)) {
+        info->content_type = mime_types_->lookup_path(path);
+    }
+    return info;
+}
+
+OpenFileInfoPtr
+OpenFileCache::create_info(const std::string& path, const struct stat64& buf)
+{
+    int file_desc = ::open(path.c_str(), O_RDONLY);
+    if (file_desc < 0) {
+        // exists but cannot be opened
+        return OpenFileInfoPtr(new_info(path, buf));
+    }
+    // the file may have been replaced after the stat
+    struct stat64 fd_buf;
+    if (fstat64(file_desc, &fd_buf) < 0) {
+        fd_buf = buf;
+    }
+    OpenFileInfo* info = new_info(path, fd_buf);
+    info->handle.reset(new FileHandle(file_desc));
+    return OpenFileInfoPtr(info);
+}
+
+void
+OpenFileCache::insert(const std::string& path, const OpenFileInfoPtr& info,
+                      time_t now)
+{
+    // before an entry replaced releases the directory, which then stays
+    // watched
+    if (watcher_) {
+        watcher_->watch(path);
+    }
+    Shard& shard = shard_of(path);
+    utils::Lock lk(shard.mutex);
+    EntryMap::iterator it = shard.entry_map.find(path);
+    if (it != shard.entry_map.end()) {
+        remove_entry(shard, it);
+    }
+    while (!shard.entries.empty()
+           && shard.entries.size() >= max_shard_entry_) {
+        remove_entry(shard,
+                     shard.entry_map.find(shard.entries.back().info->path));
+    }
+    Entry entry;
+    entry.info = info;
+    entry.validated = now;
+    shard.entries.push_front(entry);
+    shard.entry_map.insert(std::make_pair(path, shard.entries.begin()));
+}
+
+OpenFileInfoPtr
+OpenFileCache::open_file(const std::string& path, int* err)
+{
+    OpenFileInfoPtr info = stat_file(path, err);
+    if (!info)
+        return info;
+    return open_info(info);
+}
+
+OpenFileInfoPtr
+OpenFileCache::stat_file(const std::string& path, int* err, bool* cached)
+{
+    struct stat64 buf;
+    time_t now = time(NULL);
+
+    if (cached) {
+        *cached = false;
+    }
+    if (enabled()) {
+        Shard& shard = shard_of(path);
+        utils::Lock lk(shard.mutex);
+        EntryMap::iterator it = shard.entry_map.find(path);
+        if (it != shard.entry_map.end()) {
+            Entry& entry = *(it->second);
+            OpenFileInfoPtr info = entry.info;
+            if (now - entry.validated < valid_time_) {
+                shard.entries.splice(shard.entries.begin(), shard.entries,
+                                     it->second);
+                lk.unlock();
+                hits_.increment();
+                if (cached) {
+                    *cached = true;
+                }
+                return info;
+            }
+            lk.unlock();
+            revalidations_.increment();
+            if (::stat64(path.c_str(), &buf) < 0) {
+                *err = errno;
+                invalidate(path);
+                return OpenFileInfoPtr();
+            }
+            if (same_file(buf, info->stat)) {
+                lk.lock();
+                it = shard.entry_map.find(path);
+                if (it != shard.entry_map.end()
+                    && it->second->info == info) {
+                    it->second->validated = now;
+                }
+                return info;
+            }
+            invalidate(path);
+            goto load;
+        }
+    }
+
+    if (::stat64(path.c_str(), &buf) < 0) {
+        *err = errno;
+        return OpenFileInfoPtr();
+    }
+load:
+    misses_.increment();
+    OpenFileInfoPtr info(new_info(path, buf));
+    if (enabled() && S_ISREG(buf.st_mode)) {
+        // opened on the first open_info
+        insert(path, info, now);
+    }
+    return info;
+}
+
+OpenFileInfoPtr
+OpenFileCache::open_info(const OpenFileInfoPtr& info)
+{
+    if (info->handle || !S_ISREG(info->stat.st_mode))
+        return info;
+    OpenFileInfoPtr opened = create_info(info->path, info->stat);
+    if (enabled() && opened->handle) {
+        insert(info->path, opened, time(NULL));
+    }
+    return opened;
+}
+
+bool
+OpenFileCache::is_fresh(const std::string& path)
+{
+    if (!enabled())
+        return false;
+    Shard& shard = shard_of(path);
+    utils::Lock lk(shard.mutex);
+    EntryMap::iterator it = shard.entry_map.find(path);
+    return it != shard.entry_map.end()
+        && time(NULL) - it->second->validated < valid_time_;
+}
+
+void
+OpenFileCache::invalidate(const std::string& path)
+{
+    Shard& shard = shard_of(path);
+    utils::Lock lk(shard.mutex);
+    EntryMap::iterator it = shard.entry_map.find(path);
+    if (it != shard.entry_map.end()) {
+        remove_entry(shard, it);
+    }
+}
+
+void
+OpenFileCache::invalidate_directory(const std::string& dir)
+{
+    std::string prefix = dir + "/";
+    for (size_t i = 0; i < kShardCount; i++) {
+        utils::Lock lk(shards_[i].mutex);
+        EntryList& entries = shards_[i].entries;
+        EntryList::iterator it = entries.begin();
+        while (it != entries.end()) {
+            const std::string& path = it->info->path;
+            if (path.compare(0, prefix.length(), prefix) == 0) {
+                if (watcher_) {
+                    watcher_->release(path);
+                }
+                shards_[i].entry_map.erase(path);
+                it = entries.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+}
+
+void
+OpenFileCache::clear()
+{
+    for (size_t i = 0; i < kShardCount; i++) {
+        utils::Lock lk(shards_[i].mutex);
+        if (watcher_) {
+            EntryList& entries = shards_[i].entries;
+            for (EntryList::iterator it = entries.begin();
+                 it != entries.end(); ++it) {
+                watcher_->release(it->info->path);
+            }
+        }
+        shards_[i].entry_map.clear();
+        shards_[i].entries.clear();
+    }
+}
+
+size_t
+OpenFileCache::watch_count() const
+{
+    return watcher_ ? watcher_->watch_count() : 0;
+}
+
+}
@@ -0,0 +1,120 @@
+// -*- mode: c++ -*-
+
+#ifndef _FILE_CACHE_H_
+#define _FILE_CACHE_H_
+
+#include <string>
+#include <list>
+#include <ctime>
+#include <sys/stat.h>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+
+#include "utils/misc.h"
+#include "core/filesender.h"
+#include "http/mime_types.h"
+
+namespace tube {
+
+// What the static handler needs to know about a file before sending it.
+// Entries are never modified after creation, a changed file gets a new one.
+struct OpenFileInfo
+{
+    std::string   path;
+    FileHandlePtr handle; // NULL if the file cannot be opened
+    struct stat64 stat;
+    std::string   etag;
+    std::string   last_modified;
+    std::string   content_type; // empty without a MIME registry
+
+    OpenFileInfo(const std::string& file_path, const struct stat64& buf);
+};
+
+typedef boost::shared_ptr<const OpenFileInfo> OpenFileInfoPtr;
+
+class InotifyWatcher;
+
+// Caches the stat result and an open descriptor of regular files.  An entry
+// is trusted for valid_time seconds, after that a single stat tells whether
+// it can be kept.  Where inotify is available, a change to a cached file
+// drops its entry right away.
+class OpenFileCache : utils::Noncopyable
+{
+    struct Entry
+    {
+        OpenFileInfoPtr info;
+        time_t          validated;
+    };
+
+    typedef std::list<Entry> EntryList;
+    typedef boost::unordered_map<std::string, EntryList::iterator> EntryMap;
+
+    struct Shard
+    {
+        utils::Mutex mutex;
+        EntryList    entries;
+        EntryMap     entry_map;
+    };
+public:
+    static const size_t kShardCount;
+
+    OpenFileCache();
+    ~OpenFileCache();
+
+    // zero disables the cache, every lookup then hits the file system
+    void   set_max_entry(size_t nentry);
+    void   set_valid_time(int sec) { valid_time_ = sec; }
+    // types are looked up once per entry, registry must outlive the cache
+    void   set_mime_types(const MimeTypeRegistry* registry) {
+        mime_types_ = registry;
+    }
+    bool   enabled() const { return max_entry_ > 0; }
+
+    // returns NULL and sets err to errno when the path cannot be stat'ed.
+    // anything but a regular file is returned uncached and without a handle.
+    OpenFileInfoPtr open_file(const std::string& path, int* err);
+    // the same without opening a file missing from the cache, for callers
+    // that may never read it.  cached is set if no syscall was made.
+    OpenFileInfoPtr stat_file(const std::string& path, int* err,
+                              bool* cached = NULL);
+    // the opened entry for what stat_file returned, without a handle only if
+    // the file cannot be opened
+    OpenFileInfoPtr open_info(const OpenFileInfoPtr& info);
+    // true if open_file would answer without touching the file system
+    bool            is_fresh(const std::string& path);
+
+    void invalidate(const std::string& path);
+    void invalidate_directory(const std::string& dir);
+    void clear();
+
+    u64 hit_count() const { return hits_.value(); }
+    u64 miss_count() const { return misses_.value(); }
+    u64 revalidation_count() const { return revalidations_.value(); }
+    // directories watched for changes, one per directory with cached files
+    size_t watch_count() const;
+private:
+    Shard& shard_of(const std::string& path);
+
+    OpenFileInfo*   new_info(const std::string& path, const struct stat64& buf);
+    OpenFileInfoPtr create_info(const std::string& path,
+                                const struct stat64& buf);
+    void            insert(const std::string& path, const OpenFileInfoPtr& info,
+                           time_t now);
+    void            remove_entry(Shard& shard, EntryMap::iterator map_it);
+
+    Shard*          shards_;
+    size_t          max_entry_;
+    size_t          max_shard_entry_;
+    int             valid_time_;
+    InotifyWatcher* watcher_;
+
+    const MimeTypeRegistry* mime_types_;
+
+    utils::AtomicCounter hits_;
+    utils::AtomicCounter misses_;
+    utils::AtomicCounter revalidations_;
+};
+
+}
+
+#endif /* _FILE_CACHE_H_ */
@@ -0,0 +1,150 @@
+#include "pch.h"
+
+#include <cstring>
+
+#include "http/http_date.h"
+
+namespace tube {
+
+static const char kWeekDays[7][4] = {
+    "Thu", "Fri", "Sat", "Sun", "Mon", "Tue", "Wed" // 1970-01-01 was Thursday
+};
+
+static const char kMonths[12][4] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct",
+    "Nov", "Dec"
+};
+
+// days since the epoch of a proleptic gregorian date, and back.  see
+// http://howardhinnant.github.io/date_algorithms.html
+static long
+days_from_civil(long year, int month, int day)
+{
+    year -= month <= 2;
+    long era = (year >= 0 ? year : year - 399) / 400;
+    long yoe = year - era * 400;
+    long doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+static void
+civil_from_days(long days, long* year, int* month, int* day)
+{
+    days += 719468;
+    long era = (days >= 0 ? days : days - 146096) / 146097;
+    long doe = days - era * 146097;
+    long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    long mp = (5 * doy + 2) / 153;
+    *day = doy - (153 * mp + 2) / 5 + 1;
+    *month = mp < 10 ? mp + 3 : mp - 9;
+    *year = yoe + era * 400 + (*month <= 2);
+}
+
+static inline void
+put_2digits(char* p, int n)
+{
+    p[0] = '0' + n / 10;
+    p[1] = '0' + n % 10;
+}
+
+void
+format_http_date(time_t t, char* buf)
+{
+    long days = t / 86400;
+    long secs = t % 86400;
+    if (secs < 0) {
+        secs += 86400;
+        days--;
+    }
+    long year;
+    int month, day;
+    civil_from_days(days, &year, &month, &day);
+    int wday = days % 7;
+    if (wday < 0) {
+        wday += 7;
+    }
+
+    memcpy(buf, kWeekDays[wday], 3);
+    buf[3] = ',';
+    buf[4] = ' ';
+    put_2digits(buf + 5, day);
+    buf[7] = ' ';
+    memcpy(buf + 8, kMonths[month - 1], 3);
+    buf[11] = ' ';
+    put_2digits(buf + 12, (year / 100) % 100);
+    put_2digits(buf + 14, year % 100);
+    buf[16] = ' ';
+    put_2digits(buf + 17, secs / 3600);
+    buf[19] = ':';
+    put_2digits(buf + 20, secs / 60 % 60);
+    buf[22] = ':';
+    put_2digits(buf + 23, secs % 60);
+    memcpy(buf + 25, " GMT", 5);
+}
+
+std::string
+format_http_date(time_t t)
+{
+    char buf[kHttpDateLength + 1];
+    format_http_date(t, buf);
+    return std::string(buf, kHttpDateLength);
+}
+
+static inline bool
+get_digits(const char* p, int ndigits, int* res)
+{
+    *res = 0;
+    for (int i = 0; i < ndigits; i++) {
+        if (p[i] < '0' || p[i] > '9')
+            return false;
+        *res = *res * 10 + p[i] - '0';
+    }
+    return true;
+}
+
+static int
+get_month(const char* p)
+{
+    for (int i = 0; i < 12; i++) {
+        if (p[0] == kMonths[i][0] && p[1] == kMonths[i][1]
+            && p[2] == kMonths[i][2])
+            return i + 1;
+    }
+    return 0;
+}
+
+bool
+parse_http_date(const char* str, size_t len, time_t* result)
+{
+    // 0         1         2
+    // 01234567890123456789012345678
+    // Sun, 06 Nov 1994 08:49:37 GMT
+    if (len != kHttpDateLength || str[3] != ',' || str[4] != ' '
+        || str[7] != ' ' || str[11] != ' ' || str[16] != ' '
+        || str[19] != ':' || str[22] != ':'
+        || memcmp(str + 25, " GMT", 4) != 0)
+        return false;
+
+    int day, year, hour, min, sec;
+    int month = get_month(str + 8);
+    if (month == 0 || !get_digits(str + 5, 2, &day)
+        || !get_digits(str + 12, 4, &year) || !get_digits(str + 17, 2, &hour)
+        || !get_digits(str + 20, 2, &min) || !get_digits(str + 23, 2, &sec))
+        return false;
+    if (day < 1 || day > 31 || hour > 23 || min > 59 || sec > 60)
+        return false;
+    // the day name is redundant, it is not checked
+    *result = (time_t) days_from_civil(year, month, day) * 86400
+        + hour * 3600 + min * 60 + sec;
+    return true;
+}
+
+bool
+parse_http_date(const std::string& str, time_t* result)
+{
+    return parse_http_date(str.data(), str.length(), result);
+}
+
+}
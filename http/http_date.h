@@ -0,0 +1,26 @@
+// -*- mode: c++ -*-
+
+#ifndef _HTTP_DATE_H_
+#define _HTTP_DATE_H_
+
+#include <string>
+#include <ctime>
+
+namespace tube {
+
+// IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT", the only format we
+// send.  Both directions work on fixed positions and never allocate.
+static const size_t kHttpDateLength = 29;
+
+// writes kHttpDateLength characters and a terminating zero
+void        format_http_date(time_t t, char* buf);
+std::string format_http_date(time_t t);
+
+// false unless str is exactly an IMF-fixdate, the obsolete RFC 850 and
+// asctime formats are not accepted
+bool parse_http_date(const char* str, size_t len, time_t* result);
+bool parse_http_date(const std::string& str, time_t* result);
+
+}
+
+#endif /* _HTTP_DATE_H_ */
@@ -283,6 +283,8 @@ do {                                                                 \
     } else {
       fnext Responses;
     }
+    /* the body has been streamed, let the caller catch up first */
+    fbreak;
   }
 
   action body_logic {
@@ -1,9 +1,12 @@
 #include "pch.h"
 
+#include <cerrno>
+
 #include "http/http_stages.h"
 #include "http/connection.h"
 #include "http/http_wrapper.h"
 #include "http/configuration.h"
+#include "http/websocket.h"
 #include "core/stages.h"
 #include "core/pipeline.h"
 #include "utils/logger.h"
@@ -36,6 +39,7 @@ void
 HttpParserStage::initialize()
 {
     handler_stage_ = pipeline_.find_stage("http_handler");
+    websocket_stage_ = pipeline_.find_stage("websocket");
 }
 
 HttpParserStage::~HttpParserStage()
@@ -44,14 +48,32 @@ HttpParserStage::~HttpParserStage()
 int
 HttpParserStage::process_task(Connection* conn)
 {
-    Request req(conn);
     HttpConnection* http_connection = (HttpConnection*) conn;
-    if (!http_connection->do_parse()) {
+    if (http_connection->is_upgraded()) {
+        // no HTTP any more
+        websocket_stage_->sched_add(conn);
+        return 0;
+    }
+    Request req(conn);
+    bool parsed = http_connection->do_parse();
+    while (parsed && http_connection->is_body_complete()) {
+        complete_body(http_connection);
+        parsed = http_connection->do_parse();
+    }
+    if (!parsed) {
         // FIXME: if the protocol client sent is not HTTP, is it OK to close
         // the connection right away?
         LOG(WARNING, "corrupted protocol from %s. closing...",
             conn->address.address_string().c_str());
         conn->active_close();
+        return 0;
+    }
+    if (http_connection->is_body_streaming()) {
+        if (http_connection->is_body_held_back()) {
+            // the consumer is behind, stop reading until it resumes
+            pipeline_.pause_input(conn);
+        }
+        return 0;
     }
     if (!http_connection->get_request_data_list().empty()) {
         // add it into the next stage
@@ -60,10 +82,32 @@ HttpParserStage::process_task(Connection* conn)
     return 0; // release the lock whatever happened
 }
 
+void
+HttpParserStage::complete_body(HttpConnection* conn)
+{
+    HttpRequestData request;
+    HttpBodyConsumerPtr consumer = conn->finish_body(request);
+    HttpResponse response(conn);
+    response.set_http_version(request.version_major, request.version_minor);
+    if (pipeline_.is_draining()) {
+        response.add_header("Connection", "close");
+    } else if (request.keep_alive && request.version_minor == 0) {
+        response.add_header("Connection", "Keep-Alive");
+    }
+    consumer->on_complete(response);
+    if (!response.is_responded()) {
+        response.respond(HttpResponseStatus::kHttpResponseServiceUnavailable);
+    }
+    if (!request.keep_alive || response.close_after_respond()
+        || pipeline_.is_draining()) {
+        conn->close_after_finish = true;
+    }
+}
+
 const int HttpHandlerStage::kMaxContinuesRequestNumber = 3;
 
 HttpHandlerStage::HttpHandlerStage()
-    : Stage("http_handler")
+    : Stage("http_handler"), parser_stage_(NULL), websocket_stage_(NULL)
 {
     sched_ = new QueueScheduler();
 }
@@ -71,45 +115,114 @@ HttpHandlerStage::HttpHandlerStage()
 HttpHandlerStage::~HttpHandlerStage()
 {}
 
+void
+HttpHandlerStage::initialize()
+{
+    parser_stage_ = pipeline_.find_stage("parser");
+    websocket_stage_ = pipeline_.find_stage("websocket");
+}
+
 int
 HttpHandlerStage::process_task(Connection* conn)
 {
     HttpConnection* http_connection = (HttpConnection*) conn;
-    std::list<BaseHttpHandler*> chain;
+    UrlRuleItem::HandlerChain chain;
     std::list<HttpRequestData>& client_requests =
         http_connection->get_request_data_list();
     HttpResponse response(conn);
 
     for (int i = 0; i < kMaxContinuesRequestNumber; i++) {
-        if (client_requests.empty())
-            break;
-        HttpRequest request(conn, client_requests.front());
-        client_requests.pop_front();
+        HttpRequestData request_data;
+        HttpAsyncResponsePtr async_response;
+        bool resumed = http_connection->take_resumed_request(request_data,
+                                                             async_response);
+        if (!resumed) {
+            // requests after a streamed body or a parked request wait until
+            // it is done
+            if (client_requests.empty() || http_connection->is_body_streaming()
+                || http_connection->is_parked())
+                break;
+            request_data = client_requests.front();
+            client_requests.pop_front();
+        }
+        HttpRequest request(conn, request_data, resumed);
+        if (async_response && !async_response->is_retry()) {
+            // the handler is done with it, only the response is left
+            response.set_http_version(request.version_major(),
+                                      request.version_minor());
+            if (!async_response->is_streaming()) {
+                response.complete(*async_response);
+                goto finish;
+            }
+            if (!response.stream(*async_response))
+                goto finish;
+            // more of the body is on its way
+            http_connection->park_request(request_data, async_response);
+            response.reset();
+            goto done;
+        }
+        if (async_response) {
+            // tried again, whatever watched the first try sees this one
+            response.resume_recording(*async_response);
+        }
         if (request.url_rule_item()) {
             chain = request.url_rule_item()->handlers;
         } else {
-            // mis-configured, send an error
+            // mis-configured, send an error.  the body is discarded on the
+            // way out, or it would be parsed as the next request.
             response.write_string("This url is not configured.");
             response.respond(
                 HttpResponseStatus::kHttpResponseServiceUnavailable);
-            continue;
+            goto finish;
         }
-        if (request.keep_alive() && request.version_minor() == 0) {
+        response.set_http_version(request.version_major(),
+                                  request.version_minor());
+        if (pipeline_.is_draining()) {
+            // the next request goes to whoever accepts now
+            response.add_header("Connection", "close");
+        } else if (request.keep_alive() && request.version_minor() == 0) {
             response.add_header("Connection", "Keep-Alive");
         }
         for (UrlRuleItem::HandlerChain::iterator it = chain.begin();
              it != chain.end(); ++it) {
-            BaseHttpHandler* handler = *it;
-            handler->handle_request(request, response);
-            if (response.is_responded())
+            (*it)->handle_request(request, response);
+            if (response.is_responded() || response.is_deferred()
+                || response.is_suspended()
+                || http_connection->is_body_streaming())
                 break;
         }
+        if (response.is_suspended()
+            || (response.is_deferred() && !response.is_responded())) {
+            // whoever took it over schedules the connection here again
+            http_connection->park_request(request_data,
+                                          response.async_response());
+            response.reset();
+            goto done;
+        }
+        if (http_connection->is_body_streaming()) {
+            // feed what has arrived already, the consumer responds later
+            parser_stage_->sched_add(conn);
+            goto done;
+        }
+        if (http_connection->is_upgraded()) {
+            // the 101 goes out before any frame the stage may send, the
+            // write back stage never touches the connection again
+            response.flush_data();
+            response.reset();
+            client_requests.clear();
+            websocket_stage_->sched_add(conn);
+            goto done;
+        }
+    finish:
+        http_connection->discard_body();
         if (!response.is_responded()) {
             response.respond(
                 HttpResponseStatus::kHttpResponseServiceUnavailable);
         }
+        bool close_after_respond = response.close_after_respond();
         response.reset();
-        if (!request.keep_alive()) {
+        if (!request.keep_alive() || close_after_respond
+            || pipeline_.is_draining()) {
             LOG(DEBUG, "active close after transfer finish");
             conn->close_after_finish = true;
             goto done;
@@ -123,4 +236,220 @@ done:
     return response.response_code();
 }
 
+const size_t CompressStage::kMaxPendingJobs = 1024;
+
+CompressStage::CompressStage()
+    : Stage("compress"), nworkers_(0), stopped_(false)
+{
+}
+
+CompressStage::~CompressStage()
+{
+}
+
+bool
+CompressStage::add_job(const boost::function<void ()>& job)
+{
+    utils::Lock lk(mutex_);
+    if (nworkers_ == 0 || jobs_.size() >= kMaxPendingJobs) {
+        return false;
+    }
+    jobs_.push(job);
+    cond_.notify_one();
+    return true;
+}
+
+void
+CompressStage::main_loop()
+{
+    mutex_.lock();
+    nworkers_++;
+    while (true) {
+        while (jobs_.empty() && !stopped_) {
+            cond_.wait(mutex_);
+        }
+        if (stopped_) {
+            nworkers_--;
+            mutex_.unlock();
+            return;
+        }
+        boost::function<void ()> job = jobs_.front();
+        jobs_.pop();
+        mutex_.unlock();
+        job();
+        mutex_.lock();
+    }
+}
+
+void
+CompressStage::interrupt()
+{
+    utils::Lock lk(mutex_);
+    stopped_ = true;
+    cond_.notify_all();
+}
+
+const size_t DiskIOStage::kMaxPendingJobs = 4096;
+
+DiskIOStage::DiskIOStage()
+    : Stage("disk_io"), nworkers_(0), handler_stage_(NULL), stopped_(false)
+{
+}
+
+DiskIOStage::~DiskIOStage()
+{
+}
+
+void
+DiskIOStage::initialize()
+{
+    handler_stage_ = pipeline_.find_stage("http_handler");
+}
+
+bool
+DiskIOStage::submit(HttpRequest& request, HttpResponse& response,
+                    const boost::function<void ()>& work)
+{
+    Connection* conn = request.connection();
+    utils::Lock lk(mutex_);
+    if (nworkers_ == 0 || jobs_.size() >= kMaxPendingJobs
+        || parked_.find(conn) != parked_.end()) {
+        return false;
+    }
+    Job job;
+    job.conn = conn;
+    job.work = work;
+    jobs_.push_back(job);
+    parked_.insert(conn);
+    cond_.notify_one();
+    response.defer();
+    return true;
+}
+
+void
+DiskIOStage::sched_remove(Connection* conn)
+{
+    // called while the connection is disposed, its job is not wanted any more
+    utils::Lock lk(mutex_);
+    if (parked_.erase(conn) == 0)
+        return;
+    for (std::list<Job>::iterator it = jobs_.begin(); it != jobs_.end();
+         ++it) {
+        if (it->conn == conn) {
+            jobs_.erase(it);
+            break;
+        }
+    }
+}
+
+void
+DiskIOStage::main_loop()
+{
+    mutex_.lock();
+    nworkers_++;
+    while (true) {
+        while (jobs_.empty() && !stopped_) {
+            cond_.wait(mutex_);
+        }
+        if (stopped_) {
+            // submit() leaves the work to the handlers from now on
+            nworkers_--;
+            mutex_.unlock();
+            return;
+        }
+        Job job = jobs_.front();
+        jobs_.pop_front();
+        mutex_.unlock();
+
+        job.work();
+
+        // the shared lock keeps the connection from being disposed while it
+        // is woken up
+        utils::SLock pipe_lk(pipeline_.mutex());
+        mutex_.lock();
+        if (parked_.erase(job.conn) > 0) {
+            ((HttpConnection*) job.conn)->set_resumable();
+            handler_stage_->sched_add(job.conn);
+        }
+    }
+}
+
+void
+DiskIOStage::interrupt()
+{
+    utils::Lock lk(mutex_);
+    stopped_ = true;
+    cond_.notify_all();
+}
+
+const int WebSocketStage::kWriteTimeout = 10000;
+
+WebSocketStage::WebSocketStage()
+    : Stage("websocket"), write_back_stage_(NULL)
+{
+    sched_ = new QueueScheduler();
+}
+
+WebSocketStage::~WebSocketStage()
+{
+    delete sched_;
+}
+
+void
+WebSocketStage::initialize()
+{
+    write_back_stage_ = pipeline_.find_stage("write_back");
+}
+
+void
+WebSocketStage::sched_remove(Connection* conn)
+{
+    // called while the connection is disposed.  once detached nobody
+    // schedules it here again.
+    const WebSocketPtr& websocket = ((HttpConnection*) conn)->websocket();
+    if (websocket)
+        websocket->detach();
+    Stage::sched_remove(conn);
+}
+
+int
+WebSocketStage::process_task(Connection* conn)
+{
+    WebSocketPtr websocket = ((HttpConnection*) conn)->websocket();
+    if (!websocket)
+        return 0;
+    bool closing = websocket->process();
+    if (websocket->is_overflowed()) {
+        LOG(INFO, "websocket client %s is too slow, closing",
+            websocket->address().c_str());
+        conn->active_close();
+        return 0;
+    }
+
+    OutputStream& out = conn->out_stream;
+    ssize_t rs = 0;
+    while (!out.is_done() && (rs = out.write_into_output()) > 0) {
+        conn->last_active = time(NULL);
+    }
+    if (!out.is_done()) {
+        if (rs < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            LOG(INFO, "websocket client %s is gone",
+                websocket->address().c_str());
+            conn->active_close();
+            return 0;
+        }
+        // the socket is full, the write back stage waits for it.  frames
+        // sent meanwhile stay in the outbox.  it unlocks the connection
+        // when done, as after a handler.
+        websocket->output_writing();
+        if (closing)
+            conn->close_after_finish = true;
+        write_back_stage_->sched_add(conn);
+        return -1;
+    }
+    if (closing)
+        conn->active_close();
+    return 0;
+}
+
 }
@@ -3,6 +3,11 @@
 #ifndef _HTTP_STAGES_H_
 #define _HTTP_STAGES_H_
 
+#include <queue>
+#include <list>
+#include <set>
+#include <boost/function.hpp>
+
 #include "core/stages.h"
 #include "http/interface.h"
 
@@ -16,9 +21,12 @@ public:
     virtual void        destroy_connection(Connection* conn);
 };
 
+class HttpConnection;
+
 class HttpParserStage : public ParserStage
 {
     Stage* handler_stage_;
+    Stage* websocket_stage_;
 public:
     HttpParserStage();
     virtual ~HttpParserStage();
@@ -26,15 +34,107 @@ public:
     virtual void initialize();
 protected:
     int process_task(Connection* conn);
+private:
+    void complete_body(HttpConnection* conn);
 };
 
 class HttpHandlerStage : public Stage
 {
+    Stage* parser_stage_;
+    Stage* websocket_stage_;
 public:
     static const int kMaxContinuesRequestNumber;
 
     HttpHandlerStage();
     virtual ~HttpHandlerStage();
+
+    virtual void initialize();
+protected:
+    int process_task(Connection* conn);
+};
+
+// Compresses static files in the background, so handler threads never wait
+// for it.  Not connection based, jobs are queued with add_job.
+class CompressStage : public Stage
+{
+    utils::Mutex                          mutex_;
+    utils::Condition                      cond_;
+    std::queue<boost::function<void ()> > jobs_;
+    int                                   nworkers_;
+    bool                                  stopped_;
+protected:
+    // the jobs not started are dropped
+    virtual void interrupt();
+public:
+    static const size_t kMaxPendingJobs;
+
+    CompressStage();
+    virtual ~CompressStage();
+
+    // false if the stage has no threads or the queue is full already, the
+    // job is then dropped
+    bool add_job(const boost::function<void ()>& job);
+
+    virtual void main_loop();
+};
+
+class HttpRequest;
+
+// Runs blocking file system work (open, stat, reading a cold file) for the
+// handlers, so a slow disk never holds a handler thread.  The request is
+// deferred meanwhile and handled again, marked resumed, when the work is
+// done.
+class DiskIOStage : public Stage
+{
+    struct Job
+    {
+        Connection*               conn;
+        boost::function<void ()>  work;
+    };
+
+    utils::Mutex           mutex_;
+    utils::Condition       cond_;
+    std::list<Job>         jobs_;
+    std::set<Connection*>  parked_; // connections not disposed meanwhile
+    int                    nworkers_;
+    Stage*                 handler_stage_;
+    bool                   stopped_;
+protected:
+    // the jobs not started are left to the connections being disposed
+    virtual void interrupt();
+public:
+    static const size_t kMaxPendingJobs;
+
+    DiskIOStage();
+    virtual ~DiskIOStage();
+
+    virtual void initialize();
+
+    // queues the work and defers the response.  false if the stage has no
+    // threads or is too busy, the handler should then do the work itself.
+    bool submit(HttpRequest& request, HttpResponse& response,
+                const boost::function<void ()>& work);
+
+    virtual void sched_remove(Connection* conn);
+    virtual void main_loop();
+};
+
+// Takes over connections upgraded to WebSocket: decodes the frames read
+// from them, passes the messages to the handler and writes out whatever
+// was sent to them.  What the socket doesn't take at once is left to the
+// write back stage, so a slow client never holds a stage thread.
+class WebSocketStage : public Stage
+{
+    Stage* write_back_stage_;
+public:
+    // io timeout of the write back stage for an upgraded connection
+    static const int kWriteTimeout;
+
+    WebSocketStage();
+    virtual ~WebSocketStage();
+
+    virtual void initialize();
+    virtual void sched_remove(Connection* conn);
 protected:
     int process_task(Connection* conn);
 };
@@ -2,6 +2,7 @@
 
 #include "http/http_wrapper.h"
 #include "http/http_parser.h"
+#include "core/stages.h"
 #include "utils/misc.h"
 
 namespace tube {
@@ -176,9 +177,54 @@ HttpResponseStatus::HttpResponseStatus(int code,
     : status_code(code), reason(reason_string)
 {}
 
-HttpRequest::HttpRequest(Connection* conn, const HttpRequestData& request)
-    : Request(conn), request_(request)
+void
+HttpBodyConsumer::attach(Connection* conn)
+{
+    utils::Lock lk(mutex_);
+    conn_ = conn;
+}
+
+void
+HttpBodyConsumer::resume()
+{
+    Pipeline& pipeline = Pipeline::instance();
+    // the shared lock keeps the connection from being disposed meanwhile
+    utils::SLock pipe_lk(pipeline.mutex());
+    utils::Lock lk(mutex_);
+    if (conn_) {
+        pipeline.resume_input(conn_);
+    }
+}
+
+HttpRequest::HttpRequest(Connection* conn, const HttpRequestData& request,
+                         bool resumed)
+    : Request(conn), request_(request), is_resumed_(resumed)
+{
+}
+
+void
+HttpRequest::read_body(const HttpBodyConsumerPtr& consumer)
 {
+    ((HttpConnection*) conn_)->set_body_consumer(consumer, request_);
+}
+
+ssize_t
+HttpRequest::read_data(byte* ptr, size_t sz)
+{
+    HttpConnection* conn = (HttpConnection*) conn_;
+    if (request_.transfer_encoding == HTTP_CHUNKED) {
+        return conn->read_chunked_body(ptr, sz);
+    }
+    if (sz > conn->body_remaining()) {
+        sz = conn->body_remaining();
+    }
+    if (sz == 0)
+        return 0;
+    ssize_t nread = Request::read_data(ptr, sz);
+    if (nread > 0) {
+        conn->consume_body(nread);
+    }
+    return nread;
 }
 
 std::string
@@ -224,11 +270,17 @@ HttpRequest::find_header_value(std::string key) const
 const char* HttpResponse::kHttpVersion = "HTTP/1.1";
 const char* HttpResponse::kHttpNewLine = "\r\n";
 
-HttpResponse::HttpResponse(Connection* conn) : Response(conn)
+HttpResponse::HttpResponse(Connection* conn)
+    : Response(conn), version_major_(1), version_minor_(1)
 {
     reset();
 }
 
+HttpResponse::~HttpResponse()
+{
+    finish_recording();
+}
+
 void
 HttpResponse::add_header(const std::string& key, const std::string& value)
 {
@@ -242,21 +294,98 @@ HttpResponse::add_header(const std::string& key, const std::string& value)
 ssize_t
 HttpResponse::write_data(const byte* ptr, size_t size)
 {
-    if (use_prepare_buffer_) {
+    if (is_chunked_) {
+        if (size == 0)
+            return 0; // an empty chunk would end the body
+        begin_chunk(size);
+        ssize_t res = Response::write_data(ptr, size);
+        end_chunk();
+        return res;
+    }
+    // once the headers are out, data follows whatever was queued before
+    if (use_prepare_buffer_ && !is_responded_ && !is_streaming_) {
         prepare_buffer_.append(ptr, size);
         return size;
     } else {
+        if (recorder_) {
+            if (is_responded_ && !is_streaming_)
+                recorder_->on_body(ptr, size);
+            else
+                is_recorded_ = false;
+        }
         return Response::write_data(ptr, size);
     }
 }
 
 void
-HttpResponse::respond(const HttpResponseStatus& status)
+HttpResponse::write_file(int file_desc, off64_t offset, off64_t length)
 {
-    // construct the header and send it long with the prepare buffer
-    if (content_length_ < 0)
-        set_content_length(prepare_buffer_.size());
+    is_recorded_ = false;
+    if (is_chunked_) {
+        if (length < 0) {
+            struct stat64 st;
+            fstat64(file_desc, &st);
+            length = st.st_size - offset;
+        }
+        begin_chunk(length);
+        Response::write_file(file_desc, offset, length);
+        end_chunk();
+    } else {
+        Response::write_file(file_desc, offset, length);
+    }
+}
+
+void
+HttpResponse::write_file(const FileHandlePtr& handle, off64_t offset,
+                         off64_t length)
+{
+    is_recorded_ = false;
+    if (is_chunked_) {
+        if (length < 0) {
+            struct stat64 st;
+            fstat64(handle->fd(), &st);
+            length = st.st_size - offset;
+        }
+        begin_chunk(length);
+        Response::write_file(handle, offset, length);
+        end_chunk();
+    } else {
+        Response::write_file(handle, offset, length);
+    }
+}
 
+void
+HttpResponse::write_block(const DataBlockPtr& block, size_t offset,
+                          size_t length)
+{
+    is_recorded_ = false;
+    if (is_chunked_) {
+        begin_chunk(length);
+        Response::write_block(block, offset, length);
+        end_chunk();
+    } else {
+        Response::write_block(block, offset, length);
+    }
+}
+
+void
+HttpResponse::begin_chunk(u64 size)
+{
+    char chunk_header[32];
+    int len = snprintf(chunk_header, sizeof(chunk_header), "%llx\r\n",
+                       (unsigned long long) size);
+    conn_->out_stream.append_data((const byte*) chunk_header, len);
+}
+
+void
+HttpResponse::end_chunk()
+{
+    conn_->out_stream.append_data((const byte*) kHttpNewLine, 2);
+}
+
+void
+HttpResponse::send_headers(const HttpResponseStatus& status)
+{
     std::stringstream response_text;
     response_text << kHttpVersion << " " << status.status_code << " "
                   << status.reason << kHttpNewLine;
@@ -264,12 +393,99 @@ HttpResponse::respond(const HttpResponseStatus& status)
         const HttpHeaderItem& item = headers_[i];
         response_text << item.key << ": " << item.value << kHttpNewLine;
     }
-    if (has_content_length_) {
+    if (is_chunked_) {
+        response_text << "Transfer-Encoding: chunked" << kHttpNewLine;
+    } else if (has_content_length_) {
         response_text << "Content-Length: " << content_length_ << kHttpNewLine;
     }
     response_text << kHttpNewLine;
     conn_->out_stream.append_data((const byte*) response_text.str().c_str(),
                                   response_text.str().length());
+}
+
+void
+HttpResponse::begin_chunked(const HttpResponseStatus& status)
+{
+    if (is_streaming_ || is_responded_)
+        return;
+    is_streaming_ = true;
+    is_recorded_ = false;
+    if (version_major_ > 1 || (version_major_ == 1 && version_minor_ >= 1)) {
+        is_chunked_ = true;
+    } else {
+        // HTTP/1.0 doesn't know chunks, closing tells where the body ends
+        has_content_length_ = false;
+        close_after_respond_ = true;
+        for (size_t i = 0; i < headers_.size(); i++) {
+            if (utils::ignore_compare(headers_[i].key, "connection")) {
+                headers_.erase(headers_.begin() + i--);
+            }
+        }
+        add_header("Connection", "close");
+    }
+    send_headers(status);
+    // whatever is prepared so far becomes the first piece
+    Buffer pending = prepare_buffer_;
+    prepare_buffer_ = Buffer();
+    if (pending.size() > 0) {
+        if (is_chunked_)
+            begin_chunk(pending.size());
+        conn_->out_stream.append_buffer(pending);
+        if (is_chunked_)
+            end_chunk();
+    }
+}
+
+void
+HttpResponse::end_chunked()
+{
+    if (!is_streaming_ || is_responded_)
+        return;
+    if (is_chunked_) {
+        static const char* last_chunk = "0\r\n\r\n";
+        conn_->out_stream.append_data((const byte*) last_chunk,
+                                      strlen(last_chunk));
+        is_chunked_ = false;
+    }
+    is_responded_ = true;
+}
+
+void
+HttpResponse::abort()
+{
+    if (!is_responded_ && !is_streaming_)
+        return;
+    // no last chunk, the client must not take the body as complete
+    is_chunked_ = false;
+    is_recorded_ = false;
+    is_responded_ = true;
+    close_after_respond_ = true;
+}
+
+void
+HttpResponse::respond(const HttpResponseStatus& status)
+{
+    if (is_suspended_)
+        return; // the async response answers instead
+    if (is_streaming_) {
+        // headers are long gone, only the end of the body is left
+        end_chunked();
+        return;
+    }
+    // construct the header and send it long with the prepare buffer
+    if (content_length_ < 0)
+        set_content_length(prepare_buffer_.size());
+
+    if (recorder_) {
+        recorder_->on_head(status, headers_, content_length_);
+        size_t size = prepare_buffer_.size();
+        if (size > 0) {
+            std::vector<byte> body(size);
+            prepare_buffer_.copy_front(&body[0], size);
+            recorder_->on_body(&body[0], size);
+        }
+    }
+    send_headers(status);
     if (prepare_buffer_.size() > 0) {
         // send the body if have any
         conn_->out_stream.append_buffer(prepare_buffer_);
@@ -277,15 +493,339 @@ HttpResponse::respond(const HttpResponseStatus& status)
     is_responded_ = true;
 }
 
+void
+HttpResponse::respond_raw(const DataBlockPtr& block, size_t offset,
+                          size_t length)
+{
+    if (is_responded_ || is_streaming_ || is_suspended_)
+        return;
+    is_recorded_ = false;
+    Response::write_block(block, offset, length);
+    is_responded_ = true;
+}
+
+void
+HttpResponse::set_recorder(const HttpResponseRecorderPtr& recorder)
+{
+    finish_recording();
+    recorder_ = recorder;
+    is_recorded_ = true;
+}
+
+void
+HttpResponse::resume_recording(HttpAsyncResponse& async_response)
+{
+    finish_recording();
+    recorder_.swap(async_response.recorder_);
+    is_recorded_ = async_response.is_recorded_;
+}
+
+void
+HttpResponse::finish_recording()
+{
+    if (!recorder_)
+        return;
+    HttpResponseRecorderPtr recorder;
+    recorder.swap(recorder_);
+    recorder->on_finish(is_recorded_ && is_responded_ && !is_streaming_
+                        && !is_deferred_ && !is_suspended_);
+}
+
 void
 HttpResponse::reset()
 {
+    finish_recording();
+    is_recorded_ = true;
     prepare_buffer_ = Buffer(); // create a new empty buffer;
     content_length_ = -1;
     headers_.clear();
     has_content_length_ = true;
     use_prepare_buffer_ = true;
     is_responded_ = false;
+    is_streaming_ = false;
+    is_chunked_ = false;
+    close_after_respond_ = false;
+    is_deferred_ = false;
+    is_suspended_ = false;
+    async_response_.reset();
+}
+
+HttpAsyncResponsePtr
+HttpResponse::suspend()
+{
+    if (is_responded_ || is_streaming_ || is_suspended_)
+        return HttpAsyncResponsePtr();
+    async_response_.reset(new HttpAsyncResponse(conn_));
+    async_response_->headers_ = headers_;
+    async_response_->content_length_ = content_length_;
+    async_response_->body_ = prepare_buffer_;
+    // the answer comes through the async response, it is recorded there
+    async_response_->recorder_.swap(recorder_);
+    async_response_->is_recorded_ = is_recorded_;
+    is_suspended_ = true;
+    return async_response_;
+}
+
+void
+HttpResponse::complete(HttpAsyncResponse& async_response)
+{
+    resume_recording(async_response);
+    headers_ = async_response.headers_;
+    content_length_ = async_response.content_length_;
+    prepare_buffer_ = async_response.body_;
+    respond(async_response.status_);
+}
+
+bool
+HttpResponse::stream(HttpAsyncResponse& async_response)
+{
+    Buffer body;
+    bool completed, failed;
+    HttpAsyncResponse::DrainHandler drain_handler;
+    {
+        utils::Lock lk(async_response.mutex_);
+        body = async_response.body_;
+        async_response.body_ = Buffer();
+        async_response.wake_pending_ = false;
+        async_response.unsent_ += body.size();
+        drain_handler = async_response.take_drain_handler();
+        completed = async_response.is_completed_;
+        failed = async_response.is_failed_;
+    }
+    HttpResponseRecorderPtr& recorder = async_response.recorder_;
+    // the framing chosen with the headers holds for every later piece
+    if (!async_response.headers_sent_) {
+        headers_ = async_response.headers_;
+        content_length_ = async_response.content_length_;
+        if (recorder) {
+            recorder->on_head(async_response.status_, headers_,
+                              content_length_);
+        }
+        if (content_length_ >= 0) {
+            is_streaming_ = true;
+            send_headers(async_response.status_);
+        } else {
+            begin_chunked(async_response.status_);
+        }
+        async_response.headers_sent_ = true;
+        async_response.is_chunked_ = is_chunked_;
+        async_response.close_after_respond_ = close_after_respond_;
+    } else {
+        is_streaming_ = true;
+        is_recorded_ = false;
+        is_chunked_ = async_response.is_chunked_;
+        close_after_respond_ = async_response.close_after_respond_;
+    }
+    if (body.size() > 0) {
+        if (recorder) {
+            for (Buffer::PageIterator it = body.page_begin();
+                 it != body.page_end(); ++it) {
+                size_t len = 0;
+                const byte* ptr = body.get_page_segment(*it, &len);
+                recorder->on_body(ptr, len);
+            }
+        }
+        // the pages go out as they are, as a single chunk
+        is_recorded_ = false;
+        if (is_chunked_)
+            begin_chunk(body.size());
+        conn_->out_stream.append_buffer(body);
+        if (is_chunked_)
+            end_chunk();
+    }
+    if (drain_handler)
+        drain_handler();
+    if (failed) {
+        abort();
+        async_response.finish_recording(false);
+        return false;
+    }
+    if (completed) {
+        end_chunked();
+        async_response.finish_recording(true);
+        return false;
+    }
+    return true;
+}
+
+const size_t HttpAsyncResponse::kHighWatermark = 256 << 10;
+
+HttpAsyncResponse::HttpAsyncResponse(Connection* conn)
+    : conn_(conn), is_completed_(false),
+      status_(HttpResponseStatus::kHttpResponseOK), content_length_(-1),
+      is_retry_(false), is_streaming_(false), is_failed_(false),
+      wake_pending_(false), unsent_(0), is_congested_(false),
+      headers_sent_(false),
+      is_chunked_(false), close_after_respond_(false), is_recorded_(false)
+{
+}
+
+HttpAsyncResponse::~HttpAsyncResponse()
+{
+    finish_recording(false);
+}
+
+void
+HttpAsyncResponse::finish_recording(bool complete)
+{
+    if (!recorder_)
+        return;
+    HttpResponseRecorderPtr recorder;
+    recorder.swap(recorder_);
+    recorder->on_finish(complete && is_recorded_);
+}
+
+void
+HttpAsyncResponse::add_header(const std::string& key, const std::string& value)
+{
+    if (utils::ignore_compare(key, std::string("content-length"))) {
+        content_length_ = atoll(value.c_str());
+    } else {
+        headers_.push_back(HttpHeaderItem(key, value));
+    }
+}
+
+ssize_t
+HttpAsyncResponse::write_data(const byte* ptr, size_t size)
+{
+    bool streaming;
+    {
+        utils::Lock lk(mutex_);
+        body_.append(ptr, size);
+        streaming = is_streaming_;
+    }
+    if (streaming)
+        wake(status_, false, false);
+    return size;
+}
+
+ssize_t
+HttpAsyncResponse::write_string(const std::string& str)
+{
+    return write_data((const byte*) str.data(), str.length());
+}
+
+bool
+HttpAsyncResponse::is_aborted()
+{
+    utils::Lock lk(mutex_);
+    return conn_ == NULL;
+}
+
+bool
+HttpAsyncResponse::is_congested()
+{
+    utils::Lock lk(mutex_);
+    if (conn_ == NULL || body_.size() + unsent_ < kHighWatermark)
+        return false;
+    is_congested_ = true;
+    return true;
+}
+
+// with the mutex held, the handler to call once it is released
+HttpAsyncResponse::DrainHandler
+HttpAsyncResponse::take_drain_handler()
+{
+    if (!is_congested_
+        || (conn_ != NULL && body_.size() + unsent_ >= kHighWatermark))
+        return DrainHandler();
+    is_congested_ = false;
+    return drain_handler_;
+}
+
+void
+HttpAsyncResponse::drained()
+{
+    DrainHandler drain_handler;
+    {
+        utils::Lock lk(mutex_);
+        unsent_ = 0;
+        drain_handler = take_drain_handler();
+    }
+    if (drain_handler)
+        drain_handler();
+}
+
+void
+HttpAsyncResponse::set_drain_handler(const DrainHandler& handler)
+{
+    utils::Lock lk(mutex_);
+    drain_handler_ = handler;
+}
+
+void
+HttpAsyncResponse::respond(const HttpResponseStatus& status)
+{
+    wake(status, false, true);
+}
+
+void
+HttpAsyncResponse::retry()
+{
+    wake(HttpResponseStatus::kHttpResponseOK, true, true);
+}
+
+void
+HttpAsyncResponse::begin_streaming(const HttpResponseStatus& status)
+{
+    {
+        utils::Lock lk(mutex_);
+        if (is_completed_ || is_streaming_)
+            return;
+        status_ = status;
+        is_streaming_ = true;
+    }
+    wake(status, false, false); // the headers go out right away
+}
+
+void
+HttpAsyncResponse::fail()
+{
+    {
+        utils::Lock lk(mutex_);
+        if (is_completed_)
+            return;
+        is_failed_ = true;
+    }
+    wake(HttpResponseStatus::kHttpResponseBadGateway, false, true);
+}
+
+void
+HttpAsyncResponse::wake(const HttpResponseStatus& status, bool retry,
+                        bool complete)
+{
+    Pipeline& pipeline = Pipeline::instance();
+    // the shared lock keeps the connection from being disposed meanwhile
+    utils::SLock pipe_lk(pipeline.mutex());
+    utils::Lock lk(mutex_);
+    if (is_completed_)
+        return;
+    if (complete) {
+        if (!is_streaming_)
+            status_ = status; // a stream has sent its status already
+        is_retry_ = retry;
+        is_completed_ = true;
+    }
+    // one wake up at a time, the handler stage takes all there is
+    if (conn_ == NULL || wake_pending_)
+        return;
+    wake_pending_ = true;
+    ((HttpConnection*) conn_)->set_resumable();
+    pipeline.find_stage("http_handler")->sched_add(conn_);
+}
+
+void
+HttpAsyncResponse::detach()
+{
+    DrainHandler drain_handler;
+    {
+        utils::Lock lk(mutex_);
+        conn_ = NULL;
+        // the producer goes on, only to find the client gone
+        drain_handler = take_drain_handler();
+    }
+    if (drain_handler)
+        drain_handler();
 }
 
 // decode and encode url
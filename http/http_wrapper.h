@@ -4,18 +4,49 @@
 #define _HTTP_WRAPPER_H_
 
 #include <string>
+#include <boost/function.hpp>
 
 #include "http/connection.h"
 #include "core/wrapper.h"
 
 namespace tube {
 
+class HttpResponse;
+
+// Receives a request body as it arrives from the client, so uploads never
+// hold a handler thread.  Called from the parser stage with the connection
+// locked, so the callbacks must not block.
+class HttpBodyConsumer
+{
+    utils::Mutex mutex_;
+    Connection*  conn_; // NULL once the body is done or the connection gone
+    friend class HttpConnection;
+
+    void attach(Connection* conn);
+public:
+    HttpBodyConsumer() : conn_(NULL) {}
+    virtual ~HttpBodyConsumer() {}
+
+    // returns how much of the data was taken.  taking less stops reading
+    // from the client until resume(), the rest is offered again then.
+    virtual size_t on_data(const byte* ptr, size_t size) = 0;
+    // the whole body went to on_data, time to respond
+    virtual void   on_complete(HttpResponse& response) = 0;
+    // the connection went away first, resume() must not be called any more
+    virtual void   on_error() {}
+
+    // may be called from any thread
+    void resume();
+};
+
 class HttpRequest : public Request
 {
 protected:
     HttpRequestData request_;
+    bool            is_resumed_;
 public:
-    HttpRequest(Connection* conn, const HttpRequestData& request);
+    HttpRequest(Connection* conn, const HttpRequestData& request,
+                bool resumed = false);
 
     static std::string url_decode(std::string url);
 
@@ -23,7 +54,6 @@ public:
     std::string uri() const { return request_.uri; }
     std::string query_string() const { return request_.query_string; }
     std::string fragment() const { return request_.fragment; }
-    Buffer      chunk_buffer() const { return request_.chunk_buffer; }
     short       method() const { return request_.method; }
     std::string method_string() const;
     u64         content_length() const { return request_.content_length; }
@@ -31,6 +61,8 @@ public:
     short       version_major() const { return request_.version_major; }
     short       version_minor() const { return request_.version_minor; }
     bool        keep_alive() const { return request_.keep_alive; }
+    // handled again after the response was deferred
+    bool        is_resumed() const { return is_resumed_; }
 
     void set_uri(std::string uri) { request_.uri = uri; }
 
@@ -42,6 +74,13 @@ public:
     std::string find_header_value(std::string key) const;
     const UrlRuleItem* url_rule_item() const { return request_.url_rule; }
 
+    // streams the body to consumer instead, the response is then given in
+    // its on_complete().  don't respond to the request here.
+    void    read_body(const HttpBodyConsumerPtr& consumer);
+    // blocks for a content-length body, a chunked one only returns what has
+    // arrived along with the headers
+    ssize_t read_data(byte* ptr, size_t sz);
+
     // used for C wrapper only
     const HttpRequestData& request_data_ref() const { return request_; }
 };
@@ -95,6 +134,24 @@ struct HttpResponseStatus
     static const HttpResponseStatus kHttpResponseHttpVersionNotSupported;
 };
 
+// Sees a response while it is sent, e.g. to keep a copy.  Only a response
+// given by respond() with its body in memory, or streamed by an async
+// response, is seen whole.
+class HttpResponseRecorder
+{
+public:
+    virtual ~HttpResponseRecorder() {}
+
+    virtual void on_head(const HttpResponseStatus& status,
+                         const HttpHeaderEnumerate& headers,
+                         int64 content_length) = 0;
+    virtual void on_body(const byte* ptr, size_t size) = 0;
+    // once the response is done with, complete if all of it was seen
+    virtual void on_finish(bool complete) = 0;
+};
+
+typedef boost::shared_ptr<HttpResponseRecorder> HttpResponseRecorderPtr;
+
 class HttpResponse : public Response
 {
 protected:
@@ -104,12 +161,23 @@ protected:
     bool                use_prepare_buffer_;
     bool                has_content_length_;
     bool                is_responded_;
+    bool                is_streaming_;
+    bool                is_chunked_;
+    bool                close_after_respond_;
+    bool                is_deferred_;
+    bool                is_suspended_;
+    HttpAsyncResponsePtr async_response_;
+    HttpResponseRecorderPtr recorder_;
+    bool                is_recorded_; // nothing went around the recorder
+    short               version_major_;
+    short               version_minor_;
 
 public:
     static const char* kHttpVersion;
     static const char* kHttpNewLine;
 
     HttpResponse(Connection* conn);
+    virtual ~HttpResponse();
 
     void add_header(const std::string& key, const std::string& value);
 
@@ -122,11 +190,149 @@ public:
     bool has_content_length() const { return has_content_length_; }
     int64 content_length() const { return content_length_; }
     bool is_responded() const { return is_responded_; }
+    bool is_streaming() const { return is_streaming_; }
+    // body ends with the connection, the client can't reuse it
+    bool close_after_respond() const { return close_after_respond_; }
+    bool is_deferred() const { return is_deferred_; }
+
+    // gives up the request for now, without responding.  the handler chain
+    // gets the same request again, marked resumed, once the work it handed
+    // to another stage wakes the connection.  see DiskIOStage::submit.
+    void defer() { is_deferred_ = true; }
+
+    // the response is given later through the returned one, from any
+    // thread, and this one can't be responded any more.  what was added or
+    // written so far goes along.  NULL once responded or streaming.
+    HttpAsyncResponsePtr suspend();
+    bool is_suspended() const { return is_suspended_; }
+    const HttpAsyncResponsePtr& async_response() const {
+        return async_response_;
+    }
+    // sends what the async response was completed with, used by the
+    // handler stage only
+    void complete(HttpAsyncResponse& async_response);
+    // sends what a streaming async response has got so far, false once
+    // it is all sent.  used by the handler stage only.
+    bool stream(HttpAsyncResponse& async_response);
 
-    // write it into the prepared buffer
+    // watches the rest of this response, finished on reset().  suspend()
+    // hands it to the async response, which finishes it once all is sent.
+    void set_recorder(const HttpResponseRecorderPtr& recorder);
+    // takes the recorder back from a suspended response, for the answer
+    // it completed with or the retry of the request
+    void resume_recording(HttpAsyncResponse& async_response);
+    // sends a whole response, status line and headers included, as it is
+    void respond_raw(const DataBlockPtr& block, size_t offset, size_t length);
+
+    // version of the request, decides how a streamed body is delimited
+    void set_http_version(short major, short minor) {
+        version_major_ = major;
+        version_minor_ = minor;
+    }
+
+    // sends the headers right away and streams everything written later,
+    // chunked for HTTP/1.1 and until the connection closes for HTTP/1.0.
+    // respond() or end_chunked() finishes the body.
+    void begin_chunked(const HttpResponseStatus& status);
+    void end_chunked();
+    // the body sent so far is cut short, closing the connection tells the
+    // client.  only once the headers are out.
+    void abort();
+
+    // write it into the prepared buffer, or as a chunk when streaming
     virtual ssize_t write_data(const byte* ptr, size_t size);
+    virtual void    write_file(int file_desc, off64_t offset, off64_t length);
+    virtual void    write_file(const FileHandlePtr& handle, off64_t offset,
+                               off64_t length);
+    virtual void    write_block(const DataBlockPtr& block, size_t offset,
+                                size_t length);
     virtual void respond(const HttpResponseStatus& status);
     virtual void reset();
+private:
+    void finish_recording();
+    void send_headers(const HttpResponseStatus& status);
+    void begin_chunk(u64 size);
+    void end_chunk();
+};
+
+// A response completed from any thread, so a handler waiting on a backend
+// returns right away instead of holding a handler thread.  Meanwhile the
+// connection is in no scheduler at all.  Not thread safe itself, only
+// respond() may run while the connection goes away.  Once streaming, the
+// body is passed on to the client piece by piece as it is written.
+class HttpAsyncResponse : utils::Noncopyable
+{
+public:
+    typedef boost::function<void ()> DrainHandler;
+private:
+    utils::Mutex        mutex_;
+    Connection*         conn_; // NULL once the connection is gone
+    bool                is_completed_;
+    HttpResponseStatus  status_;
+    HttpHeaderEnumerate headers_;
+    int64               content_length_;
+    Buffer              body_;
+    bool                is_retry_;
+    bool                is_streaming_;
+    bool                is_failed_;
+    bool                wake_pending_;
+    u64                 unsent_; // handed to the connection, not written
+    bool                is_congested_; // a drain handler call is owed
+    DrainHandler        drain_handler_;
+    // how the handler stage frames the stream, kept between its pieces
+    bool                headers_sent_;
+    bool                is_chunked_;
+    bool                close_after_respond_;
+    // of the suspended response, sees the stream.  handler stage only.
+    HttpResponseRecorderPtr recorder_;
+    bool                is_recorded_;
+    friend class HttpResponse;
+    friend class HttpConnection;
+public:
+    // body written ahead of the client beyond that makes it congested
+    static const size_t kHighWatermark;
+
+    explicit HttpAsyncResponse(Connection* conn);
+    // a recorder not finished yet did not see it all
+    ~HttpAsyncResponse();
+
+    void    add_header(const std::string& key, const std::string& value);
+    void    set_content_length(int64 content_length) {
+        content_length_ = content_length;
+    }
+    ssize_t write_data(const byte* ptr, size_t size);
+    ssize_t write_string(const std::string& str);
+
+    // the client is gone, nothing will be sent
+    bool is_aborted();
+    // hands it to the handler stage to send, only the first call counts
+    void respond(const HttpResponseStatus& status);
+    // hands the request back to the handler chain instead, marked resumed
+    void retry();
+    bool is_retry() const { return is_retry_; }
+
+    // sends the status and headers now and every write_data() soon after,
+    // delimited by the content length if set, chunked otherwise.
+    // respond() ends the body.  headers can't be added any more.
+    void begin_streaming(const HttpResponseStatus& status);
+    bool is_streaming() const { return is_streaming_; }
+    // true once kHighWatermark of the body waits for the client, here or
+    // on the connection.  a producer stops reading its backend then, until
+    // the drain handler is called, once the client caught up or went away.
+    // the handler runs on a stage thread, or where the connection is
+    // disposed, and must not block.
+    bool is_congested();
+    void set_drain_handler(const DrainHandler& handler);
+    // the backend gave up: a 502 if nothing was sent yet, otherwise the
+    // body is cut short and the client connection closed
+    void fail();
+private:
+    void wake(const HttpResponseStatus& status, bool retry, bool complete);
+    void detach();
+    // the connection wrote all it was handed
+    void drained();
+    DrainHandler take_drain_handler();
+    void finish_recording(bool complete);
 };
 
 }
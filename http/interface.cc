@@ -26,6 +26,20 @@ BaseHttpHandler::option(const std::string& name)
     return it->second;
 }
 
+BaseHttpHandlerPtr
+BaseHttpHandler::shared_from_request(const HttpRequest& request)
+{
+    const UrlRuleItem* rule = request.url_rule_item();
+    if (rule == NULL)
+        return BaseHttpHandlerPtr();
+    for (UrlRuleItem::HandlerChain::const_iterator it = rule->handlers.begin();
+         it != rule->handlers.end(); ++it) {
+        if (it->get() == this)
+            return *it;
+    }
+    return BaseHttpHandlerPtr();
+}
+
 void
 BaseHttpHandlerFactory::register_factory(BaseHttpHandlerFactory* factory)
 {
@@ -5,6 +5,7 @@
 
 #include <map>
 #include <string>
+#include <boost/shared_ptr.hpp>
 
 #include "http/http_wrapper.h"
 
@@ -20,6 +21,9 @@ public:
                                 HttpResponse& response) = 0;
 
     virtual void load_param() {}
+    // the server is going down and no stage runs any more: the threads of
+    // the handler are stopped and joined, nothing is answered after
+    virtual void shutdown() {}
 
     void set_name(const std::string& name) { name_ = name; }
     const std::string& name() const { return name_; }
@@ -27,6 +31,12 @@ public:
     std::string option(const std::string& name);
     void add_option(const std::string& name, const std::string& value);
 
+    // the reference the rules of the request hold on this handler, empty if
+    // it isn't in them.  work that outlives the request keeps it, or a
+    // reload may free the handler meanwhile.
+    boost::shared_ptr<BaseHttpHandler> shared_from_request(
+        const HttpRequest& request);
+
 private:
     typedef std::map<std::string, std::string> OptionMap;
     OptionMap options_;
@@ -34,6 +44,8 @@ private:
     std::string name_;
 };
 
+typedef boost::shared_ptr<BaseHttpHandler> BaseHttpHandlerPtr;
+
 class BaseHttpHandlerFactory
 {
 public:
@@ -1,3 +1,8 @@
+#include "pch.h"
+
+#include <sys/mman.h>
+#include <boost/functional/hash.hpp>
+
 #include "io_cache.h"
 
 namespace tube {
@@ -5,151 +10,396 @@ namespace tube {
 const size_t IOCacheEntry::kCacheEntryMaxSize = 4096;
 
 IOCacheEntry::IOCacheEntry(const std::string& file_path, time_t mtime,
-                           size_t file_size)
-    : path(file_path), last_mtime(0), file_content(NULL), size(file_size)
+                           size_t size)
+    : path(file_path), last_mtime(0), file_content(NULL), file_size(size)
 {
     int file_desc = ::open(path.c_str(), O_RDONLY);
     if (file_desc < 0)
         return;
     file_content = new byte[file_size];
     byte* buf = file_content;
-    while (true) {
+    size_t nleft = file_size;
+    while (nleft > 0) {
         // file_size should be small though
-        ssize_t nread = ::read(file_desc, buf, file_size);
-        if (nread == 0) {
-            break;
-        } else if (nread < 0) {
-            // read error
+        ssize_t nread = ::read(file_desc, buf, nleft);
+        if (nread <= 0) {
+            // read error, or the file was truncated under us
             delete [] file_content;
             file_content = NULL;
+            ::close(file_desc);
             return;
         }
         buf += nread;
+        nleft -= nread;
     }
     last_mtime = mtime;
     ::close(file_desc);
 }
 
+IOCacheEntry::IOCacheEntry(const std::string& key, time_t mtime,
+                           const std::string& content)
+    : path(key), last_mtime(mtime), file_content(NULL),
+      file_size(content.size())
+{
+    file_content = new byte[file_size];
+    memcpy(file_content, content.data(), file_size);
+}
+
+IOCacheEntry::IOCacheEntry(const std::string& file_path, size_t size)
+    : path(file_path), last_mtime(0), file_content(NULL), file_size(size)
+{
+}
+
 IOCacheEntry::~IOCacheEntry()
 {
     last_mtime = 0;
     delete [] file_content;
 }
 
-byte*
-IOCacheEntry::data_copy()
+MappedIOCacheEntry::MappedIOCacheEntry(const std::string& file_path,
+                                       time_t mtime, size_t size,
+                                       bool populate)
+    : IOCacheEntry(file_path, size)
+{
+    int file_desc = ::open(path.c_str(), O_RDONLY);
+    if (file_desc < 0)
+        return;
+    int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    if (populate)
+        flags |= MAP_POPULATE;
+#endif
+    void* addr = mmap(NULL, file_size, PROT_READ, flags, file_desc, 0);
+    // the mapping stays valid after the descriptor is closed
+    ::close(file_desc);
+    if (addr == MAP_FAILED)
+        return;
+    // whole file is going to be written out over and over again
+    madvise(addr, file_size, MADV_WILLNEED);
+    file_content = (byte*) addr;
+    last_mtime = mtime;
+}
+
+MappedIOCacheEntry::~MappedIOCacheEntry()
+{
+    if (file_content) {
+        munmap(file_content, file_size);
+        file_content = NULL; // not for the base class to free
+    }
+}
+
+const int FrequencySketch::kDepth = 4;
+const u8  FrequencySketch::kMaxFrequency = 15;
+
+FrequencySketch::FrequencySketch()
+{
+    resize(0);
+}
+
+void
+FrequencySketch::resize(size_t nentry)
+{
+    size_t width = 64;
+    while (width < 2 * nentry) {
+        width <<= 1;
+    }
+    table_.assign(width * kDepth, 0);
+    width_mask_ = width - 1;
+    additions_ = 0;
+    sample_size_ = 10 * width;
+}
+
+size_t
+FrequencySketch::index_of(size_t hash, int row) const
+{
+    static const u64 seeds[] = {
+        0xC3A5C85C97CB3127ULL, 0xB492B66FBE98F273ULL,
+        0x9AE16A3B2F90404FULL, 0xCBF29CE484222325ULL
+    };
+    u64 h = ((u64) hash + seeds[row]) * 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 32;
+    return row * (width_mask_ + 1) + (h & width_mask_);
+}
+
+void
+FrequencySketch::increment(size_t hash)
+{
+    for (int i = 0; i < kDepth; i++) {
+        u8& counter = table_[index_of(hash, i)];
+        if (counter < kMaxFrequency)
+            counter++;
+    }
+    if (++additions_ >= sample_size_) {
+        age();
+    }
+}
+
+u8
+FrequencySketch::frequency(size_t hash) const
+{
+    u8 res = kMaxFrequency;
+    for (int i = 0; i < kDepth; i++) {
+        u8 counter = table_[index_of(hash, i)];
+        if (counter < res)
+            res = counter;
+    }
+    return res;
+}
+
+void
+FrequencySketch::age()
 {
-    byte* data = new byte[size];
-    memcpy(data, file_content, size);
-    return data;
+    for (size_t i = 0; i < table_.size(); i++) {
+        table_[i] >>= 1;
+    }
+    additions_ /= 2;
 }
 
+const size_t IOCache::kShardCount = 16;
+
 IOCache::IOCache()
-    : max_cache_entry_(0), max_entry_size_(4096) // 4K by default
+    : max_cache_entry_(0), max_cache_bytes_(0), max_shard_entry_(0),
+      max_shard_bytes_(0), max_entry_size_(4096), // 4K by default
+      mmap_threshold_(0), mmap_populate_(false), policy_(kAdmitFrequent)
 {
+    shards_ = new Shard[kShardCount];
+}
+
+IOCache::~IOCache()
+{
+    delete [] shards_;
 }
 
 void
-IOCache::add_entry(IOCacheEntry* entry)
+IOCache::set_max_cache_entry(size_t nentry)
 {
-    entries_.push_front(entry);
-    entry_map_.insert(std::make_pair(entry->path, entries_.begin()));
+    max_cache_entry_ = nentry;
+    update_shard_limits();
 }
 
 void
-IOCache::move_entry(EntryMap::iterator map_it)
+IOCache::set_max_cache_bytes(size_t nbytes)
 {
-    IOCacheEntry* entry = *(map_it->second);
-    entries_.erase(map_it->second);
-    entry_map_.erase(map_it);
-    entries_.push_front(entry);
-    entry_map_.insert(std::make_pair(entry->path, entries_.begin()));
+    max_cache_bytes_ = nbytes;
+    update_shard_limits();
 }
 
 void
-IOCache::drop_entry()
+IOCache::update_shard_limits()
 {
-    EntryList::iterator it = entries_.end();
-    --it;
-    IOCacheEntry* entry = *it;
+    max_shard_entry_ = (max_cache_entry_ + kShardCount - 1) / kShardCount;
+    max_shard_bytes_ = (max_cache_bytes_ + kShardCount - 1) / kShardCount;
+
+    // the sketch should track a few times more keys than the shard holds
+    size_t nentry = max_shard_entry_;
+    if (nentry == 0 && max_entry_size_ > 0) {
+        nentry = max_shard_bytes_ / max_entry_size_ + 1;
+    }
+    for (size_t i = 0; i < kShardCount; i++) {
+        utils::Lock lk(shards_[i].mutex);
+        shards_[i].sketch.resize(nentry);
+    }
+}
+
+void
+IOCache::add_entry(Shard& shard, const IOCacheEntryPtr& entry)
+{
+    shard.entries.push_front(entry);
+    shard.entry_map.insert(std::make_pair(entry->path,
+                                          shard.entries.begin()));
+    shard.bytes += entry->file_size;
+}
+
+void
+IOCache::move_entry(Shard& shard, EntryMap::iterator map_it)
+{
+    // relinking keeps the iterator stored in the map valid
+    shard.entries.splice(shard.entries.begin(), shard.entries,
+                         map_it->second);
+}
 
-    entries_.erase(it);
-    entry_map_.erase(entry->path);
-    delete entry;
+void
+IOCache::drop_entry(Shard& shard)
+{
+    EntryList::iterator it = shard.entries.end();
+    --it;
+    shard.bytes -= (*it)->file_size;
+    shard.entry_map.erase((*it)->path);
+    shard.entries.erase(it);
 }
 
 void
-IOCache::remove_entry(EntryMap::iterator map_it)
+IOCache::remove_entry(Shard& shard, EntryMap::iterator map_it)
 {
-    IOCacheEntry* entry = *(map_it->second);
-    entries_.erase(map_it->second);
-    entry_map_.erase(map_it);
-    delete entry;
+    shard.bytes -= (*(map_it->second))->file_size;
+    shard.entries.erase(map_it->second);
+    shard.entry_map.erase(map_it);
 }
 
-IOCacheEntry*
+bool
+IOCache::has_room(size_t nentry, size_t nbytes) const
+{
+    if (max_shard_entry_ > 0 && nentry > max_shard_entry_)
+        return false;
+    if (max_shard_bytes_ > 0 && nbytes > max_shard_bytes_)
+        return false;
+    return true;
+}
+
+bool
+IOCache::admit(Shard& shard, size_t hash, size_t file_size)
+{
+    size_t nentry = shard.entries.size() + 1;
+    size_t nbytes = shard.bytes + file_size;
+    if (policy_ == kAdmitAll || has_room(nentry, nbytes))
+        return true;
+
+    // only worth it if every entry pushed out is less popular
+    boost::hash<std::string> hasher;
+    u8 freq = shard.sketch.frequency(hash);
+    EntryList::reverse_iterator it = shard.entries.rbegin();
+    for (; it != shard.entries.rend(); ++it) {
+        const IOCacheEntryPtr& victim = *it;
+        if (shard.sketch.frequency(hasher(victim->path)) >= freq)
+            return false;
+        nentry--;
+        nbytes -= victim->file_size;
+        if (has_room(nentry, nbytes))
+            return true;
+    }
+    return true;
+}
+
+IOCacheEntryPtr
 IOCache::create_cache_entry(const std::string& file_path, time_t mtime,
                             size_t file_size)
 {
-    if (file_size >= max_entry_size_)
-        return NULL;
-    IOCacheEntry* entry = new IOCacheEntry(file_path, mtime, file_size);
+    IOCacheEntryPtr entry;
+    if (mmap_threshold_ > 0 && file_size >= mmap_threshold_) {
+        entry.reset(new MappedIOCacheEntry(file_path, mtime, file_size,
+                                           mmap_populate_));
+        if (entry->file_content != NULL) {
+            mapped_.increment();
+            return entry;
+        }
+        // fall back to a heap copy if it cannot be mapped
+    }
+    entry.reset(new IOCacheEntry(file_path, mtime, file_size));
     if (entry->file_content == NULL) {
-        delete entry;
-        entry = NULL;
+        return IOCacheEntryPtr();
     }
     return entry;
 }
 
-byte*
-IOCache::sync_cache(EntryMap::iterator it, const std::string& file_path,
-                    time_t mtime, size_t file_size)
+IOCacheEntryPtr
+IOCache::load_cache(Shard& shard, const std::string& file_path, time_t mtime,
+                    size_t file_size)
 {
-    IOCacheEntry* entry = *(it->second);
-    if (entry->last_mtime >= mtime && entry->last_mtime
-        && entry->size == file_size) {
-        move_entry(it);
-        byte* ret = entry->data_copy();
-        mutex_.unlock();
-        return ret;
+    // read the file without holding the shard lock
+    IOCacheEntryPtr entry = create_cache_entry(file_path, mtime, file_size);
+    if (!entry) {
+        return entry;
     }
-    remove_entry(it);
-
-    return load_cache(file_path, mtime, file_size);
+    utils::Lock lk(shard.mutex);
+    store_entry(shard, entry);
+    return entry;
 }
 
-byte*
-IOCache::load_cache(const std::string& file_path, time_t mtime,
-                    size_t file_size)
+void
+IOCache::store_entry(Shard& shard, const IOCacheEntryPtr& entry)
 {
-    // load cache
-    if (entries_.size() >= max_cache_entry_) {
-        drop_entry();
+    EntryMap::iterator it = shard.entry_map.find(entry->path);
+    if (it != shard.entry_map.end()) {
+        // loaded by another thread meanwhile, ours is at least as fresh
+        remove_entry(shard, it);
     }
-
-    mutex_.unlock();
-    IOCacheEntry* entry = create_cache_entry(file_path, mtime, file_size);
-    if (entry == NULL) {
-        return NULL;
+    while (!shard.entries.empty()
+           && !has_room(shard.entries.size() + 1,
+                        shard.bytes + entry->file_size)) {
+        drop_entry(shard);
+        evictions_.increment();
     }
-    utils::Lock lk(mutex_);
-    add_entry(entry);
-    return entry->data_copy();
+    add_entry(shard, entry);
+    admissions_.increment();
 }
 
-byte*
+IOCacheEntryPtr
 IOCache::access_cache(const std::string& file_path, time_t mtime,
-                      size_t file_size)
+                      size_t file_size, bool* hit)
 {
-    if (max_cache_entry_ == 0)
-        return NULL;
-    mutex_.lock();
-    EntryMap::iterator it = entry_map_.find(file_path);
-    if (it == entry_map_.end()) {
-        return load_cache(file_path, mtime, file_size);
-    } else {
-        return sync_cache(it, file_path, mtime, file_size);
+    if (hit) {
+        *hit = false;
+    }
+    if (!enabled() || file_size >= max_entry_size_
+        || (max_shard_bytes_ > 0 && file_size > max_shard_bytes_))
+        return IOCacheEntryPtr();
+    boost::hash<std::string> hasher;
+    size_t hash = hasher(file_path);
+    Shard& shard = shard_of(hash);
+    utils::Lock lk(shard.mutex);
+    shard.sketch.increment(hash);
+    EntryMap::iterator it = shard.entry_map.find(file_path);
+    if (it != shard.entry_map.end()) {
+        IOCacheEntryPtr entry = *(it->second);
+        if (entry->last_mtime >= mtime && entry->last_mtime
+            && entry->file_size == file_size) {
+            move_entry(shard, it);
+            lk.unlock();
+            hits_.increment();
+            if (hit) {
+                *hit = true;
+            }
+            return entry;
+        }
+        // stale, readers still holding it keep their copy alive
+        remove_entry(shard, it);
     }
+    misses_.increment();
+    if (!admit(shard, hash, file_size)) {
+        lk.unlock();
+        rejections_.increment();
+        return IOCacheEntryPtr();
+    }
+    lk.unlock();
+    return load_cache(shard, file_path, mtime, file_size);
+}
+
+IOCacheEntryPtr
+IOCache::find_cache(const std::string& key, time_t mtime)
+{
+    if (!enabled())
+        return IOCacheEntryPtr();
+    boost::hash<std::string> hasher;
+    size_t hash = hasher(key);
+    Shard& shard = shard_of(hash);
+    utils::Lock lk(shard.mutex);
+    shard.sketch.increment(hash);
+    EntryMap::iterator it = shard.entry_map.find(key);
+    if (it != shard.entry_map.end()) {
+        IOCacheEntryPtr entry = *(it->second);
+        if (entry->last_mtime >= mtime) {
+            move_entry(shard, it);
+            lk.unlock();
+            hits_.increment();
+            return entry;
+        }
+        remove_entry(shard, it);
+    }
+    lk.unlock();
+    misses_.increment();
+    return IOCacheEntryPtr();
+}
+
+void
+IOCache::insert_cache(const IOCacheEntryPtr& entry)
+{
+    if (!enabled() || entry->file_size >= max_entry_size_
+        || (max_shard_bytes_ > 0 && entry->file_size > max_shard_bytes_))
+        return;
+    boost::hash<std::string> hasher;
+    Shard& shard = shard_of(hasher(entry->path));
+    utils::Lock lk(shard.mutex);
+    store_entry(shard, entry);
 }
 
 }
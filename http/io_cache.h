@@ -4,61 +4,170 @@
 #define _IO_CACHE_H_
 
 #include <string>
-#include <map>
+#include <list>
+#include <vector>
 #include <ctime>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
 
 #include "utils/misc.h"
+#include "core/block_sender.h"
 
 namespace tube {
 
-struct IOCacheEntry
+// Entries are immutable once loaded, so a hit can hand the entry itself to
+// the output stream while it stays in (or drops out of) the cache.
+struct IOCacheEntry : public DataBlock
 {
     static const size_t kCacheEntryMaxSize;
     std::string path;
     time_t last_mtime; // size and extra stuff are synchronized every request
     byte*  file_content;
-    size_t size;
+    size_t file_size;
 
-    IOCacheEntry(const std::string& file_path, time_t mtime, size_t file_size);
+    IOCacheEntry(const std::string& file_path, time_t mtime, size_t size);
+    // holds a copy of content instead of a file, e.g. a compressed variant
+    IOCacheEntry(const std::string& key, time_t mtime,
+                 const std::string& content);
     virtual ~IOCacheEntry();
 
-    byte* data_copy();
+    virtual const byte* data() const { return file_content; }
+    virtual size_t      size() const { return file_size; }
+protected:
+    // leaves loading the content to the subclass
+    IOCacheEntry(const std::string& file_path, size_t size);
 };
 
-class IOCache
+// Serves the file straight from a read-only shared mapping, so the memory
+// belongs to the page cache instead of the heap and loading makes no copy.
+// The file must not be truncated in place while mapped, replace it with a
+// rename instead.
+struct MappedIOCacheEntry : public IOCacheEntry
 {
-    typedef std::list<IOCacheEntry*> EntryList;
-    typedef std::map<std::string, EntryList::iterator> EntryMap;
+    MappedIOCacheEntry(const std::string& file_path, time_t mtime, size_t size,
+                       bool populate);
+    virtual ~MappedIOCacheEntry();
+};
 
-    size_t max_cache_entry_;
-    size_t max_entry_size_;
+typedef boost::shared_ptr<IOCacheEntry> IOCacheEntryPtr;
+
+// Approximate access counts of recently requested keys: a count-min sketch
+// with small saturating counters that are halved periodically, so old
+// popularity fades away.
+class FrequencySketch
+{
+    std::vector<u8> table_;
+    size_t          width_mask_;
+    size_t          additions_;
+    size_t          sample_size_;
+public:
+    static const int kDepth;
+    static const u8  kMaxFrequency;
 
-    EntryList entries_;
-    EntryMap entry_map_;
+    FrequencySketch();
+
+    void resize(size_t nentry);
+    void increment(size_t hash);
+    u8   frequency(size_t hash) const;
+private:
+    size_t index_of(size_t hash, int row) const;
+    void   age();
+};
+
+class IOCache : utils::Noncopyable
+{
+    typedef std::list<IOCacheEntryPtr> EntryList;
+    typedef boost::unordered_map<std::string, EntryList::iterator> EntryMap;
+
+    // each shard is an independent LRU cache with its own lock
+    struct Shard
+    {
+        utils::Mutex    mutex;
+        EntryList       entries;
+        EntryMap        entry_map;
+        size_t          bytes;
+        FrequencySketch sketch;
+
+        Shard() : bytes(0) {}
+    };
 
-    utils::Mutex mutex_;
 public:
+    enum AdmissionPolicy {
+        kAdmitAll,       // plain LRU, every miss is cached
+        kAdmitFrequent   // a miss may only evict entries used less often
+    };
+
+    static const size_t kShardCount;
+
     IOCache();
+    ~IOCache();
 
-    void set_max_cache_entry(size_t nentry) { max_cache_entry_ = nentry; }
+    // zero means no limit for either of these, both zero disables the cache
+    void set_max_cache_entry(size_t nentry);
+    void set_max_cache_bytes(size_t nbytes);
     void set_max_entry_size(size_t size) { max_entry_size_ = size; }
+    void set_admission_policy(AdmissionPolicy policy) { policy_ = policy; }
+    // files of at least threshold bytes are mapped instead of read, zero
+    // never maps
+    void set_mmap_threshold(size_t threshold) { mmap_threshold_ = threshold; }
+    void set_mmap_populate(bool populate) { mmap_populate_ = populate; }
+
+    bool enabled() const {
+        return max_cache_entry_ > 0 || max_cache_bytes_ > 0;
+    }
+
+    // returns a NULL pointer if the file is not (going to be) cached.  hit
+    // is set if the entry was there already and nothing was read.
+    IOCacheEntryPtr access_cache(const std::string& file_path, time_t mtime,
+                                 size_t file_size, bool* hit = NULL);
+
+    // for entries built by the caller, a miss never loads anything
+    IOCacheEntryPtr find_cache(const std::string& key, time_t mtime);
+    void            insert_cache(const IOCacheEntryPtr& entry);
+
+    u64 hit_count() const { return hits_.value(); }
+    u64 miss_count() const { return misses_.value(); }
+    u64 admission_count() const { return admissions_.value(); }
+    u64 rejection_count() const { return rejections_.value(); }
+    u64 eviction_count() const { return evictions_.value(); }
+    u64 mapped_count() const { return mapped_.value(); }
+private:
+    Shard& shard_of(size_t hash) { return shards_[hash % kShardCount]; }
+    void   update_shard_limits();
+
+    bool   has_room(size_t nentry, size_t nbytes) const;
+    bool   admit(Shard& shard, size_t hash, size_t file_size);
+
+    IOCacheEntryPtr create_cache_entry(const std::string& file_path,
+                                       time_t mtime, size_t file_size);
+    IOCacheEntryPtr load_cache(Shard& shard, const std::string& file_path,
+                               time_t mtime, size_t file_size);
+    void            store_entry(Shard& shard, const IOCacheEntryPtr& entry);
+
+    void add_entry(Shard& shard, const IOCacheEntryPtr& entry);
+    void move_entry(Shard& shard, EntryMap::iterator map_it);
+    void drop_entry(Shard& shard);
+    void remove_entry(Shard& shard, EntryMap::iterator map_it);
 
-    byte* access_cache(const std::string& file_path, time_t mtime,
-                       size_t file_size);
 private:
-    IOCacheEntry* create_cache_entry(const std::string& file_path, time_t mtime,
-                                     size_t file_size);
+    size_t max_cache_entry_;
+    size_t max_cache_bytes_;
+    size_t max_shard_entry_;
+    size_t max_shard_bytes_;
+    size_t max_entry_size_;
+    size_t mmap_threshold_;
+    bool   mmap_populate_;
 
-    byte* load_cache(const std::string& file_path, time_t mtime,
-                     size_t file_size);
+    AdmissionPolicy policy_;
 
-    byte* sync_cache(EntryMap::iterator it, const std::string& file_path,
-                     time_t mtime, size_t file_size);
+    Shard* shards_;
 
-    void add_entry(IOCacheEntry* entry);
-    void move_entry(EntryMap::iterator map_it);
-    void drop_entry();
-    void remove_entry(EntryMap::iterator map_it);
+    utils::AtomicCounter hits_;
+    utils::AtomicCounter misses_;
+    utils::AtomicCounter admissions_;
+    utils::AtomicCounter rejections_;
+    utils::AtomicCounter evictions_;
+    utils::AtomicCounter mapped_;
 };
 
 }
@@ -0,0 +1,238 @@
+#include "pch.h"
+
+#include <fstream>
+#include <sstream>
+#include <cctype>
+
+#include "http/mime_types.h"
+#include "utils/logger.h"
+
+namespace tube {
+
+const char* MimeTypeRegistry::kDefaultType = "application/octet-stream";
+
+static const char* kBuiltinTypes[][2] = {
+    {"html", "text/html"},
+    {"htm", "text/html"},
+    {"shtml", "text/html"},
+    {"css", "text/css"},
+    {"txt", "text/plain"},
+    {"text", "text/plain"},
+    {"csv", "text/csv"},
+    {"xml", "text/xml"},
+    {"md", "text/markdown"},
+    {"js", "application/javascript"},
+    {"mjs", "application/javascript"},
+    {"json", "application/json"},
+    {"map", "application/json"},
+    {"wasm", "application/wasm"},
+    {"pdf", "application/pdf"},
+    {"rss", "application/rss+xml"},
+    {"atom", "application/atom+xml"},
+    {"xhtml", "application/xhtml+xml"},
+    {"zip", "application/zip"},
+    {"gz", "application/gzip"},
+    {"tgz", "application/gzip"},
+    {"bz2", "application/x-bzip2"},
+    {"xz", "application/x-xz"},
+    {"tar", "application/x-tar"},
+    {"7z", "application/x-7z-compressed"},
+    {"jar", "application/java-archive"},
+    {"deb", "application/octet-stream"},
+    {"bin", "application/octet-stream"},
+    {"exe", "application/octet-stream"},
+    {"iso", "application/octet-stream"},
+    {"png", "image/png"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"gif", "image/gif"},
+    {"webp", "image/webp"},
+    {"avif", "image/avif"},
+    {"svg", "image/svg+xml"},
+    {"svgz", "image/svg+xml"},
+    {"ico", "image/x-icon"},
+    {"bmp", "image/bmp"},
+    {"tif", "image/tiff"},
+    {"tiff", "image/tiff"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"ttf", "font/ttf"},
+    {"otf", "font/otf"},
+    {"eot", "application/vnd.ms-fontobject"},
+    {"mp3", "audio/mpeg"},
+    {"ogg", "audio/ogg"},
+    {"wav", "audio/wav"},
+    {"flac", "audio/flac"},
+    {"m4a", "audio/mp4"},
+    {"mp4", "video/mp4"},
+    {"m4v", "video/mp4"},
+    {"webm", "video/webm"},
+    {"ogv", "video/ogg"},
+    {"mov", "video/quicktime"},
+    {"avi", "video/x-msvideo"},
+    {"mkv", "video/x-matroska"},
+    {"m3u8", "application/vnd.apple.mpegurl"},
+    {"ts", "video/mp2t"},
+};
+
+MimeTypeRegistry::MimeTypeRegistry()
+    : nused_(0), default_type_(kDefaultType)
+{
+    slots_.resize(128);
+    add_builtin_types();
+}
+
+void
+MimeTypeRegistry::add_builtin_types()
+{
+    size_t ntypes = sizeof(kBuiltinTypes) / sizeof(kBuiltinTypes[0]);
+    for (size_t i = 0; i < ntypes; i++) {
+        add(kBuiltinTypes[i][0], kBuiltinTypes[i][1]);
+    }
+}
+
+size_t
+MimeTypeRegistry::hash(const char* ext, size_t len)
+{
+    // FNV-1a over the lower case extension
+    size_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) tolower(ext[i]);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void
+MimeTypeRegistry::insert_slot(const std::string& ext, const std::string& type)
+{
+    size_t mask = slots_.size() - 1;
+    size_t i = hash(ext.data(), ext.length()) & mask;
+    while (!slots_[i].ext.empty() && slots_[i].ext != ext) {
+        i = (i + 1) & mask;
+    }
+    if (slots_[i].ext.empty()) {
+        slots_[i].ext = ext;
+        nused_++;
+    }
+    slots_[i].type = type;
+}
+
+void
+MimeTypeRegistry::grow()
+{
+    std::vector<Slot> old;
+    old.swap(slots_);
+    slots_.resize(old.size() * 2);
+    nused_ = 0;
+    for (size_t i = 0; i < old.size(); i++) {
+        if (!old[i].ext.empty()) {
+            insert_slot(old[i].ext, old[i].type);
+        }
+    }
+}
+
+void
+MimeTypeRegistry::add(const std::string& ext, const std::string& type)
+{
+    if (ext.empty())
+        return;
+    if ((nused_ + 1) * 2 > slots_.size()) {
+        grow();
+    }
+    std::string lower(ext);
+    for (size_t i = 0; i < lower.length(); i++) {
+        lower[i] = tolower(lower[i]);
+    }
+    insert_slot(lower, type);
+}
+
+void
+MimeTypeRegistry::reset()
+{
+    slots_.clear();
+    slots_.resize(128);
+    nused_ = 0;
+    add_builtin_types();
+}
+
+bool
+MimeTypeRegistry::load_file(const std::string& path)
+{
+    std::ifstream fin(path.c_str());
+    if (!fin) {
+        LOG(WARNING, "cannot open mime types file %s", path.c_str());
+        return false;
+    }
+    std::string line;
+    while (std::getline(fin, line)) {
+        size_t comment = line.find('#');
+        if (comment != std::string::npos) {
+            line.erase(comment);
+        }
+        // nginx syntax only adds punctuation around the same fields
+        for (size_t i = 0; i < line.length(); i++) {
+            if (line[i] == ';' || line[i] == '{' || line[i] == '}') {
+                line[i] = ' ';
+            }
+        }
+        std::stringstream ss(line);
+        std::string type, ext;
+        if (!(ss >> type))
+            continue;
+        if (type == "types" && !(ss >> type))
+            continue;
+        if (type.find('/') == std::string::npos)
+            continue;
+        while (ss >> ext) {
+            add(ext, type);
+        }
+    }
+    return true;
+}
+
+const std::string&
+MimeTypeRegistry::lookup(const char* ext, size_t len) const
+{
+    if (len == 0 || slots_.empty())
+        return default_type_;
+    size_t mask = slots_.size() - 1;
+    size_t i = hash(ext, len) & mask;
+    while (!slots_[i].ext.empty()) {
+        const std::string& slot_ext = slots_[i].ext;
+        if (slot_ext.length() == len) {
+            size_t j = 0;
+            while (j < len && slot_ext[j] == tolower(ext[j])) {
+                j++;
+            }
+            if (j == len)
+                return slots_[i].type;
+        }
+        i = (i + 1) & mask;
+    }
+    return default_type_;
+}
+
+const std::string&
+MimeTypeRegistry::lookup_path(const std::string& path) const
+{
+    size_t dot = path.rfind('.');
+    if (dot == std::string::npos || path.find('/', dot) != std::string::npos)
+        return default_type_;
+    return lookup(path.data() + dot + 1, path.length() - dot - 1);
+}
+
+bool
+match_mime_type(const std::string& pattern, const std::string& type)
+{
+    if (pattern == "*" || pattern == "*/*")
+        return true;
+    size_t len = pattern.length();
+    if (len >= 2 && pattern[len - 1] == '*' && pattern[len - 2] == '/') {
+        // "text/*"
+        return type.compare(0, len - 1, pattern, 0, len - 1) == 0;
+    }
+    return pattern == type;
+}
+
+}
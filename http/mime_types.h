@@ -0,0 +1,62 @@
+// -*- mode: c++ -*-
+
+#ifndef _MIME_TYPES_H_
+#define _MIME_TYPES_H_
+
+#include <string>
+#include <vector>
+
+#include "utils/misc.h"
+
+namespace tube {
+
+// Maps file extensions to MIME types.  Filled while the configuration is
+// loaded and read-only afterwards, so lookups take no lock.  Extensions are
+// case insensitive.
+class MimeTypeRegistry : utils::Noncopyable
+{
+    struct Slot
+    {
+        std::string ext; // lower case, empty if the slot is free
+        std::string type;
+    };
+
+    // open addressing with linear probing, at most half full
+    std::vector<Slot> slots_;
+    size_t            nused_;
+    std::string       default_type_;
+public:
+    static const char* kDefaultType;
+
+    // starts with the built-in types
+    MimeTypeRegistry();
+
+    void add(const std::string& ext, const std::string& type);
+    // back to the built-in types only
+    void reset();
+    void set_default_type(const std::string& type) { default_type_ = type; }
+
+    // reads a mime.types file, either "type ext ext..." per line as shipped
+    // with Apache or the "types { type ext...; }" block of nginx.  false if
+    // it cannot be opened.
+    bool load_file(const std::string& path);
+
+    // the default type if the extension is unknown
+    const std::string& lookup(const char* ext, size_t len) const;
+    const std::string& lookup_path(const std::string& path) const;
+
+    size_t size() const { return nused_; }
+private:
+    static size_t hash(const char* ext, size_t len);
+
+    void add_builtin_types();
+    void grow();
+    void insert_slot(const std::string& ext, const std::string& type);
+};
+
+// "text/html" matches "text/html" and "text/*"
+bool match_mime_type(const std::string& pattern, const std::string& type);
+
+}
+
+#endif /* _MIME_TYPES_H_ */
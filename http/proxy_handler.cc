@@ -0,0 +1,363 @@
+#include "pch.h"
+
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <sys/socket.h>
+#include <boost/bind.hpp>
+
+#include "http/proxy_handler.h"
+#include "utils/logger.h"
+#include "module.h"
+
+namespace tube {
+
+// hop-by-hop headers, they only describe one of the two connections
+static const char* kHopByHopHeaders[] = {
+    "connection",
+    "keep-alive",
+    "proxy-connection",
+    "proxy-authenticate",
+    "proxy-authorization",
+    "te",
+    "trailer",
+    "transfer-encoding",
+    "upgrade",
+    "content-length",
+};
+
+static bool
+is_hop_by_hop(const std::string& key)
+{
+    size_t n = sizeof(kHopByHopHeaders) / sizeof(kHopByHopHeaders[0]);
+    for (size_t i = 0; i < n; i++) {
+        if (utils::ignore_compare(key, kHopByHopHeaders[i]))
+            return true;
+    }
+    return false;
+}
+
+static bool
+send_all(int fd, const char* ptr, size_t size)
+{
+    while (size > 0) {
+        ssize_t nsent = ::send(fd, ptr, size, MSG_NOSIGNAL);
+        if (nsent < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        ptr += nsent;
+        size -= nsent;
+    }
+    return true;
+}
+
+static void
+respond_error(const HttpResponseStatus& error, HttpRequest& request,
+              HttpResponse& response)
+{
+    LOG(WARNING, "%d with %s", error.status_code, request.uri().c_str());
+    std::string body = error.reason + "\n";
+    response.add_header("Content-Type", "text/plain");
+    response.write_data((const byte*) body.c_str(), body.length());
+    response.respond(error);
+}
+
+ProxyHttpHandler::ProxyHttpHandler()
+{
+    add_option("upstreams", "");
+    add_option("balance", "round_robin");
+    add_option("max_idle_connections", "32");
+    add_option("connect_timeout", "1000");
+    add_option("read_timeout", "30000");
+}
+
+void
+ProxyHttpHandler::load_param()
+{
+    std::stringstream ss(option("upstreams"));
+    std::string name;
+    while (ss >> name) {
+        pool_.add_upstream(name);
+    }
+    if (pool_.upstream_count() == 0) {
+        LOG(ERROR, "proxy handler %s has no upstreams", this->name().c_str());
+    }
+    std::string balance = option("balance");
+    if (balance == "least_conn") {
+        pool_.set_balance(UpstreamPool::kLeastConnections);
+    } else {
+        if (balance != "round_robin")
+            LOG(WARNING, "unknown balance %s, using round_robin",
+                balance.c_str());
+        pool_.set_balance(UpstreamPool::kRoundRobin);
+    }
+    pool_.set_max_idle(atoi(option("max_idle_connections").c_str()));
+    pool_.set_connect_timeout(atoi(option("connect_timeout").c_str()));
+    pool_.set_io_timeout(atoi(option("read_timeout").c_str()));
+    pool_.start_watcher();
+}
+
+void
+ProxyHttpHandler::shutdown()
+{
+    pool_.stop_watcher();
+}
+
+std::string
+ProxyHttpHandler::request_head(HttpRequest& request) const
+{
+    std::string forwarded_for;
+    std::string head = request.method_string() + " " + request.uri()
+        + " HTTP/1.1\r\n";
+    const HttpHeaderEnumerate& headers = request.headers();
+    for (size_t i = 0; i < headers.size(); i++) {
+        const HttpHeaderItem& item = headers[i];
+        if (is_hop_by_hop(item.key))
+            continue;
+        if (utils::ignore_compare(item.key, "x-forwarded-for")) {
+            forwarded_for += item.value + ", ";
+            continue;
+        }
+        head += item.key + ": " + item.value + "\r\n";
+    }
+    forwarded_for += request.connection()->address_string();
+    head += "X-Forwarded-For: " + forwarded_for + "\r\n";
+    if (request.content_length() > 0) {
+        std::stringstream ss;
+        ss << request.content_length();
+        head += "Content-Length: " + ss.str() + "\r\n";
+    }
+    head += "\r\n";
+    return head;
+}
+
+void
+ProxyHttpHandler::handle_request(HttpRequest& request, HttpResponse& response)
+{
+    if (request.transfer_encoding() == HTTP_CHUNKED) {
+        // the upstream is told the length up front, a chunked body would
+        // have to be buffered whole to learn it
+        respond_error(HttpResponseStatus::kHttpResponseLengthRequired,
+                      request, response);
+        return;
+    }
+    if (!pool_.is_watching()) {
+        respond_error(HttpResponseStatus::kHttpResponseBadGateway, request,
+                      response);
+        return;
+    }
+    std::string head = request_head(request);
+    UpstreamConnection* conn = NULL;
+    bool can_retry = false;
+    while (true) {
+        bool reused = false;
+        conn = pool_.acquire(&reused);
+        if (conn == NULL) {
+            respond_error(HttpResponseStatus::kHttpResponseBadGateway,
+                          request, response);
+            return;
+        }
+        // without a body nothing is lost if the upstream closed the
+        // connection just before it got the request.  a retried request
+        // isn't retried again.
+        can_retry = reused && request.content_length() == 0
+            && !request.is_resumed();
+        ForwardResult res = forward(conn, head, can_retry, request, response);
+        if (res == kForwardDone)
+            return;
+        if (res == kForwardSent)
+            break;
+        LOG(DEBUG, "kept alive upstream connection closed, retrying");
+    }
+
+    HttpAsyncResponsePtr async_response = response.suspend();
+    if (!async_response) {
+        pool_.release(conn, false);
+        return;
+    }
+    ProxyExchangePtr exchange(new ProxyExchange(conn, async_response));
+    exchange->head_request = request.method() == HTTP_HEAD;
+    exchange->can_retry = can_retry;
+    async_response->set_drain_handler(
+        boost::bind(&UpstreamPool::resume, &pool_, conn));
+    // from here on the watcher thread answers, whatever happens
+    if (!pool_.watch(conn, boost::bind(&ProxyHttpHandler::handle_upstream,
+                                       this, exchange, _1))) {
+        finish(*exchange, false);
+        async_response->respond(HttpResponseStatus::kHttpResponseBadGateway);
+    }
+}
+
+ProxyHttpHandler::ForwardResult
+ProxyHttpHandler::forward(UpstreamConnection* conn, const std::string& head,
+                          bool can_retry, HttpRequest& request,
+                          HttpResponse& response)
+{
+    if (!send_all(conn->fd, head.data(), head.length())) {
+        pool_.release(conn, false);
+        if (can_retry)
+            return kForwardRetry;
+        respond_error(HttpResponseStatus::kHttpResponseBadGateway, request,
+                      response);
+        return kForwardDone;
+    }
+
+    byte buf[kBufferSize];
+    u64 remaining = request.content_length();
+    while (remaining > 0) {
+        ssize_t nread = request.read_data(
+            buf, remaining < kBufferSize ? remaining : kBufferSize);
+        if (nread <= 0) {
+            // the client is gone, so is the rest of the body
+            pool_.release(conn, false);
+            request.connection()->close_after_finish = true;
+            respond_error(HttpResponseStatus::kHttpResponseBadRequest, request,
+                          response);
+            return kForwardDone;
+        }
+        if (!send_all(conn->fd, (const char*) buf, nread)) {
+            pool_.release(conn, false);
+            request.connection()->close_after_finish = true;
+            respond_error(HttpResponseStatus::kHttpResponseBadGateway,
+                          request, response);
+            return kForwardDone;
+        }
+        remaining -= nread;
+    }
+    return kForwardSent;
+}
+
+// on the watcher thread, each time the upstream sent something
+void
+ProxyHttpHandler::handle_upstream(const ProxyExchangePtr& exchange,
+                                  bool timed_out)
+{
+    ProxyExchange& ex = *exchange;
+    const char* name = ex.conn->upstream->name.c_str();
+    if (timed_out) {
+        LOG(WARNING, "upstream %s timed out", name);
+        finish(ex, false);
+        if (ex.head_done)
+            ex.response->fail();
+        else
+            ex.response->respond(
+                HttpResponseStatus::kHttpResponseGatewayTimeout);
+        return;
+    }
+    if (ex.response->is_aborted()) {
+        // the client is gone, the rest of the answer with it
+        finish(ex, false);
+        return;
+    }
+    ssize_t nreceived = ex.reader.receive();
+    if (nreceived < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+    if (nreceived < 0) {
+        LOG(WARNING, "cannot read from upstream %s: %s", name,
+            strerror(errno));
+        finish(ex, false);
+        ex.response->fail();
+        return;
+    }
+
+    if (!ex.head_done) {
+        UpstreamResponseReader::HeadResult res =
+            ex.reader.take_head(ex.upstream_response, ex.head_request);
+        if (res == UpstreamResponseReader::kHeadPending && nreceived > 0)
+            return;
+        if (res != UpstreamResponseReader::kHeadDone) {
+            bool retry = ex.can_retry && ex.reader.is_untouched();
+            finish(ex, false);
+            if (retry) {
+                LOG(DEBUG, "kept alive upstream connection closed, retrying");
+                ex.response->retry();
+            } else {
+                LOG(WARNING, "upstream %s sent no valid answer", name);
+                ex.response->fail();
+            }
+            return;
+        }
+        ex.head_done = true;
+        begin_response(ex);
+    }
+
+    HttpResponseStatus status(ex.upstream_response.status_code,
+                              ex.upstream_response.reason);
+    byte buf[kBufferSize];
+    ssize_t nread;
+    while ((nread = ex.reader.take_body(buf, kBufferSize)) > 0) {
+        ex.response->write_data(buf, nread);
+    }
+    if (nread == 0) {
+        finish(ex, ex.reader.reusable());
+        ex.response->respond(status);
+        return;
+    }
+    if (errno != EAGAIN) {
+        LOG(WARNING, "upstream %s cut the body short", name);
+        finish(ex, false);
+        ex.response->fail();
+        return;
+    }
+    // the drain handler resumes it
+    if (ex.response->is_congested())
+        pool_.pause(ex.conn);
+}
+
+void
+ProxyHttpHandler::begin_response(ProxyExchange& ex)
+{
+    const UpstreamResponse& upstream_response = ex.upstream_response;
+    HttpResponseStatus status(upstream_response.status_code,
+                              upstream_response.reason);
+    const HttpHeaderEnumerate& headers = upstream_response.headers;
+    for (size_t i = 0; i < headers.size(); i++) {
+        if (!is_hop_by_hop(headers[i].key))
+            ex.response->add_header(headers[i].key, headers[i].value);
+    }
+    if (!ex.reader.has_body()) {
+        // a HEAD answer still tells the length of the body it leaves out,
+        // and it is complete already
+        ex.response->set_content_length(
+            upstream_response.content_length >= 0
+            ? upstream_response.content_length : 0);
+    } else if (upstream_response.content_length >= 0
+               && !upstream_response.chunked) {
+        ex.response->set_content_length(upstream_response.content_length);
+        ex.response->begin_streaming(status);
+    } else {
+        // the length is only known at the end, if at all
+        ex.response->begin_streaming(status);
+    }
+}
+
+void
+ProxyHttpHandler::finish(ProxyExchange& ex, bool reusable)
+{
+    ex.response->set_drain_handler(HttpAsyncResponse::DrainHandler());
+    pool_.release(ex.conn, reusable);
+}
+
+static void
+proxy_handler_module_init()
+{
+    static ProxyHttpHandlerFactory proxy_handler_factory;
+    BaseHttpHandlerFactory::register_factory(&proxy_handler_factory);
+}
+
+static struct ProxyHandlerModule : public Module
+{
+    ProxyHandlerModule() {
+        this->on_initialize = proxy_handler_module_init;
+        this->name = "proxy_handler";
+        this->vendor = "tube server";
+        this->description = "reverse proxy handler";
+    }
+} proxy_handler_module;
+
+EXPORT_MODULE_STATIC(proxy_handler_module);
+
+}
@@ -0,0 +1,86 @@
+// -*- mode: c++ -*-
+
+#ifndef _PROXY_HANDLER_H_
+#define _PROXY_HANDLER_H_
+
+#include <string>
+#include <boost/shared_ptr.hpp>
+
+#include "http/http_wrapper.h"
+#include "http/interface.h"
+#include "http/upstream.h"
+
+namespace tube {
+
+// a request whose answer the pool's watcher passes on
+struct ProxyExchange : utils::Noncopyable
+{
+    UpstreamConnection*    conn;
+    HttpAsyncResponsePtr   response;
+    UpstreamResponseReader reader;
+    UpstreamResponse       upstream_response;
+    bool                   head_request;
+    // a kept alive connection closed unanswered, a fresh one can take it
+    bool                   can_retry;
+    bool                   head_done;
+
+    ProxyExchange(UpstreamConnection* upstream_conn,
+                  const HttpAsyncResponsePtr& async_response)
+        : conn(upstream_conn), response(async_response),
+          reader(upstream_conn->fd), head_request(false), can_retry(false),
+          head_done(false) {}
+};
+
+typedef boost::shared_ptr<ProxyExchange> ProxyExchangePtr;
+
+// Forwards requests to a set of upstream servers over kept alive
+// connections.  The handler thread only sends the request, reading a
+// content-length body from the client as it goes; the answer is streamed
+// to the client from the pool's watcher thread, which stops reading an
+// upstream while its client is behind.
+class ProxyHttpHandler : public BaseHttpHandler
+{
+    UpstreamPool pool_;
+public:
+    static const size_t kBufferSize = 16384;
+
+    ProxyHttpHandler();
+    virtual void load_param();
+    virtual void handle_request(HttpRequest& request, HttpResponse& response);
+    virtual void shutdown();
+
+    UpstreamPool& pool() { return pool_; }
+private:
+    enum ForwardResult {
+        kForwardSent,
+        kForwardDone, // answered with an error
+        kForwardRetry // a kept alive connection was closed under us
+    };
+
+    std::string   request_head(HttpRequest& request) const;
+    ForwardResult forward(UpstreamConnection* conn, const std::string& head,
+                          bool can_retry, HttpRequest& request,
+                          HttpResponse& response);
+    void          handle_upstream(const ProxyExchangePtr& exchange,
+                                  bool timed_out);
+    void          begin_response(ProxyExchange& exchange);
+    void          finish(ProxyExchange& exchange, bool reusable);
+};
+
+class ProxyHttpHandlerFactory : public BaseHttpHandlerFactory
+{
+public:
+    virtual BaseHttpHandler* create() const {
+        return new ProxyHttpHandler();
+    }
+    virtual std::string module_name() const {
+        return std::string("proxy");
+    }
+    virtual std::string vender_name() const {
+        return std::string("tube");
+    }
+};
+
+}
+
+#endif /* _PROXY_HANDLER_H_ */
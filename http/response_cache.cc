@@ -0,0 +1,309 @@
+#include "pch.h"
+
+#include <cstdlib>
+#include <cctype>
+#include <sstream>
+#include <boost/functional/hash.hpp>
+
+#include "http/response_cache.h"
+
+namespace tube {
+
+const size_t ResponseCache::kShardCount = 16;
+const size_t ResponseCache::kMaxVariants = 8;
+
+// they describe a connection, not the response kept
+static bool
+is_connection_header(const std::string& key)
+{
+    return utils::ignore_compare(key, "connection")
+        || utils::ignore_compare(key, "keep-alive")
+        || utils::ignore_compare(key, "transfer-encoding")
+        || utils::ignore_compare(key, "content-length");
+}
+
+static std::string
+trim_lower(const std::string& str)
+{
+    size_t begin = str.find_first_not_of(" \t");
+    if (begin == std::string::npos)
+        return std::string();
+    size_t end = str.find_last_not_of(" \t");
+    std::string res = str.substr(begin, end - begin + 1);
+    for (size_t i = 0; i < res.length(); i++) {
+        res[i] = tolower(res[i]);
+    }
+    return res;
+}
+
+// the comma separated tokens of every header called key
+static std::vector<std::string>
+header_tokens(const HttpHeaderEnumerate& headers, const std::string& key)
+{
+    std::vector<std::string> tokens;
+    for (size_t i = 0; i < headers.size(); i++) {
+        if (!utils::ignore_compare(headers[i].key, key))
+            continue;
+        std::stringstream ss(headers[i].value);
+        std::string token;
+        while (std::getline(ss, token, ',')) {
+            token = trim_lower(token);
+            if (!token.empty())
+                tokens.push_back(token);
+        }
+    }
+    return tokens;
+}
+
+// header names compare case insensitively, unlike find_header_value()
+static std::string
+header_value(const HttpHeaderEnumerate& headers, const std::string& key)
+{
+    std::string value;
+    for (size_t i = 0; i < headers.size(); i++) {
+        if (utils::ignore_compare(headers[i].key, key)) {
+            if (!value.empty())
+                value += ", ";
+            value += headers[i].value;
+        }
+    }
+    return value;
+}
+
+CachedResponse::CachedResponse(const HttpResponseStatus& status,
+                               const HttpHeaderEnumerate& headers,
+                               const std::string& body)
+    : status_(status)
+{
+    std::stringstream head;
+    head << HttpResponse::kHttpVersion << " " << status.status_code << " "
+         << status.reason << HttpResponse::kHttpNewLine;
+    for (size_t i = 0; i < headers.size(); i++) {
+        const HttpHeaderItem& item = headers[i];
+        if (is_connection_header(item.key))
+            continue;
+        headers_.push_back(item);
+        head << item.key << ": " << item.value << HttpResponse::kHttpNewLine;
+    }
+    head << "Content-Length: " << body.length() << HttpResponse::kHttpNewLine
+         << HttpResponse::kHttpNewLine;
+    content_ = head.str();
+    head_length_ = content_.length();
+    content_.append(body);
+}
+
+ResponseCache::ResponseCache()
+    : max_bytes_(0), max_shard_bytes_(0)
+{
+    shards_ = new Shard[kShardCount];
+}
+
+ResponseCache::~ResponseCache()
+{
+    delete [] shards_;
+}
+
+void
+ResponseCache::set_max_bytes(size_t max_bytes)
+{
+    max_bytes_ = max_bytes;
+    max_shard_bytes_ = max_bytes / kShardCount;
+    clear();
+}
+
+std::string
+ResponseCache::build_key(const HttpRequest& request)
+{
+    std::string key = request.method_string();
+    key.push_back(' ');
+    key.append(trim_lower(header_value(request.headers(), "host")));
+    key.push_back(' ');
+    key.append(request.uri());
+    return key;
+}
+
+int
+ResponseCache::cacheable_ttl(const HttpResponseStatus& status,
+                             const HttpHeaderEnumerate& headers,
+                             int default_ttl)
+{
+    int code = status.status_code;
+    if (code != 200 && code != 203 && code != 301 && code != 404
+        && code != 410)
+        return -1;
+    for (size_t i = 0; i < headers.size(); i++) {
+        // somebody's session must not go to everybody
+        if (utils::ignore_compare(headers[i].key, "set-cookie"))
+            return -1;
+    }
+    std::vector<std::string> vary = header_tokens(headers, "vary");
+    for (size_t i = 0; i < vary.size(); i++) {
+        if (vary[i] == "*")
+            return -1;
+    }
+
+    int max_age = -1, s_maxage = -1;
+    std::vector<std::string> directives = header_tokens(headers,
+                                                        "cache-control");
+    for (size_t i = 0; i < directives.size(); i++) {
+        const std::string& d = directives[i];
+        if (d == "no-store" || d == "private" || d == "no-cache")
+            return -1;
+        if (d.compare(0, 8, "max-age=") == 0) {
+            max_age = atoi(d.c_str() + 8);
+        } else if (d.compare(0, 9, "s-maxage=") == 0) {
+            s_maxage = atoi(d.c_str() + 9);
+        }
+    }
+    int ttl = s_maxage >= 0 ? s_maxage : (max_age >= 0 ? max_age
+                                          : default_ttl);
+    return ttl > 0 ? ttl : -1;
+}
+
+ResponseCache::Shard&
+ResponseCache::shard_of(const std::string& key)
+{
+    boost::hash<std::string> hasher;
+    return shards_[hasher(key) % kShardCount];
+}
+
+void
+ResponseCache::drop_entry(Shard& shard, EntryMap::iterator it)
+{
+    shard.nbytes -= it->second->nbytes;
+    shard.entries.erase(it->second);
+    shard.entry_map.erase(it);
+}
+
+CachedResponsePtr
+ResponseCache::lookup(const std::string& key,
+                      const HttpHeaderEnumerate& request_headers)
+{
+    if (max_bytes_ == 0)
+        return CachedResponsePtr();
+    Shard& shard = shard_of(key);
+    utils::Lock lk(shard.mutex);
+    EntryMap::iterator it = shard.entry_map.find(key);
+    if (it == shard.entry_map.end()) {
+        lk.unlock();
+        misses_.increment();
+        return CachedResponsePtr();
+    }
+    Entry& entry = *it->second;
+    std::vector<std::string> values;
+    for (size_t i = 0; i < entry.vary_names.size(); i++) {
+        values.push_back(header_value(request_headers, entry.vary_names[i]));
+    }
+    time_t now = time(NULL);
+    for (std::list<Variant>::iterator v = entry.variants.begin();
+         v != entry.variants.end(); ++v) {
+        if (v->vary_values != values)
+            continue;
+        if (v->expires <= now) {
+            size_t nbytes = v->response->size();
+            entry.nbytes -= nbytes;
+            shard.nbytes -= nbytes;
+            entry.variants.erase(v);
+            if (entry.variants.empty())
+                drop_entry(shard, it);
+            break;
+        }
+        shard.entries.splice(shard.entries.begin(), shard.entries,
+                             it->second);
+        CachedResponsePtr response = v->response;
+        lk.unlock();
+        hits_.increment();
+        return response;
+    }
+    lk.unlock();
+    misses_.increment();
+    return CachedResponsePtr();
+}
+
+void
+ResponseCache::insert(const std::string& key,
+                      const HttpHeaderEnumerate& request_headers,
+                      const CachedResponsePtr& response, int ttl)
+{
+    size_t nbytes = response->size();
+    if (max_bytes_ == 0 || ttl <= 0 || nbytes > max_shard_bytes_)
+        return;
+    Variant variant;
+    variant.response = response;
+    variant.expires = time(NULL) + ttl;
+    std::vector<std::string> vary_names = header_tokens(response->headers(),
+                                                        "vary");
+    for (size_t i = 0; i < vary_names.size(); i++) {
+        variant.vary_values.push_back(header_value(request_headers,
+                                                   vary_names[i]));
+    }
+
+    Shard& shard = shard_of(key);
+    utils::Lock lk(shard.mutex);
+    EntryMap::iterator it = shard.entry_map.find(key);
+    if (it == shard.entry_map.end()) {
+        Entry entry;
+        entry.key = key;
+        entry.nbytes = 0;
+        shard.entries.push_front(entry);
+        it = shard.entry_map.insert(
+            std::make_pair(key, shard.entries.begin())).first;
+    } else {
+        shard.entries.splice(shard.entries.begin(), shard.entries,
+                             it->second);
+    }
+    Entry& entry = *it->second;
+    if (entry.vary_names != vary_names) {
+        // variants by other headers can't be told apart any more
+        shard.nbytes -= entry.nbytes;
+        entry.nbytes = 0;
+        entry.variants.clear();
+        entry.vary_names = vary_names;
+    }
+    for (std::list<Variant>::iterator v = entry.variants.begin();
+         v != entry.variants.end(); ++v) {
+        if (v->vary_values == variant.vary_values) {
+            entry.nbytes -= v->response->size();
+            shard.nbytes -= v->response->size();
+            entry.variants.erase(v);
+            break;
+        }
+    }
+    if (entry.variants.size() >= kMaxVariants) {
+        entry.nbytes -= entry.variants.back().response->size();
+        shard.nbytes -= entry.variants.back().response->size();
+        entry.variants.pop_back();
+    }
+    entry.variants.push_front(variant);
+    entry.nbytes += nbytes;
+    shard.nbytes += nbytes;
+
+    // least recently used first, never the one just stored
+    while (shard.nbytes > max_shard_bytes_ && shard.entries.size() > 1) {
+        drop_entry(shard, shard.entry_map.find(shard.entries.back().key));
+    }
+}
+
+void
+ResponseCache::clear()
+{
+    for (size_t i = 0; i < kShardCount; i++) {
+        utils::Lock lk(shards_[i].mutex);
+        shards_[i].entry_map.clear();
+        shards_[i].entries.clear();
+        shards_[i].nbytes = 0;
+    }
+}
+
+size_t
+ResponseCache::size()
+{
+    size_t n = 0;
+    for (size_t i = 0; i < kShardCount; i++) {
+        utils::Lock lk(shards_[i].mutex);
+        n += shards_[i].entry_map.size();
+    }
+    return n;
+}
+
+}
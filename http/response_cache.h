@@ -0,0 +1,116 @@
+// -*- mode: c++ -*-
+
+#ifndef _RESPONSE_CACHE_H_
+#define _RESPONSE_CACHE_H_
+
+#include <string>
+#include <vector>
+#include <list>
+#include <boost/unordered_map.hpp>
+
+#include "utils/misc.h"
+#include "core/block_sender.h"
+#include "http/http_wrapper.h"
+
+namespace tube {
+
+// A response kept whole: status line, headers and body serialized into one
+// block, so a hit is a single write.  Immutable once built.
+class CachedResponse : public DataBlock
+{
+public:
+    CachedResponse(const HttpResponseStatus& status,
+                   const HttpHeaderEnumerate& headers,
+                   const std::string& body);
+
+    virtual const byte* data() const { return (const byte*) content_.data(); }
+    virtual size_t      size() const { return content_.size(); }
+
+    const HttpResponseStatus&  status() const { return status_; }
+    const HttpHeaderEnumerate& headers() const { return headers_; }
+    size_t head_length() const { return head_length_; }
+    size_t body_length() const { return content_.size() - head_length_; }
+private:
+    HttpResponseStatus  status_;
+    HttpHeaderEnumerate headers_;
+    std::string         content_;
+    size_t              head_length_;
+};
+
+typedef boost::shared_ptr<const CachedResponse> CachedResponsePtr;
+
+// Responses by method, host and uri, with a variant for each set of values
+// of the request headers the response Vary-ed on.  Keys are spread over
+// several shards, each with its own lock, LRU list and share of the bytes.
+class ResponseCache : utils::Noncopyable
+{
+public:
+    static const size_t kShardCount;
+    static const size_t kMaxVariants;
+
+    ResponseCache();
+    ~ResponseCache();
+
+    void   set_max_bytes(size_t max_bytes);
+    size_t max_bytes() const { return max_bytes_; }
+
+    static std::string build_key(const HttpRequest& request);
+    // seconds a response may be kept for, -1 if it must not be shared.
+    // default_ttl applies when Cache-Control gives no max-age.
+    static int cacheable_ttl(const HttpResponseStatus& status,
+                             const HttpHeaderEnumerate& headers,
+                             int default_ttl);
+
+    // request_headers pick the variant
+    CachedResponsePtr lookup(const std::string& key,
+                             const HttpHeaderEnumerate& request_headers);
+    void insert(const std::string& key,
+                const HttpHeaderEnumerate& request_headers,
+                const CachedResponsePtr& response, int ttl);
+    void clear();
+
+    size_t size();
+    u64    hit_count() const { return hits_.value(); }
+    u64    miss_count() const { return misses_.value(); }
+private:
+    struct Variant
+    {
+        std::vector<std::string> vary_values;
+        CachedResponsePtr        response;
+        time_t                   expires;
+    };
+
+    struct Entry
+    {
+        std::string              key;
+        std::vector<std::string> vary_names; // from the latest response
+        std::list<Variant>       variants;
+        size_t                   nbytes;
+    };
+
+    typedef std::list<Entry> EntryList;
+    typedef boost::unordered_map<std::string, EntryList::iterator> EntryMap;
+
+    struct Shard
+    {
+        utils::Mutex mutex;
+        EntryList    entries;
+        EntryMap     entry_map;
+        size_t       nbytes;
+
+        Shard() : nbytes(0) {}
+    };
+
+    Shard& shard_of(const std::string& key);
+    void   drop_entry(Shard& shard, EntryMap::iterator it);
+
+    Shard*               shards_;
+    size_t               max_bytes_;
+    size_t               max_shard_bytes_;
+    utils::AtomicCounter hits_;
+    utils::AtomicCounter misses_;
+};
+
+}
+
+#endif /* _RESPONSE_CACHE_H_ */
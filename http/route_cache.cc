@@ -0,0 +1,115 @@
+#include "pch.h"
+
+#include <boost/functional/hash.hpp>
+
+#include "http/route_cache.h"
+
+namespace tube {
+
+const size_t RouteCache::kShardCount = 16;
+const size_t RouteCache::kDefaultMaxEntry = 8192;
+
+RouteCache::RouteCache()
+{
+    shards_ = new Shard[kShardCount];
+    set_max_entry(kDefaultMaxEntry);
+}
+
+RouteCache::~RouteCache()
+{
+    delete [] shards_;
+}
+
+void
+RouteCache::set_max_entry(size_t nentry)
+{
+    max_entry_ = nentry;
+    max_shard_entry_ = (nentry + kShardCount - 1) / kShardCount;
+    clear();
+}
+
+std::string
+RouteCache::build_key(const std::string& host, const std::string& path)
+{
+    std::string key;
+    key.reserve(host.length() + path.length() + 1);
+    key.append(host);
+    key.push_back('\n'); // cannot appear in either a host or a path
+    key.append(path);
+    return key;
+}
+
+RouteCache::Shard&
+RouteCache::shard_of(const std::string& key)
+{
+    boost::hash<std::string> hasher;
+    return shards_[hasher(key) % kShardCount];
+}
+
+bool
+RouteCache::lookup(const std::string& key, const UrlRuleItem** rule,
+                   size_t* strip_len)
+{
+    if (max_entry_ == 0)
+        return false;
+    Shard& shard = shard_of(key);
+    utils::Lock lk(shard.mutex);
+    EntryMap::iterator it = shard.entry_map.find(key);
+    if (it == shard.entry_map.end()) {
+        lk.unlock();
+        misses_.increment();
+        return false;
+    }
+    // move to the front of the LRU list, iterators stay valid
+    shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+    *rule = it->second->rule;
+    *strip_len = it->second->strip_len;
+    lk.unlock();
+    hits_.increment();
+    return true;
+}
+
+void
+RouteCache::insert(const std::string& key, const UrlRuleItem* rule,
+                   size_t strip_len)
+{
+    if (max_entry_ == 0)
+        return;
+    Shard& shard = shard_of(key);
+    utils::Lock lk(shard.mutex);
+    if (shard.entry_map.find(key) != shard.entry_map.end()) {
+        return; // some other thread has resolved it already
+    }
+    if (shard.entries.size() >= max_shard_entry_) {
+        shard.entry_map.erase(shard.entries.back().key);
+        shard.entries.pop_back();
+    }
+    Entry entry;
+    entry.key = key;
+    entry.rule = rule;
+    entry.strip_len = strip_len;
+    shard.entries.push_front(entry);
+    shard.entry_map.insert(std::make_pair(key, shard.entries.begin()));
+}
+
+void
+RouteCache::clear()
+{
+    for (size_t i = 0; i < kShardCount; i++) {
+        utils::Lock lk(shards_[i].mutex);
+        shards_[i].entry_map.clear();
+        shards_[i].entries.clear();
+    }
+}
+
+double
+RouteCache::hit_rate() const
+{
+    u64 hits = hit_count();
+    u64 total = hits + miss_count();
+    if (total == 0)
+        return 0.0;
+    return (double) hits / total;
+}
+
+}
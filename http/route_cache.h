@@ -0,0 +1,74 @@
+// -*- mode: c++ -*-
+
+#ifndef _ROUTE_CACHE_H_
+#define _ROUTE_CACHE_H_
+
+#include <string>
+#include <list>
+#include <boost/unordered_map.hpp>
+
+#include "utils/misc.h"
+
+namespace tube {
+
+struct UrlRuleItem;
+
+// Remembers which url rule a (host, path) pair resolved to, so hot paths
+// skip the rule matchers.  Keys are spread over several shards, each with
+// its own lock and LRU list.
+class RouteCache : utils::Noncopyable
+{
+public:
+    static const size_t kShardCount;
+    static const size_t kDefaultMaxEntry;
+
+    RouteCache();
+    ~RouteCache();
+
+    void   set_max_entry(size_t nentry);
+    size_t max_entry() const { return max_entry_; }
+
+    // strip_len is the number of leading characters the matched rule removed
+    // from the request path and uri, so a hit can replay the rewrite
+    bool lookup(const std::string& key, const UrlRuleItem** rule,
+                size_t* strip_len);
+    void insert(const std::string& key, const UrlRuleItem* rule,
+                size_t strip_len);
+    void clear();
+
+    u64    hit_count() const { return hits_.value(); }
+    u64    miss_count() const { return misses_.value(); }
+    double hit_rate() const;
+
+    static std::string build_key(const std::string& host,
+                                 const std::string& path);
+private:
+    struct Entry
+    {
+        std::string        key;
+        const UrlRuleItem* rule;
+        size_t             strip_len;
+    };
+
+    typedef std::list<Entry> EntryList;
+    typedef boost::unordered_map<std::string, EntryList::iterator> EntryMap;
+
+    struct Shard
+    {
+        utils::Mutex mutex;
+        EntryList    entries;
+        EntryMap     entry_map;
+    };
+
+    Shard& shard_of(const std::string& key);
+
+    Shard*               shards_;
+    size_t               max_entry_;
+    size_t               max_shard_entry_;
+    utils::AtomicCounter hits_;
+    utils::AtomicCounter misses_;
+};
+
+}
+
+#endif /* _ROUTE_CACHE_H_ */
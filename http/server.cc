@@ -10,6 +10,7 @@
 
 #include "core/server.h"
 #include "core/stages.h"
+#include "core/upgrade.h"
 #include "core/wrapper.h"
 #include "utils/logger.h"
 #include "utils/exception.h"
@@ -20,17 +21,33 @@ class WebServer : public Server
 {
     HttpParserStage* parser_stage_;
     HttpHandlerStage* handler_stage_;
+    CompressStage* compress_stage_;
+    DiskIOStage* disk_io_stage_;
+    WebSocketStage* websocket_stage_;
     size_t handler_stage_pool_size_;
+    size_t compress_stage_pool_size_;
+    size_t disk_io_stage_pool_size_;
+    size_t websocket_stage_pool_size_;
 public:
-    WebServer(const char* address, const char* port) : Server(address, port) {
+    WebServer(const char* address, const char* port, int listen_fd = -1)
+        : Server(address, port, listen_fd) {
         parser_stage_ = new HttpParserStage();
         handler_stage_ = new HttpHandlerStage();
+        handler_stage_pool_size_ = 4;
+        compress_stage_ = new CompressStage();
+        compress_stage_pool_size_ = 1;
+        disk_io_stage_ = new DiskIOStage();
+        disk_io_stage_pool_size_ = 0;
+        websocket_stage_ = new WebSocketStage();
+        websocket_stage_pool_size_ = 1;
     }
 
     void initialize_stages() {
         Server::initialize_stages();
         parser_stage_->initialize();
         handler_stage_->initialize();
+        disk_io_stage_->initialize();
+        websocket_stage_->initialize();
     }
 
     void start_all_threads() {
@@ -38,6 +55,15 @@ public:
         for (size_t i = 0; i < handler_stage_pool_size_; i++) {
             handler_stage_->start_thread();
         }
+        for (size_t i = 0; i < compress_stage_pool_size_; i++) {
+            compress_stage_->start_thread();
+        }
+        for (size_t i = 0; i < disk_io_stage_pool_size_; i++) {
+            disk_io_stage_->start_thread();
+        }
+        for (size_t i = 0; i < websocket_stage_pool_size_; i++) {
+            websocket_stage_->start_thread();
+        }
         Server::start_all_threads();
     }
 
@@ -45,15 +71,38 @@ public:
         handler_stage_pool_size_ = val;
     }
 
+    void set_compress_stage_pool_size(size_t val) {
+        compress_stage_pool_size_ = val;
+    }
+
+    void set_disk_io_stage_pool_size(size_t val) {
+        disk_io_stage_pool_size_ = val;
+    }
+
+    void set_websocket_stage_pool_size(size_t val) {
+        websocket_stage_pool_size_ = val;
+    }
+
+protected:
+    // the handler threads could still answer the connections about to be
+    // freed
+    virtual void stop_handlers() {
+        HandlerConfig::instance().shutdown();
+    }
+public:
     virtual ~WebServer() {
         delete parser_stage_;
         delete handler_stage_;
+        delete compress_stage_;
+        delete disk_io_stage_;
+        delete websocket_stage_;
     }
 };
 
 }
 
 static std::string conf_file;
+static char** saved_argv;
 static std::string module_path;
 static int global_uid = -1;
 
@@ -106,23 +155,67 @@ load_modules()
     tube_module_initialize_all();
 }
 
+// a new process gets that long to accept before the upgrade is given up
+static const int kUpgradeTimeout = 30;
+
+// the other threads block these signals, they only ever wake this one.
+// returns once the server stops accepting.
+static void
+handle_signals(sigset_t signals, tube::Server* server)
+{
+    while (true) {
+        int sig = 0;
+        if (sigwait(&signals, &sig) != 0)
+            continue;
+        if (sig == SIGHUP) {
+            LOG(INFO, "reloading %s", conf_file.c_str());
+            tube::ServerConfig::instance().reload_config_file(
+                conf_file.c_str());
+        } else if (sig == SIGUSR2) {
+            LOG(WARNING, "upgrading to %s", saved_argv[0]);
+            if (tube::BinaryUpgrade::start(saved_argv, server->fd(),
+                                           kUpgradeTimeout)) {
+                server->stop_accepting();
+                return;
+            }
+        } else if (sig == SIGTERM || sig == SIGINT) {
+            LOG(WARNING, "shutting down");
+            server->stop_accepting();
+            return;
+        }
+    }
+}
+
 using namespace tube;
 
 int
 main(int argc, char* argv[])
 {
     parse_opt(argc, argv);
+    saved_argv = argv;
     if (global_uid >= 0) {
         if (setuid(global_uid) < 0) {
             perror("setuid");
             exit(-1);
         }
     }
+    // blocked before any thread starts, every thread inherits it
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGUSR2);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
     load_modules();
     ServerConfig& cfg = ServerConfig::instance();
     try {
         cfg.load_config_file(conf_file.c_str());
-        WebServer server(cfg.address().c_str(), cfg.port().c_str());
+        // the socket of the process this one replaces, if upgrading
+        int listen_fd = BinaryUpgrade::take_listen_fd();
+        WebServer server(cfg.address().c_str(), cfg.port().c_str(),
+                         listen_fd);
         if (cfg.read_stage_pool_size() > 0) {
             server.set_read_stage_pool_size(cfg.read_stage_pool_size());
         }
@@ -135,10 +228,31 @@ main(int argc, char* argv[])
         if (cfg.handler_stage_pool_size() > 0) {
             server.set_handler_stage_pool_size(cfg.handler_stage_pool_size());
         }
+        if (cfg.compress_stage_pool_size() >= 0) {
+            server.set_compress_stage_pool_size(
+                cfg.compress_stage_pool_size());
+        }
+        if (cfg.disk_io_stage_pool_size() > 0) {
+            server.set_disk_io_stage_pool_size(cfg.disk_io_stage_pool_size());
+        }
+        if (cfg.websocket_stage_pool_size() > 0) {
+            server.set_websocket_stage_pool_size(
+                cfg.websocket_stage_pool_size());
+        }
         server.initialize_stages();
         server.start_all_threads();
+        utils::Thread signal_thread(
+            boost::bind(&handle_signals, signals, &server));
         server.listen(cfg.listen_queue_size());
+        BinaryUpgrade::notify_ready();
         server.main_loop();
+        // upgraded or told to stop, the requests in flight get until the
+        // deadline
+        if (server.drain(cfg.drain_timeout())) {
+            LOG(WARNING, "drained, exiting");
+        }
+        signal_thread.join();
+        server.shutdown();
     } catch (utils::SyscallException ex) {
         fprintf(stderr, "Cannot start server: %s\n", ex.what());
         exit(-1);
@@ -1,13 +1,18 @@
 #include "pch.h"
 
 #include <sstream>
+#include <cstring>
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <cstdlib>
+#include <algorithm>
+#include <unistd.h>
 #include <locale.h>
 #include <langinfo.h>
 
 #include "http/static_handler.h"
+#include "http/http_date.h"
 #include "utils/logger.h"
 #include "module.h"
 
@@ -42,6 +47,7 @@ StaticHttpHandler::remove_path_dots(const std::string& path)
 }
 
 StaticHttpHandler::StaticHttpHandler()
+    : compress_stage_(NULL), disk_io_stage_(NULL), listing_max_size_(0)
 {
     setlocale(LC_CTYPE, "");
     charset_ = nl_langinfo(CODESET);
@@ -51,7 +57,26 @@ StaticHttpHandler::StaticHttpHandler()
     add_option("allow_index", "true");
     add_option("index_page_css", "");
     add_option("max_cache_entry", "0");
+    add_option("max_cache_bytes", "0");
     add_option("max_entry_size", "4096");
+    add_option("cache_admission", "frequency");
+    add_option("mmap_threshold", "16384");
+    add_option("mmap_populate", "false");
+    add_option("open_file_cache", "0");
+    add_option("open_file_valid", "5");
+    add_option("gzip_static", "false");
+    add_option("compress", "false");
+    add_option("compress_level", "6");
+    add_option("compress_min_size", "256");
+    add_option("compress_max_size", "1048576");
+    add_option("compress_types", "text/* application/javascript "
+               "application/json application/xml image/svg+xml");
+    add_option("compress_cache_bytes", "16777216");
+    add_option("listing_cache_bytes", "67108864");
+    add_option("listing_max_size", "4194304");
+    add_option("mime_types", "");
+    add_option("default_type", MimeTypeRegistry::kDefaultType);
+    add_option("cache_control", "");
 }
 
 void
@@ -62,48 +87,157 @@ StaticHttpHandler::load_param()
     allow_index_ = utils::parse_bool(option("allow_index"));
     index_page_css_ = option("index_page_css");
 
-    io_cache_.set_max_cache_entry(atoi(option("max_cache_entry").c_str()));
     io_cache_.set_max_entry_size(atoi(option("max_entry_size").c_str()));
+    io_cache_.set_max_cache_entry(atoi(option("max_cache_entry").c_str()));
+    io_cache_.set_max_cache_bytes(strtoull(option("max_cache_bytes").c_str(),
+                                           NULL, 10));
+    if (option("cache_admission") == "lru") {
+        io_cache_.set_admission_policy(IOCache::kAdmitAll);
+    } else {
+        io_cache_.set_admission_policy(IOCache::kAdmitFrequent);
+    }
+    io_cache_.set_mmap_threshold(atoi(option("mmap_threshold").c_str()));
+    io_cache_.set_mmap_populate(utils::parse_bool(option("mmap_populate")));
+    file_cache_.set_max_entry(atoi(option("open_file_cache").c_str()));
+    file_cache_.set_valid_time(atoi(option("open_file_valid").c_str()));
+
+    gzip_static_ = utils::parse_bool(option("gzip_static"));
+    compress_ = utils::parse_bool(option("compress"));
+    compress_level_ = atoi(option("compress_level").c_str());
+    compress_min_size_ = strtoull(option("compress_min_size").c_str(), NULL,
+                                  10);
+    compress_max_size_ = strtoull(option("compress_max_size").c_str(), NULL,
+                                  10);
+    mime_types_.reset();
+    mime_types_.set_default_type(option("default_type"));
+    if (option("mime_types") != "") {
+        mime_types_.load_file(option("mime_types"));
+    }
+    file_cache_.set_mime_types(&mime_types_);
+
+    std::stringstream types(option("compress_types"));
+    std::string type;
+    compress_types_.clear();
+    while (types >> type) {
+        // plain extensions as in older configurations
+        if (type.find('/') == std::string::npos) {
+            type = mime_types_.lookup(type.c_str(), type.length());
+        }
+        compress_types_.push_back(type);
+    }
+
+    // "image/* max-age=86400; text/css no-cache", first match wins
+    std::stringstream rules(option("cache_control"));
+    std::string rule;
+    cache_control_.clear();
+    while (std::getline(rules, rule, ';')) {
+        std::stringstream ss(rule);
+        std::string pattern, value;
+        if (!(ss >> pattern))
+            continue;
+        std::getline(ss >> std::ws, value);
+        cache_control_.push_back(std::make_pair(pattern, value));
+    }
+    compress_cache_.set_max_entry_size(compress_max_size_ + 1);
+    compress_cache_.set_max_cache_bytes(
+        strtoull(option("compress_cache_bytes").c_str(), NULL, 10));
+    compress_cache_.set_admission_policy(IOCache::kAdmitAll);
+
+    // listings are rendered again only when the directory changes, sizes and
+    // times of the files in it may lag behind until then
+    listing_max_size_ = strtoull(option("listing_max_size").c_str(), NULL, 10);
+    listing_cache_.set_max_entry_size(listing_max_size_);
+    listing_cache_.set_max_cache_bytes(
+        strtoull(option("listing_cache_bytes").c_str(), NULL, 10));
+    listing_cache_.set_admission_policy(IOCache::kAdmitAll);
 }
 
-// currently we only support single range
-static void
-parse_range(std::string range_desc, off64_t& offset, off64_t& length)
-{
-    offset = 0;
-    length = -1;
-    int end_byte = 0;
+const size_t StaticHttpHandler::kMaxRangeCount = 16;
+const size_t StaticHttpHandler::kListingChunkSize = 16 << 10;
+const off64_t StaticHttpHandler::kPrefetchSize = 1 << 20;
 
-    size_t i = 0;
-    while (i < range_desc.length()) {
-        i++;
-        if (range_desc[i - 1] == '=') {
-            break;
-        }
+static bool
+parse_number(const std::string& str, off64_t& res)
+{
+    if (str.empty() || str.length() > 18)
+        return false;
+    res = 0;
+    for (size_t i = 0; i < str.length(); i++) {
+        if (str[i] < '0' || str[i] > '9')
+            return false;
+        res = res * 10 + (str[i] - '0');
     }
+    return true;
+}
 
-    while (i < range_desc.length()) {
-        char ch = range_desc[i];
-        if (ch >= '0' && ch <= '9') {
-            offset = 10 * offset + (ch - '0');
-        } else if (ch == '-') {
-            break;
-        } else {
-            return;
-        }
-        i++;
-    }
+static std::string
+trim_spaces(const std::string& str)
+{
+    size_t start = str.find_first_not_of(" \t");
+    if (start == std::string::npos)
+        return "";
+    size_t end = str.find_last_not_of(" \t");
+    return str.substr(start, end - start + 1);
+}
 
-    while (i < range_desc.length()) {
-        char ch = range_desc[i];
-        if (ch >= '0' && ch <= '9') {
-            end_byte = 10 * end_byte + (ch - '0');
-            length = end_byte - offset + 1;
+// parses "bytes=a-b, c-, -n" into ranges clamped to the file size
+StaticHttpHandler::RangeResult
+StaticHttpHandler::parse_ranges(const std::string& range_desc,
+                                off64_t file_size, ByteRanges& ranges)
+{
+    static const std::string kUnit = "bytes=";
+    ranges.clear();
+    if (range_desc.compare(0, kUnit.length(), kUnit) != 0)
+        return kRangeIgnored;
+
+    size_t start = kUnit.length();
+    size_t nspec = 0;
+    while (start <= range_desc.length()) {
+        size_t end = range_desc.find(',', start);
+        if (end == std::string::npos)
+            end = range_desc.length();
+        std::string spec = trim_spaces(range_desc.substr(start, end - start));
+        start = end + 1;
+        if (spec.empty())
+            continue;
+        // too many ranges only make us do lots of small writes
+        if (++nspec > kMaxRangeCount)
+            return kRangeIgnored;
+
+        size_t dash = spec.find('-');
+        if (dash == std::string::npos)
+            return kRangeIgnored;
+        std::string first = spec.substr(0, dash);
+        std::string last = spec.substr(dash + 1);
+        off64_t first_byte = 0, last_byte = file_size - 1;
+        if (first.empty()) {
+            // suffix range, the final n bytes
+            off64_t suffix = 0;
+            if (!parse_number(last, suffix))
+                return kRangeIgnored;
+            if (suffix == 0)
+                continue;
+            first_byte = suffix > file_size ? 0 : file_size - suffix;
         } else {
-            return;
+            if (!parse_number(first, first_byte))
+                return kRangeIgnored;
+            if (!last.empty()) {
+                if (!parse_number(last, last_byte) || last_byte < first_byte)
+                    return kRangeIgnored;
+                if (last_byte >= file_size)
+                    last_byte = file_size - 1;
+            }
         }
-        i++;
-    }
+        if (first_byte >= file_size)
+            continue; // not satisfiable, but others may be
+        ByteRange range;
+        range.offset = first_byte;
+        range.length = last_byte - first_byte + 1;
+        ranges.push_back(range);
+    }
+    if (nspec == 0)
+        return kRangeIgnored;
+    return ranges.empty() ? kRangeUnsatisfiable : kRangeSatisfiable;
 }
 
 static std::string
@@ -114,258 +248,412 @@ build_range_response(off64_t offset, off64_t length, off64_t file_size)
     return ss.str();
 }
 
-#define MAX_TIME_LEN 128
-
 static std::string
-build_last_modified(const time_t* last_modified_time)
+build_boundary()
 {
-    struct tm gmt;
-    gmtime_r(last_modified_time, &gmt); // thread safe
-    char time_str[MAX_TIME_LEN];
-    strftime(time_str, MAX_TIME_LEN, "%a, %d %b %Y %T GMT", &gmt);
-    return std::string(time_str);
+    static utils::AtomicCounter counter;
+    std::stringstream ss;
+    ss << "tube" << std::hex << time(NULL) << counter.increment();
+    return ss.str();
 }
 
-static std::string
-build_etag(const std::string& str)
+#define MAX_TIME_LEN 128
+
+// weak comparison, as for GET and HEAD.  a tag of one of our encoded
+// variants matches as well, it only adds a suffix inside the quotes.
+static bool
+match_etag(const std::string& tag, size_t pos, size_t len,
+           const std::string& etag)
 {
-    u32 hash = 0x4F7E0912;
-    for (size_t i = 0; i < str.length(); i++) {
-        hash += str[i] << (i & 0x0F);
+    if (len >= 2 && tag.compare(pos, 2, "W/") == 0) {
+        pos += 2;
+        len -= 2;
     }
-    std::stringstream ss;
-    ss << std::hex << hash;
-    return ss.str();
+    if (len == 1 && tag[pos] == '*')
+        return true;
+    if (len == etag.length())
+        return tag.compare(pos, len, etag) == 0;
+    // "etag-coding"
+    size_t prefix = etag.length() - 1;
+    return len > etag.length() && tag.compare(pos, prefix, etag, 0, prefix) == 0
+        && tag[pos + prefix] == '-' && tag[pos + len - 1] == '"';
 }
 
-typedef std::vector<std::string> Tokens;
-
-static Tokens
-tokenize_string(std::string str, const char* delim)
+static bool
+match_any_etag(const std::string& header, const std::string& etag)
 {
-    std::vector<std::string> vec;
-    std::string last;
-    for (size_t i = 0; i < str.length(); i++) {
-        if (strchr(delim, str[i]) != NULL) {
-            if (last != "") {
-                vec.push_back(last);
-                last = "";
-            }
-        } else {
-            last += str[i];
+    size_t pos = 0;
+    while (pos < header.length()) {
+        size_t end = header.find(',', pos);
+        if (end == std::string::npos) {
+            end = header.length();
         }
+        size_t first = pos, last = end;
+        while (first < last && header[first] == ' ') first++;
+        while (last > first && header[last - 1] == ' ') last--;
+        if (first < last && match_etag(header, first, last - first, etag))
+            return true;
+        pos = end + 1;
     }
-    if (last != "") {
-        vec.push_back(last);
-    }
-    return vec;
+    return false;
 }
 
-static Tokens
-tokenize_date(std::string date)
+bool
+StaticHttpHandler::validate_client_cache(const OpenFileInfo& info,
+                                         HttpRequest& request)
 {
-    return tokenize_string(date, ", -");
+    // If-None-Match wins, If-Modified-Since is not even looked at then
+    std::string none_match = request.find_header_value("If-None-Match");
+    if (none_match != "") {
+        return match_any_etag(none_match, info.etag);
+    }
+    std::string modified_since =
+        request.find_header_value("If-Modified-Since");
+    time_t since;
+    if (modified_since != "" && parse_http_date(modified_since, &since)) {
+        return info.stat.st_mtime <= since;
+    }
+    return false;
 }
 
-static Tokens
-tokenize_time(std::string time)
+static void
+send_client_cache_info(HttpResponse& response, const OpenFileInfo& info)
 {
-    return tokenize_string(time, ":");
+    response.add_header("Last-Modified", info.last_modified);
+    response.add_header("ETag", info.etag);
 }
 
-static bool
-parse_digits(std::string number, const size_t max_ndigits, int& res)
+static void
+send_part(HttpResponse& response, const IOCacheEntryPtr& cached_entry,
+          const FileHandlePtr& handle, off64_t offset, off64_t length)
 {
-    if (number.length() > max_ndigits) return false;
-    res = 0;
-    for (size_t i = 0; i < number.length(); i++) {
-        if (number[i] < '0' || number[i] > '9')
-            return false;
-        res = res * 10 + number[i] - '0';
+    if (cached_entry) {
+        // the cache entry itself is queued, no copy is made
+        response.write_block(cached_entry, offset, length);
+    } else {
+        // the descriptor is shared with the open file cache
+        response.write_file(handle, offset, length);
     }
-    return true;
 }
 
-static bool
-parse_month(std::string month, int& res)
+static void
+send_client_data(HttpResponse& response, const HttpResponseStatus& status,
+                 const IOCacheEntryPtr& cached_entry,
+                 const FileHandlePtr& handle, off64_t offset, off64_t length)
 {
-    static const char* months[] = {
-        "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct",
-        "Nov", "Dec"
-    };
-    if (month.length() != 3)
+    response.respond(status);
+    send_part(response, cached_entry, handle, offset, length);
+}
+
+// each range goes out as its own part, the file data is never copied
+static void
+send_multipart_data(HttpResponse& response,
+                    const StaticHttpHandler::ByteRanges& ranges,
+                    const IOCacheEntryPtr& cached_entry,
+                    const FileHandlePtr& handle, off64_t file_size,
+                    const std::string& content_type)
+{
+    std::string boundary = build_boundary();
+    std::vector<std::string> part_headers;
+    off64_t content_length = 0;
+    for (size_t i = 0; i < ranges.size(); i++) {
+        std::stringstream ss;
+        ss << "\r\n--" << boundary << "\r\n"
+           << "Content-Type: " << content_type << "\r\n"
+           << "Content-Range: "
+           << build_range_response(ranges[i].offset, ranges[i].length,
+                                   file_size)
+           << "\r\n\r\n";
+        part_headers.push_back(ss.str());
+        content_length += part_headers.back().length() + ranges[i].length;
+    }
+    std::string trailer = "\r\n--" + boundary + "--\r\n";
+    content_length += trailer.length();
+
+    response.add_header("Content-Type",
+                        "multipart/byteranges; boundary=" + boundary);
+    response.set_content_length(content_length);
+    response.respond(HttpResponseStatus::kHttpResponsePartialContent);
+    for (size_t i = 0; i < ranges.size(); i++) {
+        response.write_string(part_headers[i]);
+        send_part(response, cached_entry, handle, ranges[i].offset,
+                  ranges[i].length);
+    }
+    response.write_string(trailer);
+}
+
+bool
+StaticHttpHandler::is_compressible(const std::string& content_type) const
+{
+    if (!gzip_static_ && !compress_)
         return false;
-    for (res = 0; res < 12; res++) {
-        if (month == months[res]) {
+    for (size_t i = 0; i < compress_types_.size(); i++) {
+        if (match_mime_type(compress_types_[i], content_type))
             return true;
-        }
     }
     return false;
 }
 
-static bool
-parse_datetime(std::string datetime, struct tm* tm_struct)
+void
+StaticHttpHandler::send_cache_control(const std::string& content_type,
+                                      HttpResponse& response) const
 {
-    Tokens toks = tokenize_date(datetime);
+    for (size_t i = 0; i < cache_control_.size(); i++) {
+        if (match_mime_type(cache_control_[i].first, content_type)) {
+            response.add_header("Cache-Control", cache_control_[i].second);
+            return;
+        }
+    }
+}
 
-    if (toks.size() !=6 || toks[5] != "GMT") {
-        return false;
+static void
+send_encoded_headers(HttpResponse& response, const OpenFileInfo& info,
+                     ContentCoding coding, off64_t length)
+{
+    response.add_header("Content-Encoding", content_coding_name(coding));
+    // a different representation needs a different tag
+    std::string etag = info.etag.substr(0, info.etag.length() - 1);
+    etag += std::string("-") + content_coding_name(coding) + "\"";
+    response.add_header("ETag", etag);
+    response.add_header("Last-Modified", info.last_modified);
+    response.set_content_length(length);
+}
+
+// serve file.br or file.gz next to the file, if newer than the file itself
+bool
+StaticHttpHandler::respond_precompressed(const std::string& path,
+                                         const OpenFileInfoPtr& info,
+                                         const std::string& accept_encoding,
+                                         HttpResponse& response)
+{
+    int codings = kAllCodings;
+    ContentCoding coding = choose_content_coding(accept_encoding, codings);
+    while (coding != kCodingIdentity) {
+        int err = 0;
+        OpenFileInfoPtr encoded =
+            file_cache_.open_file(path + content_coding_suffix(coding), &err);
+        if (encoded && encoded->handle && S_ISREG(encoded->stat.st_mode)
+            && encoded->stat.st_mtime >= info->stat.st_mtime) {
+            send_encoded_headers(response, *info, coding,
+                                 encoded->stat.st_size);
+            response.respond(HttpResponseStatus::kHttpResponseOK);
+            response.write_file(encoded->handle, 0, encoded->stat.st_size);
+            return true;
+        }
+        codings &= ~CODING_MASK(coding);
+        coding = choose_content_coding(accept_encoding, codings);
     }
-    // we'll ignore the first token. since mktime will add for us
-    if (!parse_digits(toks[1], 2, tm_struct->tm_mday))
-        return false;
-    if (!parse_month(toks[2], tm_struct->tm_mon))
-        return false;
-    if (!parse_digits(toks[3], 4, tm_struct->tm_year))
+    return false;
+}
+
+bool
+StaticHttpHandler::respond_encoded(const std::string& path,
+                                   const OpenFileInfoPtr& info,
+                                   HttpRequest& request,
+                                   HttpResponse& response, bool* from_memory)
+{
+    *from_memory = false;
+    std::string accept_encoding = request.find_header_value("Accept-Encoding");
+    if (accept_encoding.empty())
         return false;
-    if (tm_struct->tm_year > 100) {
-        tm_struct->tm_year -= 1900;
+    if (gzip_static_
+        && respond_precompressed(path, info, accept_encoding, response)) {
+        return true;
     }
-    Tokens time_toks = tokenize_time(toks[4]);
-    if (time_toks.size() != 3) {
+    off64_t file_size = info->stat.st_size;
+    if (!compress_ || (size_t) file_size < compress_min_size_
+        || (size_t) file_size > compress_max_size_) {
         return false;
     }
-    if (!parse_digits(time_toks[0], 2, tm_struct->tm_hour)) {
+    ContentCoding coding = choose_content_coding(accept_encoding,
+                                                 supported_compressors());
+    if (coding == kCodingIdentity)
         return false;
-    }
-    if (!parse_digits(time_toks[1], 2, tm_struct->tm_min)) {
+
+    std::stringstream ss;
+    ss << path << '\n' << file_size << '\n' << content_coding_name(coding);
+    std::string key = ss.str();
+    IOCacheEntryPtr entry = compress_cache_.find_cache(key,
+                                                       info->stat.st_mtime);
+    if (!entry) {
+        // this one goes out as it is, later ones get the compressed copy
+        schedule_compress(path, *info, coding, key,
+                          shared_from_request(request));
         return false;
     }
-    if (!parse_digits(time_toks[2], 2, tm_struct->tm_sec)) {
-        return false;
+    if (entry->size() >= (size_t) file_size) {
+        return false; // did not compress well
     }
+    send_encoded_headers(response, *info, coding, entry->size());
+    response.respond(HttpResponseStatus::kHttpResponseOK);
+    response.write_block(entry, 0, entry->size());
+    *from_memory = true;
     return true;
 }
 
-bool
-StaticHttpHandler::validate_client_cache(const std::string& path,
-                                         struct stat64 stat,
-                                         const std::string& etag,
-                                         HttpRequest& request)
+void
+StaticHttpHandler::schedule_compress(const std::string& path,
+                                     const OpenFileInfo& info,
+                                     ContentCoding coding,
+                                     const std::string& key,
+                                     const BaseHttpHandlerPtr& self)
 {
-    std::string modified_since =
-        request.find_header_value("If-Modified-Since");
-    struct tm tm_struct;
-    if (parse_datetime(modified_since, &tm_struct)) {
-        struct tm gmt;
-        gmtime_r(&stat.st_mtime, &gmt);
-        time_t orig_mtime = mktime(&gmt);
-        time_t modified_time = mktime(&tm_struct);
-        if (orig_mtime > modified_time) {
-            return false;
-        }
-        // try to check the etag
-        std::string etag = request.find_header_value("If-None-Match");
-        if (etag != "" && etag != build_etag(path)) {
-            return false;
-        }
-        return true;
+    if (compress_stage_ == NULL) {
+        compress_stage_ =
+            (CompressStage*) Pipeline::instance().find_stage("compress");
+        if (compress_stage_ == NULL)
+            return;
     }
-    return false;
-}
-
-int
-StaticHttpHandler::try_open_file(const std::string& path, HttpRequest& request,
-                                 HttpResponse& response)
-{
-    int file_desc = 0;
-    if (request.method() != HTTP_HEAD) {
-        file_desc = ::open(path.c_str(), O_RDONLY);
-        // cannot open, this is access forbidden
-        if (file_desc < 0) {
-            respond_error(HttpResponseStatus::kHttpResponseForbidden,
-                          request, response);
-        }
+    utils::Lock lk(compress_mutex_);
+    if (compress_pending_.find(key) != compress_pending_.end())
+        return;
+    compress_pending_.insert(key);
+    lk.unlock();
+    // the job holds self, the handler is not freed before it's done
+    if (!compress_stage_->add_job(
+            boost::bind(&StaticHttpHandler::compress_file, this, path,
+                        info.stat.st_mtime, info.stat.st_size, coding, key,
+                        self))) {
+        lk.lock();
+        compress_pending_.erase(key);
     }
-    return file_desc;
-}
-
-static void
-send_client_cache_info(HttpResponse& response, time_t* mtime, std::string etag)
-{
-    response.add_header("Last-Modified", build_last_modified(mtime));
-    response.add_header("ETag", etag);
 }
 
-static void
-send_client_data(HttpResponse& response, const HttpResponseStatus& status,
-                 byte* cached_entry, int file_desc, off64_t offset,
-                 off64_t length)
+// runs on the compress stage
+void
+StaticHttpHandler::compress_file(std::string path, time_t mtime,
+                                 off64_t file_size, ContentCoding coding,
+                                 std::string key, BaseHttpHandlerPtr self)
 {
-    if (cached_entry) {
+    std::string content, output;
+    struct stat64 buf;
+    int file_desc = ::open(path.c_str(), O_RDONLY);
+    if (file_desc < 0)
+        goto done;
+    // give up if the file has changed since the request
+    if (fstat64(file_desc, &buf) < 0 || buf.st_mtime != mtime
+        || buf.st_size != file_size) {
         ::close(file_desc);
-        response.write_data(cached_entry + offset, length);
-        response.respond(status);
-    } else {
-        response.respond(status);
-        response.write_file(file_desc, offset, length);
+        goto done;
+    }
+    content.resize(file_size);
+    for (size_t nread = 0; nread < content.size();) {
+        ssize_t res = ::read(file_desc, &content[nread],
+                             content.size() - nread);
+        if (res <= 0) {
+            ::close(file_desc);
+            goto done;
+        }
+        nread += res;
+    }
+    ::close(file_desc);
+    if (compress_data(coding, compress_level_, (const byte*) content.data(),
+                      content.size(), output)) {
+        // kept even if it is larger, so we don't try again
+        compress_cache_.insert_cache(
+            IOCacheEntryPtr(new IOCacheEntry(key, mtime, output)));
     }
+done:
+    utils::Lock lk(compress_mutex_);
+    compress_pending_.erase(key);
 }
 
-void
+bool
 StaticHttpHandler::respond_file_content(const std::string& path,
-                                        struct stat64 stat,
+                                        const OpenFileInfoPtr& file_info,
                                         HttpRequest& request,
                                         HttpResponse& response)
 {
-    byte* cached_entry = NULL;
+    OpenFileInfoPtr info = file_info;
+    IOCacheEntryPtr cached_entry;
+    bool from_memory = true;
     off64_t file_size = -1;
     std::string range_str;
-    std::string etag;
-    HttpResponseStatus ret_status = HttpResponseStatus::kHttpResponseOK;
-    off64_t offset = 0, length = -1;
-
-    if (request.method() != HTTP_HEAD) {
-        cached_entry = io_cache_.access_cache(path, stat.st_mtime,
-                                              stat.st_size);
+    ByteRanges ranges;
+    RangeResult range_res = kRangeIgnored;
+    bool compressible = false;
+
+    bool not_modified = validate_client_cache(*info, request);
+    if (!not_modified && request.method() != HTTP_HEAD) {
+        cached_entry = io_cache_.access_cache(path, info->stat.st_mtime,
+                                              info->stat.st_size,
+                                              &from_memory);
+        if (!cached_entry) {
+            // a hit never gets here, only the content needs the descriptor
+            info = file_cache_.open_info(info);
+            if (!info->handle) {
+                // cannot open, this is access forbidden
+                respond_error(HttpResponseStatus::kHttpResponseForbidden,
+                              request, response);
+                return false;
+            }
+        }
     }
 
-    int file_desc = try_open_file(path, request, response);
-    if (file_desc < 0) {
-        goto done;
-    }
+    file_size = info->stat.st_size;
+    compressible = is_compressible(info->content_type);
 
-    file_size = stat.st_size;
-    etag = build_etag(path);
+    if (compressible) {
+        response.add_header("Vary", "Accept-Encoding");
+    }
+    send_cache_control(info->content_type, response);
 
-    if (validate_client_cache(path, stat, etag, request)) {
+    if (not_modified) {
+        send_client_cache_info(response, *info);
         response.respond(HttpResponseStatus::kHttpResponseNotModified);
-        goto done;
+        return true;
     }
 
     range_str = request.find_header_value("Range");
-    if (range_str != "") {
-        // parse range
-        parse_range(range_str, offset, length);
-        // incomplete range, doesn't have a length
-        // we'll transfer all begining from that offset
-        if (length < 0) {
-            length = file_size - offset;
-        }
-        // exceeded file size, this is invalid range
-        if ((size_t) (offset + length) > file_size) {
-            respond_error(
-                HttpResponseStatus::kHttpResponseRequestedRangeNotSatisfiable,
-                request, response);
-            goto done;
-        }
-        response.add_header("Content-Range",
-                            build_range_response(offset, length, file_size));
-        ret_status = HttpResponseStatus::kHttpResponsePartialContent;
-    } else {
-        offset = 0;
-        length = file_size;
+    if (range_str != "" && request.method() != HTTP_HEAD) {
+        range_res = parse_ranges(range_str, file_size, ranges);
+    }
+    if (range_res == kRangeUnsatisfiable) {
+        std::stringstream ss;
+        ss << "bytes */" << file_size;
+        response.add_header("Content-Range", ss.str());
+        respond_error(
+            HttpResponseStatus::kHttpResponseRequestedRangeNotSatisfiable,
+            request, response);
+        return false;
     }
-    response.set_content_length(length);
-    send_client_cache_info(response, &stat.st_mtime, etag);
-    if (request.method() != HTTP_HEAD) {
-        send_client_data(response, ret_status, cached_entry, file_desc, offset,
-                         length);
-    } else {
+
+    if (range_res != kRangeSatisfiable || ranges.size() == 1) {
+        // multipart responses carry it for every part instead
+        response.add_header("Content-Type", info->content_type);
+    }
+
+    bool encoded_from_memory = false;
+    if (range_res == kRangeIgnored && request.method() != HTTP_HEAD
+        && compressible
+        && respond_encoded(path, info, request, response,
+                           &encoded_from_memory)) {
+        return encoded_from_memory;
+    }
+
+    send_client_cache_info(response, *info);
+    if (request.method() == HTTP_HEAD) {
+        response.set_content_length(file_size);
         response.respond(HttpResponseStatus::kHttpResponseOK);
+    } else if (range_res == kRangeIgnored) {
+        response.set_content_length(file_size);
+        send_client_data(response, HttpResponseStatus::kHttpResponseOK,
+                         cached_entry, info->handle, 0, file_size);
+    } else if (ranges.size() == 1) {
+        response.add_header("Content-Range",
+                            build_range_response(ranges[0].offset,
+                                                 ranges[0].length,
+                                                 file_size));
+        response.set_content_length(ranges[0].length);
+        send_client_data(response,
+                         HttpResponseStatus::kHttpResponsePartialContent,
+                         cached_entry, info->handle, ranges[0].offset,
+                         ranges[0].length);
+    } else {
+        send_multipart_data(response, ranges, cached_entry, info->handle,
+                            file_size, info->content_type);
     }
-done:
-    delete [] cached_entry;
+    return from_memory;
 }
 
 static void
@@ -397,15 +685,37 @@ add_directory_entry(std::stringstream& ss, std::string entry,
 void
 StaticHttpHandler::respond_directory_list(const std::string& path,
                                           const std::string& href_path,
+                                          const OpenFileInfoPtr& info,
                                           HttpRequest& request,
                                           HttpResponse& response)
 {
+    time_t dir_mtime = info->stat.st_mtime;
+    IOCacheEntryPtr cached = listing_cache_.find_cache(path, dir_mtime);
+    if (cached) {
+        response.add_header("Content-Type", "text/html");
+        response.set_content_length(cached->size());
+        response.respond(HttpResponseStatus::kHttpResponseOK);
+        if (request.method() != HTTP_HEAD) {
+            response.write_block(cached, 0, cached->size());
+        }
+        return;
+    }
+
     DIR* dirp = opendir(path.c_str());
     if (!dirp) {
         respond_error(HttpResponseStatus::kHttpResponseForbidden,
                       request, response);
         return;
     }
+    // a change within the same second would leave the mtime as it is
+    bool caching = listing_cache_.enabled() && dir_mtime < time(NULL) - 1;
+    std::string page;
+    // large directories start flowing before readdir is done
+    bool streaming = request.method() != HTTP_HEAD;
+    response.add_header("Content-Type", "text/html");
+    if (streaming) {
+        response.begin_chunked(HttpResponseStatus::kHttpResponseOK);
+    }
     std::stringstream ss;
     ss << "<html><head>"
        << "<meta http-equiv=\"Content-Type\" content=\"text/html; charset="
@@ -423,28 +733,47 @@ StaticHttpHandler::respond_directory_list(const std::string& path,
         add_directory_entry(ss, "..", NULL);
     }
     dirent* ent = NULL;
+    int dir_fd = dirfd(dirp);
     ss << "<table>";
     while ((ent = readdir(dirp))) {
-        std::string ent_name = ent->d_name;
-        std::string ent_path = path + "/" + ent->d_name;
+        const char* ent_name = ent->d_name;
         struct stat64 buf;
-        if (ent_name == "." || ent_name == "..") {
+        if (strcmp(ent_name, ".") == 0 || strcmp(ent_name, "..") == 0) {
             continue;
         }
-        if (::stat64(ent_path.c_str(), &buf) < 0) {
+        // relative to the open directory, no path lookup from the root
+        if (fstatat64(dir_fd, ent_name, &buf, 0) < 0) {
             continue;
         }
         add_directory_entry(ss, ent_name, &buf);
+        if (streaming && (size_t) ss.tellp() >= kListingChunkSize) {
+            std::string chunk = ss.str();
+            response.write_string(chunk);
+            if (caching && page.size() + chunk.size() >= listing_max_size_) {
+                // too large to be cached anyway
+                caching = false;
+                std::string().swap(page);
+            } else if (caching) {
+                page.append(chunk);
+            }
+            ss.str("");
+        }
     }
     closedir(dirp);
     ss << "</table></body></html>" << std::endl;
-    response.add_header("Content-Type", "text/html");
-    if (request.method() != HTTP_HEAD) {
-        response.write_string(ss.str());
+    std::string rest = ss.str();
+    if (streaming) {
+        response.write_string(rest);
     } else {
-        response.set_content_length(ss.str().length());
+        response.set_content_length(rest.length());
     }
     response.respond(HttpResponseStatus::kHttpResponseOK);
+    if (caching) {
+        // HEAD requests have the whole page in rest
+        page.append(rest);
+        listing_cache_.insert_cache(
+            IOCacheEntryPtr(new IOCacheEntry(path, dir_mtime, page)));
+    }
 }
 
 void
@@ -457,25 +786,21 @@ StaticHttpHandler::respond_error(const HttpResponseStatus& error,
 
     std::stringstream ss;
     std::string path;
-    int file_desc = -1;
-    struct stat64 buf;
+    OpenFileInfoPtr info;
+    int err = 0;
 
     if (error_root_ == "") {
         goto default_resp;
     }
     ss << error_root_ << "/" << error.status_code << ".html";
     path = ss.str();
-    file_desc = ::open(path.c_str(), O_RDONLY);
-    if (file_desc < 0) {
+    info = file_cache_.open_file(path, &err);
+    if (!info || !info->handle) {
         goto default_resp;
     }
-    if (fstat64(file_desc, &buf) < 0) {
-        ::close(file_desc);
-        goto default_resp;
-    }
-    response.set_content_length(buf.st_size);
+    response.set_content_length(info->stat.st_size);
     response.respond(error);
-    response.write_file(file_desc, 0, -1);
+    response.write_file(info->handle, 0, info->stat.st_size);
     return;
 default_resp:
     ss.clear();
@@ -487,6 +812,51 @@ default_resp:
     return;
 }
 
+double
+StaticHttpHandler::syscall_free_rate() const
+{
+    u64 total = response_count();
+    if (total == 0)
+        return 0.0;
+    return (double) syscall_free_count() / total;
+}
+
+bool
+StaticHttpHandler::offload_open_file(const std::string& path,
+                                     HttpRequest& request,
+                                     HttpResponse& response)
+{
+    // without the cache every request would look like a miss
+    if (!file_cache_.enabled() || file_cache_.is_fresh(path))
+        return false;
+    if (disk_io_stage_ == NULL) {
+        disk_io_stage_ =
+            (DiskIOStage*) Pipeline::instance().find_stage("disk_io");
+        if (disk_io_stage_ == NULL)
+            return false;
+    }
+    return disk_io_stage_->submit(
+        request, response,
+        boost::bind(&StaticHttpHandler::prefetch_file, this, path));
+}
+
+// runs on the disk io stage.  leaves the file in file_cache_ and the start of
+// it in the page cache, so the resumed request does not wait for the disk.
+void
+StaticHttpHandler::prefetch_file(std::string path)
+{
+    int err = 0;
+    OpenFileInfoPtr info = file_cache_.open_file(path, &err);
+    if (!info || !info->handle)
+        return;
+    off64_t length = std::min(info->stat.st_size, kPrefetchSize);
+    char buf[16 << 10];
+    for (off64_t offset = 0; offset < length; offset += sizeof(buf)) {
+        if (::pread64(info->handle->fd(), buf, sizeof(buf), offset) <= 0)
+            break;
+    }
+}
+
 void
 StaticHttpHandler::handle_request(HttpRequest& request, HttpResponse& response)
 {
@@ -497,22 +867,34 @@ StaticHttpHandler::handle_request(HttpRequest& request, HttpResponse& response)
         && request.method() != HTTP_HEAD) {
         respond_error(HttpResponseStatus::kHttpResponseBadRequest, request,
                       response);
+        return;
     }
 
-    struct stat64 buf;
+    int err = 0;
+    bool cached = false;
     std::string filepath = doc_root_ + filename;
-    if (::stat64(filepath.c_str(), &buf) < 0) {
+    if (!request.is_resumed()
+        && offload_open_file(filepath, request, response)) {
+        return; // handled again once the disk io stage has the file
+    }
+    response_count_.increment();
+    OpenFileInfoPtr info = file_cache_.stat_file(filepath, &err, &cached);
+    if (!info) {
         LOG(DEBUG, "Cannot stat file %s", filepath.c_str());
         respond_error(HttpResponseStatus::kHttpResponseNotFound,
                       request, response);
         return;
     }
 
-    if (S_ISREG(buf.st_mode)) {
-        respond_file_content(filepath, buf, request, response);
-    } else if (S_ISDIR(buf.st_mode)) {
+    if (S_ISREG(info->stat.st_mode)) {
+        if (respond_file_content(filepath, info, request, response)
+            && cached) {
+            syscall_free_count_.increment();
+        }
+    } else if (S_ISDIR(info->stat.st_mode)) {
         if (allow_index_) {
-            respond_directory_list(filepath, filename, request, response);
+            respond_directory_list(filepath, filename, info, request,
+                                   response);
         } else {
             respond_error(HttpResponseStatus::kHttpResponseForbidden,
                           request, response);
@@ -4,11 +4,17 @@
 #define _STATIC_HANDLER_H_
 
 #include <string>
+#include <vector>
+#include <set>
 
 #include "utils/misc.h"
 #include "http/http_wrapper.h"
 #include "http/interface.h"
 #include "http/io_cache.h"
+#include "http/file_cache.h"
+#include "http/mime_types.h"
+#include "http/compression.h"
+#include "http/http_stages.h"
 
 namespace tube {
 
@@ -19,17 +25,76 @@ class StaticHttpHandler : public BaseHttpHandler
     std::string index_page_css_;
     bool        allow_index_;
 
-    IOCache     io_cache_;
-    std::string charset_;
+    IOCache          io_cache_;
+    MimeTypeRegistry mime_types_; // outlives file_cache_, which points to it
+    OpenFileCache    file_cache_;
+    std::string      charset_;
+
+    // content encoding
+    bool                     gzip_static_;
+    bool                     compress_;
+    int                      compress_level_;
+    size_t                   compress_min_size_;
+    size_t                   compress_max_size_;
+    std::vector<std::string> compress_types_; // MIME type patterns
+    IOCache                  compress_cache_;
+    utils::Mutex             compress_mutex_;
+    std::set<std::string>    compress_pending_;
+    CompressStage*           compress_stage_;
+
+    // opens and reads ahead files missing from file_cache_, if it has threads
+    DiskIOStage*             disk_io_stage_;
+
+    // rendered directory listings, valid while the directory mtime is
+    IOCache                  listing_cache_;
+    size_t                   listing_max_size_;
+
+    // Cache-Control values by MIME type pattern
+    std::vector<std::pair<std::string, std::string> > cache_control_;
+
+    utils::AtomicCounter response_count_;
+    utils::AtomicCounter syscall_free_count_;
 public:
+    struct ByteRange
+    {
+        off64_t offset;
+        off64_t length;
+    };
+    typedef std::vector<ByteRange> ByteRanges;
+
+    enum RangeResult {
+        kRangeIgnored,      // no or malformed Range, send the whole file
+        kRangeSatisfiable,
+        kRangeUnsatisfiable
+    };
+
+    static const size_t kMaxRangeCount;
+    static const size_t kListingChunkSize;
+    static const off64_t kPrefetchSize;
+
     static std::string remove_path_dots(const std::string& path);
+    static RangeResult parse_ranges(const std::string& range_desc,
+                                    off64_t file_size, ByteRanges& ranges);
 
     StaticHttpHandler();
 
     virtual void handle_request(HttpRequest& request, HttpResponse& response);
     virtual void load_param();
 
-    void respond_file_content(const std::string& path, struct stat64 stat,
+    const IOCache& io_cache() const { return io_cache_; }
+    const OpenFileCache& file_cache() const { return file_cache_; }
+    const IOCache& listing_cache() const { return listing_cache_; }
+    const MimeTypeRegistry& mime_types() const { return mime_types_; }
+
+    // requests handled, and how many of them were answered from the caches
+    // alone, without a single file system syscall
+    u64    response_count() const { return response_count_.value(); }
+    u64    syscall_free_count() const { return syscall_free_count_.value(); }
+    double syscall_free_rate() const;
+
+    // true if the response came from memory, the file was not read
+    bool respond_file_content(const std::string& path,
+                              const OpenFileInfoPtr& file_info,
                               HttpRequest& request, HttpResponse& resposne);
 
     void respond_error(const HttpResponseStatus& error,
@@ -37,13 +102,32 @@ public:
 
     void respond_directory_list(const std::string& path,
                                 const std::string& href_path,
+                                const OpenFileInfoPtr& info,
                                 HttpRequest& request,
                                 HttpResponse& response);
 private:
-    bool validate_client_cache(const std::string& path, struct stat64 stat,
-                               const std::string& etag, HttpRequest& request);
-    int  try_open_file(const std::string& path, HttpRequest& request,
-                       HttpResponse& response);
+    bool validate_client_cache(const OpenFileInfo& info, HttpRequest& request);
+
+    bool offload_open_file(const std::string& path, HttpRequest& request,
+                           HttpResponse& response);
+    void prefetch_file(std::string path);
+
+    bool is_compressible(const std::string& content_type) const;
+    void send_cache_control(const std::string& content_type,
+                            HttpResponse& response) const;
+    bool respond_encoded(const std::string& path, const OpenFileInfoPtr& info,
+                         HttpRequest& request, HttpResponse& response,
+                         bool* from_memory);
+    bool respond_precompressed(const std::string& path,
+                               const OpenFileInfoPtr& info,
+                               const std::string& accept_encoding,
+                               HttpResponse& response);
+    void schedule_compress(const std::string& path, const OpenFileInfo& info,
+                           ContentCoding coding, const std::string& key,
+                           const BaseHttpHandlerPtr& self);
+    void compress_file(std::string path, time_t mtime, off64_t file_size,
+                       ContentCoding coding, std::string key,
+                       BaseHttpHandlerPtr self);
 };
 
 class StaticHttpHandlerFactory : public BaseHttpHandlerFactory
@@ -0,0 +1,649 @@
+#include "pch.h"
+
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <cctype>
+#include <algorithm>
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <boost/bind.hpp>
+
+#include "http/upstream.h"
+#include "utils/logger.h"
+
+namespace tube {
+
+UpstreamConnection::~UpstreamConnection()
+{
+    ::close(fd);
+}
+
+// the upstream has neither closed it nor sent anything unasked
+static bool
+is_idle_alive(int fd)
+{
+    char c;
+    ssize_t res = ::recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+UpstreamPool::UpstreamPool()
+    : next_(0), balance_(kRoundRobin), max_idle_(32), connect_timeout_(1000),
+      io_timeout_(30000), poller_(NULL), watcher_(NULL), last_scan_(0)
+{
+}
+
+UpstreamPool::~UpstreamPool()
+{
+    stop_watcher();
+    if (poller_)
+        PollerFactory::instance().destroy_poller(poller_);
+    // their handlers are dropped unanswered
+    for (ConnectionSet::iterator it = watched_.begin(); it != watched_.end();
+         ++it) {
+        delete *it;
+    }
+    for (size_t i = 0; i < upstreams_.size(); i++) {
+        std::list<UpstreamConnection*>& idle = upstreams_[i]->idle;
+        for (std::list<UpstreamConnection*>::iterator it = idle.begin();
+             it != idle.end(); ++it) {
+            delete *it;
+        }
+        delete upstreams_[i];
+    }
+}
+
+bool
+UpstreamPool::add_upstream(const std::string& name)
+{
+    size_t colon = name.rfind(':');
+    if (colon == std::string::npos || colon == 0) {
+        LOG(ERROR, "upstream %s should be host:port", name.c_str());
+        return false;
+    }
+    std::string host = name.substr(0, colon);
+    std::string port = name.substr(colon + 1);
+    if (host.length() > 2 && host[0] == '[' && host[host.length() - 1] == ']')
+        host = host.substr(1, host.length() - 2);
+
+    struct addrinfo hints;
+    struct addrinfo* res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+    if (err != 0 || res == NULL) {
+        LOG(ERROR, "cannot resolve upstream %s: %s", name.c_str(),
+            gai_strerror(err));
+        return false;
+    }
+    Upstream* upstream = new Upstream();
+    upstream->name = name;
+    if (res->ai_addrlen > upstream->address.max_address_length()) {
+        freeaddrinfo(res);
+        delete upstream;
+        return false;
+    }
+    memcpy(upstream->address.get_address(), res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+
+    utils::Lock lk(mutex_);
+    upstreams_.push_back(upstream);
+    return true;
+}
+
+void
+UpstreamPool::start_watcher()
+{
+    if (watcher_)
+        return;
+    poller_ = PollerFactory::instance().create_poller(
+        PollerFactory::instance().default_poller_name());
+    if (poller_ == NULL) {
+        LOG(WARNING, "no poller for idle upstream connections");
+        return;
+    }
+    poller_->set_event_handler(
+        boost::bind(&UpstreamPool::handle_event, this, _1, _2));
+    poller_->set_post_handler(
+        boost::bind(&UpstreamPool::scan_timeouts, this, _1));
+    watcher_ = new utils::Thread(boost::bind(&UpstreamPool::poll, this));
+}
+
+void
+UpstreamPool::stop_watcher()
+{
+    if (watcher_ == NULL)
+        return;
+    poller_->stop();
+    watcher_->join();
+    delete watcher_;
+    watcher_ = NULL;
+}
+
+void
+UpstreamPool::poll()
+{
+    // wakes up every second at least, for the timeouts
+    poller_->handle_event(1);
+}
+
+void
+UpstreamPool::handle_event(Connection* conn, PollerEvent evt)
+{
+    UpstreamConnection::EventHandler handler;
+    {
+        utils::Lock lk(mutex_);
+        // it may have been taken, or even freed, since the event came in
+        UpstreamConnection* upstream_conn = (UpstreamConnection*) conn;
+        if (watched_.count(upstream_conn)) {
+            // a copy, the handler may release the connection
+            handler = upstream_conn->on_readable;
+            upstream_conn->last_read = time(NULL);
+        } else {
+            ConnectionSet::iterator it = idle_set_.find(upstream_conn);
+            if (it == idle_set_.end())
+                return;
+            if (!(evt & (POLLER_EVENT_ERROR | POLLER_EVENT_HUP))
+                && is_idle_alive((*it)->fd))
+                return;
+            drop_idle(*it);
+            return;
+        }
+    }
+    handler(false);
+}
+
+void
+UpstreamPool::scan_timeouts(Poller& poller)
+{
+    time_t now = time(NULL);
+    if (io_timeout_ <= 0 || now == last_scan_)
+        return;
+    last_scan_ = now;
+
+    std::vector<UpstreamConnection::EventHandler> expired;
+    {
+        utils::Lock lk(mutex_);
+        for (ConnectionSet::iterator it = watched_.begin();
+             it != watched_.end(); ++it) {
+            UpstreamConnection* conn = *it;
+            if (conn->npaused > 0
+                || (now - conn->last_read) * 1000 < io_timeout_)
+                continue;
+            conn->last_read = now;
+            expired.push_back(conn->on_readable);
+        }
+    }
+    for (size_t i = 0; i < expired.size(); i++) {
+        expired[i](true);
+    }
+}
+
+// round robin over the ones not tried yet, preferring the ones not down
+Upstream*
+UpstreamPool::pick_upstream(std::set<Upstream*>& tried)
+{
+    size_t n = upstreams_.size();
+    time_t now = time(NULL);
+    for (int pass = 0; pass < 2; pass++) {
+        Upstream* best = NULL;
+        size_t best_idx = 0;
+        for (size_t i = 0; i < n; i++) {
+            size_t idx = (next_ + i) % n;
+            Upstream* upstream = upstreams_[idx];
+            if (tried.count(upstream))
+                continue;
+            if (pass == 0 && upstream->down_until > now)
+                continue;
+            if (best == NULL || (balance_ == kLeastConnections
+                                 && upstream->nactive < best->nactive)) {
+                best = upstream;
+                best_idx = idx;
+            }
+            if (balance_ == kRoundRobin)
+                break;
+        }
+        if (best) {
+            next_ = best_idx + 1;
+            return best;
+        }
+    }
+    return NULL;
+}
+
+// the most recently released one, the least likely to be timed out
+UpstreamConnection*
+UpstreamPool::take_idle(Upstream* upstream)
+{
+    while (!upstream->idle.empty()) {
+        UpstreamConnection* conn = upstream->idle.back();
+        upstream->idle.pop_back();
+        idle_set_.erase(conn);
+        if (poller_)
+            poller_->remove_fd(conn->fd);
+        if (is_idle_alive(conn->fd))
+            return conn;
+        delete conn;
+    }
+    return NULL;
+}
+
+UpstreamConnection*
+UpstreamPool::connect(Upstream* upstream)
+{
+    const InternetAddress& address = upstream->address;
+    int fd = ::socket(address.family(), SOCK_STREAM, 0);
+    if (fd < 0)
+        return NULL;
+    utils::set_socket_blocking(fd, false);
+    if (::connect(fd, address.get_address(), address.address_length()) < 0) {
+        if (errno != EINPROGRESS)
+            goto failed;
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        int res;
+        do {
+            res = ::poll(&pfd, 1, connect_timeout_);
+        } while (res < 0 && errno == EINTR);
+        if (res <= 0)
+            goto failed;
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+            goto failed;
+    }
+    utils::set_socket_blocking(fd, true);
+    {
+        UpstreamConnection* conn = new UpstreamConnection(fd, upstream);
+        conn->address = address;
+        if (io_timeout_ > 0)
+            conn->set_io_timeout(io_timeout_);
+        return conn;
+    }
+failed:
+    ::close(fd);
+    return NULL;
+}
+
+UpstreamConnection*
+UpstreamPool::acquire(bool* reused)
+{
+    std::set<Upstream*> tried;
+    while (true) {
+        Upstream* upstream = NULL;
+        UpstreamConnection* conn = NULL;
+        {
+            utils::Lock lk(mutex_);
+            upstream = pick_upstream(tried);
+            if (upstream == NULL)
+                return NULL;
+            tried.insert(upstream);
+            upstream->nactive++;
+            conn = take_idle(upstream);
+        }
+        if (conn) {
+            reuse_count_.increment();
+            if (reused)
+                *reused = true;
+            return conn;
+        }
+        conn = connect(upstream);
+        if (conn) {
+            connect_count_.increment();
+            if (reused)
+                *reused = false;
+            return conn;
+        }
+        LOG(WARNING, "cannot connect to upstream %s", upstream->name.c_str());
+        utils::Lock lk(mutex_);
+        upstream->nactive--;
+        upstream->down_until = time(NULL) + kFailTimeout;
+    }
+}
+
+void
+UpstreamPool::release(UpstreamConnection* conn, bool reusable)
+{
+    utils::Lock lk(mutex_);
+    if (watched_.erase(conn) > 0) {
+        if (conn->npaused <= 0)
+            poller_->remove_fd(conn->fd);
+        conn->on_readable = UpstreamConnection::EventHandler();
+        utils::set_socket_blocking(conn->fd, true);
+    }
+    Upstream* upstream = conn->upstream;
+    upstream->nactive--;
+    upstream->down_until = 0;
+    if (!reusable || upstream->idle.size() >= max_idle_) {
+        delete conn;
+        return;
+    }
+    if (poller_ && !poller_->add_fd(conn->fd, conn, POLLER_EVENT_READ
+                                    | POLLER_EVENT_ERROR | POLLER_EVENT_HUP)) {
+        delete conn;
+        return;
+    }
+    upstream->idle.push_back(conn);
+    idle_set_.insert(conn);
+}
+
+bool
+UpstreamPool::watch(UpstreamConnection* conn,
+                    const UpstreamConnection::EventHandler& handler)
+{
+    if (poller_ == NULL)
+        return false;
+    utils::set_socket_blocking(conn->fd, false);
+    utils::Lock lk(mutex_);
+    conn->on_readable = handler;
+    conn->npaused = 0;
+    conn->last_read = time(NULL);
+    if (!poller_->add_fd(conn->fd, conn, POLLER_EVENT_READ
+                         | POLLER_EVENT_ERROR | POLLER_EVENT_HUP)) {
+        conn->on_readable = UpstreamConnection::EventHandler();
+        utils::set_socket_blocking(conn->fd, true);
+        return false;
+    }
+    watched_.insert(conn);
+    return true;
+}
+
+void
+UpstreamPool::pause(UpstreamConnection* conn)
+{
+    utils::Lock lk(mutex_);
+    if (watched_.count(conn) && conn->npaused++ == 0)
+        poller_->remove_fd(conn->fd);
+}
+
+void
+UpstreamPool::resume(UpstreamConnection* conn)
+{
+    utils::Lock lk(mutex_);
+    // it may have been released, or even freed, meanwhile
+    if (watched_.count(conn) == 0 || --conn->npaused != 0)
+        return;
+    conn->last_read = time(NULL);
+    poller_->add_fd(conn->fd, conn, POLLER_EVENT_READ | POLLER_EVENT_ERROR
+                    | POLLER_EVENT_HUP);
+}
+
+void
+UpstreamPool::drop_idle(UpstreamConnection* conn)
+{
+    conn->upstream->idle.remove(conn);
+    idle_set_.erase(conn);
+    if (poller_)
+        poller_->remove_fd(conn->fd);
+    delete conn;
+}
+
+size_t
+UpstreamPool::idle_count()
+{
+    utils::Lock lk(mutex_);
+    return idle_set_.size();
+}
+
+UpstreamResponseReader::UpstreamResponseReader(int fd)
+    : fd_(fd), pos_(0), eof_(false), nreceived_(0), body_type_(kNoBody),
+      remaining_(0), body_done_(false), keep_alive_(false)
+{
+}
+
+ssize_t
+UpstreamResponseReader::receive()
+{
+    if (pos_ == buf_.size()) {
+        buf_.clear();
+        pos_ = 0;
+    } else if (pos_ >= kMaxHeadSize) {
+        buf_.erase(0, pos_);
+        pos_ = 0;
+    }
+    char tmp[16384];
+    ssize_t nread;
+    do {
+        nread = ::read(fd_, tmp, sizeof(tmp));
+    } while (nread < 0 && errno == EINTR);
+    if (nread > 0) {
+        buf_.append(tmp, nread);
+        nreceived_ += nread;
+    } else if (nread == 0) {
+        eof_ = true;
+    }
+    return nread;
+}
+
+// the line starting at pos, if it has arrived whole
+bool
+UpstreamResponseReader::next_line(size_t& pos, std::string& line) const
+{
+    size_t nl = buf_.find('\n', pos);
+    if (nl == std::string::npos)
+        return false;
+    line.assign(buf_, pos, nl - pos);
+    if (!line.empty() && line[line.length() - 1] == '\r')
+        line.erase(line.length() - 1);
+    pos = nl + 1;
+    return true;
+}
+
+// 0 while more may complete what is parsed, -1 once it can't
+int
+UpstreamResponseReader::need_more() const
+{
+    return buf_.size() - pos_ > kMaxHeadSize ? -1 : 0;
+}
+
+static std::string
+trim_space(const std::string& str)
+{
+    size_t begin = str.find_first_not_of(" \t");
+    if (begin == std::string::npos)
+        return std::string();
+    size_t end = str.find_last_not_of(" \t");
+    return str.substr(begin, end - begin + 1);
+}
+
+static std::string
+lower_string(std::string str)
+{
+    for (size_t i = 0; i < str.length(); i++) {
+        str[i] = tolower(str[i]);
+    }
+    return str;
+}
+
+// 1 once the lines after the status line were parsed up to pos
+int
+UpstreamResponseReader::parse_head(size_t& pos, const std::string& status_line,
+                                   UpstreamResponse& response)
+{
+    // HTTP/1.x NNN reason
+    if (status_line.length() < 12 || status_line.compare(0, 7, "HTTP/1.") != 0
+        || !isdigit(status_line[7]) || status_line[8] != ' ')
+        return -1;
+    response.version_minor = status_line[7] - '0';
+    response.status_code = atoi(status_line.c_str() + 9);
+    if (response.status_code < 100 || response.status_code > 999)
+        return -1;
+    response.reason = status_line.length() > 13 ? status_line.substr(13) : "";
+    response.keep_alive = response.version_minor >= 1;
+    response.content_length = -1;
+    response.chunked = false;
+    response.headers.clear();
+
+    std::string line;
+    size_t head_size = status_line.length();
+    while (true) {
+        if (!next_line(pos, line))
+            return need_more();
+        head_size += line.length();
+        if (head_size > kMaxHeadSize)
+            return -1;
+        if (line.empty())
+            break;
+        size_t colon = line.find(':');
+        if (colon == std::string::npos || colon == 0)
+            return -1;
+        std::string key = line.substr(0, colon);
+        std::string value = trim_space(line.substr(colon + 1));
+        if (utils::ignore_compare(key, "content-length")) {
+            char* end = NULL;
+            long long len = strtoll(value.c_str(), &end, 10);
+            if (end == value.c_str() || *end != '\0' || len < 0)
+                return -1;
+            response.content_length = len;
+        } else if (utils::ignore_compare(key, "transfer-encoding")) {
+            if (lower_string(value).find("chunked") != std::string::npos)
+                response.chunked = true;
+        } else if (utils::ignore_compare(key, "connection")) {
+            std::string token = lower_string(value);
+            if (token.find("close") != std::string::npos)
+                response.keep_alive = false;
+            else if (token.find("keep-alive") != std::string::npos)
+                response.keep_alive = true;
+        }
+        response.headers.push_back(HttpHeaderItem(key, value));
+    }
+    return 1;
+}
+
+UpstreamResponseReader::HeadResult
+UpstreamResponseReader::take_head(UpstreamResponse& response,
+                                  bool head_request)
+{
+    // nothing is consumed until a whole head is in
+    do {
+        size_t pos = pos_;
+        std::string status_line;
+        int res = next_line(pos, status_line) ?
+            parse_head(pos, status_line, response) : need_more();
+        if (res < 0)
+            return kHeadMalformed;
+        if (res == 0)
+            return kHeadPending;
+        pos_ = pos;
+    } while (response.status_code == 100);
+
+    keep_alive_ = response.keep_alive;
+    body_done_ = false;
+    int code = response.status_code;
+    if (head_request || code < 200 || code == 204 || code == 304) {
+        body_type_ = kNoBody;
+        body_done_ = true;
+    } else if (response.chunked) {
+        body_type_ = kChunkedBody;
+        remaining_ = 0;
+    } else if (response.content_length >= 0) {
+        body_type_ = kLengthBody;
+        remaining_ = response.content_length;
+        body_done_ = remaining_ == 0;
+    } else {
+        body_type_ = kCloseBody;
+        keep_alive_ = false;
+    }
+    return kHeadDone;
+}
+
+bool
+UpstreamResponseReader::read_head(UpstreamResponse& response,
+                                  bool head_request)
+{
+    while (true) {
+        HeadResult res = take_head(response, head_request);
+        if (res != kHeadPending)
+            return res == kHeadDone;
+        if (eof_ || receive() <= 0)
+            return false;
+    }
+}
+
+// the size line of the next chunk, and the trailers after the last one.
+// 1 once they all arrived, consumed only then.
+int
+UpstreamResponseReader::next_chunk()
+{
+    size_t pos = pos_;
+    std::string line;
+    if (!next_line(pos, line))
+        return need_more();
+    if (line.empty() && !next_line(pos, line)) // end of the previous chunk
+        return need_more();
+    char* end = NULL;
+    u64 size = strtoull(line.c_str(), &end, 16);
+    if (end == line.c_str())
+        return -1;
+    if (size == 0) {
+        do {
+            if (!next_line(pos, line))
+                return need_more();
+        } while (!line.empty());
+        body_done_ = true;
+    }
+    remaining_ = size;
+    pos_ = pos;
+    return 1;
+}
+
+ssize_t
+UpstreamResponseReader::take_body(byte* ptr, size_t size)
+{
+    if (body_done_ || size == 0)
+        return 0;
+    if (body_type_ == kChunkedBody && remaining_ == 0) {
+        int res = next_chunk();
+        if (res < 0 || (res == 0 && eof_)) {
+            errno = EPROTO;
+            return -1;
+        }
+        if (res == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+        if (body_done_)
+            return 0;
+    }
+    if (pos_ == buf_.size()) {
+        if (!eof_) {
+            errno = EAGAIN;
+            return -1;
+        }
+        if (body_type_ != kCloseBody) {
+            errno = EPROTO; // truncated
+            return -1;
+        }
+        body_done_ = true;
+        return 0;
+    }
+    if (body_type_ != kCloseBody && size > remaining_)
+        size = remaining_;
+    size_t nread = std::min(size, buf_.size() - pos_);
+    memcpy(ptr, buf_.data() + pos_, nread);
+    pos_ += nread;
+    if (body_type_ != kCloseBody) {
+        remaining_ -= nread;
+        if (remaining_ == 0 && body_type_ == kLengthBody)
+            body_done_ = true;
+    }
+    return nread;
+}
+
+ssize_t
+UpstreamResponseReader::read_body(byte* ptr, size_t size)
+{
+    while (true) {
+        ssize_t nread = take_body(ptr, size);
+        if (nread >= 0 || errno != EAGAIN)
+            return nread;
+        if (receive() < 0)
+            return -1;
+    }
+}
+
+}
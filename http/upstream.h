@@ -0,0 +1,214 @@
+// -*- mode: c++ -*-
+
+#ifndef _UPSTREAM_H_
+#define _UPSTREAM_H_
+
+#include <string>
+#include <vector>
+#include <list>
+#include <set>
+#include <boost/function.hpp>
+
+#include "utils/misc.h"
+#include "core/pipeline.h"
+#include "core/poller.h"
+#include "http/connection.h"
+
+namespace tube {
+
+struct Upstream;
+
+// a connection to an upstream server, closed with it
+struct UpstreamConnection : public Connection
+{
+    // true when called for the io timeout instead
+    typedef boost::function<void (bool timed_out)> EventHandler;
+
+    Upstream*    upstream;
+    // while the pool's watcher waits for an answer on it
+    EventHandler on_readable;
+    int          npaused; // below zero if resumed ahead of the pause
+    time_t       last_read;
+
+    UpstreamConnection(int sock, Upstream* up)
+        : Connection(sock), upstream(up), npaused(0), last_read(0) {}
+    virtual ~UpstreamConnection();
+};
+
+struct Upstream
+{
+    std::string     name; // host:port as configured
+    InternetAddress address;
+    size_t          nactive; // handed out right now
+    time_t          down_until;
+
+    std::list<UpstreamConnection*> idle;
+
+    Upstream() : nactive(0), down_until(0) {}
+};
+
+// Keep-alive connections to a set of upstream servers.  A connection is
+// handed to one request at a time and used blocking, with I/O timeouts,
+// or given to the watcher to wait for the answer without a thread of its
+// own.  Idle ones are watched too, so the ones the upstream closes
+// meanwhile are dropped instead of failing the next request.
+class UpstreamPool : utils::Noncopyable
+{
+public:
+    enum Balance {
+        kRoundRobin,
+        kLeastConnections
+    };
+    // an upstream that refused a connection is skipped that long
+    static const int kFailTimeout = 10;
+
+    UpstreamPool();
+    ~UpstreamPool();
+
+    // "host:port", false if it can't be resolved
+    bool add_upstream(const std::string& name);
+    size_t upstream_count() const { return upstreams_.size(); }
+
+    void set_balance(Balance balance) { balance_ = balance; }
+    void set_max_idle(size_t max_idle) { max_idle_ = max_idle; }
+    void set_connect_timeout(int msec) { connect_timeout_ = msec; }
+    void set_io_timeout(int msec) { io_timeout_ = msec; }
+
+    // thread dropping idle connections the upstream closed, and passing
+    // the answers on watched ones
+    void start_watcher();
+    bool is_watching() const { return watcher_ != NULL; }
+    // joins the watcher, the watched connections get no more events
+    void stop_watcher();
+
+    // a connected one, kept alive from an earlier request if possible.
+    // NULL if no upstream can be reached.
+    UpstreamConnection* acquire(bool* reused = NULL);
+    // back into the idle list, or closed if it can't carry another request
+    void release(UpstreamConnection* conn, bool reusable);
+
+    // made non-blocking, handler is called on the watcher thread whenever
+    // conn is readable, or once nothing came for the io timeout.  the
+    // handler releases it in the end.  false without a watcher.
+    bool watch(UpstreamConnection* conn,
+               const UpstreamConnection::EventHandler& handler);
+    // stops watching a watched conn until as many resume(), which may
+    // come first and from any thread.  paused ones don't time out.
+    void pause(UpstreamConnection* conn);
+    void resume(UpstreamConnection* conn);
+
+    size_t idle_count();
+    u64 connect_count() const { return connect_count_.value(); }
+    u64 reuse_count() const { return reuse_count_.value(); }
+private:
+    typedef std::set<UpstreamConnection*> ConnectionSet;
+
+    utils::Mutex           mutex_;
+    std::vector<Upstream*> upstreams_;
+    ConnectionSet          idle_set_; // every idle list together
+    ConnectionSet          watched_;
+    size_t                 next_;
+    Balance                balance_;
+    size_t                 max_idle_;
+    int                    connect_timeout_;
+    int                    io_timeout_;
+
+    Poller*         poller_;
+    utils::Thread*  watcher_;
+    time_t          last_scan_;
+
+    utils::AtomicCounter connect_count_;
+    utils::AtomicCounter reuse_count_;
+
+    Upstream* pick_upstream(std::set<Upstream*>& tried);
+    UpstreamConnection* take_idle(Upstream* upstream);
+    UpstreamConnection* connect(Upstream* upstream);
+    void drop_idle(UpstreamConnection* conn);
+    void poll();
+    void handle_event(Connection* conn, PollerEvent evt);
+    void scan_timeouts(Poller& poller);
+};
+
+struct UpstreamResponse
+{
+    int                 status_code;
+    std::string         reason;
+    short               version_minor;
+    HttpHeaderEnumerate headers;
+    int64               content_length; // -1 if not given
+    bool                chunked;
+    bool                keep_alive;
+
+    UpstreamResponse()
+        : status_code(0), version_minor(0), content_length(-1),
+          chunked(false), keep_alive(false) {}
+};
+
+// Parses what an upstream answers.  The body is read piece by piece,
+// chunks decoded, so it never has to fit in memory.  On a blocking socket
+// read_head() and read_body() wait for what they need.  On a non-blocking
+// one, receive() reads what has arrived and take_head() and take_body()
+// parse it without waiting.
+class UpstreamResponseReader : utils::Noncopyable
+{
+public:
+    static const size_t kMaxHeadSize = 65536;
+
+    enum HeadResult {
+        kHeadDone,
+        kHeadPending, // not all of it has arrived
+        kHeadMalformed
+    };
+
+    explicit UpstreamResponseReader(int fd);
+
+    // false on a malformed or truncated head, errno tells a timeout apart.
+    // interim 100 responses are skipped.
+    bool read_head(UpstreamResponse& response, bool head_request = false);
+    // 0 at the end of the body, -1 on error
+    ssize_t read_body(byte* ptr, size_t size);
+
+    // what read() returned, 0 once the upstream closed
+    ssize_t    receive();
+    HeadResult take_head(UpstreamResponse& response,
+                         bool head_request = false);
+    // as read_body(), -1 with EAGAIN in errno until more is received
+    ssize_t    take_body(byte* ptr, size_t size);
+    // the upstream hasn't sent a byte
+    bool is_untouched() const { return nreceived_ == 0; }
+
+    // false if the status or the request method rule a body out
+    bool has_body() const { return body_type_ != kNoBody; }
+    // the whole body was read, nothing more came and the upstream keeps
+    // the connection open
+    bool reusable() const {
+        return body_done_ && keep_alive_ && pos_ == buf_.size();
+    }
+private:
+    enum BodyType {
+        kNoBody,
+        kLengthBody,
+        kChunkedBody,
+        kCloseBody
+    };
+
+    int         fd_;
+    std::string buf_; // read ahead of what is consumed
+    size_t      pos_;
+    bool        eof_;
+    u64         nreceived_;
+    BodyType    body_type_;
+    u64         remaining_; // of the body or the current chunk
+    bool        body_done_;
+    bool        keep_alive_;
+
+    bool next_line(size_t& pos, std::string& line) const;
+    int  need_more() const;
+    int  parse_head(size_t& pos, const std::string& status_line,
+                    UpstreamResponse& response);
+    int  next_chunk();
+};
+
+}
+
+#endif /* _UPSTREAM_H_ */
@@ -0,0 +1,664 @@
+#include "pch.h"
+
+#include <cstring>
+#include <cstdlib>
+
+#include "http/websocket.h"
+#include "http/connection.h"
+#include "http/http_stages.h"
+#include "utils/logger.h"
+#include "module.h"
+
+namespace tube {
+
+static const char* kWebSocketGuid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+const size_t WebSocket::kMaxOutboxSize = 4 << 20;
+
+static inline u32
+rotl(u32 value, int bits)
+{
+    return (value << bits) | (value >> (32 - bits));
+}
+
+// only ever hashes a handshake key, speed doesn't matter
+static void
+sha1(const std::string& input, byte digest[20])
+{
+    u32 h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476,
+                 0xC3D2E1F0 };
+    std::string msg = input;
+    u64 bit_length = (u64) input.size() * 8;
+    msg.push_back((char) 0x80);
+    while (msg.size() % 64 != 56) {
+        msg.push_back(0);
+    }
+    for (int i = 7; i >= 0; i--) {
+        msg.push_back((char) (bit_length >> (i * 8)));
+    }
+    for (size_t chunk = 0; chunk < msg.size(); chunk += 64) {
+        const byte* p = (const byte*) msg.data() + chunk;
+        u32 w[80];
+        for (int i = 0; i < 16; i++) {
+            w[i] = ((u32) p[i * 4] << 24) | ((u32) p[i * 4 + 1] << 16)
+                | ((u32) p[i * 4 + 2] << 8) | p[i * 4 + 3];
+        }
+        for (int i = 16; i < 80; i++) {
+            w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+        u32 a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            u32 f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            u32 temp = rotl(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rotl(b, 30);
+            b = a;
+            a = temp;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    for (int i = 0; i < 5; i++) {
+        digest[i * 4] = (byte) (h[i] >> 24);
+        digest[i * 4 + 1] = (byte) (h[i] >> 16);
+        digest[i * 4 + 2] = (byte) (h[i] >> 8);
+        digest[i * 4 + 3] = (byte) h[i];
+    }
+}
+
+static std::string
+base64_encode(const byte* ptr, size_t size)
+{
+    static const char* table =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string res;
+    for (size_t i = 0; i < size; i += 3) {
+        u32 group = (u32) ptr[i] << 16;
+        if (i + 1 < size)
+            group |= (u32) ptr[i + 1] << 8;
+        if (i + 2 < size)
+            group |= ptr[i + 2];
+        res.push_back(table[(group >> 18) & 0x3f]);
+        res.push_back(table[(group >> 12) & 0x3f]);
+        res.push_back(i + 1 < size ? table[(group >> 6) & 0x3f] : '=');
+        res.push_back(i + 2 < size ? table[group & 0x3f] : '=');
+    }
+    return res;
+}
+
+WebSocketFrame::WebSocketFrame(int opcode, const byte* ptr, size_t size)
+{
+    content_.reserve(size + 10);
+    content_.push_back((char) (0x80 | opcode)); // never fragmented
+    if (size < 126) {
+        content_.push_back((char) size);
+    } else if (size <= 0xffff) {
+        content_.push_back((char) 126);
+        content_.push_back((char) (size >> 8));
+        content_.push_back((char) (size & 0xff));
+    } else {
+        content_.push_back((char) 127);
+        for (int i = 7; i >= 0; i--) {
+            content_.push_back((char) ((u64) size >> (i * 8)));
+        }
+    }
+    content_.append((const char*) ptr, size);
+}
+
+WebSocket::WebSocket(Connection* conn, WebSocketHttpHandler* handler,
+                     size_t max_message_size)
+    : conn_(conn), stage_(Pipeline::instance().find_stage("websocket")),
+      address_(conn->address_string()), outbox_size_(0), scheduled_(false),
+      processing_(false), writing_(false), overflowed_(false),
+      close_sent_(false), close_notified_(false),
+      handler_(handler), max_message_size_(max_message_size),
+      message_opcode_(kContinuation)
+{
+}
+
+std::string
+WebSocket::accept_key(const std::string& key)
+{
+    byte digest[20];
+    sha1(key + kWebSocketGuid, digest);
+    return base64_encode(digest, sizeof(digest));
+}
+
+void
+WebSocket::unmask(byte* ptr, size_t size, const byte* mask, size_t offset)
+{
+    // a word of mask bytes laid out in memory order, so the same XOR works
+    // whatever the byte order
+    byte mask_bytes[8];
+    for (int i = 0; i < 8; i++) {
+        mask_bytes[i] = mask[(offset + i) % 4];
+    }
+    u64 mask_word;
+    memcpy(&mask_word, mask_bytes, sizeof(mask_word));
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        u64 word;
+        memcpy(&word, ptr + i, sizeof(word));
+        word ^= mask_word;
+        memcpy(ptr + i, &word, sizeof(word));
+    }
+    for (; i < size; i++) {
+        ptr[i] ^= mask_bytes[i % 8];
+    }
+}
+
+bool
+WebSocket::queue(const DataBlockPtr& block, bool closing)
+{
+    utils::Lock lk(mutex_);
+    if (conn_ == NULL || close_sent_ || overflowed_)
+        return false;
+    if (!outbox_.empty() && outbox_size_ + block->size() > kMaxOutboxSize) {
+        // the client doesn't keep up, drop it rather than buffer for it
+        overflowed_ = true;
+        outbox_.clear();
+        outbox_size_ = 0;
+        schedule();
+        return false;
+    }
+    outbox_.push_back(block);
+    outbox_size_ += block->size();
+    if (closing)
+        close_sent_ = true;
+    if (!writing_)
+        schedule();
+    return true;
+}
+
+// with the lock held.  the connection can't be disposed meanwhile,
+// detach() waits for it.
+void
+WebSocket::schedule()
+{
+    if (!scheduled_ && !processing_ && stage_) {
+        scheduled_ = true;
+        stage_->sched_add(conn_);
+    }
+}
+
+bool
+WebSocket::send_text(const std::string& text)
+{
+    return send_frame(WebSocketFramePtr(
+                          new WebSocketFrame(kText, (const byte*) text.data(),
+                                             text.size())));
+}
+
+bool
+WebSocket::send_binary(const byte* ptr, size_t size)
+{
+    return send_frame(WebSocketFramePtr(
+                          new WebSocketFrame(kBinary, ptr, size)));
+}
+
+bool
+WebSocket::send_frame(const WebSocketFramePtr& frame)
+{
+    return queue(frame, false);
+}
+
+void
+WebSocket::close(int code, const std::string& reason)
+{
+    std::string payload;
+    payload.push_back((char) (code >> 8));
+    payload.push_back((char) (code & 0xff));
+    payload.append(reason, 0, 123);
+    queue(WebSocketFramePtr(new WebSocketFrame(kClose,
+                                               (const byte*) payload.data(),
+                                               payload.size())),
+          true);
+}
+
+bool
+WebSocket::is_open()
+{
+    utils::Lock lk(mutex_);
+    return conn_ != NULL && !close_sent_ && !overflowed_;
+}
+
+void
+WebSocket::output_writing()
+{
+    utils::Lock lk(mutex_);
+    writing_ = true;
+}
+
+void
+WebSocket::output_written()
+{
+    utils::Lock lk(mutex_);
+    writing_ = false;
+    if (conn_ != NULL && !outbox_.empty())
+        schedule();
+}
+
+bool
+WebSocket::is_overflowed()
+{
+    utils::Lock lk(mutex_);
+    return overflowed_;
+}
+
+void
+WebSocket::detach()
+{
+    {
+        utils::Lock lk(mutex_);
+        if (conn_ == NULL)
+            return;
+        conn_ = NULL;
+        outbox_.clear();
+        outbox_size_ = 0;
+    }
+    notify_close();
+}
+
+void
+WebSocket::notify_close()
+{
+    {
+        utils::Lock lk(mutex_);
+        if (close_notified_)
+            return;
+        close_notified_ = true;
+    }
+    handler_->on_close(shared_from_this());
+}
+
+bool
+WebSocket::process()
+{
+    Connection* conn;
+    {
+        utils::Lock lk(mutex_);
+        conn = conn_;
+        if (conn == NULL)
+            return false;
+        scheduled_ = false;
+        processing_ = true;
+    }
+    Buffer& in = conn->in_stream.buffer();
+    size_t size = in.size();
+    if (size > 0) {
+        size_t old_size = input_.size();
+        input_.resize(old_size + size);
+        in.copy_front((byte*) &input_[old_size], size);
+        in.pop(size);
+    }
+    decode_frames();
+    {
+        utils::Lock lk(mutex_);
+        processing_ = false;
+    }
+    return flush();
+}
+
+bool
+WebSocket::flush()
+{
+    std::list<DataBlockPtr> blocks;
+    bool closing;
+    {
+        utils::Lock lk(mutex_);
+        if (conn_ == NULL)
+            return false;
+        scheduled_ = false;
+        // the write back stage has the output, output_written() brings
+        // the connection back here
+        if (writing_)
+            return false;
+        blocks.swap(outbox_);
+        outbox_size_ = 0;
+        closing = close_sent_;
+    }
+    for (std::list<DataBlockPtr>::iterator it = blocks.begin();
+         it != blocks.end(); ++it) {
+        conn_->out_stream.append_block(*it, 0, (*it)->size());
+    }
+    if (closing)
+        notify_close();
+    return closing;
+}
+
+// false once the connection is to be closed
+bool
+WebSocket::decode_frames()
+{
+    size_t pos = 0;
+    bool ok = true;
+    while (ok) {
+        size_t avail = input_.size() - pos;
+        if (avail < 2)
+            break;
+        const byte* head = (const byte*) input_.data() + pos;
+        bool fin = head[0] & 0x80;
+        int opcode = head[0] & 0x0f;
+        bool masked = head[1] & 0x80;
+        u64 length = head[1] & 0x7f;
+        size_t head_length = 2 + (length == 126 ? 2 : 0)
+            + (length == 127 ? 8 : 0) + (masked ? 4 : 0);
+        if (avail < head_length)
+            break;
+        if ((head[0] & 0x70) || !masked) {
+            // no extension was agreed on, and clients must mask
+            close(kCloseProtocolError);
+            ok = false;
+            break;
+        }
+        if (length == 126) {
+            length = ((u64) head[2] << 8) | head[3];
+        } else if (length == 127) {
+            length = 0;
+            for (int i = 0; i < 8; i++) {
+                length = (length << 8) | head[2 + i];
+            }
+        }
+        if (opcode >= kClose && (!fin || length > 125)) {
+            close(kCloseProtocolError);
+            ok = false;
+            break;
+        }
+        if (length > max_message_size_ - message_.size()) {
+            close(kCloseTooBig);
+            ok = false;
+            break;
+        }
+        if (avail - head_length < length)
+            break;
+        std::string payload(input_, pos + head_length, length);
+        if (length > 0) {
+            unmask((byte*) &payload[0], length,
+                   head + head_length - 4);
+        }
+        pos += head_length + length;
+        ok = handle_frame(opcode, fin, payload);
+    }
+    if (!ok) {
+        input_.clear();
+        message_.clear();
+    } else if (pos > 0) {
+        input_.erase(0, pos);
+    }
+    return ok;
+}
+
+bool
+WebSocket::handle_frame(int opcode, bool fin, std::string& payload)
+{
+    switch (opcode) {
+    case kContinuation:
+        if (message_opcode_ == kContinuation) {
+            close(kCloseProtocolError);
+            return false;
+        }
+        message_.append(payload);
+        if (fin) {
+            std::string message;
+            message.swap(message_);
+            int message_opcode = message_opcode_;
+            message_opcode_ = kContinuation;
+            handler_->on_message(shared_from_this(), message_opcode, message);
+        }
+        return true;
+    case kText:
+    case kBinary:
+        if (message_opcode_ != kContinuation) {
+            close(kCloseProtocolError);
+            return false;
+        }
+        if (fin) {
+            handler_->on_message(shared_from_this(), opcode, payload);
+        } else {
+            message_opcode_ = opcode;
+            message_.swap(payload);
+        }
+        return true;
+    case kPing:
+        queue(WebSocketFramePtr(new WebSocketFrame(
+                                    kPong, (const byte*) payload.data(),
+                                    payload.size())),
+              false);
+        return true;
+    case kPong:
+        return true;
+    case kClose:
+    {
+        // the reply carries the code the client closed with
+        int code = payload.size() >= 2
+            ? (((byte) payload[0] << 8) | (byte) payload[1]) : kCloseNormal;
+        close(code);
+        return false;
+    }
+    default:
+        close(kCloseProtocolError);
+        return false;
+    }
+}
+
+void
+WebSocketGroup::add(const WebSocketPtr& websocket)
+{
+    utils::Lock lk(mutex_);
+    members_.push_back(websocket);
+}
+
+void
+WebSocketGroup::remove(const WebSocketPtr& websocket)
+{
+    utils::Lock lk(mutex_);
+    for (size_t i = 0; i < members_.size(); i++) {
+        if (members_[i] == websocket) {
+            members_[i] = members_.back();
+            members_.pop_back();
+            return;
+        }
+    }
+}
+
+size_t
+WebSocketGroup::size()
+{
+    utils::Lock lk(mutex_);
+    return members_.size();
+}
+
+size_t
+WebSocketGroup::broadcast(const WebSocketFramePtr& frame,
+                          const WebSocket* except)
+{
+    // sent without the lock, on_close of a member may remove it meanwhile
+    std::vector<WebSocketPtr> members;
+    {
+        utils::Lock lk(mutex_);
+        members = members_;
+    }
+    size_t nsent = 0;
+    std::vector<WebSocketPtr> gone;
+    for (size_t i = 0; i < members.size(); i++) {
+        if (members[i].get() == except)
+            continue;
+        if (members[i]->send_frame(frame)) {
+            nsent++;
+        } else {
+            gone.push_back(members[i]);
+        }
+    }
+    for (size_t i = 0; i < gone.size(); i++) {
+        remove(gone[i]);
+    }
+    return nsent;
+}
+
+size_t
+WebSocketGroup::broadcast_text(const std::string& text,
+                               const WebSocket* except)
+{
+    return broadcast(WebSocketFramePtr(
+                         new WebSocketFrame(WebSocket::kText,
+                                            (const byte*) text.data(),
+                                            text.size())),
+                     except);
+}
+
+// a comma separated header holds token, case aside
+static bool
+has_token(const std::string& value, const std::string& token)
+{
+    size_t pos = 0;
+    while (pos <= value.size()) {
+        size_t end = value.find(',', pos);
+        if (end == std::string::npos)
+            end = value.size();
+        size_t begin = value.find_first_not_of(" \t", pos);
+        size_t last = value.find_last_not_of(" \t", end - 1);
+        if (begin < end && last != std::string::npos && last >= begin
+            && utils::ignore_compare(value.substr(begin, last - begin + 1),
+                                     token))
+            return true;
+        pos = end + 1;
+    }
+    return false;
+}
+
+WebSocketHttpHandler::WebSocketHttpHandler()
+    : broadcast_(false), max_message_size_(1 << 20), idle_timeout_(300)
+{
+    add_option("mode", "echo");
+    add_option("max_message_size", "1048576");
+    add_option("idle_timeout", "300");
+}
+
+void
+WebSocketHttpHandler::load_param()
+{
+    std::string mode = option("mode");
+    if (mode != "echo" && mode != "broadcast")
+        LOG(WARNING, "unknown websocket mode %s, using echo", mode.c_str());
+    broadcast_ = mode == "broadcast";
+    max_message_size_ = strtoull(option("max_message_size").c_str(), NULL,
+                                 10);
+    idle_timeout_ = atoi(option("idle_timeout").c_str());
+}
+
+void
+WebSocketHttpHandler::handle_request(HttpRequest& request,
+                                     HttpResponse& response)
+{
+    std::string upgrade, connection, version, key;
+    const HttpHeaderEnumerate& headers = request.headers();
+    for (size_t i = 0; i < headers.size(); i++) {
+        const HttpHeaderItem& item = headers[i];
+        if (utils::ignore_compare(item.key, "upgrade")) {
+            upgrade = item.value;
+        } else if (utils::ignore_compare(item.key, "connection")) {
+            connection += item.value + ",";
+        } else if (utils::ignore_compare(item.key, "sec-websocket-version")) {
+            version = item.value;
+        } else if (utils::ignore_compare(item.key, "sec-websocket-key")) {
+            key = item.value;
+        }
+    }
+    if (request.method() != HTTP_GET || request.version_major() != 1
+        || request.version_minor() < 1 || !has_token(upgrade, "websocket")
+        || !has_token(connection, "upgrade") || key.empty()) {
+        response.write_string("A WebSocket handshake is expected.\n");
+        response.respond(HttpResponseStatus::kHttpResponseBadRequest);
+        return;
+    }
+    if (version != "13") {
+        response.add_header("Sec-WebSocket-Version", "13");
+        response.respond(HttpResponseStatus(426, "Upgrade Required"));
+        return;
+    }
+
+    response.add_header("Upgrade", "websocket");
+    response.add_header("Connection", "Upgrade");
+    response.add_header("Sec-WebSocket-Accept", WebSocket::accept_key(key));
+    response.set_has_content_length(false);
+    response.respond(HttpResponseStatus::kHttpResponseSwitchingProtocols);
+
+    Connection* conn = request.connection();
+    WebSocketPtr websocket(new WebSocket(conn, this, max_message_size_));
+    websocket->keep_handler(shared_from_request(request));
+    conn->set_timeout(idle_timeout_);
+    conn->set_io_timeout(WebSocketStage::kWriteTimeout);
+    ((HttpConnection*) conn)->upgrade(websocket);
+    on_open(websocket);
+}
+
+void
+WebSocketHttpHandler::on_open(const WebSocketPtr& websocket)
+{
+    if (broadcast_)
+        group_.add(websocket);
+}
+
+void
+WebSocketHttpHandler::on_message(const WebSocketPtr& websocket, int opcode,
+                                 const std::string& message)
+{
+    if (!broadcast_) {
+        if (opcode == WebSocket::kText) {
+            websocket->send_text(message);
+        } else {
+            websocket->send_binary((const byte*) message.data(),
+                                   message.size());
+        }
+        return;
+    }
+    group_.broadcast(WebSocketFramePtr(
+                         new WebSocketFrame(opcode,
+                                            (const byte*) message.data(),
+                                            message.size())));
+}
+
+void
+WebSocketHttpHandler::on_close(const WebSocketPtr& websocket)
+{
+    if (broadcast_)
+        group_.remove(websocket);
+}
+
+static void
+websocket_handler_module_init()
+{
+    static WebSocketHttpHandlerFactory websocket_handler_factory;
+    BaseHttpHandlerFactory::register_factory(&websocket_handler_factory);
+}
+
+static struct WebSocketHandlerModule : public Module
+{
+    WebSocketHandlerModule() {
+        this->on_initialize = websocket_handler_module_init;
+        this->name = "websocket_handler";
+        this->vendor = "tube server";
+        this->description = "WebSocket upgrade handler";
+    }
+} websocket_handler_module;
+
+EXPORT_MODULE_STATIC(websocket_handler_module);
+
+}
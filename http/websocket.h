@@ -0,0 +1,193 @@
+// -*- mode: c++ -*-
+
+#ifndef _WEBSOCKET_H_
+#define _WEBSOCKET_H_
+
+#include <string>
+#include <list>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+
+#include "utils/misc.h"
+#include "core/block_sender.h"
+#include "core/pipeline.h"
+#include "http/http_wrapper.h"
+#include "http/interface.h"
+
+namespace tube {
+
+// A whole frame as the server sends it, unmasked.  Immutable, so one frame
+// can be queued on any number of connections without being copied.
+class WebSocketFrame : public DataBlock
+{
+    std::string content_;
+public:
+    WebSocketFrame(int opcode, const byte* ptr, size_t size);
+
+    virtual const byte* data() const { return (const byte*) content_.data(); }
+    virtual size_t      size() const { return content_.size(); }
+};
+
+typedef boost::shared_ptr<const WebSocketFrame> WebSocketFramePtr;
+
+class WebSocketHttpHandler;
+class Stage;
+
+// The WebSocket side of an upgraded connection.  Frames from the client are
+// decoded by the websocket stage, which also owns the connection while it
+// does; sending may happen from any thread, the frames wait in an outbox
+// until the stage moves them to the output stream.  A client that lets the
+// outbox grow past kMaxOutboxSize is disconnected.
+class WebSocket : public boost::enable_shared_from_this<WebSocket>,
+                  utils::Noncopyable
+{
+public:
+    enum Opcode {
+        kContinuation = 0,
+        kText = 1,
+        kBinary = 2,
+        kClose = 8,
+        kPing = 9,
+        kPong = 10
+    };
+
+    enum CloseCode {
+        kCloseNormal = 1000,
+        kCloseGoingAway = 1001,
+        kCloseProtocolError = 1002,
+        kCloseUnsupported = 1003,
+        kClosePolicyViolation = 1008,
+        kCloseTooBig = 1009
+    };
+
+    // bytes waiting for a slow client, one frame is taken whatever its size
+    static const size_t kMaxOutboxSize;
+
+    WebSocket(Connection* conn, WebSocketHttpHandler* handler,
+              size_t max_message_size);
+
+    // Sec-WebSocket-Accept for the Sec-WebSocket-Key of a client
+    static std::string accept_key(const std::string& key);
+    // XORs the 4 byte mask in, offset is where ptr is in the payload
+    static void unmask(byte* ptr, size_t size, const byte* mask,
+                       size_t offset = 0);
+
+    // thread safe, false once the connection is closing or gone
+    bool send_text(const std::string& text);
+    bool send_binary(const byte* ptr, size_t size);
+    bool send_frame(const WebSocketFramePtr& frame);
+    // sends a close frame, the connection is closed once it is out
+    void close(int code = kCloseNormal, const std::string& reason = "");
+    bool is_open();
+
+    std::string address() const { return address_; }
+
+    // used by the websocket stage, with the connection locked.  true once
+    // the close frame is in the output stream.
+    bool process();
+    // the rest of the output is left to the write back stage, frames wait
+    // in the outbox until output_written()
+    void output_writing();
+    void output_written();
+    // the client fell behind, the stage closes the connection
+    bool is_overflowed();
+    // the connection is gone, nothing is scheduled for it any more
+    void detach();
+    // a reload may drop the handler from the rules while the socket is
+    // still open, this keeps it until the socket is gone
+    void keep_handler(const BaseHttpHandlerPtr& handler) {
+        handler_ref_ = handler;
+    }
+private:
+    utils::Mutex mutex_;
+    Connection*  conn_;
+    Stage*       stage_;
+    std::string  address_;
+    std::list<DataBlockPtr> outbox_;
+    size_t       outbox_size_;
+    bool         scheduled_;   // waits in the stage already
+    bool         processing_;  // the stage flushes the outbox when done
+    bool         writing_;     // the write back stage owns the output
+    bool         overflowed_;
+    bool         close_sent_;
+    bool         close_notified_;
+
+    // the stage's only
+    WebSocketHttpHandler* handler_;
+    BaseHttpHandlerPtr    handler_ref_;
+    size_t       max_message_size_;
+    std::string  input_;   // what hasn't made a whole frame yet
+    std::string  message_; // fragments so far
+    int          message_opcode_;
+
+    bool queue(const DataBlockPtr& block, bool closing);
+    void schedule();
+    bool decode_frames();
+    bool handle_frame(int opcode, bool fin, std::string& payload);
+    bool flush();
+    void notify_close();
+};
+
+typedef boost::shared_ptr<WebSocket> WebSocketPtr;
+
+// Connections a message goes to at once, e.g. the subscribers of a topic.
+class WebSocketGroup : utils::Noncopyable
+{
+    utils::Mutex              mutex_;
+    std::vector<WebSocketPtr> members_;
+public:
+    void   add(const WebSocketPtr& websocket);
+    void   remove(const WebSocketPtr& websocket);
+    size_t size();
+
+    // the frame is serialized once and shared by every member.  returns
+    // how many took it, the ones gone or too slow are dropped.
+    size_t broadcast(const WebSocketFramePtr& frame,
+                     const WebSocket* except = NULL);
+    size_t broadcast_text(const std::string& text,
+                          const WebSocket* except = NULL);
+};
+
+// Upgrades the requests asking for it and gets their messages.  Subclasses
+// override the callbacks, which run on a websocket stage thread except
+// on_open on the handler thread; they may send to any WebSocket.  Without
+// a subclass, module "websocket" echoes every message, or broadcasts it to
+// every connection of the handler with mode broadcast.
+class WebSocketHttpHandler : public BaseHttpHandler
+{
+protected:
+    WebSocketGroup group_;
+    bool           broadcast_;
+    size_t         max_message_size_;
+    int            idle_timeout_;
+public:
+    WebSocketHttpHandler();
+    virtual void load_param();
+    virtual void handle_request(HttpRequest& request, HttpResponse& response);
+
+    virtual void on_open(const WebSocketPtr& websocket);
+    virtual void on_message(const WebSocketPtr& websocket, int opcode,
+                            const std::string& message);
+    virtual void on_close(const WebSocketPtr& websocket);
+
+    WebSocketGroup& group() { return group_; }
+};
+
+class WebSocketHttpHandlerFactory : public BaseHttpHandlerFactory
+{
+public:
+    virtual BaseHttpHandler* create() const {
+        return new WebSocketHttpHandler();
+    }
+    virtual std::string module_name() const {
+        return std::string("websocket");
+    }
+    virtual std::string vender_name() const {
+        return std::string("tube");
+    }
+};
+
+}
+
+#endif /* _WEBSOCKET_H_ */
@@ -0,0 +1,84 @@
+#!/bin/bash
+# Keeps clients busy while the server upgrades itself with SIGUSR2, not a
+# single request may fail.  Run from the top of the tree after scons.
+
+SERVER=${SERVER:-build/tube-server}
+PORT=${PORT:-8089}
+DURATION=${DURATION:-10}
+CLIENTS=${CLIENTS:-4}
+
+WORK=`mktemp -d`
+cleanup() {
+    pkill -f "$WORK/conf.yaml"
+    rm -rf $WORK
+}
+trap cleanup EXIT
+
+mkdir $WORK/www
+echo "hello" > $WORK/www/index.txt
+cat > $WORK/conf.yaml <<EOF
+address: 127.0.0.1
+port: $PORT
+drain_timeout: 10
+
+handlers:
+  - name: default
+    module: static
+    doc_root: $WORK/www
+
+host:
+  domain: default
+  url-rules:
+    - type: none
+      chain:
+        - default
+EOF
+
+export LD_LIBRARY_PATH=build:$LD_LIBRARY_PATH
+$SERVER -c $WORK/conf.yaml &
+OLD_PID=$!
+for ((i=0;i<50;i++)); do
+    curl -sf -o /dev/null http://127.0.0.1:$PORT/index.txt && break
+    sleep 0.1
+done
+
+# every curl run fetches 20 times, over connections kept alive as long as
+# the server lets it.  a failed transfer reports 000.
+load() {
+    local end=$((`date +%s` + DURATION))
+    local urls=""
+    for ((i=0;i<20;i++)); do
+        # an -o for each url, or the bodies go to the codes too
+        urls="$urls -o /dev/null http://127.0.0.1:$PORT/index.txt"
+    done
+    while [ `date +%s` -lt $end ]; do
+        curl -s -w '%{http_code}\n' $urls
+    done > $WORK/codes.$1
+}
+
+for ((c=0;c<$CLIENTS;c++)); do
+    load $c &
+    LOAD_PIDS="$LOAD_PIDS $!"
+done
+
+sleep $((DURATION / 2))
+kill -USR2 $OLD_PID
+for ((i=0;i<300;i++)); do
+    kill -0 $OLD_PID 2>/dev/null || break
+    sleep 0.1
+done
+if kill -0 $OLD_PID 2>/dev/null; then
+    echo "FAIL: the old process $OLD_PID is still running"
+    exit 1
+fi
+NEW_PID=`pgrep -f "$WORK/conf.yaml"`
+if [ -z "$NEW_PID" ]; then
+    echo "FAIL: no new process"
+    exit 1
+fi
+
+wait $LOAD_PIDS
+TOTAL=`cat $WORK/codes.* | wc -l`
+FAILED=`cat $WORK/codes.* | grep -vc '^200$'`
+echo "$TOTAL requests, $FAILED failed, old $OLD_PID replaced by $NEW_PID"
+[ "$FAILED" -eq 0 ]
@@ -0,0 +1,107 @@
+// Cost of the date handling in a conditional GET: formatting Last-Modified
+// and parsing If-Modified-Since, against the libc functions doing the same.
+// usage: bench_http_date [iterations]
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <sys/time.h>
+
+#include "http/http_date.h"
+
+using namespace tube;
+
+static double
+now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void
+libc_format(time_t t, char* buf)
+{
+    struct tm gmt;
+    gmtime_r(&t, &gmt);
+    strftime(buf, kHttpDateLength + 1, "%a, %d %b %Y %T GMT", &gmt);
+}
+
+static bool
+libc_parse(const char* str, time_t* result)
+{
+    struct tm tm_struct;
+    memset(&tm_struct, 0, sizeof(tm_struct));
+    if (strptime(str, "%a, %d %b %Y %T GMT", &tm_struct) == NULL)
+        return false;
+    *result = timegm(&tm_struct);
+    return true;
+}
+
+static void
+check(time_t t)
+{
+    char ours[kHttpDateLength + 1], theirs[kHttpDateLength + 1];
+    format_http_date(t, ours);
+    libc_format(t, theirs);
+    assert(strcmp(ours, theirs) == 0);
+    time_t parsed = 0;
+    assert(parse_http_date(ours, kHttpDateLength, &parsed));
+    assert(parsed == t);
+}
+
+static void
+report(const char* name, double elapsed, int n)
+{
+    printf("%-14s %8.1f ns/op\n", name, elapsed * 1e9 / n);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : 1000000;
+    srand(time(NULL));
+
+    check(0);
+    check(784111777); // Sun, 06 Nov 1994 08:49:37 GMT
+    check(951782400); // Tue, 29 Feb 2000 00:00:00 GMT
+    for (int i = 0; i < 100000; i++) {
+        check((time_t) rand() * 2);
+    }
+    time_t t;
+    assert(!parse_http_date("Sunday, 06-Nov-94 08:49:37 GMT", &t));
+    assert(!parse_http_date("Sun Nov  6 08:49:37 1994", &t));
+    assert(!parse_http_date("Sun, 06 Nov 1994 08:49:37 UTC", &t));
+    assert(!parse_http_date("Sun, 06 Xyz 1994 08:49:37 GMT", &t));
+
+    char buf[kHttpDateLength + 1];
+    time_t base = time(NULL);
+    volatile time_t sink = 0;
+    double start = now();
+    for (int i = 0; i < n; i++) {
+        format_http_date(base + i, buf);
+    }
+    report("format", now() - start, n);
+    start = now();
+    for (int i = 0; i < n; i++) {
+        libc_format(base + i, buf);
+    }
+    report("libc format", now() - start, n);
+
+    format_http_date(base, buf);
+    start = now();
+    for (int i = 0; i < n; i++) {
+        parse_http_date(buf, kHttpDateLength, &t);
+        sink += t;
+    }
+    report("parse", now() - start, n);
+    start = now();
+    for (int i = 0; i < n; i++) {
+        libc_parse(buf, &t);
+        sink += t;
+    }
+    report("libc parse", now() - start, n);
+    return 0;
+}
@@ -0,0 +1,96 @@
+// Throughput of FileSender over a local socket with different chunk sizes
+// and send strategies.
+// usage: bench_sendfile [file size in MiB]
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <boost/thread.hpp>
+
+#include "core/stream.h"
+#include "core/filesender.h"
+
+using namespace tube;
+
+static const char* kFilePath = "/tmp/tube_bench_sendfile";
+
+static void
+drain(int fd)
+{
+    char buf[65536];
+    while (::read(fd, buf, sizeof(buf)) > 0) {}
+}
+
+static double
+now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void
+create_file(size_t size)
+{
+    int fd = ::open(kFilePath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    char buf[65536];
+    memset(buf, 'x', sizeof(buf));
+    for (size_t left = size; left > 0;) {
+        size_t n = left < sizeof(buf) ? left : sizeof(buf);
+        assert(::write(fd, buf, n) == (ssize_t) n);
+        left -= n;
+    }
+    ::close(fd);
+}
+
+static void
+run(const char* name, FileSender::SendStrategy strategy, size_t min_chunk,
+    size_t max_chunk, size_t size)
+{
+    int sv[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    boost::thread reader(boost::bind(drain, sv[1]));
+
+    FileSender::set_send_strategy(strategy);
+    FileSender::set_chunk_size_range(min_chunk, max_chunk);
+    int file_desc = ::open(kFilePath, O_RDONLY);
+    assert(file_desc >= 0);
+    OutputStream out(sv[0]);
+    out.append_file(file_desc, 0, -1);
+
+    double start = now();
+    size_t nturn = 0, nbytes = 0;
+    while (!out.is_done()) {
+        ssize_t rs = out.write_into_output();
+        assert(rs > 0);
+        nbytes += rs;
+        nturn++;
+    }
+    double elapsed = now() - start;
+    ::close(sv[0]);
+    reader.join();
+    ::close(sv[1]);
+
+    assert(nbytes == size);
+    printf("%-10s %8.1f MiB/s %8lu turns\n", name,
+           size / elapsed / (1 << 20), (unsigned long) nturn);
+}
+
+int
+main(int argc, char* argv[])
+{
+    size_t size = (argc > 1 ? atoi(argv[1]) : 64) << 20;
+    create_file(size);
+    run("fixed-8k", FileSender::kSendfile, 8 << 10, 8 << 10, size);
+    run("adaptive", FileSender::kSendfile, FileSender::kDefaultMinChunkSize,
+        FileSender::kDefaultMaxChunkSize, size);
+    run("mmap", FileSender::kMmapWrite, FileSender::kDefaultMinChunkSize,
+        FileSender::kDefaultMaxChunkSize, size);
+    unlink(kFilePath);
+    return 0;
+}
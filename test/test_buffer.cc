@@ -1,4 +1,11 @@
+#include <cassert>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
 #include "core/buffer.h"
+#include "core/stream.h"
+#include "utils/misc.h"
 
 using namespace tube;
 
@@ -17,9 +24,36 @@ test_cow()
     other.write_to_fd(2);
 }
 
+// a full socket ends the turn, the rest waits for the client
+void
+test_blocked_write()
+{
+    int fds[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    int sndbuf = 65536;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    utils::set_socket_blocking(fds[0], false);
+    utils::set_socket_blocking(fds[1], false);
+    std::string data(4 << 20, 'x');
+    OutputStream out(fds[0]);
+    out.append_data((const byte*) data.data(), data.size());
+
+    ssize_t nwrite = out.write_into_output();
+    assert(nwrite > 0 && (size_t) nwrite < OutputStream::kWriteBudget);
+    assert(out.is_blocked() && !out.is_done());
+    assert(out.write_into_output() < 0 && out.is_blocked());
+
+    char buf[65536];
+    while (::read(fds[1], buf, sizeof(buf)) > 0) {}
+    assert(out.write_into_output() > 0);
+    close(fds[0]);
+    close(fds[1]);
+}
+
 int
 main(int argc, char *argv[])
 {
     test_cow();
+    test_blocked_write();
     return 0;
 }
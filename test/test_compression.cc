@@ -0,0 +1,47 @@
+#include <cassert>
+#include <string>
+
+#include "http/compression.h"
+
+using namespace tube;
+
+static void
+test_choose()
+{
+    assert(choose_content_coding("gzip, deflate, br", kAllCodings)
+           == kCodingBrotli);
+    assert(choose_content_coding("gzip, br;q=0.5", kAllCodings)
+           == kCodingGzip);
+    assert(choose_content_coding("gzip;q=0, br;q=0", kAllCodings)
+           == kCodingIdentity);
+    assert(choose_content_coding("*", CODING_MASK(kCodingGzip))
+           == kCodingGzip);
+    assert(choose_content_coding("br", CODING_MASK(kCodingGzip))
+           == kCodingIdentity);
+    assert(choose_content_coding("", kAllCodings) == kCodingIdentity);
+}
+
+static void
+test_compress()
+{
+    std::string input(10000, 'a'), output;
+    if (supported_compressors() & CODING_MASK(kCodingGzip)) {
+        assert(compress_data(kCodingGzip, 6, (const byte*) input.data(),
+                             input.size(), output));
+        assert(output.size() < input.size());
+        assert((byte) output[0] == 0x1f && (byte) output[1] == 0x8b);
+    }
+    if (supported_compressors() & CODING_MASK(kCodingBrotli)) {
+        assert(compress_data(kCodingBrotli, 6, (const byte*) input.data(),
+                             input.size(), output));
+        assert(output.size() < input.size());
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    test_choose();
+    test_compress();
+    return 0;
+}
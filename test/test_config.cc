@@ -1,12 +1,180 @@
+#include <cassert>
+#include <cstdio>
+#include <unistd.h>
+
 #include "http/configuration.h"
+#include "http/connection.h"
+#include "http/module.h"
+#include "http/websocket.h"
 
 using namespace tube;
 
+static int nfreed = 0;
+
+class CountedHttpHandler : public BaseHttpHandler
+{
+public:
+    virtual ~CountedHttpHandler() { nfreed++; }
+    virtual void handle_request(HttpRequest& request,
+                                HttpResponse& response) {}
+};
+
+class CountedHttpHandlerFactory : public BaseHttpHandlerFactory
+{
+public:
+    virtual BaseHttpHandler* create() const {
+        return new CountedHttpHandler();
+    }
+    virtual std::string module_name() const {
+        return std::string("counted");
+    }
+    virtual std::string vender_name() const {
+        return std::string("test");
+    }
+};
+
+static int nwebsocket_freed = 0;
+
+class CountedWebSocketHttpHandler : public WebSocketHttpHandler
+{
+public:
+    virtual ~CountedWebSocketHttpHandler() { nwebsocket_freed++; }
+};
+
+class CountedWebSocketHttpHandlerFactory : public BaseHttpHandlerFactory
+{
+public:
+    virtual BaseHttpHandler* create() const {
+        return new CountedWebSocketHttpHandler();
+    }
+    virtual std::string module_name() const {
+        return std::string("counted_websocket");
+    }
+    virtual std::string vender_name() const {
+        return std::string("test");
+    }
+};
+
+static const char* kReloadConfPath = "/tmp/tube_test_reload.yaml";
+
+static void
+write_conf(const char* generation, const char* module = "counted")
+{
+    FILE* fp = fopen(kReloadConfPath, "w");
+    assert(fp != NULL);
+    fprintf(fp, "handlers:\n"
+            "  - name: counted\n"
+            "    module: %s\n"
+            "    generation: %s\n"
+            "host:\n"
+            "  domain: default\n"
+            "  url-rules:\n"
+            "    - type: none\n"
+            "      chain:\n"
+            "        - counted\n", module, generation);
+    fclose(fp);
+}
+
+static BaseHttpHandler*
+route(const VHostRulesPtr& rules, const std::string& path)
+{
+    HttpRequestData req;
+    req.path = req.uri = path;
+    const UrlRuleItem* rule = rules->match_uri("default", req);
+    assert(rule != NULL && !rule->handlers.empty());
+    return rule->handlers.front().get();
+}
+
+static void
+test_reload()
+{
+    ServerConfig& conf = ServerConfig::instance();
+    VHostRulesPtr old_rules = VHostConfig::instance().rules();
+    BaseHttpHandler* theme = route(old_rules, "/index_theme/plain.css");
+
+    assert(conf.reload_config_file("test/test-conf.yaml"));
+    VHostRulesPtr rules = VHostConfig::instance().rules();
+    assert(rules != old_rules);
+    // defined the same, so the same instance with its caches
+    assert(route(rules, "/index_theme/plain.css") == theme);
+    // the old rules still route the requests holding them
+    assert(route(old_rules, "/index_theme/plain.css") == theme);
+
+    assert(!conf.reload_config_file("test/no-such-conf.yaml"));
+    assert(VHostConfig::instance().rules() == rules);
+}
+
+// a replaced handler is freed once the last request of its config is done
+static void
+test_release()
+{
+    static CountedHttpHandlerFactory factory;
+    HandlerConfig::instance().register_handler_factory(&factory);
+    ServerConfig& conf = ServerConfig::instance();
+
+    write_conf("1");
+    assert(conf.reload_config_file(kReloadConfPath));
+    VHostRulesPtr held = VHostConfig::instance().rules();
+    BaseHttpHandler* first = route(held, "/");
+    assert(nfreed == 0);
+
+    write_conf("2");
+    assert(conf.reload_config_file(kReloadConfPath));
+    assert(route(VHostConfig::instance().rules(), "/") != first);
+    // a request of the first config still holds it
+    assert(nfreed == 0);
+    held.reset();
+
+    // the same config again keeps the running instance
+    assert(conf.reload_config_file(kReloadConfPath));
+    assert(nfreed == 1);
+    ::unlink(kReloadConfPath);
+}
+
+// an upgraded connection keeps its handler through a reload
+static void
+test_release_websocket()
+{
+    static CountedWebSocketHttpHandlerFactory factory;
+    HandlerConfig::instance().register_handler_factory(&factory);
+    ServerConfig& conf = ServerConfig::instance();
+
+    write_conf("1", "counted_websocket");
+    assert(conf.reload_config_file(kReloadConfPath));
+    HttpRequestData req;
+    req.path = req.uri = "/";
+    BaseHttpHandlerPtr handler =
+        VHostConfig::instance().rules()->match_uri("default", req)
+        ->handlers.front();
+    HttpConnection conn(0);
+    conn.address.get_address()->sa_family = AF_INET;
+    WebSocketPtr websocket(
+        new WebSocket(&conn, (WebSocketHttpHandler*) handler.get(), 1 << 20));
+    websocket->keep_handler(handler);
+    handler.reset();
+
+    write_conf("2", "counted_websocket");
+    assert(conf.reload_config_file(kReloadConfPath));
+    assert(conf.reload_config_file(kReloadConfPath));
+    assert(nwebsocket_freed == 0);
+
+    // closing calls into the old handler, which goes after the socket
+    websocket->detach();
+    websocket.reset();
+    assert(conf.reload_config_file(kReloadConfPath));
+    assert(nwebsocket_freed == 1);
+    ::unlink(kReloadConfPath);
+}
+
 int
 main(int argc, char *argv[])
 {
+    tube_module_initialize_all();
     ServerConfig& conf = ServerConfig::instance();
     conf.load_config_file("test/test-conf.yaml");
+    test_reload();
+    test_release();
+    test_release_websocket();
     assert(conf.address() == "127.0.0.1");
     assert(conf.port() == "80");
 
@@ -0,0 +1,287 @@
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <set>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <boost/bind.hpp>
+
+#include "http/fastcgi.h"
+
+using namespace tube;
+
+static void
+test_records()
+{
+    std::string out;
+    fcgi_append_begin_request(out, 1);
+    std::string big(70000, 'x');
+    fcgi_append_record(out, kFcgiStdin, 1, big.data(), big.size());
+    fcgi_append_record(out, kFcgiStdin, 1, NULL, 0);
+    assert(out.size() % 8 == 0);
+
+    // fed a byte at a time, records only come out whole
+    FcgiRecordParser parser;
+    FcgiRecord record;
+    std::string body;
+    int nrecords = 0;
+    for (size_t i = 0; i < out.size(); i++) {
+        parser.feed(out.data() + i, 1);
+        while (parser.next(record)) {
+            nrecords++;
+            assert(record.request_id == 1);
+            if (nrecords == 1) {
+                assert(record.type == kFcgiBeginRequest);
+                assert(record.content.size() == 8);
+                assert(record.content[1] == kFcgiResponder);
+                assert(record.content[2] == kFcgiKeepConn);
+            } else {
+                assert(record.type == kFcgiStdin);
+                body += record.content;
+            }
+        }
+    }
+    assert(nrecords == 4);
+    assert(body == big);
+
+    parser.feed("\x02\x06\x00\x01\x00\x00\x00\x00", 8);
+    assert(!parser.next(record));
+    assert(parser.is_malformed());
+}
+
+static void
+test_params()
+{
+    std::string long_value(300, 'v');
+    std::string content;
+    fcgi_append_param(content, "SCRIPT_NAME", "/index.php");
+    fcgi_append_param(content, "HTTP_COOKIE", long_value);
+    fcgi_append_param(content, "QUERY_STRING", "");
+    FcgiParams params;
+    assert(fcgi_parse_params(content, params));
+    assert(params.size() == 3);
+    assert(params[0].first == "SCRIPT_NAME" && params[0].second == "/index.php");
+    assert(params[1].second == long_value);
+    assert(params[2].first == "QUERY_STRING" && params[2].second.empty());
+    content.erase(content.size() - 1);
+    params.clear();
+    assert(!fcgi_parse_params(content, params));
+}
+
+static void
+test_cgi_head()
+{
+    std::string data = "Status: 404 Not Found\r\nContent-Type: text/html\r\n"
+        "\r\nbody";
+    size_t length = fcgi_cgi_head_length(data);
+    assert(length == data.size() - 4);
+    int code;
+    std::string reason;
+    HttpHeaderEnumerate headers;
+    assert(fcgi_parse_cgi_head(data.substr(0, length), code, reason, headers));
+    assert(code == 404 && reason == "Not Found");
+    assert(headers.size() == 1 && headers[0].key == "Content-Type");
+
+    headers.clear();
+    data = "Location: /elsewhere\n\n";
+    assert(fcgi_cgi_head_length(data) == data.size());
+    assert(fcgi_parse_cgi_head(data, code, reason, headers));
+    assert(code == 302 && headers.size() == 1);
+
+    headers.clear();
+    assert(fcgi_parse_cgi_head("X-Powered-By: test\r\n\r\n", code, reason,
+                               headers));
+    assert(code == 200);
+    assert(fcgi_cgi_head_length("Content-Type: text/html\r\n") ==
+           std::string::npos);
+    assert(!fcgi_parse_cgi_head("no colon here\r\n\r\n", code, reason,
+                                headers));
+}
+
+static const char* kSocketPath = "/tmp/tube_test_fastcgi.sock";
+static int listen_fd = -1;
+static utils::Mutex stub_mutex;
+static std::set<u16> stub_ids; // every request id the stub has seen
+static int stub_connections = 0;
+
+// a responder answering each request once its stdin ends, the answers of
+// the requests on a connection interleaved
+static void
+serve_connection(int fd)
+{
+    FcgiRecordParser parser;
+    std::set<u16> active;
+    char buf[4096];
+    ssize_t n;
+    while ((n = ::read(fd, buf, sizeof(buf))) > 0) {
+        parser.feed(buf, n);
+        FcgiRecord record;
+        std::string out;
+        std::set<u16> done;
+        while (parser.next(record)) {
+            if (record.type == kFcgiBeginRequest) {
+                active.insert(record.request_id);
+                utils::Lock lk(stub_mutex);
+                stub_ids.insert(record.request_id);
+            } else if (record.type == kFcgiStdin && record.content.empty()) {
+                done.insert(record.request_id);
+            } else if (record.type == kFcgiAbortRequest
+                       && active.count(record.request_id)) {
+                done.insert(record.request_id);
+            }
+        }
+        static const char* head = "Content-Type: text/plain\r\n\r\n";
+        for (std::set<u16>::iterator it = done.begin(); it != done.end();
+             ++it) {
+            fcgi_append_record(out, kFcgiStdout, *it, head, strlen(head));
+        }
+        for (std::set<u16>::iterator it = done.begin(); it != done.end();
+             ++it) {
+            fcgi_append_record(out, kFcgiStderr, *it, "note", 4);
+            fcgi_append_record(out, kFcgiStdout, *it, "hello", 5);
+            fcgi_append_record(out, kFcgiStdout, *it, NULL, 0);
+            char end[8];
+            memset(end, 0, sizeof(end));
+            fcgi_append_record(out, kFcgiEndRequest, *it, end, sizeof(end));
+            active.erase(*it);
+        }
+        if (!out.empty())
+            ::write(fd, out.data(), out.size());
+    }
+    ::close(fd);
+}
+
+static void
+serve()
+{
+    while (true) {
+        int fd = ::accept(listen_fd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        {
+            utils::Lock lk(stub_mutex);
+            stub_connections++;
+        }
+        new utils::Thread(boost::bind(serve_connection, fd));
+    }
+}
+
+static void
+start_backend()
+{
+    ::unlink(kSocketPath);
+    listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, kSocketPath);
+    assert(::bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr)) == 0);
+    assert(::listen(listen_fd, 16) == 0);
+    new utils::Thread(serve);
+}
+
+static std::string
+whole_request(u16 id)
+{
+    std::string records, params;
+    fcgi_append_param(params, "REQUEST_METHOD", "GET");
+    fcgi_append_begin_request(records, id);
+    fcgi_append_record(records, kFcgiParams, id, params.data(),
+                       params.size());
+    fcgi_append_record(records, kFcgiParams, id, NULL, 0);
+    fcgi_append_record(records, kFcgiStdin, id, NULL, 0);
+    return records;
+}
+
+static void
+test_client()
+{
+    start_backend();
+    FcgiClient* client = new FcgiClient();
+    assert(client->set_backend(std::string("unix:") + kSocketPath));
+    client->set_max_connections(1);
+    client->set_multiplex(2);
+    client->set_io_timeout(2000);
+    assert(client->start());
+
+    // the responses have no connection, the client takes them as aborted
+    HttpAsyncResponsePtr r1(new HttpAsyncResponse(NULL));
+    HttpAsyncResponsePtr r2(new HttpAsyncResponse(NULL));
+    HttpAsyncResponsePtr r3(new HttpAsyncResponse(NULL));
+    FcgiRequestHandle h1, h2, h3;
+    assert(client->open_request(r1, h1));
+    assert(client->open_request(r2, h2));
+    assert(h1.conn == h2.conn && h1.request_id != h2.request_id);
+    assert(!client->open_request(r3, h3));
+    assert(client->connection_count() == 1);
+
+    // interleaved on the one connection
+    std::string records = whole_request(h1.request_id)
+        + whole_request(h2.request_id);
+    FcgiRequestHandle both = h1;
+    assert(client->send(both, records));
+
+    // the ids are given back once the backend ended them
+    bool reopened = false;
+    for (int i = 0; i < 200 && !reopened; i++) {
+        FcgiRequestHandle h;
+        HttpAsyncResponsePtr r(new HttpAsyncResponse(NULL));
+        if (client->open_request(r, h)) {
+            reopened = true;
+            assert(h.conn == h1.conn);
+            assert(client->send(h, whole_request(h.request_id)));
+        } else {
+            usleep(10000);
+        }
+    }
+    assert(reopened);
+    usleep(100000);
+    utils::Lock lk(stub_mutex);
+    assert(stub_connections == 1);
+    assert(stub_ids.size() == 3);
+    // joins the poller thread
+    delete client;
+    ::unlink(kSocketPath);
+}
+
+static int ndrained = 0;
+
+static void
+count_drain()
+{
+    ndrained++;
+}
+
+// a producer stopped by a slow client goes on once the client is gone
+static void
+test_congestion()
+{
+    HttpConnection* conn = new HttpConnection(-1);
+    HttpAsyncResponsePtr response(new HttpAsyncResponse(conn));
+    response->set_drain_handler(count_drain);
+    conn->park_request(HttpRequestData(), response);
+
+    std::string piece(4096, 'x');
+    while (!response->is_congested()) {
+        response->write_string(piece);
+    }
+    assert(ndrained == 0);
+    delete conn;
+    assert(ndrained == 1);
+    assert(response->is_aborted());
+    assert(!response->is_congested());
+}
+
+int
+main(int argc, char *argv[])
+{
+    test_records();
+    test_params();
+    test_cgi_head();
+    test_congestion();
+    test_client();
+    printf("all passed\n");
+    return 0;
+}
@@ -0,0 +1,133 @@
+#include <cassert>
+#include <cstdio>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "http/file_cache.h"
+
+using namespace tube;
+
+static std::string
+create_file(const char* name, const char* content)
+{
+    std::string path = std::string("/tmp/") + name;
+    FILE* fp = fopen(path.c_str(), "w");
+    assert(fp);
+    fputs(content, fp);
+    fclose(fp);
+    return path;
+}
+
+static void
+test_hit()
+{
+    OpenFileCache cache;
+    cache.set_max_entry(16);
+    std::string path = create_file("tube_file_cache_hit", "hello");
+    int err = 0;
+
+    OpenFileInfoPtr first = cache.open_file(path, &err);
+    assert(first && first->handle && first->stat.st_size == 5);
+    assert(first->etag != "" && first->last_modified != "");
+    OpenFileInfoPtr second = cache.open_file(path, &err);
+    assert(first == second);
+    assert(cache.hit_count() == 1 && cache.miss_count() == 1);
+
+    cache.invalidate(path);
+    OpenFileInfoPtr third = cache.open_file(path, &err);
+    assert(third && third != first);
+    unlink(path.c_str());
+}
+
+static void
+test_revalidate()
+{
+    OpenFileCache cache;
+    cache.set_max_entry(16);
+    cache.set_valid_time(0); // always revalidate
+    std::string path = create_file("tube_file_cache_reval", "hello");
+    int err = 0;
+
+    OpenFileInfoPtr first = cache.open_file(path, &err);
+    assert(cache.open_file(path, &err) == first);
+    assert(cache.revalidation_count() == 1);
+
+    create_file("tube_file_cache_reval", "hello world");
+    OpenFileInfoPtr second = cache.open_file(path, &err);
+    assert(second != first && second->stat.st_size == 11);
+
+    unlink(path.c_str());
+    assert(!cache.open_file(path, &err) && err == ENOENT);
+}
+
+static void
+test_stat_only()
+{
+    OpenFileCache cache;
+    cache.set_max_entry(16);
+    std::string path = create_file("tube_file_cache_stat", "hello");
+    int err = 0;
+    bool cached = true;
+
+    OpenFileInfoPtr first = cache.stat_file(path, &err, &cached);
+    assert(first && !first->handle && !cached);
+    assert(cache.stat_file(path, &err, &cached) == first && cached);
+    OpenFileInfoPtr opened = cache.open_info(first);
+    assert(opened->handle && opened->stat.st_size == 5);
+    assert(cache.open_info(opened) == opened);
+    assert(cache.stat_file(path, &err, &cached) == opened && cached);
+    assert(cache.open_file(path, &err) == opened);
+    unlink(path.c_str());
+}
+
+static void
+test_disabled()
+{
+    OpenFileCache cache;
+    int err = 0;
+    OpenFileInfoPtr dir = cache.open_file("/tmp", &err);
+    assert(dir && !dir->handle && S_ISDIR(dir->stat.st_mode));
+    std::string path = create_file("tube_file_cache_off", "hello");
+    assert(cache.open_file(path, &err) != cache.open_file(path, &err));
+    unlink(path.c_str());
+}
+
+static void
+test_watch_released()
+{
+    OpenFileCache cache;
+    cache.set_max_entry(1); // a single entry in every shard
+    int err = 0;
+    std::string paths[64];
+    std::string dirs[64];
+    for (int i = 0; i < 64; i++) {
+        char dir[] = "/tmp/tube_file_cache_dirXXXXXX";
+        assert(mkdtemp(dir));
+        dirs[i] = dir;
+        paths[i] = dirs[i] + "/file";
+        FILE* fp = fopen(paths[i].c_str(), "w");
+        assert(fp);
+        fclose(fp);
+        assert(cache.open_file(paths[i], &err));
+    }
+    // the directories of evicted entries are no longer watched
+    assert(cache.watch_count() <= OpenFileCache::kShardCount);
+    cache.clear();
+    assert(cache.watch_count() == 0);
+    for (int i = 0; i < 64; i++) {
+        unlink(paths[i].c_str());
+        rmdir(dirs[i].c_str());
+    }
+}
+
+int
+main(int argc, char* argv[])
+{
+    test_hit();
+    test_revalidate();
+    test_stat_only();
+    test_disabled();
+    test_watch_released();
+    return 0;
+}
@@ -1,8 +1,13 @@
 #include <cstdio>
+#include <cassert>
 #include <iostream>
 #include <ctime>
+#include <sys/socket.h>
 
 #include "http/connection.h"
+#include "http/http_wrapper.h"
+#include "http/http_stages.h"
+#include "core/stages.h"
 #include "utils/logger.h"
 
 using namespace tube;
@@ -11,6 +16,15 @@ static const char* protocol_text = "GET / HTTP/1.1\r\nHost: www.test.com\r\n\r\n
 
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
 
+static HttpConnection*
+new_connection()
+{
+    HttpConnection* conn = new HttpConnection(0);
+    // requests are logged with the peer address
+    conn->address.get_address()->sa_family = AF_INET;
+    return conn;
+}
+
 static void
 process_stub(HttpConnection* conn)
 {
@@ -58,15 +72,113 @@ continous_test(HttpConnection* conn)
     }
 }
 
+static const char* chunked_text = "POST /up HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n7\r\n, world\r\n0\r\n\r\nGET / HTTP/1.1\r\n\r\n";
+
+// takes at most quota bytes, then lags
+class StubConsumer : public HttpBodyConsumer
+{
+public:
+    std::string body;
+    size_t      quota;
+
+    StubConsumer() : quota(0) {}
+
+    virtual size_t on_data(const byte* ptr, size_t size) {
+        size_t n = size < quota ? size : quota;
+        body.append((const char*) ptr, n);
+        quota -= n;
+        return n;
+    }
+    virtual void on_complete(HttpResponse& response) {}
+};
+
+static void
+stream_test(const char* text, const char* expected)
+{
+    HttpConnection* conn = new_connection();
+    Buffer& buf = conn->in_stream.buffer();
+    buf.append((const byte*) text, strlen(text));
+    assert(conn->do_parse());
+    assert(conn->get_request_data_list().size() == 1);
+    HttpRequestData request = conn->get_request_data_list().front();
+    conn->get_request_data_list().pop_front();
+    assert(request.method == HTTP_POST);
+
+    StubConsumer* consumer = new StubConsumer();
+    conn->set_body_consumer(HttpBodyConsumerPtr(consumer), request);
+    // the following request waits for the body
+    consumer->quota = 3;
+    assert(conn->do_parse());
+    assert(conn->is_body_held_back());
+    assert(!conn->is_body_complete());
+    assert(conn->get_request_data_list().empty());
+
+    consumer->quota = 1 << 20;
+    assert(conn->do_parse());
+    assert(conn->is_body_complete());
+    HttpBodyConsumerPtr finished = conn->finish_body(request);
+    assert(finished.get() == consumer);
+    assert(consumer->body == expected);
+
+    assert(conn->do_parse());
+    assert(conn->get_request_data_list().size() == 1);
+    assert(conn->get_request_data_list().front().method == HTTP_GET);
+    delete conn;
+}
+
+class TestHandlerStage : public HttpHandlerStage
+{
+public:
+    using HttpHandlerStage::process_task;
+};
+
+// no url rule is configured, the handler answers with an error
+static void
+unrouted_test()
+{
+    PollInStage poll_stage;
+    TestHandlerStage handler_stage;
+    WriteBackStage write_stage;
+    int fds[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    HttpConnection* conn = new HttpConnection(fds[0]);
+    conn->address.get_address()->sa_family = AF_INET;
+    conn->input_paused = true; // never polled here
+    const char* text = "POST /nowhere HTTP/1.1\r\nContent-Length: 26\r\n\r\n"
+        "GET /smuggled HTTP/1.1\r\n\r\n"
+        "GET /next HTTP/1.1\r\n\r\n";
+    conn->in_stream.buffer().append((const byte*) text, strlen(text));
+    assert(conn->do_parse());
+    assert(conn->get_request_data_list().size() == 1);
+    assert(conn->get_request_data_list().front().url_rule == NULL);
+
+    conn->lock();
+    handler_stage.process_task(conn);
+    conn->unlock();
+    write_stage.sched_remove(conn);
+    assert(conn->get_request_data_list().empty());
+    // the body is skipped, not taken for a request
+    assert(conn->do_parse());
+    assert(conn->get_request_data_list().size() == 1);
+    assert(conn->get_request_data_list().front().path == "/next");
+    delete conn;
+    close(fds[0]);
+    close(fds[1]);
+}
+
 int
 main(int argc, char *argv[])
 {
     utils::logger.set_level(DEBUG);
     srand(time(NULL));
-    HttpConnection* conn = new HttpConnection(0);
+    HttpConnection* conn = new_connection();
     random_test(conn);
     continous_test(conn);
     delete conn;
+    stream_test(chunked_text, "hello, world");
+    stream_test("POST /up HTTP/1.1\r\nContent-Length: 12\r\n\r\nhello, world"
+                "GET / HTTP/1.1\r\n\r\n", "hello, world");
+    unrouted_test();
     return 0;
 }
 
@@ -0,0 +1,145 @@
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "http/io_cache.h"
+
+using namespace tube;
+
+static std::string
+create_file(const char* name, const char* content)
+{
+    std::string path = std::string("/tmp/") + name;
+    FILE* fp = fopen(path.c_str(), "w");
+    assert(fp);
+    fputs(content, fp);
+    fclose(fp);
+    return path;
+}
+
+static void
+test_hit()
+{
+    IOCache cache;
+    cache.set_max_cache_entry(16);
+    std::string path = create_file("tube_io_cache_hit", "hello world");
+    struct stat st;
+    stat(path.c_str(), &st);
+
+    IOCacheEntryPtr first = cache.access_cache(path, st.st_mtime, st.st_size);
+    assert(first && first->size() == 11);
+    assert(memcmp(first->data(), "hello world", 11) == 0);
+    IOCacheEntryPtr second = cache.access_cache(path, st.st_mtime, st.st_size);
+    assert(first == second); // shared, not copied
+
+    // modified file invalidates the entry but not the one still in use
+    IOCacheEntryPtr third = cache.access_cache(path, st.st_mtime + 1,
+                                               st.st_size);
+    assert(third && third != first);
+    assert(memcmp(first->data(), "hello world", 11) == 0);
+    unlink(path.c_str());
+}
+
+static void
+test_limit()
+{
+    IOCache cache;
+    cache.set_max_entry_size(8);
+    cache.set_max_cache_entry(16);
+    std::string path = create_file("tube_io_cache_big", "too large to cache");
+    struct stat st;
+    stat(path.c_str(), &st);
+    assert(!cache.access_cache(path, st.st_mtime, st.st_size));
+    unlink(path.c_str());
+}
+
+static void
+test_admission()
+{
+    IOCache cache;
+    cache.set_max_cache_entry(IOCache::kShardCount); // one entry per shard
+    std::string hot = create_file("tube_io_cache_hot", "hot");
+    struct stat st;
+    stat(hot.c_str(), &st);
+    for (int i = 0; i < 5; i++) {
+        assert(cache.access_cache(hot, st.st_mtime, st.st_size));
+    }
+
+    // a scan of one-hit files must not push the hot entry out
+    char name[64];
+    for (int i = 0; i < 200; i++) {
+        snprintf(name, 64, "tube_io_cache_scan%d", i);
+        std::string path = create_file(name, "cold");
+        stat(path.c_str(), &st);
+        cache.access_cache(path, st.st_mtime, st.st_size);
+        unlink(path.c_str());
+    }
+    assert(cache.rejection_count() > 0);
+    stat(hot.c_str(), &st);
+    u64 nhit = cache.hit_count();
+    assert(cache.access_cache(hot, st.st_mtime, st.st_size));
+    assert(cache.hit_count() == nhit + 1);
+    unlink(hot.c_str());
+}
+
+static void
+test_byte_budget()
+{
+    IOCache cache;
+    cache.set_max_entry_size(1024);
+    cache.set_max_cache_bytes(IOCache::kShardCount * 8);
+    cache.set_admission_policy(IOCache::kAdmitAll);
+    char name[64];
+    for (int i = 0; i < 100; i++) {
+        snprintf(name, 64, "tube_io_cache_budget%d", i);
+        std::string path = create_file(name, "12345");
+        struct stat st;
+        stat(path.c_str(), &st);
+        cache.access_cache(path, st.st_mtime, st.st_size);
+        unlink(path.c_str());
+    }
+    // 5 bytes each, at most one fits into an 8 byte shard
+    assert(cache.admission_count() - cache.eviction_count()
+           <= IOCache::kShardCount);
+}
+
+static void
+test_mapped()
+{
+    IOCache cache;
+    cache.set_max_entry_size(1024);
+    cache.set_max_cache_entry(16);
+    cache.set_mmap_threshold(8);
+    cache.set_mmap_populate(true);
+    std::string path = create_file("tube_io_cache_mapped", "mapped content");
+    struct stat st;
+    stat(path.c_str(), &st);
+
+    IOCacheEntryPtr entry = cache.access_cache(path, st.st_mtime, st.st_size);
+    assert(entry && cache.mapped_count() == 1);
+    assert(memcmp(entry->data(), "mapped content", 14) == 0);
+    assert(cache.access_cache(path, st.st_mtime, st.st_size) == entry);
+    // still readable after the file is gone
+    unlink(path.c_str());
+    assert(memcmp(entry->data(), "mapped content", 14) == 0);
+
+    // below the threshold it is copied as before
+    path = create_file("tube_io_cache_small", "small");
+    stat(path.c_str(), &st);
+    assert(cache.access_cache(path, st.st_mtime, st.st_size));
+    assert(cache.mapped_count() == 1);
+    unlink(path.c_str());
+}
+
+int
+main(int argc, char *argv[])
+{
+    test_hit();
+    test_limit();
+    test_admission();
+    test_byte_budget();
+    test_mapped();
+    return 0;
+}
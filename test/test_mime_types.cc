@@ -0,0 +1,91 @@
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <unistd.h>
+
+#include "http/mime_types.h"
+
+using namespace tube;
+
+static const char* kTypesPath = "/tmp/tube_test_mime.types";
+
+static void
+test_builtin()
+{
+    MimeTypeRegistry registry;
+    assert(registry.lookup_path("/www/index.html") == "text/html");
+    assert(registry.lookup_path("/www/logo.PNG") == "image/png");
+    assert(registry.lookup_path("/www/archive.tar.gz") == "application/gzip");
+    assert(registry.lookup_path("/www/README") == "application/octet-stream");
+    assert(registry.lookup_path("/www.d/README") ==
+           "application/octet-stream");
+    assert(registry.lookup_path("/www/trailing.") ==
+           "application/octet-stream");
+    registry.set_default_type("text/plain");
+    assert(registry.lookup_path("/www/README") == "text/plain");
+}
+
+static void
+test_grow()
+{
+    MimeTypeRegistry registry;
+    char ext[16];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(ext, sizeof(ext), "x%d", i);
+        registry.add(ext, "application/x-test");
+    }
+    for (int i = 0; i < 1000; i++) {
+        snprintf(ext, sizeof(ext), "X%d", i);
+        assert(registry.lookup(ext, strlen(ext)) == "application/x-test");
+    }
+    assert(registry.lookup_path("a.css") == "text/css");
+    registry.reset();
+    assert(registry.lookup("x1", 2) == MimeTypeRegistry::kDefaultType);
+}
+
+static void
+test_load_file()
+{
+    std::ofstream fout(kTypesPath);
+    fout << "# apache style\n"
+         << "text/x-foo\tfoo fo\n"
+         << "text/css css # overrides nothing new\n"
+         << "types {\n"
+         << "    application/x-bar  bar;\n"
+         << "    image/png          png apng;\n"
+         << "}\n";
+    fout.close();
+
+    MimeTypeRegistry registry;
+    assert(registry.load_file(kTypesPath));
+    assert(registry.lookup_path("a.foo") == "text/x-foo");
+    assert(registry.lookup_path("a.fo") == "text/x-foo");
+    assert(registry.lookup_path("a.bar") == "application/x-bar");
+    assert(registry.lookup_path("a.apng") == "image/png");
+    assert(registry.lookup_path("a.types") == MimeTypeRegistry::kDefaultType);
+    assert(registry.lookup_path("a.html") == "text/html");
+    assert(!registry.load_file("/nonexistent/mime.types"));
+    unlink(kTypesPath);
+}
+
+static void
+test_match()
+{
+    assert(match_mime_type("text/*", "text/html"));
+    assert(match_mime_type("text/html", "text/html"));
+    assert(match_mime_type("*", "image/png"));
+    assert(!match_mime_type("text/*", "textual/html"));
+    assert(!match_mime_type("text/html", "text/css"));
+}
+
+int
+main(int argc, char *argv[])
+{
+    test_builtin();
+    test_grow();
+    test_load_file();
+    test_match();
+    printf("all passed\n");
+    return 0;
+}
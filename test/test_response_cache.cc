@@ -0,0 +1,119 @@
+#include <cassert>
+#include <cstdio>
+#include <string>
+#include <unistd.h>
+
+#include "http/response_cache.h"
+
+using namespace tube;
+
+static HttpHeaderEnumerate
+make_headers(const char* key, const char* value)
+{
+    HttpHeaderEnumerate headers;
+    headers.push_back(HttpHeaderItem(key, value));
+    return headers;
+}
+
+static CachedResponsePtr
+make_response(const HttpHeaderEnumerate& headers, const std::string& body)
+{
+    return CachedResponsePtr(
+        new CachedResponse(HttpResponseStatus::kHttpResponseOK, headers, body));
+}
+
+static void
+test_serialize()
+{
+    HttpHeaderEnumerate headers = make_headers("Content-Type", "text/plain");
+    headers.push_back(HttpHeaderItem("Connection", "Keep-Alive"));
+    CachedResponsePtr response = make_response(headers, "hello");
+    std::string content((const char*) response->data(), response->size());
+    assert(content == "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+           "Content-Length: 5\r\n\r\nhello");
+    assert(response->body_length() == 5);
+    assert(response->headers().size() == 1);
+}
+
+static void
+test_ttl()
+{
+    const HttpResponseStatus& ok = HttpResponseStatus::kHttpResponseOK;
+    assert(ResponseCache::cacheable_ttl(
+               ok, make_headers("Cache-Control", "public, max-age=60"), 0)
+           == 60);
+    assert(ResponseCache::cacheable_ttl(
+               ok, make_headers("cache-control", "max-age=60, s-maxage=5"), 0)
+           == 5);
+    assert(ResponseCache::cacheable_ttl(
+               ok, make_headers("Cache-Control", "private, max-age=60"), 0)
+           == -1);
+    assert(ResponseCache::cacheable_ttl(
+               ok, make_headers("Cache-Control", "max-age=0"), 30) == -1);
+    assert(ResponseCache::cacheable_ttl(ok, HttpHeaderEnumerate(), 30) == 30);
+    assert(ResponseCache::cacheable_ttl(ok, HttpHeaderEnumerate(), 0) == -1);
+    assert(ResponseCache::cacheable_ttl(
+               ok, make_headers("Set-Cookie", "a=b"), 30) == -1);
+    assert(ResponseCache::cacheable_ttl(
+               ok, make_headers("Vary", "*"), 30) == -1);
+    assert(ResponseCache::cacheable_ttl(
+               HttpResponseStatus::kHttpResponseInternalServerError,
+               HttpHeaderEnumerate(), 30) == -1);
+}
+
+static void
+test_vary()
+{
+    ResponseCache cache;
+    cache.set_max_bytes(1 << 20);
+    HttpHeaderEnumerate vary = make_headers("Vary", "Accept-Encoding");
+    HttpHeaderEnumerate gzip = make_headers("accept-encoding", "gzip");
+    HttpHeaderEnumerate plain;
+    assert(!cache.lookup("GET a /", gzip));
+    cache.insert("GET a /", gzip, make_response(vary, "zipped"), 60);
+    cache.insert("GET a /", plain, make_response(vary, "plain"), 60);
+    CachedResponsePtr hit = cache.lookup("GET a /", gzip);
+    assert(hit && hit->body_length() == 6);
+    hit = cache.lookup("GET a /", plain);
+    assert(hit && hit->body_length() == 5);
+    assert(!cache.lookup("GET a /", make_headers("Accept-Encoding", "br")));
+    assert(cache.size() == 1);
+
+    // expired entries are misses, and dropped
+    cache.insert("GET a /old", plain, make_response(plain, "x"), 1);
+    assert(cache.lookup("GET a /old", plain));
+    sleep(2);
+    assert(!cache.lookup("GET a /old", plain));
+    assert(cache.size() == 1);
+}
+
+static void
+test_evict()
+{
+    ResponseCache cache;
+    // one shard holds a single body of 3000 bytes
+    cache.set_max_bytes(ResponseCache::kShardCount * 4096);
+    std::string body(3000, 'x');
+    HttpHeaderEnumerate none;
+    char key[32];
+    for (int i = 0; i < 200; i++) {
+        snprintf(key, sizeof(key), "GET a /%d", i);
+        cache.insert(key, none, make_response(none, body), 60);
+    }
+    assert(cache.size() <= ResponseCache::kShardCount);
+    assert(cache.lookup("GET a /199", none));
+    cache.insert("GET a /big", none,
+                 make_response(none, std::string(8192, 'x')), 60);
+    assert(!cache.lookup("GET a /big", none));
+}
+
+int
+main(int argc, char *argv[])
+{
+    test_serialize();
+    test_ttl();
+    test_vary();
+    test_evict();
+    printf("all passed\n");
+    return 0;
+}
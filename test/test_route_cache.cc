@@ -0,0 +1,56 @@
+#include <cassert>
+#include <cstdio>
+
+#include "http/route_cache.h"
+
+using namespace tube;
+
+static void
+test_lookup()
+{
+    RouteCache cache;
+    const UrlRuleItem* rule = NULL;
+    const UrlRuleItem* dummy = (const UrlRuleItem*) &cache;
+    size_t strip_len = 0;
+
+    std::string key = RouteCache::build_key("www.test.com", "/index_theme/a");
+    assert(!cache.lookup(key, &rule, &strip_len));
+    cache.insert(key, dummy, 12);
+    assert(cache.lookup(key, &rule, &strip_len));
+    assert(rule == dummy && strip_len == 12);
+    assert(cache.hit_count() == 1 && cache.miss_count() == 1);
+
+    cache.clear();
+    assert(!cache.lookup(key, &rule, &strip_len));
+}
+
+static void
+test_bounded()
+{
+    RouteCache cache;
+    const UrlRuleItem* rule = NULL;
+    size_t strip_len = 0;
+    char path[32];
+
+    cache.set_max_entry(RouteCache::kShardCount);
+    for (int i = 0; i < 1000; i++) {
+        snprintf(path, 32, "/file%d", i);
+        cache.insert(RouteCache::build_key("default", path), NULL, 0);
+    }
+    int nhit = 0;
+    for (int i = 0; i < 1000; i++) {
+        snprintf(path, 32, "/file%d", i);
+        if (cache.lookup(RouteCache::build_key("default", path), &rule,
+                         &strip_len))
+            nhit++;
+    }
+    assert(nhit <= (int) RouteCache::kShardCount);
+}
+
+int
+main(int argc, char *argv[])
+{
+    test_lookup();
+    test_bounded();
+    return 0;
+}
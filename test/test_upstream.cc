@@ -0,0 +1,391 @@
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <boost/bind.hpp>
+
+#include "core/stages.h"
+#include "http/cache_handler.h"
+#include "http/configuration.h"
+#include "http/connection.h"
+#include "http/http_stages.h"
+#include "http/proxy_handler.h"
+#include "http/upstream.h"
+
+using namespace tube;
+
+static int listen_fd = -1;
+static unsigned short listen_port = 0;
+static int ncached_served = 0;
+
+// a tiny keep-alive upstream, the path picks how the body is delimited
+static void
+serve_connection(int fd)
+{
+    std::string buf;
+    char tmp[4096];
+    while (true) {
+        size_t end;
+        while ((end = buf.find("\r\n\r\n")) == std::string::npos) {
+            ssize_t n = ::read(fd, tmp, sizeof(tmp));
+            if (n <= 0) {
+                ::close(fd);
+                return;
+            }
+            buf.append(tmp, n);
+        }
+        std::string head = buf.substr(0, end);
+        buf.erase(0, end + 4);
+        std::string resp;
+        bool close_after = false;
+        if (head.find(" /chunked ") != std::string::npos) {
+            resp = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+                "3\r\nhel\r\n2;ext=1\r\nlo\r\n0\r\nX-Trailer: 1\r\n\r\n";
+        } else if (head.find(" /close ") != std::string::npos) {
+            resp = "HTTP/1.0 200 OK\r\n\r\nhello";
+            close_after = true;
+        } else if (head.find(" /cached ") != std::string::npos) {
+            resp = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n"
+                "Cache-Control: max-age=60\r\n\r\nhello";
+            ncached_served++;
+        } else if (head.find(" /bye ") != std::string::npos) {
+            resp = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello";
+            close_after = true;
+        } else {
+            resp = "HTTP/1.1 100 Continue\r\n\r\n"
+                "HTTP/1.1 200 OK\r\nContent-Length: 5\r\nX-Test: a\r\n\r\nhello";
+        }
+        ::write(fd, resp.data(), resp.length());
+        if (close_after) {
+            ::close(fd);
+            return;
+        }
+    }
+}
+
+static void
+serve()
+{
+    while (true) {
+        int fd = ::accept(listen_fd, NULL, NULL);
+        if (fd < 0)
+            return;
+        utils::Thread t(boost::bind(serve_connection, fd));
+        t.detach();
+    }
+}
+
+static void
+start_server()
+{
+    listen_fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    assert(::bind(listen_fd, (sockaddr*) &addr, sizeof(addr)) == 0);
+    assert(::listen(listen_fd, 16) == 0);
+    socklen_t len = sizeof(addr);
+    getsockname(listen_fd, (sockaddr*) &addr, &len);
+    listen_port = ntohs(addr.sin_port);
+    utils::Thread t(serve);
+    t.detach();
+}
+
+static std::string
+upstream_name(const char* host)
+{
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%s:%d", host, listen_port);
+    return buf;
+}
+
+static std::string
+fetch(UpstreamConnection* conn, const char* path, bool* reusable)
+{
+    std::string req = std::string("GET ") + path + " HTTP/1.1\r\n\r\n";
+    assert(::write(conn->fd, req.data(), req.length()) == (ssize_t) req.size());
+    UpstreamResponseReader reader(conn->fd);
+    UpstreamResponse response;
+    assert(reader.read_head(response));
+    assert(response.status_code == 200);
+    std::string body;
+    byte buf[2];
+    ssize_t n;
+    while ((n = reader.read_body(buf, sizeof(buf))) > 0) {
+        body.append((const char*) buf, n);
+    }
+    assert(n == 0);
+    *reusable = reader.reusable();
+    return body;
+}
+
+static void
+test_reuse()
+{
+    UpstreamPool pool;
+    assert(pool.add_upstream(upstream_name("127.0.0.1")));
+    bool reused = true, reusable = false;
+    UpstreamConnection* conn = pool.acquire(&reused);
+    assert(conn && !reused);
+    assert(fetch(conn, "/length", &reusable) == "hello" && reusable);
+    pool.release(conn, reusable);
+    assert(pool.idle_count() == 1);
+
+    conn = pool.acquire(&reused);
+    assert(conn && reused);
+    assert(fetch(conn, "/chunked", &reusable) == "hello" && reusable);
+    pool.release(conn, reusable);
+
+    conn = pool.acquire(&reused);
+    assert(conn && reused);
+    assert(fetch(conn, "/close", &reusable) == "hello" && !reusable);
+    pool.release(conn, reusable);
+    assert(pool.idle_count() == 0);
+
+    // closed by the upstream while idle, a fresh one is made instead
+    conn = pool.acquire(&reused);
+    assert(fetch(conn, "/bye", &reusable) == "hello" && reusable);
+    pool.release(conn, reusable);
+    usleep(100000);
+    conn = pool.acquire(&reused);
+    assert(conn && !reused);
+    pool.release(conn, false);
+    assert(pool.connect_count() == 3 && pool.reuse_count() == 2);
+}
+
+static void
+test_watcher()
+{
+    UpstreamPool pool;
+    assert(pool.add_upstream(upstream_name("127.0.0.1")));
+    pool.start_watcher();
+    bool reusable = false;
+    UpstreamConnection* conn = pool.acquire();
+    assert(fetch(conn, "/bye", &reusable) == "hello" && reusable);
+    pool.release(conn, reusable);
+    for (int i = 0; i < 100 && pool.idle_count() > 0; i++) {
+        usleep(10000);
+    }
+    assert(pool.idle_count() == 0);
+    // the watcher is joined on the way out
+}
+
+static void
+test_balance()
+{
+    UpstreamPool pool;
+    assert(pool.add_upstream(upstream_name("127.0.0.1")));
+    assert(pool.add_upstream(upstream_name("127.0.0.1")));
+    pool.set_balance(UpstreamPool::kLeastConnections);
+    UpstreamConnection* a = pool.acquire();
+    UpstreamConnection* b = pool.acquire();
+    assert(a && b && a->upstream != b->upstream);
+    Upstream* first = a->upstream;
+    pool.release(a, false);
+    UpstreamConnection* c = pool.acquire();
+    assert(c->upstream == first);
+    pool.release(b, false);
+    pool.release(c, false);
+
+    // nothing listens on port 1, it is passed over
+    UpstreamPool failover;
+    assert(failover.add_upstream("127.0.0.1:1"));
+    assert(failover.add_upstream(upstream_name("127.0.0.1")));
+    for (int i = 0; i < 4; i++) {
+        UpstreamConnection* conn = failover.acquire();
+        assert(conn && conn->upstream->name != "127.0.0.1:1");
+        failover.release(conn, false);
+    }
+    assert(!failover.add_upstream("no-port"));
+}
+
+static void
+send_string(int fd, const char* str)
+{
+    assert(::write(fd, str, strlen(str)) == (ssize_t) strlen(str));
+}
+
+// parsed as it arrives, nothing waits for the rest
+static void
+test_partial()
+{
+    int fds[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    utils::set_socket_blocking(fds[0], false);
+    UpstreamResponseReader reader(fds[0]);
+    UpstreamResponse response;
+    byte buf[16];
+    assert(reader.is_untouched());
+
+    send_string(fds[1], "HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 200 OK\r\n"
+                "Transfer-Enc");
+    assert(reader.receive() > 0);
+    assert(reader.take_head(response) == UpstreamResponseReader::kHeadPending);
+    send_string(fds[1], "oding: chunked\r\n\r\n3\r\nhel\r\n2\r");
+    assert(reader.receive() > 0);
+    assert(reader.take_head(response) == UpstreamResponseReader::kHeadDone);
+    assert(response.status_code == 200 && response.chunked);
+    assert(reader.take_body(buf, sizeof(buf)) == 3);
+    assert(reader.take_body(buf, sizeof(buf)) < 0 && errno == EAGAIN);
+    assert(reader.receive() < 0 && errno == EAGAIN);
+    send_string(fds[1], "\nlo\r\n0\r\nX-Trailer");
+    assert(reader.receive() > 0);
+    assert(reader.take_body(buf, sizeof(buf)) == 2);
+    assert(reader.take_body(buf, sizeof(buf)) < 0 && errno == EAGAIN);
+    send_string(fds[1], ": 1\r\n\r\n");
+    assert(reader.receive() > 0);
+    assert(reader.take_body(buf, sizeof(buf)) == 0);
+    assert(reader.reusable());
+
+    // closed before the head was complete
+    UpstreamResponseReader truncated(fds[0]);
+    send_string(fds[1], "HTTP/1.1 200 OK\r\n");
+    ::close(fds[1]);
+    assert(truncated.receive() > 0 && truncated.receive() == 0);
+    assert(truncated.take_head(response)
+           == UpstreamResponseReader::kHeadPending);
+    ::close(fds[0]);
+}
+
+static int nreadable = 0;
+
+static void
+on_readable(UpstreamPool* pool, UpstreamConnection* conn,
+            UpstreamResponseReader* reader, bool timed_out)
+{
+    assert(!timed_out);
+    nreadable++;
+    reader->receive();
+    UpstreamResponse response;
+    if (reader->take_head(response) == UpstreamResponseReader::kHeadPending)
+        return;
+    byte buf[16];
+    while (reader->take_body(buf, sizeof(buf)) > 0) {}
+    pool->release(conn, reader->reusable());
+}
+
+static void
+test_watch()
+{
+    UpstreamPool pool;
+    assert(pool.add_upstream(upstream_name("127.0.0.1")));
+    pool.start_watcher();
+    UpstreamConnection* conn = pool.acquire();
+    UpstreamResponseReader reader(conn->fd);
+    assert(pool.watch(conn, boost::bind(on_readable, &pool, conn, &reader,
+                                        _1)));
+    // paused ahead of the answer, it waits for the resume
+    pool.pause(conn);
+    send_string(conn->fd, "GET / HTTP/1.1\r\n\r\n");
+    usleep(100000);
+    assert(nreadable == 0);
+    pool.resume(conn);
+    for (int i = 0; i < 100 && pool.idle_count() == 0; i++) {
+        usleep(10000);
+    }
+    assert(nreadable > 0 && pool.idle_count() == 1);
+
+    // freed while watching one, which is dropped with the pool
+    conn = pool.acquire();
+    assert(pool.watch(conn, boost::bind(on_readable, &pool, conn, &reader,
+                                        _1)));
+}
+
+class TestHandlerStage : public HttpHandlerStage
+{
+public:
+    using HttpHandlerStage::process_task;
+};
+
+// runs the handler chain on what the client sent, and on what the proxy
+// answered until the request is done
+static std::string
+serve_request(TestHandlerStage* handler_stage, WriteBackStage* write_stage,
+              int fds[2], const UrlRuleItem* rule)
+{
+    HttpConnection* conn = new HttpConnection(fds[0]);
+    conn->address.get_address()->sa_family = AF_INET;
+    conn->input_paused = true; // never polled here
+    const char* text = "GET /cached HTTP/1.1\r\nHost: test\r\n\r\n";
+    conn->in_stream.buffer().append((const byte*) text, strlen(text));
+    assert(conn->do_parse());
+    assert(conn->get_request_data_list().size() == 1);
+    conn->get_request_data_list().front().url_rule = rule;
+
+    conn->lock();
+    handler_stage->process_task(conn);
+    for (int i = 0; i < 500 && conn->is_parked(); i++) {
+        conn->unlock();
+        usleep(10000);
+        conn->lock();
+        handler_stage->process_task(conn);
+    }
+    assert(!conn->is_parked());
+    write_stage->process_task(conn);
+    conn->unlock();
+    write_stage->sched_remove(conn);
+    delete conn;
+
+    std::string out;
+    char buf[4096];
+    ssize_t n;
+    while ((n = ::read(fds[1], buf, sizeof(buf))) > 0) {
+        out.append(buf, n);
+    }
+    return out;
+}
+
+// a cache in front of the proxy keeps the streamed answer
+static void
+test_cache_proxy()
+{
+    PollInStage poll_stage;
+    TestHandlerStage handler_stage;
+    WriteBackStage write_stage;
+    CacheHttpHandler* cache = new CacheHttpHandler();
+    cache->load_param();
+    ProxyHttpHandler* proxy = new ProxyHttpHandler();
+    proxy->add_option("upstreams", upstream_name("127.0.0.1"));
+    proxy->load_param();
+    UrlRuleItem rule("none", Node());
+    rule.handlers.push_back(BaseHttpHandlerPtr(cache));
+    rule.handlers.push_back(BaseHttpHandlerPtr(proxy));
+
+    for (int i = 0; i < 2; i++) {
+        int fds[2];
+        assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        utils::set_socket_blocking(fds[1], false);
+        std::string out = serve_request(&handler_stage, &write_stage, fds,
+                                        &rule);
+        assert(out.find("HTTP/1.1 200 OK\r\n") == 0);
+        assert(out.substr(out.length() - 9) == "\r\n\r\nhello");
+        ::close(fds[0]);
+        ::close(fds[1]);
+    }
+    // the second one was served from the cache
+    assert(ncached_served == 1);
+    assert(cache->cache().hit_count() == 1);
+    proxy->shutdown();
+    cache->shutdown();
+}
+
+int
+main(int argc, char *argv[])
+{
+    start_server();
+    test_reuse();
+    test_watcher();
+    test_balance();
+    test_partial();
+    test_watch();
+    test_cache_proxy();
+    printf("all passed\n");
+    return 0;
+}
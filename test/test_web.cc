@@ -17,18 +17,27 @@ class WebServer : public Server
 {
     HttpParserStage* parser_stage_;
     HttpHandlerStage* handler_stage_;
+    CompressStage* compress_stage_;
+    DiskIOStage* disk_io_stage_;
     size_t handler_stage_pool_size_;
+    size_t compress_stage_pool_size_;
+    size_t disk_io_stage_pool_size_;
 public:
     WebServer(const char* address, const char* port) : Server(address, port) {
         utils::logger.set_level(DEBUG);
         parser_stage_ = new HttpParserStage();
         handler_stage_ = new HttpHandlerStage();
+        compress_stage_ = new CompressStage();
+        compress_stage_pool_size_ = 1;
+        disk_io_stage_ = new DiskIOStage();
+        disk_io_stage_pool_size_ = 0;
     }
 
     void initialize_stages() {
         Server::initialize_stages();
         parser_stage_->initialize();
         handler_stage_->initialize();
+        disk_io_stage_->initialize();
     }
 
     void start_all_threads() {
@@ -36,6 +45,12 @@ public:
         for (size_t i = 0; i < handler_stage_pool_size_; i++) {
             handler_stage_->start_thread();
         }
+        for (size_t i = 0; i < compress_stage_pool_size_; i++) {
+            compress_stage_->start_thread();
+        }
+        for (size_t i = 0; i < disk_io_stage_pool_size_; i++) {
+            disk_io_stage_->start_thread();
+        }
         Server::start_all_threads();
     }
 
@@ -43,9 +58,19 @@ public:
         handler_stage_pool_size_ = val;
     }
 
+    void set_compress_stage_pool_size(size_t val) {
+        compress_stage_pool_size_ = val;
+    }
+
+    void set_disk_io_stage_pool_size(size_t val) {
+        disk_io_stage_pool_size_ = val;
+    }
+
     virtual ~WebServer() {
         delete parser_stage_;
         delete handler_stage_;
+        delete compress_stage_;
+        delete disk_io_stage_;
     }
 };
 
@@ -70,6 +95,14 @@ main(int argc, char *argv[])
         server.set_handler_stage_pool_size(
             (size_t) cfg.handler_stage_pool_size());
     }
+    if (cfg.compress_stage_pool_size() >= 0) {
+        server.set_compress_stage_pool_size(
+            (size_t) cfg.compress_stage_pool_size());
+    }
+    if (cfg.disk_io_stage_pool_size() > 0) {
+        server.set_disk_io_stage_pool_size(
+            (size_t) cfg.disk_io_stage_pool_size());
+    }
     server.initialize_stages();
     server.start_all_threads();
     server.listen(cfg.listen_queue_size());
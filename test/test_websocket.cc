@@ -0,0 +1,111 @@
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "http/websocket.h"
+#include "http/connection.h"
+
+using namespace tube;
+
+static void
+test_accept_key()
+{
+    // the example of RFC 6455
+    assert(WebSocket::accept_key("dGhlIHNhbXBsZSBub25jZQ==")
+           == "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=");
+}
+
+static void
+test_unmask()
+{
+    const byte mask[4] = { 0x37, 0xfa, 0x21, 0x3d };
+    std::string plain;
+    for (int i = 0; i < 300; i++) {
+        plain.push_back((char) (i * 7));
+    }
+    for (size_t size = 0; size < 40; size++) {
+        std::string masked = plain.substr(0, size);
+        for (size_t i = 0; i < size; i++) {
+            masked[i] ^= mask[i % 4];
+        }
+        std::string data = masked;
+        WebSocket::unmask((byte*) &data[0], size, mask);
+        assert(data == plain.substr(0, size));
+
+        // unmasked in two pieces, as when a frame arrives split
+        data = masked;
+        size_t half = (size + 1) / 2;
+        WebSocket::unmask((byte*) &data[0], half, mask);
+        WebSocket::unmask((byte*) &data[0] + half, size - half, mask, half);
+        assert(data == plain.substr(0, size));
+    }
+    // "Hello" from the RFC
+    byte hello[] = { 0x7f, 0x9f, 0x4d, 0x51, 0x58 };
+    WebSocket::unmask(hello, sizeof(hello), mask);
+    assert(memcmp(hello, "Hello", 5) == 0);
+}
+
+static void
+test_frame()
+{
+    WebSocketFrame hello(WebSocket::kText, (const byte*) "Hello", 5);
+    assert(hello.size() == 7);
+    assert(memcmp(hello.data(), "\x81\x05Hello", 7) == 0);
+
+    std::string payload(256, 'x');
+    WebSocketFrame medium(WebSocket::kBinary, (const byte*) payload.data(),
+                          payload.size());
+    assert(medium.size() == 4 + 256);
+    assert(memcmp(medium.data(), "\x82\x7e\x01\x00", 4) == 0);
+
+    payload.assign(65536, 'x');
+    WebSocketFrame large(WebSocket::kBinary, (const byte*) payload.data(),
+                         payload.size());
+    assert(large.size() == 10 + 65536);
+    assert(memcmp(large.data(), "\x82\x7f\0\0\0\0\0\x01\0\0", 10) == 0);
+
+    WebSocketFrame empty(WebSocket::kPong, NULL, 0);
+    assert(empty.size() == 2);
+    assert(memcmp(empty.data(), "\x8a\x00", 2) == 0);
+}
+
+static void
+test_outbox_limit()
+{
+    HttpConnection conn(0);
+    conn.address.get_address()->sa_family = AF_INET;
+
+    // nothing takes the frames out, as with a client that doesn't read
+    WebSocketPtr websocket(new WebSocket(&conn, NULL, 1 << 20));
+    std::string payload(65536, 'x');
+    WebSocketFramePtr frame(new WebSocketFrame(WebSocket::kBinary,
+                                               (const byte*) payload.data(),
+                                               payload.size()));
+    size_t nqueued = 0;
+    while (websocket->send_frame(frame)) {
+        nqueued++;
+    }
+    assert(nqueued == WebSocket::kMaxOutboxSize / frame->size());
+    assert(websocket->is_overflowed());
+    assert(!websocket->is_open());
+    assert(!websocket->send_text("late"));
+
+    // a single frame is taken whatever its size
+    WebSocketPtr other(new WebSocket(&conn, NULL, 1 << 20));
+    payload.assign(WebSocket::kMaxOutboxSize + 1, 'x');
+    assert(other->send_binary((const byte*) payload.data(), payload.size()));
+    assert(!other->is_overflowed());
+    assert(other->is_open());
+}
+
+int
+main(int argc, char *argv[])
+{
+    test_accept_key();
+    test_unmask();
+    test_frame();
+    test_outbox_limit();
+    printf("all passed\n");
+    return 0;
+}
@@ -49,6 +49,18 @@ void set_socket_blocking(int fd, bool block);
 void set_fdtable_size(size_t sz);
 long get_thread_id();
 
+// counter for statistics which may be bumped from many threads at once
+class AtomicCounter
+{
+    volatile u64 value_;
+public:
+    AtomicCounter() : value_(0) {}
+
+    u64 increment(u64 delta = 1) { return __sync_add_and_fetch(&value_, delta); }
+    u64 decrement(u64 delta = 1) { return __sync_sub_and_fetch(&value_, delta); }
+    u64 value() const { return value_; }
+};
+
 struct PtrHashFunc
 {
     size_t operator()(void* const x) const {